@@ -0,0 +1,284 @@
+// Memory cost and cleanup pause scaling of RateLimiter as the number of
+// tracked clients grows.
+//
+//   ./bench_memory_soak --max-clients 10000000 --format json > soak.json
+//
+// Clients are inserted in steps (1k, 2.5k, 5k, 10k, ... up to --max-clients).
+// After each step the process RSS, live heap bytes, allocations per insert,
+// the worst single insert (rehash pauses) and the cleanupExpired() pause are
+// recorded, one row per step, so the curve can be diffed across releases.
+
+#include "throttlebox/rate_limiter.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <malloc.h>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace throttlebox;
+
+namespace {
+
+// Counted by the global operator new/delete below
+std::atomic<uint64_t> allocationCount{0};
+std::atomic<int64_t> liveHeapBytes{0};
+
+void* countedAllocate(size_t size) {
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    liveHeapBytes.fetch_add(malloc_usable_size(ptr), std::memory_order_relaxed);
+    return ptr;
+}
+
+void countedFree(void* ptr) {
+    if (ptr) {
+        liveHeapBytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+        std::free(ptr);
+    }
+}
+
+} // namespace
+
+void* operator new(size_t size) { return countedAllocate(size); }
+void* operator new[](size_t size) { return countedAllocate(size); }
+void operator delete(void* ptr) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { countedFree(ptr); }
+
+namespace {
+
+struct Options {
+    size_t maxClients = 10000000;
+    double policyFraction = 0.1;   // Share of clients that also get a client policy
+    int cleanupRuns = 3;
+    bool json = false;
+};
+
+struct Step {
+    size_t clients = 0;
+    size_t policies = 0;
+    int64_t rssBytes = 0;
+    int64_t bucketHeapBytes = 0;    // Live heap attributed to buckets_ inserts
+    int64_t policyHeapBytes = 0;    // Live heap attributed to clientPolicies_ inserts
+    double allocsPerInsert = 0.0;   // Allocations per new client during allow()
+    double allocsPerPolicy = 0.0;
+    double insertNsAvg = 0.0;
+    double insertNsMax = 0.0;       // Worst single insert in this step, typically a rehash
+    double cleanupMsMin = 0.0;
+    double cleanupMsMax = 0.0;
+};
+
+int64_t residentBytes() {
+    long pages = 0;
+    long resident = 0;
+    FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    std::fclose(statm);
+    return static_cast<int64_t>(resident) * sysconf(_SC_PAGESIZE);
+}
+
+// Shaped like real device IDs: varying prefix, unique suffix
+void makeClientId(std::string& out, size_t index) {
+    out = "device-";
+    out += std::to_string(index * 2654435761u % 100000000);
+    out += '-';
+    out += std::to_string(index);
+}
+
+std::vector<size_t> stepSizes(size_t maxClients) {
+    std::vector<size_t> sizes;
+    for (size_t decade = 1000; decade <= maxClients; decade *= 10) {
+        for (size_t size : {decade, decade * 5 / 2, decade * 5}) {
+            if (size <= maxClients) {
+                sizes.push_back(size);
+            }
+        }
+    }
+    if (sizes.empty() || sizes.back() != maxClients) {
+        sizes.push_back(maxClients);
+    }
+    return sizes;
+}
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " [OPTIONS]\n"
+              << "Options:\n"
+              << "  -n, --max-clients N      Largest table size (default: 10000000)\n"
+              << "  -P, --policy-fraction F  Share of clients with a client policy (default: 0.1)\n"
+              << "  -r, --cleanup-runs N     cleanupExpired() calls timed per step (default: 3)\n"
+              << "  -f, --format csv|json    Output format (default: csv)\n"
+              << "  -h, --help               Show this help message\n";
+}
+
+void printStep(const Step& step, bool json, bool first) {
+    double perClient = step.clients > 0 ? static_cast<double>(step.rssBytes) / step.clients : 0.0;
+    double bucketBytes = step.clients > 0 ? static_cast<double>(step.bucketHeapBytes) / step.clients : 0.0;
+    double policyBytes = step.policies > 0 ? static_cast<double>(step.policyHeapBytes) / step.policies : 0.0;
+
+    if (json) {
+        std::printf("%s{\"clients\":%zu,\"policies\":%zu,\"rss_bytes\":%lld,\"rss_bytes_per_client\":%.1f,"
+                    "\"bucket_heap_bytes_per_client\":%.1f,\"policy_heap_bytes_per_entry\":%.1f,"
+                    "\"allocs_per_insert\":%.2f,\"allocs_per_policy\":%.2f,"
+                    "\"insert_ns_avg\":%.1f,\"insert_ns_max\":%.0f,"
+                    "\"cleanup_ms_min\":%.3f,\"cleanup_ms_max\":%.3f}",
+                    first ? "" : ",\n  ", step.clients, step.policies,
+                    static_cast<long long>(step.rssBytes), perClient, bucketBytes, policyBytes,
+                    step.allocsPerInsert, step.allocsPerPolicy, step.insertNsAvg, step.insertNsMax,
+                    step.cleanupMsMin, step.cleanupMsMax);
+    } else {
+        std::printf("%zu,%zu,%lld,%.1f,%.1f,%.1f,%.2f,%.2f,%.1f,%.0f,%.3f,%.3f\n",
+                    step.clients, step.policies, static_cast<long long>(step.rssBytes), perClient,
+                    bucketBytes, policyBytes, step.allocsPerInsert, step.allocsPerPolicy,
+                    step.insertNsAvg, step.insertNsMax, step.cleanupMsMin, step.cleanupMsMax);
+    }
+    std::fflush(stdout);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+
+    static struct option long_options[] = {
+        {"max-clients", required_argument, 0, 'n'},
+        {"policy-fraction", required_argument, 0, 'P'},
+        {"cleanup-runs", required_argument, 0, 'r'},
+        {"format", required_argument, 0, 'f'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:P:r:f:h", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 'n': options.maxClients = std::stoul(optarg); break;
+            case 'P': options.policyFraction = std::min(1.0, std::max(0.0, std::stod(optarg))); break;
+            case 'r': options.cleanupRuns = std::max(1, std::stoi(optarg)); break;
+            case 'f': options.json = std::strcmp(optarg, "json") == 0; break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+
+    // Never limits, so every insert takes the full allow path
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1e9;
+    policy.burstSize = 1000000000;
+    policy.blockDurationSec = 0;
+
+    RateLimitPolicy clientPolicy = policy;
+    clientPolicy.maxMessagesPerSec = 5e8;
+
+    RateLimiter limiter(policy);
+    const std::string ip = "10.0.0.1";
+    std::string clientId;
+    clientId.reserve(64);
+
+    int64_t baselineRss = residentBytes();
+    int64_t bucketHeap = 0;
+    int64_t policyHeap = 0;
+    size_t policies = 0;
+    size_t inserted = 0;
+    size_t policyStride = options.policyFraction > 0 ? static_cast<size_t>(1.0 / options.policyFraction) : 0;
+
+    if (options.json) {
+        std::printf("{\"baseline_rss_bytes\":%lld,\"steps\":[\n  ", static_cast<long long>(baselineRss));
+    } else {
+        std::printf("clients,policies,rss_bytes,rss_bytes_per_client,bucket_heap_bytes_per_client,"
+                    "policy_heap_bytes_per_entry,allocs_per_insert,allocs_per_policy,"
+                    "insert_ns_avg,insert_ns_max,cleanup_ms_min,cleanup_ms_max\n");
+    }
+
+    bool first = true;
+    for (size_t target : stepSizes(options.maxClients)) {
+        Step step;
+        size_t newClients = target - inserted;
+
+        // Client policies for this step's share of clients
+        size_t newPolicies = 0;
+        int64_t heapBefore = liveHeapBytes.load();
+        uint64_t allocsBefore = allocationCount.load();
+        if (policyStride > 0) {
+            for (size_t i = inserted; i < target; i++) {
+                if (i % policyStride == 0) {
+                    makeClientId(clientId, i);
+                    limiter.setClientPolicy(clientId, clientPolicy);
+                    newPolicies++;
+                }
+            }
+        }
+        // makeClientId reuses clientId's buffer, so it adds no allocations
+        policyHeap += liveHeapBytes.load() - heapBefore;
+        step.allocsPerPolicy = newPolicies > 0
+            ? static_cast<double>(allocationCount.load() - allocsBefore) / newPolicies : 0.0;
+        policies += newPolicies;
+
+        // One allow() per new client creates its bucket
+        heapBefore = liveHeapBytes.load();
+        allocsBefore = allocationCount.load();
+        double worstNs = 0.0;
+        auto stepStart = std::chrono::steady_clock::now();
+        for (size_t i = inserted; i < target; i++) {
+            makeClientId(clientId, i);
+            auto start = std::chrono::steady_clock::now();
+            limiter.allow(ip, clientId);
+            double elapsed = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - start).count();
+            worstNs = std::max(worstNs, elapsed);
+        }
+        double stepNs = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - stepStart).count();
+        bucketHeap += liveHeapBytes.load() - heapBefore;
+        step.allocsPerInsert = static_cast<double>(allocationCount.load() - allocsBefore) / newClients;
+        step.insertNsAvg = stepNs / newClients;
+        step.insertNsMax = worstNs;
+        inserted = target;
+
+        // Nothing is idle long enough to be evicted, so this is the full
+        // scan every periodic cleanup pays while holding the limiter lock
+        step.cleanupMsMin = 1e300;
+        for (int run = 0; run < options.cleanupRuns; run++) {
+            auto start = std::chrono::steady_clock::now();
+            limiter.cleanupExpired();
+            double elapsed = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count();
+            step.cleanupMsMin = std::min(step.cleanupMsMin, elapsed);
+            step.cleanupMsMax = std::max(step.cleanupMsMax, elapsed);
+        }
+
+        step.clients = inserted;
+        step.policies = policies;
+        step.rssBytes = residentBytes() - baselineRss;
+        step.bucketHeapBytes = bucketHeap;
+        step.policyHeapBytes = policyHeap;
+        printStep(step, options.json, first);
+        first = false;
+    }
+
+    if (options.json) {
+        std::printf("\n]}\n");
+    }
+
+    return 0;
+}
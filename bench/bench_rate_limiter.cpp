@@ -0,0 +1,237 @@
+// RateLimiter::allow() throughput and tail latency under contention, and
+// topic rule matching.
+//
+//   ./bench_rate_limiter --benchmark_format=json --benchmark_out=limiter.json
+//
+// Every benchmark reports items_per_second plus p50/p99/p999 latency (ns)
+// sampled on each thread, so runs of different limiter engines can be
+// compared field by field.
+
+#include "throttlebox/rate_limiter.hpp"
+#include "throttlebox/topic_trie.hpp"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace throttlebox;
+
+namespace {
+
+// One limiter shared by all threads of a run, created and destroyed by thread 0
+std::unique_ptr<RateLimiter> sharedLimiter;
+
+// Never runs dry, so every call exercises the full allow path
+RateLimitPolicy unlimitedPolicy() {
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1e9;
+    policy.burstSize = 1000000000;
+    policy.blockDurationSec = 0;
+    return policy;
+}
+
+// Client IDs shaped like real device IDs, built once per size. Every
+// thread of a run calls this before the start barrier, so growth is
+// serialized; it never happens while an earlier run is reading the IDs.
+const std::vector<std::string>& clientIds(size_t count) {
+    static std::mutex mutex;
+    static std::vector<std::string> ids;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (ids.size() < count) {
+        ids.reserve(count);
+        for (size_t i = ids.size(); i < count; i++) {
+            ids.push_back("device-" + std::to_string(i * 2654435761u % 100000000) + "-" + std::to_string(i));
+        }
+    }
+    return ids;
+}
+
+// Latency of every 64th call, reported as per-thread percentiles averaged
+// across threads
+class LatencySampler {
+public:
+    static constexpr uint64_t kEvery = 64;
+
+    bool shouldSample(uint64_t iteration) const { return iteration % kEvery == 0; }
+
+    void add(std::chrono::steady_clock::duration elapsed) {
+        samples_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    void report(benchmark::State& state) {
+        if (samples_.empty()) {
+            return;
+        }
+        std::sort(samples_.begin(), samples_.end());
+        auto percentile = [this](double q) {
+            return static_cast<double>(samples_[std::min(samples_.size() - 1,
+                                                         static_cast<size_t>(q * samples_.size()))]);
+        };
+        state.counters["p50_ns"] = benchmark::Counter(percentile(0.50), benchmark::Counter::kAvgThreads);
+        state.counters["p99_ns"] = benchmark::Counter(percentile(0.99), benchmark::Counter::kAvgThreads);
+        state.counters["p999_ns"] = benchmark::Counter(percentile(0.999), benchmark::Counter::kAvgThreads);
+    }
+
+private:
+    std::vector<int64_t> samples_;
+};
+
+template <typename NextKey>
+void runAllowLoop(benchmark::State& state, NextKey nextKey) {
+    LatencySampler latency;
+    const std::string ip = "10.0.0.1";
+    uint64_t iteration = 0;
+
+    for (auto _ : state) {
+        const std::string& clientId = nextKey(iteration);
+        if (latency.shouldSample(iteration)) {
+            auto start = std::chrono::steady_clock::now();
+            benchmark::DoNotOptimize(sharedLimiter->allow(ip, clientId));
+            latency.add(std::chrono::steady_clock::now() - start);
+        } else {
+            benchmark::DoNotOptimize(sharedLimiter->allow(ip, clientId));
+        }
+        iteration++;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    latency.report(state);
+}
+
+// A handful of busy clients per thread: measures lock contention
+void BM_AllowHotKeys(benchmark::State& state) {
+    const auto& ids = clientIds(1024);
+    if (state.thread_index() == 0) {
+        sharedLimiter = std::make_unique<RateLimiter>(unlimitedPolicy());
+    }
+
+    size_t base = static_cast<size_t>(state.thread_index()) * 16;
+    runAllowLoop(state, [&ids, base](uint64_t i) -> const std::string& {
+        return ids[(base + (i & 15)) % ids.size()];
+    });
+
+    if (state.thread_index() == 0) {
+        sharedLimiter.reset();
+    }
+}
+BENCHMARK(BM_AllowHotKeys)->ThreadRange(1, 64)->UseRealTime();
+
+// Every thread walks the whole client table: measures hashing, cache
+// misses and table growth with state.range(0) distinct clients
+void BM_AllowColdKeys(benchmark::State& state) {
+    size_t clients = static_cast<size_t>(state.range(0));
+    const auto& ids = clientIds(clients);
+    if (state.thread_index() == 0) {
+        sharedLimiter = std::make_unique<RateLimiter>(unlimitedPolicy());
+    }
+
+    // Large odd stride so consecutive calls land far apart in the table
+    size_t start = static_cast<size_t>(state.thread_index()) * 7919;
+    runAllowLoop(state, [&ids, clients, start](uint64_t i) -> const std::string& {
+        return ids[(start + i * 104729) % clients];
+    });
+
+    if (state.thread_index() == 0) {
+        state.counters["clients"] = static_cast<double>(sharedLimiter->getStats().totalClients);
+        sharedLimiter.reset();
+    }
+}
+BENCHMARK(BM_AllowColdKeys)
+    ->ArgName("clients")
+    ->Arg(1000)->Arg(100000)->Arg(1000000)->Arg(10000000)
+    ->Threads(1)->Threads(8)->Threads(64)
+    ->UseRealTime();
+
+// A share of clients (state.range(0) percent) carry their own policy, as
+// with per-device overrides in production
+void BM_AllowMixedPolicies(benchmark::State& state) {
+    const size_t clients = 100000;
+    const auto& ids = clientIds(clients);
+    if (state.thread_index() == 0) {
+        sharedLimiter = std::make_unique<RateLimiter>(unlimitedPolicy());
+        RateLimitPolicy premium = unlimitedPolicy();
+        premium.maxMessagesPerSec = 5e8;
+        size_t overrides = clients * static_cast<size_t>(state.range(0)) / 100;
+        for (size_t i = 0; i < overrides; i++) {
+            sharedLimiter->setClientPolicy(ids[i * 100 / std::max<int64_t>(state.range(0), 1)], premium);
+        }
+    }
+
+    size_t start = static_cast<size_t>(state.thread_index()) * 7919;
+    runAllowLoop(state, [&ids, clients, start](uint64_t i) -> const std::string& {
+        return ids[(start + i * 104729) % clients];
+    });
+
+    if (state.thread_index() == 0) {
+        sharedLimiter.reset();
+    }
+}
+BENCHMARK(BM_AllowMixedPolicies)
+    ->ArgName("override_pct")
+    ->Arg(0)->Arg(10)->Arg(50)
+    ->Threads(1)->Threads(8)
+    ->UseRealTime();
+
+// Clients over their limit: the reject path, including block bookkeeping
+void BM_AllowOverLimit(benchmark::State& state) {
+    const auto& ids = clientIds(1024);
+    if (state.thread_index() == 0) {
+        RateLimitPolicy strict;
+        strict.maxMessagesPerSec = 1.0;
+        strict.burstSize = 1;
+        strict.blockDurationSec = 1;
+        sharedLimiter = std::make_unique<RateLimiter>(strict);
+    }
+
+    size_t base = static_cast<size_t>(state.thread_index()) * 16;
+    runAllowLoop(state, [&ids, base](uint64_t i) -> const std::string& {
+        return ids[(base + (i & 15)) % ids.size()];
+    });
+
+    if (state.thread_index() == 0) {
+        sharedLimiter.reset();
+    }
+}
+BENCHMARK(BM_AllowOverLimit)->ThreadRange(1, 64)->UseRealTime();
+
+// Matching a PUBLISH topic against the compiled topic rules; the cost
+// should track the topic's depth, not the number of rules
+void BM_TopicMatch(benchmark::State& state) {
+    std::vector<TopicRule> rules;
+    for (int64_t i = 0; i < state.range(0); i++) {
+        TopicRule rule;
+        switch (i % 4) {
+            case 0: rule.filter = "site" + std::to_string(i) + "/+/alarm"; break;
+            case 1: rule.filter = "site" + std::to_string(i) + "/line/#"; break;
+            case 2: rule.filter = "fleet/" + std::to_string(i) + "/telemetry"; break;
+            default: rule.filter = "+/" + std::to_string(i) + "/status"; break;
+        }
+        rule.maxMessagesPerSec = 10.0;
+        rules.push_back(rule);
+    }
+    TopicTrie trie(rules);
+    
+    std::vector<std::string> topics;
+    for (int64_t i = 0; i < 256; i++) {
+        int64_t n = i * 7919 % state.range(0);
+        topics.push_back("site" + std::to_string(n) + "/line/alarm");
+        topics.push_back("fleet/" + std::to_string(n) + "/telemetry");
+        topics.push_back("home/" + std::to_string(n) + "/status/extra");
+    }
+    
+    uint64_t matched = 0;
+    size_t i = 0;
+    for (auto _ : state) {
+        trie.forEachMatch(topics[i++ % topics.size()], [&matched](uint32_t rule) { matched += rule; });
+    }
+    benchmark::DoNotOptimize(matched);
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TopicMatch)->Arg(100)->Arg(1000)->Arg(10000);
+
+} // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+namespace throttlebox {
+
+// Time source for rate limiting. All implementations share the
+// steady_clock epoch, so their time points can be mixed and compared.
+class Clock {
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    virtual ~Clock() = default;
+    virtual time_point now() const = 0;
+};
+
+// steady_clock (CLOCK_MONOTONIC): nanosecond resolution
+class MonotonicClock : public Clock {
+public:
+    time_point now() const override { return std::chrono::steady_clock::now(); }
+};
+
+// CLOCK_MONOTONIC_COARSE: the kernel's last tick (1-4 ms resolution) read
+// without touching the hardware counter, several times cheaper per call
+class CoarseClock : public Clock {
+public:
+    time_point now() const override;
+};
+
+// Time that only moves when told to, for tests and trace replay. Thread-safe.
+class VirtualClock : public Clock {
+public:
+    explicit VirtualClock(time_point start = time_point(std::chrono::hours(1)))
+        : nowNs_(start.time_since_epoch().count()) {}
+
+    time_point now() const override {
+        return time_point(time_point::duration(nowNs_.load(std::memory_order_acquire)));
+    }
+
+    void set(time_point t) { nowNs_.store(t.time_since_epoch().count(), std::memory_order_release); }
+
+    void advance(std::chrono::nanoseconds delta) {
+        nowNs_.fetch_add(std::chrono::duration_cast<time_point::duration>(delta).count(),
+                         std::memory_order_acq_rel);
+    }
+
+private:
+    std::atomic<time_point::rep> nowNs_;
+};
+
+enum class ClockSource : uint8_t {
+    Monotonic = 0,
+    Coarse = 1,
+};
+
+std::shared_ptr<Clock> makeClock(ClockSource source);
+
+bool parseClockSource(const std::string& text, ClockSource& source);
+
+} // namespace throttlebox
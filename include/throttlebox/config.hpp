@@ -2,7 +2,11 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "rate_limiter.hpp"
+#include "connection_limiter.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
 
 namespace throttlebox {
 
@@ -13,6 +17,37 @@ public:
         int listenPort = 1883;
         std::string brokerHost = "localhost";
         int brokerPort = 1884;
+        ClockSource clockSource = ClockSource::Monotonic;  // Time source for rate limiting
+        int receiveMaximum = 0;      // Advertised to MQTT 5 clients in the CONNACK; 0 leaves the broker's
+        size_t maxPacketSize = 1024 * 1024;   // Largest packet accepted from clients, advertised to MQTT 5; 0 = no limit
+        int topicAliasMaximum = 0;   // Lowers the broker's Topic Alias Maximum in the CONNACK; 0 leaves it
+    };
+
+    // Limits on connections. The caps on open connections are checked as a
+    // connection is accepted, the connect rates once its CONNECT is read and
+    // before the broker is connected to. The timeouts count from accept.
+    struct ConnectionSettings {
+        int connectTimeoutMs = 10000;     // The whole CONNECT must have arrived
+        int halfOpenTimeoutMs = 30000;    // The broker must have answered the CONNECT
+        size_t maxConnections = 0;        // Open connections in total; 0 = no limit
+        size_t maxConnectionsPerIp = 0;   // Open connections per source address; 0 = no limit
+        std::vector<CidrLimit> cidrLimits;
+        double ipConnectRate = 0.0;       // CONNECTs per second per source address; 0 disables
+        int ipConnectBurst = 0;           // 0 means one second's worth
+        double clientConnectRate = 0.0;   // CONNECTs per second per client ID; 0 disables
+        int clientConnectBurst = 0;
+    };
+
+    struct MetricsSettings {
+        int httpPort = 9090;
+        bool statsdEnabled = false;  // Enabled by setting statsd_host
+        StatsdSettings statsd;
+    };
+
+    struct DiagnosticsSettings {
+        size_t flightRecorderEvents = 512;  // Per thread; 0 disables the recorder
+        std::string flightRecorderPath = "throttlebox-flightrec.bin";
+        std::string traceCapturePath;       // Empty disables traffic capture
     };
 
     Config() = default;
@@ -27,9 +62,27 @@ public:
     // Get client-specific policy (falls back to global if not found)
     RateLimitPolicy getClientPolicy(const std::string& clientId) const;
     
+    // Get what client buckets are keyed on
+    const IdentityKey& getIdentityKey() const { return identityKey_; }
+    
+    // Get per-topic limits and deny rules, applied on top of every policy
+    const std::vector<TopicRule>& getTopicRules() const { return topicRules_; }
+    
     // Get proxy settings
     const ProxySettings& getProxySettings() const { return proxySettings_; }
     
+    // Get limits on new connections
+    const ConnectionSettings& getConnectionSettings() const { return connectionSettings_; }
+    
+    // Get metrics exposition and push settings
+    const MetricsSettings& getMetricsSettings() const { return metricsSettings_; }
+    
+    // Get logging settings
+    const LoggingSettings& getLoggingSettings() const { return loggingSettings_; }
+    
+    // Get flight recorder and other diagnostics settings
+    const DiagnosticsSettings& getDiagnosticsSettings() const { return diagnosticsSettings_; }
+    
     // Check if configuration is valid
     bool isValid() const { return valid_; }
     
@@ -43,7 +96,13 @@ private:
     
     RateLimitPolicy globalPolicy_;
     std::unordered_map<std::string, RateLimitPolicy> clientPolicies_;
+    IdentityKey identityKey_;
+    std::vector<TopicRule> topicRules_;
     ProxySettings proxySettings_;
+    ConnectionSettings connectionSettings_;
+    MetricsSettings metricsSettings_;
+    DiagnosticsSettings diagnosticsSettings_;
+    LoggingSettings loggingSettings_;
     
     bool valid_ = false;
     std::string lastError_;
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace throttlebox {
+
+// A cap on the connections open at once from an IPv4 address block
+struct CidrLimit {
+    uint32_t network = 0;        // Host byte order, host bits cleared
+    int prefixLength = 0;        // 0..32
+    size_t maxConnections = 0;
+    
+    uint32_t mask() const { return prefixLength == 0 ? 0 : ~uint32_t(0) << (32 - prefixLength); }
+};
+
+// Parse "<address>/<prefix> <max>", e.g. "10.0.0.0/8 500". Several limits
+// may be separated by ';'. Appends to limits; on error sets error and
+// returns false.
+bool parseCidrLimits(const std::string& text, std::vector<CidrLimit>& limits, std::string& error);
+
+// Counts of the connections open from each source address, from each
+// limited address block and in total, checked when a connection is
+// accepted. Blocks are found by one hash lookup per distinct prefix length
+// in the limits, so the cost does not grow with the number of blocks.
+// Zero caps are unlimited.
+class ConnectionLimiter {
+public:
+    enum class Admission {
+        Admitted,
+        Global,     // max_connections reached
+        Ip,         // max_connections_per_ip reached for the address
+        Cidr        // A block containing the address is full
+    };
+    
+    ConnectionLimiter(size_t maxConnections, size_t maxPerIp, const std::vector<CidrLimit>& cidrLimits);
+    
+    // Count a connection from address (IPv4, host byte order), unless it
+    // would go over a cap. Every admitted connection must be released.
+    Admission admit(uint32_t address);
+    
+    // Stop counting a connection admit() let in
+    void release(uint32_t address);
+    
+    size_t connections() const;
+    
+    // Open connections from address; only tracked with a per-address cap
+    size_t connectionsFrom(uint32_t address) const;
+
+private:
+    // Limited blocks of one prefix length, keyed by network address
+    struct PrefixTable {
+        uint32_t mask;
+        std::unordered_map<uint32_t, size_t> blocks;   // Index into cidrLimits_
+    };
+    
+    template <typename Visit>
+    void forEachBlock(uint32_t address, Visit&& visit) {
+        for (const PrefixTable& table : prefixTables_) {
+            auto it = table.blocks.find(address & table.mask);
+            if (it != table.blocks.end()) {
+                visit(it->second);
+            }
+        }
+    }
+    
+    size_t maxConnections_;
+    size_t maxPerIp_;
+    std::vector<CidrLimit> cidrLimits_;
+    std::vector<PrefixTable> prefixTables_;
+    
+    mutable std::mutex mutex_;
+    size_t connections_ = 0;
+    std::unordered_map<uint32_t, size_t> perIp_;   // Only addresses with connections open
+    std::vector<size_t> perBlock_;                 // Parallel to cidrLimits_
+};
+
+} // namespace throttlebox
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "clock.hpp"
+#include "timer_wheel.hpp"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+namespace throttlebox {
+
+// The deadline of one connection: no CONNECT yet, no answer from the
+// broker, or an idle client. One deadline is armed at a time, on a timer
+// wheel shared by every connection, and enforced from the thread
+// advancing the wheel: when it passes, onExpire is called with its kind,
+// e.g. to shut the client's socket down and end a blocked read.
+//
+// Create with std::make_shared: pending timers hold a reference. Thread-safe.
+class ConnectionWatch : public std::enable_shared_from_this<ConnectionWatch> {
+public:
+    using time_point = Clock::time_point;
+    using Expire = std::function<void(const char* kind)>;
+
+    // Idle deadlines are checked against clock; onExpire runs under the
+    // watch's lock, so it must not call back into the watch
+    ConnectionWatch(TimerWheel& wheel, std::shared_ptr<Clock> clock, Expire onExpire);
+
+    // Arm the deadline, replacing the pending one, or just disarm it when
+    // kind is null. kind ("connect", "half_open", "idle") names it in the
+    // log and metrics. With idleLimit set the deadline follows the last
+    // recordActivity() instead of staying at deadline. Nothing is armed
+    // once the watch has expired or closed.
+    void arm(const char* kind, time_point deadline, std::chrono::nanoseconds idleLimit = std::chrono::nanoseconds(0));
+
+    // Expire the armed deadline now, as when a wait bounded by it ran out
+    // before the wheel caught up. False if none is armed.
+    bool expire();
+
+    // Disarm for good, before the socket onExpire acts on is closed.
+    // Returns the kind of deadline that expired, or null.
+    const char* close();
+
+    // Reads only record their time; an idle deadline catches up with them
+    // when it comes due, so an active client costs one timer per idle
+    // period, not one per read
+    void recordActivity(time_point at) {
+        lastActivityNs_.store(at.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    time_point lastActivity() const {
+        return time_point(time_point::duration(lastActivityNs_.load(std::memory_order_relaxed)));
+    }
+
+    // The armed deadline's kind, null when none is
+    const char* armed() const;
+
+    // The kind of deadline that expired, null if none has
+    const char* expired() const;
+
+private:
+    TimerWheel::TimerId schedule(uint64_t generation, time_point deadline);
+    void fire(uint64_t generation);
+    void expireLocked();
+
+    TimerWheel& wheel_;
+    std::shared_ptr<Clock> clock_;
+    Expire onExpire_;
+    std::atomic<time_point::rep> lastActivityNs_{0};
+
+    mutable std::mutex mutex_;                   // Guards the rest
+    uint64_t generation_ = 0;                    // Bumped on every (re)arm; older timers are stale
+    TimerWheel::TimerId timer_ = 0;
+    const char* kind_ = nullptr;
+    std::chrono::nanoseconds idleLimit_{0};
+    const char* expired_ = nullptr;              // Deadline that passed
+    bool closed_ = false;
+};
+
+} // namespace throttlebox
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+
+namespace throttlebox {
+
+// What the proxy did with a packet
+enum class FlightDecision : uint8_t {
+    Allowed = 0,
+    Limited = 1,   // Bucket empty
+    Blocked = 2,   // Client inside a block period
+    Delayed = 3,   // Held in the connection's shaping queue
+    Denied = 4,    // Refused by a deny topic rule
+};
+
+// One rate limiting decision, kept compact so recording stays cheap
+struct FlightEvent {
+    uint64_t timestampNs = 0;   // steady_clock, see DumpHeader for wall time mapping
+    uint32_t clientHandle = 0;  // Per-connection id assigned at accept
+    uint32_t ipv4 = 0;          // Host byte order, 0x7F000001 = 127.0.0.1
+    float tokensLeft = 0.0f;
+    uint8_t packetType = 0;     // MQTT control packet type (1 = CONNECT, 3 = PUBLISH, ...)
+    uint8_t decision = 0;       // FlightDecision
+    uint8_t policyLevel = 0;    // PolicyLevel that decided
+    uint8_t flags = 0;
+};
+
+// Fixed-size, per-thread, lock-free rings of recent decisions. Each thread
+// writes only to its own ring; dump() may run concurrently and skips
+// slots that are being overwritten while it copies them.
+class FlightRecorder {
+public:
+    // Header of a binary dump, followed by eventCount serialized events
+    struct DumpHeader {
+        uint32_t version = 0;
+        uint32_t eventCount = 0;
+        uint64_t steadyNowNs = 0;   // steady_clock at dump time
+        uint64_t wallNowNs = 0;     // system_clock at dump time, for absolute times
+    };
+
+    static constexpr uint32_t kDumpVersion = 1;
+    static constexpr size_t kHeaderBytes = 32;
+    static constexpr size_t kEventBytes = 24;
+
+    explicit FlightRecorder(size_t eventsPerThread = 512);
+    ~FlightRecorder() = default;
+
+    FlightRecorder(const FlightRecorder&) = delete;
+    FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+    // Record an event in the calling thread's ring
+    void record(const FlightEvent& event);
+
+    // Snapshot every ring, oldest event first, as a binary dump
+    std::string dump() const;
+
+    // Write dump() to a file
+    bool dumpToFile(const std::string& path) const;
+
+    // Parse a binary dump produced by dump()
+    static bool parseDump(const std::string& data, DumpHeader& header, std::vector<FlightEvent>& events);
+
+    // Nanoseconds on the clock used for event timestamps
+    static uint64_t nowNs();
+
+    size_t eventsPerThread() const { return mask_ + 1; }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};  // Position + 1 once written, kWriting while in flux
+        FlightEvent event;
+    };
+
+    struct Ring {
+        explicit Ring(size_t capacity) : slots(capacity) {}
+        std::atomic<bool> inUse{true};
+        std::atomic<uint64_t> head{0};
+        std::vector<Slot> slots;
+    };
+
+    // Thread-exit hook that hands the ring back for reuse
+    struct ThreadRing {
+        uint64_t ownerId = 0;
+        std::shared_ptr<Ring> ring;
+        ~ThreadRing();
+    };
+
+    Ring& ringForThisThread();
+
+    static constexpr uint64_t kWriting = ~uint64_t{0};
+
+    const uint64_t id_;
+    const size_t mask_;
+
+    mutable std::mutex ringsMutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+};
+
+} // namespace throttlebox
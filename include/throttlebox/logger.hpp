@@ -0,0 +1,184 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <type_traits>
+
+namespace throttlebox {
+
+enum class LogLevel : uint8_t {
+    Debug = 0,
+    Info = 1,
+    Warn = 2,
+    Error = 3,
+};
+
+enum class LogFormat : uint8_t {
+    Text = 0,   // logfmt: ts=... level=info event=... key=value
+    Json = 1,   // One JSON object per line
+};
+
+struct LoggingSettings {
+    LogLevel level = LogLevel::Info;
+    LogFormat format = LogFormat::Text;
+    std::string output = "stdout";    // stdout, stderr or a file path
+    size_t queueSize = 4096;          // Records buffered before new ones are dropped
+    int sampleIntervalMs = 1000;      // Per-key window for repetitive records
+};
+
+// One key/value pair of a structured record. Keys must outlive the logger
+// (string literals); string values are copied when the record is queued.
+struct LogField {
+    enum class Type : uint8_t { String, Int, Uint, Double };
+
+    LogField(const char* k, std::string_view v) : key(k), type(Type::String), text(v) {}
+    LogField(const char* k, const std::string& v) : LogField(k, std::string_view(v)) {}
+    LogField(const char* k, const char* v) : LogField(k, std::string_view(v)) {}
+    LogField(const char* k, double v) : key(k), type(Type::Double) { number.d = v; }
+
+    template <typename T, std::enable_if_t<std::is_integral<T>::value, int> = 0>
+    LogField(const char* k, T v) : key(k), type(std::is_signed<T>::value ? Type::Int : Type::Uint) {
+        if (std::is_signed<T>::value) {
+            number.i = static_cast<int64_t>(v);
+        } else {
+            number.u = static_cast<uint64_t>(v);
+        }
+    }
+
+    const char* key;
+    Type type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+    } number = {0};
+    std::string_view text;
+};
+
+// Admits at most one record per interval for a key and counts the rest,
+// so a flood costs one line per interval instead of one per event. Not
+// thread-safe: keep one per key per thread (e.g. per connection).
+class LogSampler {
+public:
+    explicit LogSampler(int intervalMs = 1000)
+        : intervalNs_(static_cast<uint64_t>(intervalMs) * 1000000) {}
+
+    // True if this occurrence should be logged. suppressed() then holds the
+    // number swallowed since the previous admitted one. nowNs is any
+    // monotonic nanosecond clock.
+    bool admit(uint64_t nowNs) {
+        if (logged_ && nowNs - lastLoggedNs_ < intervalNs_) {
+            pending_++;
+            return false;
+        }
+        logged_ = true;
+        lastLoggedNs_ = nowNs;
+        suppressed_ = pending_;
+        pending_ = 0;
+        return true;
+    }
+
+    uint64_t suppressed() const { return suppressed_; }
+
+    // Occurrences swallowed since the last admitted one, not yet reported
+    uint64_t pending() const { return pending_; }
+
+private:
+    uint64_t intervalNs_;
+    uint64_t lastLoggedNs_ = 0;
+    uint64_t suppressed_ = 0;
+    uint64_t pending_ = 0;
+    bool logged_ = false;
+};
+
+// Structured logger whose producers only copy the record into a bounded
+// lock-free queue; formatting and I/O happen on a dedicated writer thread.
+// When the queue is full records are dropped and counted, never blocked on.
+class AsyncLogger {
+public:
+    static constexpr size_t kMaxFields = 8;
+    static constexpr size_t kTextBytes = 192;
+
+    explicit AsyncLogger(const LoggingSettings& settings = LoggingSettings());
+    ~AsyncLogger();
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
+
+    bool enabled(LogLevel level) const { return level >= settings_.level; }
+
+    // Queue a record; event must be a string literal
+    void log(LogLevel level, const char* event, std::initializer_list<LogField> fields);
+
+    // Block until everything queued so far has been written
+    void flush();
+
+    // Records lost because the queue was full
+    uint64_t droppedRecords() const { return dropped_.load(std::memory_order_relaxed); }
+
+    const LoggingSettings& settings() const { return settings_; }
+
+    // Wall clock nanoseconds, the timestamp stamped on records
+    static uint64_t nowNs();
+
+    static bool parseLevel(const std::string& text, LogLevel& level);
+
+private:
+    struct StoredField {
+        const char* key;
+        LogField::Type type;
+        uint16_t offset;
+        uint16_t length;
+        union {
+            int64_t i;
+            uint64_t u;
+            double d;
+        } number;
+    };
+
+    struct Record {
+        uint64_t timestampNs;
+        const char* event;
+        LogLevel level;
+        uint8_t fieldCount;
+        StoredField fields[kMaxFields];
+        char text[kTextBytes];
+    };
+
+    // Bounded MPMC queue cell (Vyukov); the sequence says whose turn it is
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Record record;
+    };
+
+    bool tryPop(Record& record);
+    void writerLoop();
+    void writeRecord(const Record& record);
+    void writeDroppedNotice(uint64_t count);
+
+    LoggingSettings settings_;
+    size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<size_t> enqueuePos_{0};
+    alignas(64) size_t dequeuePos_ = 0;
+
+    std::atomic<uint64_t> dropped_{0};
+    uint64_t droppedReported_ = 0;
+    std::atomic<uint64_t> written_{0};
+    std::atomic<uint64_t> queued_{0};
+
+    std::FILE* out_ = nullptr;
+    bool ownsOutput_ = false;
+    std::string line_;
+
+    std::atomic<bool> running_{true};
+    std::thread writerThread_;
+};
+
+} // namespace throttlebox
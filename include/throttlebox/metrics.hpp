@@ -4,43 +4,147 @@
 #include <atomic>
 #include <unordered_map>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <thread>
+#include <vector>
 
 namespace throttlebox {
 
+// Push exporter settings for sites that cannot be scraped
+struct StatsdSettings {
+    std::string host = "127.0.0.1";
+    int port = 8125;
+    int flushIntervalMs = 10000;
+    bool dogstatsd = false;          // Append DogStatsD "|#tags" to each line
+    std::string prefix = "throttlebox.";
+    std::string tags;                // DogStatsD tags, e.g. "site:edge1,env:prod"
+    size_t maxDatagramBytes = 1432;  // Fits a 1500 byte MTU with IPv4/UDP headers
+};
+
 class Metrics {
 public:
+    // Fixed latency-style bucket bounds shared by every histogram
+    static constexpr size_t kHistogramBuckets = 14;
+    static const double kHistogramBounds[kHistogramBuckets];
+
+    struct Histogram {
+        std::atomic<uint64_t> buckets[kHistogramBuckets + 1] = {};  // last is +Inf
+        std::atomic<uint64_t> count{0};
+        std::atomic<double> sum{0.0};
+
+        // Record one sample
+        void observe(double value);
+    };
+
     Metrics();
     ~Metrics();
 
     // Increment named counter
     void incrementCounter(const std::string& name);
-    
+
     // Set gauge value
     void setGauge(const std::string& name, int64_t value);
-    
+
+    // Get a live counter or gauge, registering it if needed. The reference
+    // stays valid for the lifetime of this Metrics object, so hot paths
+    // can cache it and skip the name lookup.
+    std::atomic<uint64_t>& counter(const std::string& name);
+    std::atomic<int64_t>& gauge(const std::string& name);
+    Histogram& histogram(const std::string& name);
+
+    // Record one sample in a named histogram
+    void observeHistogram(const std::string& name, double value);
+
     // Get formatted metrics in Prometheus text format
     std::string getFormattedMetrics() const;
-    
+
     // Start HTTP server for /metrics endpoint (optional)
     bool startHttpServer(int port = 9090);
-    
+
     // Stop HTTP server
     void stopHttpServer();
 
+    // Serve handler() for "GET <path>" on the metrics HTTP server, e.g.
+    // debug endpoints owned by other components
+    void addHttpHandler(const std::string& path, const std::string& contentType,
+                        std::function<std::string()> handler);
+    void removeHttpHandler(const std::string& path);
+
+    // Start periodic StatsD/DogStatsD push over UDP (optional)
+    bool startStatsdExporter(const StatsdSettings& settings);
+
+    // Stop the push exporter, flushing pending deltas first
+    void stopStatsdExporter();
+
 private:
     void httpServerLoop();
-    
+    void statsdExporterLoop();
+
+    // Format one flush worth of StatsD lines and send them in as few
+    // datagrams as the size limit allows. Returns datagrams sent.
+    size_t flushStatsd(int socket);
+
+    // One exposition series: the cached HELP/TYPE block and sample names,
+    // plus a pointer to the live value (map nodes never move).
+    struct Series {
+        std::string name;
+        std::string prefix;
+        const std::atomic<uint64_t>* counter = nullptr;
+        const std::atomic<int64_t>* gauge = nullptr;
+        const Histogram* histogram = nullptr;
+        std::vector<std::string> sampleNames;  // histogram bucket/sum/count lines
+    };
+
+    void rebuildSeriesCache() const;
+
+    // Both require renderMutex_ to be held
+    void refreshSeriesLocked() const;
+    const std::string& renderLocked() const;
+
     mutable std::mutex counterMutex_;
     std::unordered_map<std::string, std::atomic<uint64_t>> counters_;
-    
+
     mutable std::mutex gaugeMutex_;
     std::unordered_map<std::string, std::atomic<int64_t>> gauges_;
-    
+
+    mutable std::mutex histogramMutex_;
+    std::unordered_map<std::string, Histogram> histograms_;
+
+    // Bumped whenever a counter, gauge or histogram is registered
+    std::atomic<uint64_t> generation_{0};
+
+    // Scrape-side state, only touched under renderMutex_
+    mutable std::mutex renderMutex_;
+    mutable std::vector<Series> series_;
+    mutable uint64_t cachedGeneration_ = ~uint64_t{0};
+    mutable size_t prefixBytes_ = 0;
+    mutable size_t sampleCount_ = 0;
+    mutable std::string renderBuffer_;
+
     // HTTP server for metrics
     std::atomic<bool> httpServerRunning_{false};
     std::thread httpServerThread_;
     int httpPort_ = 9090;
+
+    struct HttpHandler {
+        std::string path;
+        std::string contentType;
+        std::function<std::string()> handler;
+    };
+    std::mutex httpHandlersMutex_;
+    std::vector<HttpHandler> httpHandlers_;
+
+    // StatsD push exporter; last pushed values are keyed by the address
+    // of the live atomic so deltas survive cache rebuilds
+    StatsdSettings statsdSettings_;
+    std::atomic<bool> statsdRunning_{false};
+    std::thread statsdThread_;
+    std::mutex statsdWakeMutex_;
+    std::condition_variable statsdWake_;
+    std::unordered_map<const void*, uint64_t> statsdLastCounts_;
+    std::unordered_map<const void*, double> statsdLastSums_;
+    std::string statsdBuffer_;
 };
 
-} // namespace throttlebox
\ No newline at end of file
+} // namespace throttlebox
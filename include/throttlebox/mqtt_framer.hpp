@@ -0,0 +1,263 @@
+#pragma once
+
+#include <vector>
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+
+namespace throttlebox {
+
+// Non-owning view of bytes inside a packet (std::span arrives in C++20)
+struct ByteSpan {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    bool empty() const { return size == 0; }
+};
+
+// One complete MQTT control packet inside an MqttFramer's buffer
+struct MqttPacket {
+    const uint8_t* data = nullptr;   // Fixed header onwards
+    size_t size = 0;                 // Whole packet
+    size_t headerSize = 0;           // Fixed header: type byte + remaining length
+    uint8_t type = 0;                // Control packet type (1 = CONNECT, 3 = PUBLISH, ...)
+    uint8_t flags = 0;               // Low nibble of the first byte
+
+    const uint8_t* body() const { return data + headerSize; }
+    size_t bodySize() const { return size - headerSize; }
+};
+
+// Control packet types used by the proxy itself
+namespace mqtt {
+constexpr uint8_t kConnect = 1;
+constexpr uint8_t kConnack = 2;
+constexpr uint8_t kPublish = 3;
+constexpr uint8_t kPuback = 4;
+constexpr uint8_t kPubrec = 5;
+constexpr uint8_t kPubrel = 6;
+constexpr uint8_t kPubcomp = 7;
+constexpr uint8_t kDisconnect = 14;
+
+constexpr uint8_t kProtocolV5 = 5;
+
+// MQTT 5 reason codes
+constexpr uint8_t kSuccess = 0x00;
+constexpr uint8_t kMalformedPacket = 0x81;
+constexpr uint8_t kNotAuthorized = 0x87;
+constexpr uint8_t kServerBusy = 0x89;
+constexpr uint8_t kTopicNameInvalid = 0x90;
+constexpr uint8_t kTopicAliasInvalid = 0x94;
+constexpr uint8_t kPacketTooLarge = 0x95;
+constexpr uint8_t kMessageRateTooHigh = 0x96;
+constexpr uint8_t kQuotaExceeded = 0x97;
+constexpr uint8_t kConnectionRateExceeded = 0x9F;
+
+// MQTT 3.1/3.1.1 CONNACK return code for every refusal the proxy makes
+constexpr uint8_t kServerUnavailable = 0x03;
+
+// MQTT 5 property identifiers
+constexpr uint8_t kPropertyServerKeepAlive = 0x13;
+constexpr uint8_t kPropertyReceiveMaximum = 0x21;
+constexpr uint8_t kPropertyTopicAliasMaximum = 0x22;
+constexpr uint8_t kPropertyTopicAlias = 0x23;
+constexpr uint8_t kPropertyMaximumPacketSize = 0x27;
+} // namespace mqtt
+
+// View the complete packet at the start of data, e.g. one kept whole in a
+// PacketQueue or peeked from a socket. False if data holds less than one
+// packet or its remaining length is malformed.
+bool viewPacket(const uint8_t* data, size_t size, MqttPacket& packet);
+
+// QoS of a PUBLISH (0-2), from its fixed header flags
+inline uint8_t publishQos(const MqttPacket& packet) { return (packet.flags >> 1) & 0x03; }
+
+// Packet identifier of a QoS 1/2 PUBLISH, or of a PUBACK, PUBREC, PUBREL
+// or PUBCOMP. False for other packets or if the body is too short.
+bool packetIdOf(const MqttPacket& packet, uint16_t& id);
+
+// A PUBLISH's fields, viewed in place in the packet: valid as long as the
+// packet's bytes are, and parsing allocates nothing
+struct PublishView {
+    std::string_view topic;     // Empty for MQTT 5 publishes using a topic alias
+    uint16_t packetId = 0;      // QoS 1/2 only
+    uint8_t qos = 0;
+    bool dup = false;
+    bool retain = false;
+    ByteSpan properties;        // MQTT 5 only, without the length prefix
+    ByteSpan payload;
+};
+
+// Parse a PUBLISH sent under protocolLevel (properties only exist from
+// MQTT 5). False for other packets or if a field overruns the packet.
+bool parsePublish(const MqttPacket& packet, uint8_t protocolLevel, PublishView& view);
+
+// Re-encode a PUBLISH into out with its topic name replaced by topic,
+// e.g. to spell out the topic of one that only carries a topic alias.
+// Everything after the topic name is copied. False if publish is not a
+// PUBLISH with a topic name field.
+bool rewritePublishTopic(const MqttPacket& publish, std::string_view topic, std::vector<uint8_t>& out);
+
+// One MQTT 5 property
+struct MqttProperty {
+    uint8_t id = 0;
+    uint32_t value = 0;   // Byte, two and four byte, and variable byte integers
+    ByteSpan data;        // Strings and binary data; both strings of a user property
+    ByteSpan encoded;     // The whole property, identifier included
+};
+
+// Walks an MQTT 5 property block such as PublishView::properties
+class PropertyReader {
+public:
+    explicit PropertyReader(ByteSpan properties) : properties_(properties) {}
+
+    // Next property, or false at the end of the block or if it is
+    // malformed: an unknown identifier or a value overrunning the block
+    bool next(MqttProperty& property);
+
+    bool error() const { return error_; }
+
+private:
+    ByteSpan properties_;
+    size_t offset_ = 0;
+    bool error_ = false;
+};
+
+// Whether every property in the block is well-formed
+inline bool validProperties(ByteSpan properties) {
+    PropertyReader reader(properties);
+    MqttProperty property;
+    while (reader.next(property)) {
+    }
+    return !reader.error();
+}
+
+// A DISCONNECT's reason code and MQTT 5 properties, viewed in place
+struct DisconnectView {
+    uint8_t reasonCode = 0;   // Normal disconnection when omitted
+    ByteSpan properties;
+};
+
+// Parse a DISCONNECT sent under protocolLevel. False for other packets or
+// if a field overruns it.
+bool parseDisconnect(const MqttPacket& packet, uint8_t protocolLevel, DisconnectView& view);
+
+// Limits the proxy advertises in MQTT 5 CONNACKs; 0 leaves the broker's
+struct ConnackLimits {
+    uint16_t receiveMaximum = 0;      // QoS 1/2 publishes in flight from the client
+    uint32_t maximumPacketSize = 0;   // Largest packet the client may send, in bytes
+    uint16_t topicAliasMaximum = 0;   // Topic aliases the client may set
+
+    bool empty() const { return receiveMaximum == 0 && maximumPacketSize == 0 && topicAliasMaximum == 0; }
+};
+
+// A CONNACK's fields, viewed in place
+struct ConnackView {
+    uint8_t ackFlags = 0;
+    uint8_t reasonCode = 0;   // The return code before MQTT 5
+    ByteSpan properties;      // MQTT 5 only, without the length prefix
+};
+
+// Parse a CONNACK sent under protocolLevel. False for other packets, if a
+// field overruns it or bytes are left over.
+bool parseConnack(const MqttPacket& packet, uint8_t protocolLevel, ConnackView& view);
+
+// Re-encode a successful MQTT 5 CONNACK into out with Receive Maximum and
+// Maximum Packet Size each set to the lower of the broker's and limits'.
+// Topic Alias Maximum is only lowered: without one from the broker the
+// client may not use aliases at all. Other properties are copied. False
+// if connack is not a well-formed, successful MQTT 5 CONNACK.
+bool rewriteConnack(const MqttPacket& connack, const ConnackLimits& limits, std::vector<uint8_t>& out);
+
+// Connect flags
+namespace mqtt {
+constexpr uint8_t kConnectReserved = 0x01;
+constexpr uint8_t kConnectCleanStart = 0x02;
+constexpr uint8_t kConnectWill = 0x04;
+constexpr uint8_t kConnectWillRetain = 0x20;
+constexpr uint8_t kConnectPassword = 0x40;
+constexpr uint8_t kConnectUsername = 0x80;
+} // namespace mqtt
+
+// A CONNECT's variable header and payload, viewed in place. Fields whose
+// flag is not set are left empty.
+struct ConnectView {
+    std::string_view protocolName;   // "MQTT", or "MQIsdp" for 3.1
+    uint8_t protocolLevel = 0;       // 3 = 3.1, 4 = 3.1.1, 5 = 5.0
+    uint8_t flags = 0;               // Connect flags
+    uint16_t keepAlive = 0;          // Seconds
+    ByteSpan properties;             // MQTT 5 only, without the length prefix
+    std::string_view clientId;       // May be empty
+    ByteSpan willProperties;         // MQTT 5 only
+    std::string_view willTopic;
+    ByteSpan willPayload;
+    std::string_view username;
+    ByteSpan password;
+
+    bool hasWill() const { return (flags & mqtt::kConnectWill) != 0; }
+    bool hasUsername() const { return (flags & mqtt::kConnectUsername) != 0; }
+};
+
+// Parse a CONNECT. False for other packets, if a field overruns it or
+// bytes are left over, or if the reserved connect flag is set.
+bool parseConnect(const MqttPacket& packet, ConnectView& view);
+
+// Encode a PUBACK, PUBREC, PUBREL or PUBCOMP into out (at least 5 bytes).
+// The reason code is only written for MQTT 5 and only when it is not
+// Success, as the spec allows. Returns the bytes written.
+size_t encodeAck(uint8_t type, uint16_t id, uint8_t reasonCode, uint8_t protocolLevel, uint8_t* out);
+
+// Encode a CONNACK refusing the connection into out (at least 5 bytes):
+// reasonCode for MQTT 5, Server unavailable for older clients, which
+// have no finer code. Returns the bytes written.
+size_t encodeConnackRefusal(uint8_t reasonCode, uint8_t protocolLevel, uint8_t* out);
+
+// Splits a byte stream into MQTT control packets. Reads go straight into
+// the framer's buffer (prepare/commit), so complete packets are handed out
+// in place and a partial packet simply waits for the next read.
+//
+//   uint8_t* space = framer.prepare(4096);
+//   ssize_t n = recv(fd, space, 4096, 0);
+//   framer.commit(n);
+//   while (framer.next(packet)) { ... }
+//
+// Packets returned by next() stay valid until the next prepare().
+class MqttFramer {
+public:
+    static constexpr size_t kMaxRemainingLength = 268435455;   // MQTT limit
+
+    explicit MqttFramer(size_t maxPacketSize = kMaxRemainingLength + 5);
+
+    // Writable space for at least minBytes; compacts and grows as needed
+    uint8_t* prepare(size_t minBytes);
+
+    // Mark bytes written into the space from prepare() as received
+    void commit(size_t bytes);
+
+    // Next complete packet, or false if more bytes are needed (or the
+    // stream is malformed, see error())
+    bool next(MqttPacket& packet);
+
+    // Like next(), but the packet is returned again by the next call
+    bool peek(MqttPacket& packet);
+
+    // Malformed remaining length or a packet over maxPacketSize; the
+    // stream cannot be resynchronized and the connection should be closed
+    bool error() const { return error_; }
+
+    // The error was a packet over maxPacketSize
+    bool oversized() const { return oversized_; }
+
+    // Bytes received but not yet returned as packets
+    size_t buffered() const { return end_ - start_; }
+    const uint8_t* pending() const { return buffer_.data() + start_; }
+
+private:
+    std::vector<uint8_t> buffer_;
+    size_t start_ = 0;   // First byte not yet returned by next()
+    size_t end_ = 0;     // One past the last received byte
+    size_t maxPacketSize_;
+    bool error_ = false;
+    bool oversized_ = false;
+};
+
+} // namespace throttlebox
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string_view>
+#include <cstddef>
+#include <cstdint>
+
+namespace throttlebox {
+
+// Checks on the strings inside MQTT packets, made before a packet is
+// forwarded so malformed ones never reach the broker. Runs of ASCII are
+// scanned 32 (AVX2) or 16 (SSE2) bytes at a time, picked once per process
+// by CPU support; multi-byte sequences and other CPUs take the scalar path.
+
+// Whether data is a well-formed MQTT UTF-8 string: no overlong encodings,
+// surrogates or code points above U+10FFFF, and no U+0000
+bool isValidMqttString(const uint8_t* data, size_t size);
+
+inline bool isValidMqttString(std::string_view text) {
+    return isValidMqttString(reinterpret_cast<const uint8_t*>(text.data()), text.size());
+}
+
+// Whether topic is a valid PUBLISH topic name: a valid MQTT string without
+// the wildcards '+' and '#'. An empty name (an MQTT 5 topic alias) is
+// left to the caller.
+bool isValidTopicName(std::string_view topic);
+
+// Kernel the checks above run on: "avx2", "sse2" or "scalar"
+const char* mqttValidateKernel();
+
+} // namespace throttlebox
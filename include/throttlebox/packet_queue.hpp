@@ -0,0 +1,35 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace throttlebox {
+
+// FIFO of whole packets held back by traffic shaping. The bytes are kept
+// contiguous, so the first n packets go out in a single send.
+class PacketQueue {
+public:
+    // Copy a packet to the back
+    void push(const uint8_t* data, size_t size);
+
+    // Bytes taken by the first n packets, which start at front()
+    size_t frontBytes(size_t n) const;
+    const uint8_t* front() const { return storage_.data() + head_; }
+
+    // Drop the first n packets
+    void pop(size_t n);
+
+    size_t packets() const { return sizes_.size(); }
+    size_t packetSize(size_t i) const { return sizes_[i]; }
+    size_t bytes() const { return storage_.size() - head_; }
+    bool empty() const { return sizes_.empty(); }
+
+private:
+    std::vector<uint8_t> storage_;
+    size_t head_ = 0;              // Start of the first queued packet
+    std::deque<uint32_t> sizes_;
+};
+
+} // namespace throttlebox
@@ -5,35 +5,271 @@
 #include <mutex>
 #include <chrono>
 #include <deque>
+#include <atomic>
+#include <queue>
+#include <vector>
+#include <memory>
+#include <string_view>
+#include "clock.hpp"
+#include "topic_trie.hpp"
 
 namespace throttlebox {
 
+class Metrics;
+
+// What happens to packets over the limit
+enum class LimitMode : uint8_t {
+    Drop = 0,     // Discard them (and block the client if configured)
+    Shape = 1,    // Hold them per connection until tokens refill; never blocks
+};
+
+// How a dropped QoS 1/2 PUBLISH is answered, so the client does not
+// retransmit it. QoS 0 and other packets are simply dropped.
+enum class RejectAction : uint8_t {
+    Drop = 0,         // No answer; the client retransmits with DUP set
+    SilentAck = 1,    // PUBACK/PUBREC as if it was delivered
+    ReasonCode = 2,   // MQTT 5: PUBACK/PUBREC with 0x96 Message rate too high;
+                      // MQTT 3.1.1 has no reason codes and gets SilentAck
+    Disconnect = 3,   // Close the connection (MQTT 5: DISCONNECT 0x96 first)
+};
+
+// Control packet types with budgets of their own
+enum class PacketClass : uint8_t {
+    Publish = 0,     // PUBLISH
+    Subscribe = 1,   // SUBSCRIBE, UNSUBSCRIBE
+    Ping = 2,        // PINGREQ
+    Connect = 3,     // CONNECT
+    Other = 4,       // Acknowledgements, DISCONNECT, AUTH
+};
+
+constexpr size_t kPacketClasses = 5;
+
+// Packet class of an MQTT control packet type (first byte >> 4)
+PacketClass classifyPacket(uint8_t type);
+
+// Config name of a packet class ("publish", "subscribe", ...)
+const char* packetClassName(PacketClass packetClass);
+
+// One packet class's share of a policy
+struct PacketBudget {
+    double maxPerSec = 0.0;   // Own bucket at this rate; 0 draws from the policy's bucket
+    int burstSize = 0;        // Own bucket capacity; 0 means one second's worth
+    double weight = 1.0;      // Tokens one packet costs
+};
+
 struct RateLimitPolicy {
     double maxMessagesPerSec = 10.0;
     int burstSize = 20;
     int blockDurationSec = 60;
+    double maxBytesPerSec = 0.0;   // Bandwidth limit; 0 disables it
+    double byteBurst = 0.0;        // Byte bucket capacity; 0 means one second's worth
+    LimitMode mode = LimitMode::Drop;
+    size_t shapeQueueBytes = 1024 * 1024;   // Per connection; reading pauses beyond this
+    RejectAction rejectAction = RejectAction::Drop;
+    PacketBudget packetBudgets[kPacketClasses];   // Indexed by PacketClass
+    
+    const PacketBudget& budget(PacketClass packetClass) const {
+        return packetBudgets[static_cast<size_t>(packetClass)];
+    }
+    
+    // Which bucket a packet class draws from: its own (the class's index)
+    // or the policy's (kPacketClasses)
+    size_t bucketOf(PacketClass packetClass) const {
+        return budget(packetClass).maxPerSec > 0 ? static_cast<size_t>(packetClass) : kPacketClasses;
+    }
+    
+    double byteCapacity() const { return byteBurst > 0 ? byteBurst : maxBytesPerSec; }
+};
+
+bool parseLimitMode(const std::string& text, LimitMode& mode);
+bool parseRejectAction(const std::string& text, RejectAction& action);
+
+// What a client's bucket is keyed on, read once from its CONNECT. Client
+// IDs are chosen by the client, so a flood can rotate them for a fresh
+// bucket on every reconnect; usernames and addresses are harder to change.
+struct IdentityKey {
+    bool clientId = true;
+    bool username = false;
+    bool ip = false;
+};
+
+// "client_id", "username", "ip", or a composite joined by '+' such as
+// "username+ip"
+bool parseIdentityKey(const std::string& text, IdentityKey& key);
+
+// Bucket key of a connection. A missing client ID or username stands in as
+// the IP address, so every client has a key it cannot change by itself.
+// Each part is prefixed with its kind ("c:", "u:" or "ip:") and parts are
+// joined by NUL, which MQTT strings cannot contain.
+std::string identityOf(const IdentityKey& key, const std::string& ip, const std::string& clientId,
+                       const std::string& username);
+
+// Which policy a decision was made under
+enum class PolicyLevel : uint8_t {
+    Default = 0,
+    Client = 1,
+};
+
+struct RateLimitDecision {
+    bool allowed = false;
+    bool blocked = false;      // Rejected by an active block, not an empty bucket
+    bool denied = false;       // Rejected by a deny topic rule; retrying never helps
+    bool overQuota = false;    // Rejected for bandwidth (max_bytes_per_sec), not message rate
+    double tokensLeft = 0.0;
+    PolicyLevel level = PolicyLevel::Default;
+    std::chrono::nanoseconds retryAfter{0};   // Until the next packet could pass; zero if allowed
+};
+
+// Bucket of a packet class with its own budget
+struct ClassBucket {
+    double tokens = 0.0;
+    std::chrono::steady_clock::time_point lastRefill;
 };
 
 struct TokenBucket {
     double tokens = 0.0;
+    double byteTokens = 0.0;   // Refilled with tokens, when the policy limits bandwidth
     std::chrono::steady_clock::time_point lastRefill;
     std::chrono::steady_clock::time_point blockedUntil;
     bool isBlocked = false;
+    uint32_t pins = 0;         // Live ClientHandles; pinned buckets are never evicted
+    std::unique_ptr<ClassBucket[]> classBuckets;   // Allocated on first use by a class with its own budget
+    std::vector<std::pair<uint32_t, ClassBucket>> topicBuckets;   // Per topic rule this client published under
 };
 
 class RateLimiter {
 public:
-    RateLimiter(const RateLimitPolicy& defaultPolicy);
+    // A client's bucket and policy resolved once, so per-packet decisions
+    // skip the key lookup. The bucket stays pinned (exempt from cleanup)
+    // until the handle is destroyed; the policy is the one in effect at
+    // acquire(). Handles must not outlive their RateLimiter.
+    class ClientHandle {
+    public:
+        ClientHandle() = default;
+        ~ClientHandle() { reset(); }
+        
+        ClientHandle(ClientHandle&& other) noexcept { *this = std::move(other); }
+        ClientHandle& operator=(ClientHandle&& other) noexcept;
+        ClientHandle(const ClientHandle&) = delete;
+        ClientHandle& operator=(const ClientHandle&) = delete;
+        
+        bool valid() const { return bucket_ != nullptr; }
+        PolicyLevel level() const { return level_; }
+        const RateLimitPolicy& policy() const { return policy_; }
+        
+        // Unpin the bucket early
+        void reset();
+        
+    private:
+        friend class RateLimiter;
+        
+        RateLimiter* limiter_ = nullptr;
+        const std::string* key_ = nullptr;   // Owned by the buckets_ node
+        TokenBucket* bucket_ = nullptr;
+        RateLimitPolicy policy_;
+        PolicyLevel level_ = PolicyLevel::Default;
+    };
+    
+    // One client's share of an allowBatch() call
+    struct BatchEntry {
+        ClientHandle* handle = nullptr;
+        uint32_t count = 0;      // Packets waiting
+        uint32_t allowed = 0;    // Set by allowBatch(): how many of them may pass
+    };
+
+    // Reads time from clock (MonotonicClock when null)
+    explicit RateLimiter(const RateLimitPolicy& defaultPolicy, std::shared_ptr<Clock> clock = nullptr);
     ~RateLimiter() = default;
 
     // Check if a message from this client/IP is allowed
     bool allow(const std::string& ip, const std::string& clientId);
     
+    // Same as allow(), but also reports why and under which policy
+    RateLimitDecision check(const std::string& ip, const std::string& clientId);
+    
+    // Same as check(), at a time the caller already read (e.g. once for a
+    // whole batch of packets) instead of reading the clock. Times must not
+    // go backwards per client; earlier ones refill nothing.
+    RateLimitDecision check(const std::string& ip, const std::string& clientId,
+                            std::chrono::steady_clock::time_point now);
+    
+    // Resolve and pin a client's bucket for allowN()/allowBatch()
+    ClientHandle acquire(const std::string& ip, const std::string& clientId);
+    
+    // Same, with the bucket keyed on an identity from identityOf(); the
+    // client ID still selects a per-client policy
+    ClientHandle acquireIdentity(const std::string& identity, const std::string& clientId);
+    
+    // Whether the bucket keyed on identity is blocked, e.g. so a client
+    // that reconnects is refused while its block lasts
+    bool isBlocked(const std::string& identity);
+    
+    // Decide n packets from one client at once, with one lock and one clock
+    // read. Returns how many of them (from the front) may pass. last, when
+    // given, describes the decision for the last packet.
+    size_t allowN(ClientHandle& handle, size_t n, RateLimitDecision* last = nullptr);
+    size_t allowN(ClientHandle& handle, size_t n, std::chrono::steady_clock::time_point now,
+                  RateLimitDecision* last = nullptr);
+    
+    // allowN() for many clients under one lock and one clock read, e.g. for
+    // everything an event loop read in one iteration
+    void allowBatch(BatchEntry* entries, size_t count);
+    
+    // Decide n packets of the given control packet types (first byte >> 4)
+    // and sizes in one call. Each is charged its class's weight against its
+    // class's bucket, and packets drawing from the policy's bucket are also
+    // charged their size against the byte bucket (sizes may be null when
+    // the policy has no maxBytesPerSec). PUBLISHes with a topic (topics may
+    // be null) are also charged to the client's bucket of every topic rule
+    // they match. allowed[i] is set per packet, so a PINGREQ with a budget
+    // of its own passes even when the PUBLISH before it does not. Blocks
+    // only apply to packets drawing from the policy's bucket. Returns how
+    // many were allowed; last describes the first rejection, if any.
+    // denied, when given, is set per packet: refused by a deny topic rule,
+    // so it should be dropped rather than retried.
+    size_t allowPackets(ClientHandle& handle, const uint8_t* types, const uint32_t* sizes,
+                        const std::string_view* topics, size_t n, bool* allowed,
+                        std::chrono::steady_clock::time_point now, RateLimitDecision* last = nullptr,
+                        bool* denied = nullptr);
+    
+    // Same, but packets drawing from one bucket (see bucketOf()) must pass
+    // in order: once one is rejected, later ones from that bucket are
+    // rejected without taking tokens, while packets drawing from other
+    // buckets are still decided. Packets from buckets set in waiting (bit
+    // bucketOf()) are rejected undecided, e.g. because earlier ones are
+    // already queued. last.retryAfter is the soonest any rejecting bucket
+    // could pass. Denied packets are reported whether decided or not, and
+    // never hold back their bucket.
+    size_t allowPacketsInOrder(ClientHandle& handle, const uint8_t* types, const uint32_t* sizes,
+                               const std::string_view* topics, size_t n, bool* allowed,
+                               std::chrono::steady_clock::time_point now, RateLimitDecision* last = nullptr,
+                               uint32_t waiting = 0, bool* denied = nullptr);
+    
+    // Replace the topic rules, applied to every client on top of its
+    // policy. Every rule matching a PUBLISH's topic applies: deny rules
+    // refuse it, the others each limit it with a (client, rule) bucket.
+    void setTopicRules(std::vector<TopicRule> rules);
+    
+    // Whether any topic rules are set, i.e. topics are worth extracting
+    bool hasTopicRules() const { return hasTopicRules_.load(std::memory_order_relaxed); }
+    
+    // Whether a deny rule matches topic. Takes the limiter's lock, so
+    // per-packet checks should use the denials allowPackets() reports.
+    bool topicDenied(std::string_view topic) const;
+    
     // Set custom policy for a specific client
     void setClientPolicy(const std::string& clientId, const RateLimitPolicy& policy);
     
     // Clean up expired entries to prevent memory leaks
     void cleanupExpired();
+    void cleanupExpired(std::chrono::steady_clock::time_point now);
+    
+    // Mirror the tracked and blocked client counts into the
+    // unique_clients and blocked_clients gauges as they change
+    void bindMetrics(Metrics& metrics);
+    
+    // The time source decisions are made against
+    const Clock& clock() const { return *clock_; }
     
     // Get statistics for metrics
     struct Stats {
@@ -46,15 +282,73 @@ public:
     Stats getStats() const;
 
 private:
-    bool checkAndUpdateBucket(const std::string& key, const RateLimitPolicy& policy);
-    void refillBucket(TokenBucket& bucket, const RateLimitPolicy& policy);
+    RateLimitDecision checkAndUpdateBucket(const std::string& key, const RateLimitPolicy& policy,
+                                           std::chrono::steady_clock::time_point now);
+    void refillBucket(TokenBucket& bucket, const RateLimitPolicy& policy,
+                      std::chrono::steady_clock::time_point now);
+    static void refillTokens(double& tokens, std::chrono::steady_clock::time_point& lastRefill,
+                             double ratePerSec, double capacity, std::chrono::steady_clock::time_point now);
+    
+    // Refill and take up to n tokens; requires mutex_ to be held
+    size_t takeTokensLocked(const std::string& key, TokenBucket& bucket, const RateLimitPolicy& policy,
+                            std::chrono::steady_clock::time_point now, size_t n, RateLimitDecision& last);
+    
+    // Per-packet-class decisions for allowPackets(); requires mutex_ to be held
+    size_t takePacketsLocked(const std::string& key, TokenBucket& bucket, const RateLimitPolicy& policy,
+                             std::chrono::steady_clock::time_point now, const uint8_t* types,
+                             const uint32_t* sizes, const std::string_view* topics, size_t n,
+                             bool* allowed, bool* denied, bool inOrder, uint32_t waiting,
+                             RateLimitDecision& last);
+    
+    // Match topic and check the client's bucket of every matching rule,
+    // leaving them in topicMatches_ to be charged. Sets denied on last when
+    // a deny rule matches, and retryAfter when refused and first is set.
+    // Requires mutex_.
+    bool checkTopicLocked(TokenBucket& bucket, std::string_view topic,
+                          std::chrono::steady_clock::time_point now, bool first, RateLimitDecision& last);
+    bool topicDeniedLocked(std::string_view topic) const;
+    void recordDecisions(uint64_t allowed, uint64_t rejected);
+    
+    // Client count bookkeeping; all require mutex_ to be held
+    void onBucketCreated();
+    void onBucketErased(const TokenBucket& bucket);
+    void onBlocked(const std::string& key, TokenBucket& bucket,
+                   std::chrono::steady_clock::time_point until);
+    void onUnblocked(TokenBucket& bucket) const;
+    void expireBlocksLocked(std::chrono::steady_clock::time_point now) const;
+    
+    // Pending block expiries, earliest first. Entries are checked against
+    // the bucket when popped, so re-blocks and evictions need no removal.
+    struct BlockExpiry {
+        std::chrono::steady_clock::time_point until;
+        std::string key;
+        bool operator>(const BlockExpiry& other) const { return until > other.until; }
+    };
     
     RateLimitPolicy defaultPolicy_;
+    std::shared_ptr<Clock> clock_;
     std::unordered_map<std::string, RateLimitPolicy> clientPolicies_;
-    std::unordered_map<std::string, TokenBucket> buckets_;
+    
+    // Mutable, like the rest of the block bookkeeping: getStats() retires
+    // blocks that lapsed without further traffic
+    mutable std::unordered_map<std::string, TokenBucket> buckets_;
+    
+    // Topic rules and their compiled filters, guarded by mutex_
+    std::vector<TopicRule> topicRules_;
+    TopicTrie topicTrie_;
+    std::vector<uint32_t> topicMatches_;   // Scratch for checkTopicLocked(): indices into topicBuckets
+    std::atomic<bool> hasTopicRules_{false};
+    
+    mutable std::priority_queue<BlockExpiry, std::vector<BlockExpiry>, std::greater<BlockExpiry>> blockExpiries_;
     
     mutable std::mutex mutex_;
     
+    // Maintained on bucket creation/eviction and block transitions
+    std::atomic<size_t> trackedClients_{0};
+    mutable std::atomic<size_t> blockedClients_{0};
+    std::atomic<int64_t>* trackedClientsGauge_ = nullptr;
+    std::atomic<int64_t>* blockedClientsGauge_ = nullptr;
+    
     // Statistics
     mutable std::mutex statsMutex_;
     uint64_t allowedMessages_ = 0;
@@ -5,9 +5,19 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include "rate_limiter.hpp"
+#include "connection_limiter.hpp"
 #include "config.hpp"
 #include "metrics.hpp"
+#include "flight_recorder.hpp"
+#include "logger.hpp"
+#include "trace.hpp"
+#include "mqtt_framer.hpp"
+#include "packet_queue.hpp"
+#include "timer_wheel.hpp"
+#include "connection_watch.hpp"
 
 namespace throttlebox {
 
@@ -21,28 +31,76 @@ public:
     
     // Stop the proxy server
     void stop();
+    
+    // Write the flight recorder's recent decisions to a file
+    // (the configured path when empty)
+    bool dumpFlightRecorder(const std::string& path = "");
 
 private:
-    // Handle individual client connection
-    void handleClient(int clientSocket);
+    // Handle individual client connection, admitted by connectionLimiter_
+    // from address (IPv4, host byte order)
+    void handleClient(int clientSocket, uint32_t address);
     
     // Extract client info from MQTT CONNECT packet
     struct ClientInfo {
         std::string ip;
         std::string clientId;
+        std::string username;        // Empty without the username flag
+        std::string willTopic;       // Empty without a will
+        std::string identity;        // Rate limiter bucket key, see identity_key
+        uint32_t ipv4 = 0;     // Host byte order, for compact event records
+        uint32_t handle = 0;   // Per-connection id
+        uint8_t protocolLevel = 4;   // From CONNECT: 3 = 3.1, 4 = 3.1.1, 5 = 5.0
+        uint8_t connectFlags = 0;
+        uint16_t keepAlive = 0;      // Seconds
     };
     
-    bool extractClientInfo(int socket, ClientInfo& info);
+    // Disarm the connection's deadline, then close its socket
+    void closeClient(int clientSocket, ConnectionWatch& watch, const ClientInfo& info);
+    
+    // Read the client's CONNECT into framer, where it is left for
+    // forwardTraffic() to send on; false if it is missing or malformed
+    bool extractClientInfo(int socket, MqttFramer& framer, ClientInfo& info);
+    
+    // Charge a new connection to the CONNECT-rate buckets of its address
+    // and client ID. A client over either, or whose identity is blocked,
+    // is sent a refusing CONNACK and false is returned; the caller closes
+    // the socket.
+    bool admitConnect(int clientSocket, const ClientInfo& info);
+    
+    // Forward traffic between client and broker, starting with whatever
+    // framer already holds
+    void forwardTraffic(int clientSocket, int brokerSocket, const ClientInfo& info, MqttFramer& framer,
+                        const std::shared_ptr<ConnectionWatch>& watch);
     
-    // Forward traffic between client and broker
-    void forwardTraffic(int clientSocket, int brokerSocket, const ClientInfo& info);
+    // Connect to the real MQTT broker, giving up at deadline
+    int connectToBroker(std::chrono::steady_clock::time_point deadline);
     
-    // Connect to the real MQTT broker
-    int connectToBroker();
+    // Schedule on the shared timer wheel and wake its thread
+    TimerWheel::TimerId scheduleTimer(std::chrono::steady_clock::time_point deadline,
+                                      TimerWheel::Callback callback);
+    void timerLoop();
 
 private:
     std::unique_ptr<RateLimiter> rateLimiter_;
+    std::unique_ptr<ConnectionLimiter> connectionLimiter_;
+    std::unique_ptr<RateLimiter> ipConnectLimiter_;       // Null when ip_connect_rate is 0
+    std::unique_ptr<RateLimiter> clientConnectLimiter_;   // Null when client_connect_rate is 0
+    std::atomic<uint64_t>* connectRateRejections_ = nullptr;
+    std::mutex connectRateLogMutex_;
+    LogSampler connectRateLogSampler_;
     std::unique_ptr<Metrics> metrics_;
+    std::unique_ptr<AsyncLogger> logger_;
+    std::atomic<int64_t>* activeConnections_ = nullptr;
+    std::unique_ptr<FlightRecorder> flightRecorder_;
+    std::unique_ptr<TraceWriter> traceWriter_;
+    std::unique_ptr<TimerWheel> timerWheel_;
+    std::unique_ptr<TimerWheel> deadlineWheel_;   // Coarse ticks for connection deadlines
+    std::shared_ptr<Clock> deadlineClock_;
+    std::thread timerThread_;
+    std::mutex timerWakeMutex_;
+    std::condition_variable timerWake_;
+    std::atomic<uint32_t> nextClientHandle_{1};
     Config config_;
     
     int serverSocket_;
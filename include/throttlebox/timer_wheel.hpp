@@ -0,0 +1,67 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace throttlebox {
+
+// Hashed timing wheel: timers hash into slots by deadline tick, so
+// scheduling and cancelling are O(1) however many timers are pending and
+// advancing costs one slot per elapsed tick. Deadlines are rounded up to
+// the next tick; timers further out than one revolution simply stay in
+// their slot until a later pass reaches their tick.
+//
+// Thread-safe. Callbacks run on the thread calling advance(), outside the
+// timer lock, so they may schedule new timers (but must not cancel).
+class TimerWheel {
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+    using TimerId = uint64_t;
+    using Callback = std::function<void()>;
+
+    explicit TimerWheel(time_point start,
+                        std::chrono::nanoseconds tick = std::chrono::milliseconds(1),
+                        size_t slots = 512);
+
+    // Run callback once the wheel advances past deadline. Deadlines already
+    // passed fire on the next advance(). Ids are never reused.
+    TimerId schedule(time_point deadline, Callback callback);
+
+    // Remove a pending timer. Returns false if it already fired or was
+    // cancelled; if it is firing right now, waits for the callback to
+    // finish, so nothing it refers to is used after cancel() returns.
+    bool cancel(TimerId id);
+
+    // Fire every timer due at or before now. Returns the number fired.
+    size_t advance(time_point now);
+
+    size_t pending() const;
+
+    std::chrono::nanoseconds tick() const { return tick_; }
+
+private:
+    struct Timer {
+        TimerId id;
+        uint64_t deadlineTick;
+        Callback callback;
+    };
+
+    uint64_t tickOf(time_point t) const;
+
+    time_point start_;
+    std::chrono::nanoseconds tick_;
+    std::vector<std::vector<Timer>> slots_;
+    std::unordered_map<TimerId, size_t> slotOf_;   // Pending timer -> slot
+    uint64_t currentTick_ = 0;                     // Every tick up to here has fired
+    TimerId nextId_ = 1;
+
+    mutable std::mutex mutex_;
+    std::mutex fireMutex_;                         // Held while callbacks run
+};
+
+} // namespace throttlebox
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+namespace throttlebox {
+
+// A topic-level policy: PUBLISHes whose topic matches filter are either
+// refused outright or limited per client by a bucket of their own
+struct TopicRule {
+    std::string filter;               // MQTT topic filter, may use + and #
+    double maxMessagesPerSec = 0.0;
+    int burstSize = 0;                // 0 means one second's worth
+    bool deny = false;                // Refuse every matching PUBLISH
+    
+    double capacity() const;
+};
+
+// Parse "<filter> <rate>[/<burst>]" or "<filter> deny", e.g.
+// "factory/+/alarm 1" or "firmware/# deny". Several rules may be
+// separated by ';'. Appends to rules; on error sets error and returns false.
+bool parseTopicRules(const std::string& text, std::vector<TopicRule>& rules, std::string& error);
+
+// Whether filter is a valid MQTT topic filter: '+' and '#' fill a whole
+// level, and '#' only as the last one
+bool isValidTopicFilter(std::string_view filter);
+
+// Topic filters compiled into a trie of topic levels. Matching walks one
+// level at a time, following the exact child and the '+' child and
+// collecting '#' rules on the way, so its cost depends on the topic's depth
+// rather than on the number of rules. Topics are matched as string_views,
+// e.g. straight out of a receive buffer, without copying.
+class TopicTrie {
+public:
+    TopicTrie() = default;
+    explicit TopicTrie(const std::vector<TopicRule>& rules);
+    
+    // Children are keyed by views into levels_, which a copy would not update
+    TopicTrie(TopicTrie&&) = default;
+    TopicTrie& operator=(TopicTrie&&) = default;
+    TopicTrie(const TopicTrie&) = delete;
+    TopicTrie& operator=(const TopicTrie&) = delete;
+    
+    bool empty() const { return nodes_.empty(); }
+    
+    // Call visit(ruleIndex) for every rule whose filter matches topic. As
+    // the spec requires, wildcards at the first level do not match topics
+    // starting with '$'.
+    template <typename Visit>
+    void forEachMatch(std::string_view topic, Visit&& visit) const {
+        if (!nodes_.empty()) {
+            matchFrom(0, topic, false, !topic.empty() && topic[0] == '$', visit);
+        }
+    }
+
+private:
+    struct Node {
+        std::unordered_map<std::string_view, uint32_t> children;
+        uint32_t plusChild = 0;               // 0: none (the root is never a child)
+        std::vector<uint32_t> rules;          // Filters ending at this level
+        std::vector<uint32_t> multiRules;     // Filters ending in '#' below this level
+    };
+    
+    uint32_t addChild(uint32_t parent, std::string_view level);
+    
+    template <typename Visit>
+    void matchFrom(uint32_t index, std::string_view rest, bool atEnd, bool noWildcards, Visit& visit) const {
+        const Node& node = nodes_[index];
+        
+        // "a/#" matches "a" itself as well as everything below it
+        if (!noWildcards) {
+            for (uint32_t rule : node.multiRules) {
+                visit(rule);
+            }
+        }
+        if (atEnd) {
+            for (uint32_t rule : node.rules) {
+                visit(rule);
+            }
+            return;
+        }
+        
+        size_t slash = rest.find('/');
+        std::string_view level = rest.substr(0, slash);
+        bool last = slash == std::string_view::npos;
+        std::string_view next = last ? std::string_view() : rest.substr(slash + 1);
+        
+        auto child = node.children.find(level);
+        if (child != node.children.end()) {
+            matchFrom(child->second, next, last, false, visit);
+        }
+        if (node.plusChild != 0 && !noWildcards) {
+            matchFrom(node.plusChild, next, last, false, visit);
+        }
+    }
+    
+    std::vector<Node> nodes_;
+    std::deque<std::string> levels_;   // Stable storage for the child keys
+};
+
+} // namespace throttlebox
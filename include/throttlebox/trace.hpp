@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <cstdint>
+#include <cstdio>
+
+namespace throttlebox {
+
+// One client-to-broker read as seen by the rate limiter
+struct TraceEvent {
+    uint64_t timestampNs = 0;   // steady_clock, see TraceHeader for wall time mapping
+    std::string ip;
+    std::string clientId;
+    uint8_t packetType = 0;     // MQTT control packet type
+    uint32_t size = 0;          // Packet size in bytes
+};
+
+// File header: when capture started on both clocks
+struct TraceHeader {
+    uint32_t version = 0;
+    uint64_t steadyStartNs = 0;
+    uint64_t wallStartNs = 0;
+};
+
+// Appends events to a binary trace file. Thread-safe; writes are buffered
+// and flushed in 64 KiB chunks and on destruction.
+//
+// Format (little-endian): "TBTRACE\0", u32 version, u32 reserved,
+// u64 steady start, u64 wall start, then per event u64 timestamp,
+// u32 size, u8 packet type, u8 ip length, u16 client id length, ip bytes,
+// client id bytes.
+class TraceWriter {
+public:
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kHeaderBytes = 32;
+
+    explicit TraceWriter(const std::string& path);
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool isOpen() const { return file_ != nullptr; }
+
+    void record(uint64_t timestampNs, const std::string& ip, const std::string& clientId,
+                uint8_t packetType, uint32_t size);
+
+    void flush();
+
+    uint64_t eventsWritten() const { return events_; }
+
+private:
+    void flushLocked();
+
+    std::mutex mutex_;
+    std::FILE* file_ = nullptr;
+    std::string buffer_;
+    uint64_t events_ = 0;
+};
+
+// Streams events back out of a trace file
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path);
+    ~TraceReader();
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    // False if the file is missing or not a trace
+    bool isOpen() const { return file_ != nullptr; }
+
+    const TraceHeader& header() const { return header_; }
+
+    // Next event; false at end of file or on a truncated record
+    bool next(TraceEvent& event);
+
+private:
+    std::FILE* file_ = nullptr;
+    TraceHeader header_;
+};
+
+} // namespace throttlebox
@@ -0,0 +1,34 @@
+#include "throttlebox/clock.hpp"
+#include <time.h>
+
+namespace throttlebox {
+
+Clock::time_point CoarseClock::now() const {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return time_point(std::chrono::duration_cast<time_point::duration>(
+        std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+}
+
+std::shared_ptr<Clock> makeClock(ClockSource source) {
+    switch (source) {
+        case ClockSource::Coarse:
+            return std::make_shared<CoarseClock>();
+        case ClockSource::Monotonic:
+            break;
+    }
+    return std::make_shared<MonotonicClock>();
+}
+
+bool parseClockSource(const std::string& text, ClockSource& source) {
+    if (text == "monotonic") {
+        source = ClockSource::Monotonic;
+    } else if (text == "coarse") {
+        source = ClockSource::Coarse;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+} // namespace throttlebox
@@ -1,7 +1,10 @@
 #include "throttlebox/config.hpp"
+#include "throttlebox/mqtt_framer.hpp"
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <arpa/inet.h>
 
 // We'll use a simple JSON parser for now - in a real implementation, 
 // you'd want to use yaml-cpp or nlohmann::json
@@ -9,6 +12,36 @@
 
 namespace throttlebox {
 
+namespace {
+
+const char* const kPacketBudgetSuffixes[] = {"_rate", "_burst", "_weight"};
+
+// "<class>_rate", "<class>_burst" and "<class>_weight", e.g. "ping_rate"
+bool applyPacketBudgetKey(const std::string& key, const std::string& value, RateLimitPolicy& policy) {
+    for (size_t i = 0; i < kPacketClasses; i++) {
+        std::string name = packetClassName(static_cast<PacketClass>(i));
+        if (key.compare(0, name.size(), name) != 0) {
+            continue;
+        }
+        
+        std::string suffix = key.substr(name.size());
+        PacketBudget& budget = policy.packetBudgets[i];
+        if (suffix == "_rate") {
+            budget.maxPerSec = std::stod(value);
+        } else if (suffix == "_burst") {
+            budget.burstSize = std::stoi(value);
+        } else if (suffix == "_weight") {
+            budget.weight = std::stod(value);
+        } else {
+            return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
 bool Config::loadFromFile(const std::string& path) {
     lastError_.clear();
     valid_ = false;
@@ -74,12 +107,108 @@ bool Config::loadFromYaml(const std::string& path) {
             proxySettings_.brokerHost = value;
         } else if (key == "broker_port") {
             proxySettings_.brokerPort = std::stoi(value);
+        } else if (key == "clock_source") {
+            if (!parseClockSource(value, proxySettings_.clockSource)) {
+                lastError_ = "Unknown clock_source: " + value;
+                return false;
+            }
+        } else if (key == "receive_maximum") {
+            proxySettings_.receiveMaximum = std::stoi(value);
+        } else if (key == "max_packet_size") {
+            proxySettings_.maxPacketSize = std::stoul(value);
+        } else if (key == "topic_alias_maximum") {
+            proxySettings_.topicAliasMaximum = std::stoi(value);
+        } else if (key == "max_connections") {
+            connectionSettings_.maxConnections = std::stoul(value);
+        } else if (key == "max_connections_per_ip") {
+            connectionSettings_.maxConnectionsPerIp = std::stoul(value);
+        } else if (key == "cidr_connection_limits") {
+            // May be repeated; each line adds to the limits
+            if (!parseCidrLimits(value, connectionSettings_.cidrLimits, lastError_)) {
+                return false;
+            }
+        } else if (key == "ip_connect_rate") {
+            connectionSettings_.ipConnectRate = std::stod(value);
+        } else if (key == "ip_connect_burst") {
+            connectionSettings_.ipConnectBurst = std::stoi(value);
+        } else if (key == "client_connect_rate") {
+            connectionSettings_.clientConnectRate = std::stod(value);
+        } else if (key == "client_connect_burst") {
+            connectionSettings_.clientConnectBurst = std::stoi(value);
+        } else if (key == "connect_timeout_ms") {
+            connectionSettings_.connectTimeoutMs = std::stoi(value);
+        } else if (key == "half_open_timeout_ms") {
+            connectionSettings_.halfOpenTimeoutMs = std::stoi(value);
         } else if (key == "max_messages_per_sec") {
             globalPolicy_.maxMessagesPerSec = std::stod(value);
         } else if (key == "burst_size") {
             globalPolicy_.burstSize = std::stoi(value);
         } else if (key == "block_duration_sec") {
             globalPolicy_.blockDurationSec = std::stoi(value);
+        } else if (key == "max_bytes_per_sec") {
+            globalPolicy_.maxBytesPerSec = std::stod(value);
+        } else if (key == "byte_burst") {
+            globalPolicy_.byteBurst = std::stod(value);
+        } else if (key == "mode") {
+            if (!parseLimitMode(value, globalPolicy_.mode)) {
+                lastError_ = "Unknown mode: " + value;
+                return false;
+            }
+        } else if (key == "shape_queue_bytes") {
+            globalPolicy_.shapeQueueBytes = std::stoul(value);
+        } else if (key == "reject_action") {
+            if (!parseRejectAction(value, globalPolicy_.rejectAction)) {
+                lastError_ = "Unknown reject_action: " + value;
+                return false;
+            }
+        } else if (key == "identity_key") {
+            if (!parseIdentityKey(value, identityKey_)) {
+                lastError_ = "Unknown identity_key: " + value;
+                return false;
+            }
+        } else if (key == "topic_rules") {
+            // May be repeated; each line adds to the rules
+            if (!parseTopicRules(value, topicRules_, lastError_)) {
+                return false;
+            }
+        } else if (key == "metrics_port") {
+            metricsSettings_.httpPort = std::stoi(value);
+        } else if (key == "statsd_host") {
+            metricsSettings_.statsd.host = value;
+            metricsSettings_.statsdEnabled = !value.empty();
+        } else if (key == "statsd_port") {
+            metricsSettings_.statsd.port = std::stoi(value);
+        } else if (key == "statsd_flush_interval_ms") {
+            metricsSettings_.statsd.flushIntervalMs = std::stoi(value);
+        } else if (key == "statsd_flavor") {
+            metricsSettings_.statsd.dogstatsd = (value == "dogstatsd");
+        } else if (key == "statsd_prefix") {
+            metricsSettings_.statsd.prefix = value;
+        } else if (key == "statsd_tags") {
+            metricsSettings_.statsd.tags = value;
+        } else if (key == "statsd_max_datagram_bytes") {
+            metricsSettings_.statsd.maxDatagramBytes = std::stoul(value);
+        } else if (key == "flight_recorder_events") {
+            diagnosticsSettings_.flightRecorderEvents = std::stoul(value);
+        } else if (key == "flight_recorder_path") {
+            diagnosticsSettings_.flightRecorderPath = value;
+        } else if (key == "trace_capture_path") {
+            diagnosticsSettings_.traceCapturePath = value;
+        } else if (key == "log_level") {
+            if (!AsyncLogger::parseLevel(value, loggingSettings_.level)) {
+                lastError_ = "Unknown log_level: " + value;
+                return false;
+            }
+        } else if (key == "log_format") {
+            loggingSettings_.format = (value == "json") ? LogFormat::Json : LogFormat::Text;
+        } else if (key == "log_output") {
+            loggingSettings_.output = value;
+        } else if (key == "log_queue_size") {
+            loggingSettings_.queueSize = std::stoul(value);
+        } else if (key == "log_sample_interval_ms") {
+            loggingSettings_.sampleIntervalMs = std::stoi(value);
+        } else {
+            applyPacketBudgetKey(key, value, globalPolicy_);
         }
     }
     
@@ -133,6 +262,50 @@ bool Config::loadFromJson(const std::string& path) {
     value = findValue("broker_port");
     if (!value.empty()) proxySettings_.brokerPort = std::stoi(value);
     
+    value = findValue("clock_source");
+    if (!value.empty() && !parseClockSource(value, proxySettings_.clockSource)) {
+        lastError_ = "Unknown clock_source: " + value;
+        return false;
+    }
+    
+    value = findValue("receive_maximum");
+    if (!value.empty()) proxySettings_.receiveMaximum = std::stoi(value);
+    
+    value = findValue("max_packet_size");
+    if (!value.empty()) proxySettings_.maxPacketSize = std::stoul(value);
+    
+    value = findValue("topic_alias_maximum");
+    if (!value.empty()) proxySettings_.topicAliasMaximum = std::stoi(value);
+    
+    value = findValue("max_connections");
+    if (!value.empty()) connectionSettings_.maxConnections = std::stoul(value);
+    
+    value = findValue("max_connections_per_ip");
+    if (!value.empty()) connectionSettings_.maxConnectionsPerIp = std::stoul(value);
+    
+    value = findValue("cidr_connection_limits");
+    if (!value.empty() && !parseCidrLimits(value, connectionSettings_.cidrLimits, lastError_)) {
+        return false;
+    }
+    
+    value = findValue("ip_connect_rate");
+    if (!value.empty()) connectionSettings_.ipConnectRate = std::stod(value);
+    
+    value = findValue("ip_connect_burst");
+    if (!value.empty()) connectionSettings_.ipConnectBurst = std::stoi(value);
+    
+    value = findValue("client_connect_rate");
+    if (!value.empty()) connectionSettings_.clientConnectRate = std::stod(value);
+    
+    value = findValue("client_connect_burst");
+    if (!value.empty()) connectionSettings_.clientConnectBurst = std::stoi(value);
+    
+    value = findValue("connect_timeout_ms");
+    if (!value.empty()) connectionSettings_.connectTimeoutMs = std::stoi(value);
+    
+    value = findValue("half_open_timeout_ms");
+    if (!value.empty()) connectionSettings_.halfOpenTimeoutMs = std::stoi(value);
+    
     value = findValue("max_messages_per_sec");
     if (!value.empty()) globalPolicy_.maxMessagesPerSec = std::stod(value);
     
@@ -142,6 +315,100 @@ bool Config::loadFromJson(const std::string& path) {
     value = findValue("block_duration_sec");
     if (!value.empty()) globalPolicy_.blockDurationSec = std::stoi(value);
     
+    value = findValue("max_bytes_per_sec");
+    if (!value.empty()) globalPolicy_.maxBytesPerSec = std::stod(value);
+    
+    value = findValue("byte_burst");
+    if (!value.empty()) globalPolicy_.byteBurst = std::stod(value);
+    
+    value = findValue("mode");
+    if (!value.empty() && !parseLimitMode(value, globalPolicy_.mode)) {
+        lastError_ = "Unknown mode: " + value;
+        return false;
+    }
+    
+    value = findValue("shape_queue_bytes");
+    if (!value.empty()) globalPolicy_.shapeQueueBytes = std::stoul(value);
+    
+    value = findValue("reject_action");
+    if (!value.empty() && !parseRejectAction(value, globalPolicy_.rejectAction)) {
+        lastError_ = "Unknown reject_action: " + value;
+        return false;
+    }
+    
+    value = findValue("identity_key");
+    if (!value.empty() && !parseIdentityKey(value, identityKey_)) {
+        lastError_ = "Unknown identity_key: " + value;
+        return false;
+    }
+    
+    value = findValue("topic_rules");
+    if (!value.empty() && !parseTopicRules(value, topicRules_, lastError_)) {
+        return false;
+    }
+    
+    for (size_t i = 0; i < kPacketClasses; i++) {
+        for (const char* suffix : kPacketBudgetSuffixes) {
+            std::string key = std::string(packetClassName(static_cast<PacketClass>(i))) + suffix;
+            value = findValue(key);
+            if (!value.empty()) applyPacketBudgetKey(key, value, globalPolicy_);
+        }
+    }
+    
+    value = findValue("metrics_port");
+    if (!value.empty()) metricsSettings_.httpPort = std::stoi(value);
+    
+    value = findValue("statsd_host");
+    if (!value.empty()) {
+        metricsSettings_.statsd.host = value;
+        metricsSettings_.statsdEnabled = true;
+    }
+    
+    value = findValue("statsd_port");
+    if (!value.empty()) metricsSettings_.statsd.port = std::stoi(value);
+    
+    value = findValue("statsd_flush_interval_ms");
+    if (!value.empty()) metricsSettings_.statsd.flushIntervalMs = std::stoi(value);
+    
+    value = findValue("statsd_flavor");
+    if (!value.empty()) metricsSettings_.statsd.dogstatsd = (value == "dogstatsd");
+    
+    value = findValue("statsd_prefix");
+    if (!value.empty()) metricsSettings_.statsd.prefix = value;
+    
+    value = findValue("statsd_tags");
+    if (!value.empty()) metricsSettings_.statsd.tags = value;
+    
+    value = findValue("statsd_max_datagram_bytes");
+    if (!value.empty()) metricsSettings_.statsd.maxDatagramBytes = std::stoul(value);
+    
+    value = findValue("flight_recorder_events");
+    if (!value.empty()) diagnosticsSettings_.flightRecorderEvents = std::stoul(value);
+    
+    value = findValue("flight_recorder_path");
+    if (!value.empty()) diagnosticsSettings_.flightRecorderPath = value;
+    
+    value = findValue("trace_capture_path");
+    if (!value.empty()) diagnosticsSettings_.traceCapturePath = value;
+    
+    value = findValue("log_level");
+    if (!value.empty() && !AsyncLogger::parseLevel(value, loggingSettings_.level)) {
+        lastError_ = "Unknown log_level: " + value;
+        return false;
+    }
+    
+    value = findValue("log_format");
+    if (!value.empty()) loggingSettings_.format = (value == "json") ? LogFormat::Json : LogFormat::Text;
+    
+    value = findValue("log_output");
+    if (!value.empty()) loggingSettings_.output = value;
+    
+    value = findValue("log_queue_size");
+    if (!value.empty()) loggingSettings_.queueSize = std::stoul(value);
+    
+    value = findValue("log_sample_interval_ms");
+    if (!value.empty()) loggingSettings_.sampleIntervalMs = std::stoi(value);
+    
     return true;
 }
 
@@ -161,6 +428,39 @@ bool Config::validateConfig() {
         return false;
     }
     
+    if (globalPolicy_.maxBytesPerSec < 0 || globalPolicy_.byteBurst < 0) {
+        lastError_ = "max_bytes_per_sec and byte_burst cannot be negative";
+        return false;
+    }
+    
+    for (size_t i = 0; i < kPacketClasses; i++) {
+        const PacketBudget& budget = globalPolicy_.packetBudgets[i];
+        std::string name = packetClassName(static_cast<PacketClass>(i));
+        
+        if (budget.weight <= 0) {
+            lastError_ = name + "_weight must be positive";
+            return false;
+        }
+        
+        if (budget.maxPerSec < 0 || budget.burstSize < 0) {
+            lastError_ = name + "_rate and " + name + "_burst cannot be negative";
+            return false;
+        }
+        
+        // A packet costing more than its bucket holds could never pass
+        double capacity = budget.maxPerSec <= 0 ? globalPolicy_.burstSize
+                        : budget.burstSize > 0 ? budget.burstSize : std::ceil(budget.maxPerSec);
+        if (budget.weight > capacity) {
+            lastError_ = name + "_weight exceeds the capacity of its bucket";
+            return false;
+        }
+    }
+    
+    if (globalPolicy_.shapeQueueBytes == 0) {
+        lastError_ = "shape_queue_bytes must be positive";
+        return false;
+    }
+    
     if (proxySettings_.listenPort <= 0 || proxySettings_.listenPort > 65535) {
         lastError_ = "listen_port must be between 1 and 65535";
         return false;
@@ -171,6 +471,75 @@ bool Config::validateConfig() {
         return false;
     }
     
+    if (proxySettings_.receiveMaximum < 0 || proxySettings_.receiveMaximum > 65535) {
+        lastError_ = "receive_maximum must be between 0 and 65535";
+        return false;
+    }
+    
+    if (proxySettings_.topicAliasMaximum < 0 || proxySettings_.topicAliasMaximum > 65535) {
+        lastError_ = "topic_alias_maximum must be between 0 and 65535";
+        return false;
+    }
+    
+    // Room for a CONNECT with a short client ID, and within MQTT's own limit
+    if (proxySettings_.maxPacketSize != 0 &&
+        (proxySettings_.maxPacketSize < 64 || proxySettings_.maxPacketSize > MqttFramer::kMaxRemainingLength + 5)) {
+        lastError_ = "max_packet_size must be 0 or between 64 and 268435460";
+        return false;
+    }
+    
+    if (connectionSettings_.ipConnectRate < 0 || connectionSettings_.ipConnectBurst < 0 ||
+        connectionSettings_.clientConnectRate < 0 || connectionSettings_.clientConnectBurst < 0) {
+        lastError_ = "connect rates and bursts cannot be negative";
+        return false;
+    }
+    
+    // The half-open time includes the CONNECT's arrival
+    if (connectionSettings_.connectTimeoutMs <= 0 ||
+        connectionSettings_.halfOpenTimeoutMs < connectionSettings_.connectTimeoutMs) {
+        lastError_ = "connect_timeout_ms must be positive and at most half_open_timeout_ms";
+        return false;
+    }
+    
+    if (metricsSettings_.httpPort <= 0 || metricsSettings_.httpPort > 65535) {
+        lastError_ = "metrics_port must be between 1 and 65535";
+        return false;
+    }
+    
+    if (metricsSettings_.statsdEnabled) {
+        // The exporter sends to an address, not a name it would resolve
+        struct in_addr statsdAddress;
+        if (inet_pton(AF_INET, metricsSettings_.statsd.host.c_str(), &statsdAddress) != 1) {
+            lastError_ = "statsd_host must be an IPv4 address: " + metricsSettings_.statsd.host;
+            return false;
+        }
+        
+        if (metricsSettings_.statsd.port <= 0 || metricsSettings_.statsd.port > 65535) {
+            lastError_ = "statsd_port must be between 1 and 65535";
+            return false;
+        }
+        
+        if (metricsSettings_.statsd.flushIntervalMs <= 0) {
+            lastError_ = "statsd_flush_interval_ms must be positive";
+            return false;
+        }
+        
+        if (metricsSettings_.statsd.maxDatagramBytes < 64) {
+            lastError_ = "statsd_max_datagram_bytes must be at least 64";
+            return false;
+        }
+    }
+    
+    if (loggingSettings_.queueSize == 0) {
+        lastError_ = "log_queue_size must be positive";
+        return false;
+    }
+    
+    if (loggingSettings_.sampleIntervalMs < 0) {
+        lastError_ = "log_sample_interval_ms cannot be negative";
+        return false;
+    }
+    
     if (proxySettings_.brokerHost.empty()) {
         lastError_ = "broker_host cannot be empty";
         return false;
@@ -0,0 +1,137 @@
+#include "throttlebox/connection_limiter.hpp"
+#include <arpa/inet.h>
+#include <sstream>
+
+namespace throttlebox {
+
+bool parseCidrLimits(const std::string& text, std::vector<CidrLimit>& limits, std::string& error) {
+    std::stringstream entries(text);
+    std::string entry;
+    
+    while (std::getline(entries, entry, ';')) {
+        std::stringstream fields(entry);
+        std::string block, max, extra;
+        if (!(fields >> block)) {
+            continue;   // Empty entry, e.g. a trailing ';'
+        }
+        
+        if (!(fields >> max) || (fields >> extra)) {
+            error = "CIDR limit needs a block and a connection count: " + entry;
+            return false;
+        }
+        
+        CidrLimit limit;
+        size_t slash = block.find('/');
+        struct in_addr address;
+        if (slash == std::string::npos || inet_pton(AF_INET, block.substr(0, slash).c_str(), &address) != 1) {
+            error = "Invalid CIDR block: " + block;
+            return false;
+        }
+        try {
+            size_t used = 0;
+            limit.prefixLength = std::stoi(block.substr(slash + 1), &used);
+            if (used != block.size() - slash - 1) {
+                throw std::invalid_argument(block);
+            }
+            long long count = std::stoll(max, &used);
+            if (used != max.size() || count <= 0) {
+                throw std::invalid_argument(max);
+            }
+            limit.maxConnections = static_cast<size_t>(count);
+        } catch (const std::exception&) {
+            error = "Invalid CIDR limit: " + entry;
+            return false;
+        }
+        if (limit.prefixLength < 0 || limit.prefixLength > 32) {
+            error = "Invalid CIDR prefix length: " + block;
+            return false;
+        }
+        
+        // Bits past the prefix are ignored, as in routing tables
+        limit.network = ntohl(address.s_addr) & limit.mask();
+        for (const CidrLimit& other : limits) {
+            if (other.network == limit.network && other.prefixLength == limit.prefixLength) {
+                error = "Duplicate CIDR limit: " + block;
+                return false;
+            }
+        }
+        limits.push_back(limit);
+    }
+    return true;
+}
+
+ConnectionLimiter::ConnectionLimiter(size_t maxConnections, size_t maxPerIp,
+                                     const std::vector<CidrLimit>& cidrLimits)
+    : maxConnections_(maxConnections), maxPerIp_(maxPerIp), cidrLimits_(cidrLimits),
+      perBlock_(cidrLimits.size(), 0) {
+    for (size_t index = 0; index < cidrLimits_.size(); index++) {
+        const CidrLimit& limit = cidrLimits_[index];
+        PrefixTable* table = nullptr;
+        for (PrefixTable& existing : prefixTables_) {
+            if (existing.mask == limit.mask()) {
+                table = &existing;
+            }
+        }
+        if (!table) {
+            prefixTables_.push_back(PrefixTable{limit.mask(), {}});
+            table = &prefixTables_.back();
+        }
+        table->blocks[limit.network] = index;
+    }
+}
+
+ConnectionLimiter::Admission ConnectionLimiter::admit(uint32_t address) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    if (maxConnections_ > 0 && connections_ >= maxConnections_) {
+        return Admission::Global;
+    }
+    if (maxPerIp_ > 0) {
+        auto it = perIp_.find(address);
+        if (it != perIp_.end() && it->second >= maxPerIp_) {
+            return Admission::Ip;
+        }
+    }
+    bool blockFull = false;
+    forEachBlock(address, [&](size_t index) {
+        blockFull = blockFull || perBlock_[index] >= cidrLimits_[index].maxConnections;
+    });
+    if (blockFull) {
+        return Admission::Cidr;
+    }
+    
+    // Nothing is counted until every cap has passed
+    connections_++;
+    if (maxPerIp_ > 0) {
+        perIp_[address]++;
+    }
+    forEachBlock(address, [&](size_t index) { perBlock_[index]++; });
+    return Admission::Admitted;
+}
+
+void ConnectionLimiter::release(uint32_t address) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    connections_--;
+    if (maxPerIp_ > 0) {
+        // Erased at zero so the table only holds addresses with open connections
+        auto it = perIp_.find(address);
+        if (it != perIp_.end() && --it->second == 0) {
+            perIp_.erase(it);
+        }
+    }
+    forEachBlock(address, [&](size_t index) { perBlock_[index]--; });
+}
+
+size_t ConnectionLimiter::connections() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connections_;
+}
+
+size_t ConnectionLimiter::connectionsFrom(uint32_t address) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = perIp_.find(address);
+    return it != perIp_.end() ? it->second : 0;
+}
+
+} // namespace throttlebox
@@ -0,0 +1,107 @@
+#include "throttlebox/connection_watch.hpp"
+
+namespace throttlebox {
+
+ConnectionWatch::ConnectionWatch(TimerWheel& wheel, std::shared_ptr<Clock> clock, Expire onExpire)
+    : wheel_(wheel), clock_(std::move(clock)), onExpire_(std::move(onExpire)) {
+    recordActivity(clock_->now());
+}
+
+void ConnectionWatch::arm(const char* kind, time_point deadline, std::chrono::nanoseconds idleLimit) {
+    TimerWheel::TimerId previous;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || expired_) {
+            return;
+        }
+        previous = timer_;
+        generation_++;
+        kind_ = kind;
+        idleLimit_ = idleLimit;
+        timer_ = kind ? schedule(generation_, deadline) : 0;
+    }
+    
+    // Outside the lock: cancel() waits for a callback in flight, and the
+    // callback takes the lock
+    if (previous != 0) {
+        wheel_.cancel(previous);
+    }
+}
+
+bool ConnectionWatch::expire() {
+    TimerWheel::TimerId pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || expired_ || !kind_) {
+            return false;
+        }
+        pending = timer_;
+        generation_++;
+        timer_ = 0;
+        expireLocked();
+    }
+    if (pending != 0) {
+        wheel_.cancel(pending);
+    }
+    return true;
+}
+
+const char* ConnectionWatch::close() {
+    TimerWheel::TimerId pending;
+    const char* expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        pending = timer_;
+        timer_ = 0;
+        expired = expired_;
+    }
+    
+    // cancel() waits out a callback in flight, so none acts on the socket
+    // once the caller has closed it and its descriptor is reused
+    if (pending != 0) {
+        wheel_.cancel(pending);
+    }
+    return expired;
+}
+
+const char* ConnectionWatch::armed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ || expired_ ? nullptr : kind_;
+}
+
+const char* ConnectionWatch::expired() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return expired_;
+}
+
+TimerWheel::TimerId ConnectionWatch::schedule(uint64_t generation, time_point deadline) {
+    std::shared_ptr<ConnectionWatch> self = shared_from_this();
+    return wheel_.schedule(deadline, [self, generation]() { self->fire(generation); });
+}
+
+void ConnectionWatch::fire(uint64_t generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_ || generation_ != generation) {
+        return; // Re-armed or closed since this timer was scheduled
+    }
+    
+    // An idle deadline moves to the client's last read if it has read since
+    if (idleLimit_.count() > 0) {
+        time_point deadline = lastActivity() + idleLimit_;
+        if (deadline > clock_->now()) {
+            timer_ = schedule(generation, deadline);
+            return;
+        }
+    }
+    
+    timer_ = 0;
+    expireLocked();
+}
+
+void ConnectionWatch::expireLocked() {
+    expired_ = kind_;
+    onExpire_(kind_);
+}
+
+} // namespace throttlebox
@@ -0,0 +1,217 @@
+#include "throttlebox/flight_recorder.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+namespace throttlebox {
+
+namespace {
+
+std::atomic<uint64_t> nextRecorderId{1};
+
+size_t roundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+// Dumps are little-endian regardless of host byte order
+void put32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+void put64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+uint32_t get32(const unsigned char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= static_cast<uint32_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t get64(const unsigned char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+const char kDumpMagic[8] = {'T', 'B', 'F', 'L', 'I', 'G', 'H', 'T'};
+
+} // namespace
+
+FlightRecorder::ThreadRing::~ThreadRing() {
+    if (ring) {
+        ring->inUse.store(false, std::memory_order_release);
+    }
+}
+
+FlightRecorder::FlightRecorder(size_t eventsPerThread)
+    : id_(nextRecorderId.fetch_add(1)),
+      mask_(roundUpToPowerOfTwo(std::max<size_t>(eventsPerThread, 2)) - 1) {
+}
+
+uint64_t FlightRecorder::nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+FlightRecorder::Ring& FlightRecorder::ringForThisThread() {
+    thread_local ThreadRing threadRing;
+
+    if (threadRing.ownerId == id_) {
+        return *threadRing.ring;
+    }
+
+    // First event from this thread, or the thread switched recorders:
+    // hand back the old ring and adopt an idle one (or a new one)
+    if (threadRing.ring) {
+        threadRing.ring->inUse.store(false, std::memory_order_release);
+        threadRing.ring.reset();
+    }
+
+    std::lock_guard<std::mutex> lock(ringsMutex_);
+    for (const auto& ring : rings_) {
+        bool idle = false;
+        if (ring->inUse.compare_exchange_strong(idle, true, std::memory_order_acquire)) {
+            threadRing.ring = ring;
+            break;
+        }
+    }
+    if (!threadRing.ring) {
+        rings_.push_back(std::make_shared<Ring>(mask_ + 1));
+        threadRing.ring = rings_.back();
+    }
+    threadRing.ownerId = id_;
+    return *threadRing.ring;
+}
+
+void FlightRecorder::record(const FlightEvent& event) {
+    Ring& ring = ringForThisThread();
+
+    // Single writer per ring: a per-slot sequence lets readers detect
+    // a slot that was overwritten while they copied it
+    uint64_t position = ring.head.load(std::memory_order_relaxed);
+    Slot& slot = ring.slots[position & mask_];
+    slot.sequence.store(kWriting, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.event = event;
+    slot.sequence.store(position + 1, std::memory_order_release);
+    ring.head.store(position + 1, std::memory_order_release);
+}
+
+std::string FlightRecorder::dump() const {
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        std::lock_guard<std::mutex> lock(ringsMutex_);
+        rings = rings_;
+    }
+
+    std::vector<FlightEvent> events;
+    for (const auto& ring : rings) {
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head > ring->slots.size() ? head - ring->slots.size() : 0;
+
+        for (uint64_t position = first; position < head; position++) {
+            const Slot& slot = ring->slots[position & mask_];
+            uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            if (before != position + 1) {
+                continue; // Already overwritten by a newer event
+            }
+            FlightEvent event = slot.event;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) != before) {
+                continue; // Torn copy
+            }
+            events.push_back(event);
+        }
+    }
+
+    std::stable_sort(events.begin(), events.end(), [](const FlightEvent& a, const FlightEvent& b) {
+        return a.timestampNs < b.timestampNs;
+    });
+
+    std::string out;
+    out.reserve(kHeaderBytes + events.size() * kEventBytes);
+    out.append(kDumpMagic, sizeof(kDumpMagic));
+    put32(out, kDumpVersion);
+    put32(out, static_cast<uint32_t>(events.size()));
+    put64(out, nowNs());
+    put64(out, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count());
+
+    for (const auto& event : events) {
+        put64(out, event.timestampNs);
+        put32(out, event.clientHandle);
+        put32(out, event.ipv4);
+        uint32_t tokenBits;
+        std::memcpy(&tokenBits, &event.tokensLeft, sizeof(tokenBits));
+        put32(out, tokenBits);
+        out += static_cast<char>(event.packetType);
+        out += static_cast<char>(event.decision);
+        out += static_cast<char>(event.policyLevel);
+        out += static_cast<char>(event.flags);
+    }
+
+    return out;
+}
+
+bool FlightRecorder::dumpToFile(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::string data = dump();
+    file.write(data.data(), data.size());
+    return static_cast<bool>(file);
+}
+
+bool FlightRecorder::parseDump(const std::string& data, DumpHeader& header, std::vector<FlightEvent>& events) {
+    if (data.size() < kHeaderBytes || std::memcmp(data.data(), kDumpMagic, sizeof(kDumpMagic)) != 0) {
+        return false;
+    }
+
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data.data());
+    header.version = get32(in + 8);
+    header.eventCount = get32(in + 12);
+    header.steadyNowNs = get64(in + 16);
+    header.wallNowNs = get64(in + 24);
+
+    if (header.version != kDumpVersion ||
+        data.size() != kHeaderBytes + static_cast<size_t>(header.eventCount) * kEventBytes) {
+        return false;
+    }
+
+    events.clear();
+    events.reserve(header.eventCount);
+    in += kHeaderBytes;
+    for (uint32_t i = 0; i < header.eventCount; i++, in += kEventBytes) {
+        FlightEvent event;
+        event.timestampNs = get64(in);
+        event.clientHandle = get32(in + 8);
+        event.ipv4 = get32(in + 12);
+        uint32_t tokenBits = get32(in + 16);
+        std::memcpy(&event.tokensLeft, &tokenBits, sizeof(tokenBits));
+        event.packetType = in[20];
+        event.decision = in[21];
+        event.policyLevel = in[22];
+        event.flags = in[23];
+        events.push_back(event);
+    }
+
+    return true;
+}
+
+} // namespace throttlebox
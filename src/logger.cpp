@@ -0,0 +1,336 @@
+#include "throttlebox/logger.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+namespace throttlebox {
+
+namespace {
+
+size_t roundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+const char* levelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "debug";
+        case LogLevel::Info: return "info";
+        case LogLevel::Warn: return "warn";
+        case LogLevel::Error: return "error";
+    }
+    return "info";
+}
+
+void appendNumber(std::string& out, const LogField::Type type, int64_t i, uint64_t u, double d) {
+    char buffer[32];
+    char* end;
+    switch (type) {
+        case LogField::Type::Int:
+            end = std::to_chars(buffer, buffer + sizeof(buffer), i).ptr;
+            break;
+        case LogField::Type::Uint:
+            end = std::to_chars(buffer, buffer + sizeof(buffer), u).ptr;
+            break;
+        default:
+            end = std::to_chars(buffer, buffer + sizeof(buffer), d).ptr;
+            break;
+    }
+    out.append(buffer, end - buffer);
+}
+
+// Quote only when needed so common values stay greppable
+void appendTextValue(std::string& out, std::string_view value) {
+    bool quote = value.empty() ||
+                 value.find_first_of(" \"=\\\n\t") != std::string_view::npos;
+    if (!quote) {
+        out.append(value.data(), value.size());
+        return;
+    }
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += '?';
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void appendJsonString(std::string& out, std::string_view value) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (char c : value) {
+        unsigned char byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (byte < 0x20) {
+            out += "\\u00";
+            out += hex[byte >> 4];
+            out += hex[byte & 0x0F];
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void appendTimestamp(std::string& out, uint64_t timestampNs) {
+    time_t seconds = static_cast<time_t>(timestampNs / 1000000000);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+
+    char buffer[40];
+    size_t len = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+    len += snprintf(buffer + len, sizeof(buffer) - len, ".%03uZ",
+                    static_cast<unsigned>((timestampNs / 1000000) % 1000));
+    out.append(buffer, len);
+}
+
+} // namespace
+
+AsyncLogger::AsyncLogger(const LoggingSettings& settings)
+    : settings_(settings),
+      mask_(roundUpToPowerOfTwo(std::max<size_t>(settings.queueSize, 2)) - 1),
+      cells_(new Cell[mask_ + 1]) {
+    for (size_t i = 0; i <= mask_; i++) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    if (settings_.output == "stderr") {
+        out_ = stderr;
+    } else if (settings_.output.empty() || settings_.output == "stdout") {
+        out_ = stdout;
+    } else {
+        out_ = std::fopen(settings_.output.c_str(), "a");
+        ownsOutput_ = out_ != nullptr;
+        if (!out_) {
+            out_ = stderr;
+            std::fprintf(stderr, "Cannot open log file %s, logging to stderr\n", settings_.output.c_str());
+        }
+    }
+
+    line_.reserve(512);
+    writerThread_ = std::thread(&AsyncLogger::writerLoop, this);
+}
+
+AsyncLogger::~AsyncLogger() {
+    running_ = false;
+    if (writerThread_.joinable()) {
+        writerThread_.join();
+    }
+
+    if (ownsOutput_) {
+        std::fclose(out_);
+    } else {
+        std::fflush(out_);
+    }
+}
+
+uint64_t AsyncLogger::nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool AsyncLogger::parseLevel(const std::string& text, LogLevel& level) {
+    if (text == "debug") {
+        level = LogLevel::Debug;
+    } else if (text == "info") {
+        level = LogLevel::Info;
+    } else if (text == "warn" || text == "warning") {
+        level = LogLevel::Warn;
+    } else if (text == "error") {
+        level = LogLevel::Error;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void AsyncLogger::log(LogLevel level, const char* event, std::initializer_list<LogField> fields) {
+    if (!enabled(level)) {
+        return;
+    }
+
+    // Claim a cell; a full queue drops the record instead of waiting
+    Cell* cell;
+    size_t position = enqueuePos_.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &cells_[position & mask_];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+        if (diff == 0) {
+            if (enqueuePos_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            position = enqueuePos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    Record& record = cell->record;
+    record.timestampNs = nowNs();
+    record.event = event;
+    record.level = level;
+    record.fieldCount = 0;
+
+    // String values are copied into the record's inline buffer and
+    // truncated once it is full
+    size_t used = 0;
+    for (const LogField& field : fields) {
+        if (record.fieldCount == kMaxFields) {
+            break;
+        }
+        StoredField& stored = record.fields[record.fieldCount++];
+        stored.key = field.key;
+        stored.type = field.type;
+        stored.number.u = field.number.u;
+        stored.offset = static_cast<uint16_t>(used);
+        stored.length = 0;
+        if (field.type == LogField::Type::String) {
+            size_t length = std::min(field.text.size(), kTextBytes - used);
+            std::memcpy(record.text + used, field.text.data(), length);
+            stored.length = static_cast<uint16_t>(length);
+            used += length;
+        }
+    }
+
+    queued_.fetch_add(1, std::memory_order_relaxed);
+    cell->sequence.store(position + 1, std::memory_order_release);
+}
+
+bool AsyncLogger::tryPop(Record& record) {
+    Cell& cell = cells_[dequeuePos_ & mask_];
+    size_t sequence = cell.sequence.load(std::memory_order_acquire);
+    if (sequence != dequeuePos_ + 1) {
+        return false; // Empty, or the producer hasn't finished writing it
+    }
+
+    record = cell.record;
+    cell.sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+    dequeuePos_++;
+    return true;
+}
+
+void AsyncLogger::flush() {
+    uint64_t target = queued_.load(std::memory_order_relaxed);
+    while (written_.load(std::memory_order_acquire) < target) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void AsyncLogger::writerLoop() {
+    Record record;
+    int idleRounds = 0;
+
+    while (true) {
+        bool drained = true;
+        while (tryPop(record)) {
+            writeRecord(record);
+            written_.fetch_add(1, std::memory_order_release);
+            drained = false;
+        }
+
+        uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != droppedReported_) {
+            writeDroppedNotice(dropped - droppedReported_);
+            droppedReported_ = dropped;
+        }
+
+        if (!drained) {
+            idleRounds = 0;
+            continue;
+        }
+
+        // Idle: push buffered lines out, then back off so an idle logger
+        // costs nothing; stop only once the queue is empty
+        std::fflush(out_);
+        if (!running_.load()) {
+            if (queued_.load() == written_.load()) {
+                break;
+            }
+            continue;
+        }
+        if (++idleRounds < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+}
+
+void AsyncLogger::writeRecord(const Record& record) {
+    std::string& line = line_;
+    line.clear();
+
+    if (settings_.format == LogFormat::Json) {
+        line += "{\"ts\":\"";
+        appendTimestamp(line, record.timestampNs);
+        line += "\",\"level\":\"";
+        line += levelName(record.level);
+        line += "\",\"event\":";
+        appendJsonString(line, record.event);
+        for (uint8_t i = 0; i < record.fieldCount; i++) {
+            const StoredField& field = record.fields[i];
+            line += ',';
+            appendJsonString(line, field.key);
+            line += ':';
+            if (field.type == LogField::Type::String) {
+                appendJsonString(line, std::string_view(record.text + field.offset, field.length));
+            } else {
+                appendNumber(line, field.type, field.number.i, field.number.u, field.number.d);
+            }
+        }
+        line += "}\n";
+    } else {
+        line += "ts=";
+        appendTimestamp(line, record.timestampNs);
+        line += " level=";
+        line += levelName(record.level);
+        line += " event=";
+        line += record.event;
+        for (uint8_t i = 0; i < record.fieldCount; i++) {
+            const StoredField& field = record.fields[i];
+            line += ' ';
+            line += field.key;
+            line += '=';
+            if (field.type == LogField::Type::String) {
+                appendTextValue(line, std::string_view(record.text + field.offset, field.length));
+            } else {
+                appendNumber(line, field.type, field.number.i, field.number.u, field.number.d);
+            }
+        }
+        line += '\n';
+    }
+
+    std::fwrite(line.data(), 1, line.size(), out_);
+}
+
+void AsyncLogger::writeDroppedNotice(uint64_t count) {
+    Record record;
+    record.timestampNs = nowNs();
+    record.event = "log_records_dropped";
+    record.level = LogLevel::Warn;
+    record.fieldCount = 1;
+    record.fields[0].key = "count";
+    record.fields[0].type = LogField::Type::Uint;
+    record.fields[0].number.u = count;
+    writeRecord(record);
+}
+
+} // namespace throttlebox
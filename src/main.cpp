@@ -10,12 +10,17 @@
 using namespace throttlebox;
 
 std::atomic<bool> shutdown_requested{false};
+std::atomic<bool> flight_dump_requested{false};
 
 void signalHandler(int signal) {
     std::cout << "\nReceived signal " << signal << ", shutting down gracefully..." << std::endl;
     shutdown_requested = true;
 }
 
+void dumpSignalHandler(int) {
+    flight_dump_requested = true;
+}
+
 void printUsage(const char* programName) {
     std::cout << "Usage: " << programName << " [OPTIONS]\n"
               << "Options:\n"
@@ -96,6 +101,7 @@ int main(int argc, char* argv[]) {
     // Set up signal handlers for graceful shutdown
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
+    signal(SIGUSR1, dumpSignalHandler);
     
     try {
         // Create and configure ThrottleBox
@@ -118,6 +124,16 @@ int main(int argc, char* argv[]) {
         // Wait for shutdown signal
         while (!shutdown_requested) {
             std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            
+            // SIGUSR1: snapshot recent rate limiting decisions
+            if (flight_dump_requested.exchange(false)) {
+                const auto& path = config.getDiagnosticsSettings().flightRecorderPath;
+                if (proxy.dumpFlightRecorder()) {
+                    std::cout << "Flight recorder written to " << path << std::endl;
+                } else {
+                    std::cerr << "Failed to write flight recorder to " << path << std::endl;
+                }
+            }
         }
         
         // Stop proxy
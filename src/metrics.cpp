@@ -1,13 +1,84 @@
 #include "throttlebox/metrics.hpp"
-#include <sstream>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <iostream>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
+#include <cstdio>
 #include <cstring>
+#include <sys/uio.h>
 
 namespace throttlebox {
 
+namespace {
+
+const char* describeMetric(const std::string& name) {
+    static const std::unordered_map<std::string, const char*> descriptions = {
+        {"total_connections", "Total connections accepted"},
+        {"allowed_messages", "Messages allowed through"},
+        {"blocked_messages", "Messages blocked by rate limiter"},
+        {"shaped_messages", "Messages delayed by traffic shaping"},
+        {"shape_queue_bytes", "Bytes waiting in traffic shaping queues"},
+        {"rejected_publish_acks", "Dropped QoS 1/2 publishes acknowledged by the proxy"},
+        {"rate_limit_disconnects", "Connections closed for exceeding the rate limit"},
+        {"connect_rate_rejections", "Connections refused for reconnecting too fast"},
+        {"global_connection_refusals", "Connections refused at max_connections"},
+        {"ip_connection_refusals", "Connections refused at max_connections_per_ip"},
+        {"cidr_connection_refusals", "Connections refused by a full cidr_connection_limits block"},
+        {"connect_timeouts", "Connections closed for not sending a CONNECT within connect_timeout_ms"},
+        {"half_open_timeouts", "Connections closed for not being answered within half_open_timeout_ms"},
+        {"idle_timeouts", "Connections closed for sending nothing for 1.5 times their keepalive"},
+        {"denied_messages", "Publishes refused by a deny topic rule"},
+        {"malformed_packets", "Connections closed for a malformed packet or topic name"},
+        {"client_disconnects", "Total client disconnections"},
+        {"active_connections", "Currently active connections"},
+        {"unique_clients", "Number of unique clients tracked by the rate limiter"},
+        {"blocked_clients", "Clients currently blocked by the rate limiter"},
+        {"processing_duration_seconds", "Time spent processing messages"},
+    };
+    
+    auto it = descriptions.find(name);
+    return it != descriptions.end() ? it->second : "ThrottleBox metric";
+}
+
+// Plain decimal notation where it fits ("0.0001" rather than "1e-04"),
+// which every StatsD implementation and Prometheus label reader accepts
+char* formatDecimal(char* first, char* last, double value) {
+    auto result = std::to_chars(first, last, value, std::chars_format::fixed);
+    if (result.ec != std::errc()) {
+        result = std::to_chars(first, last, value);
+    }
+    return result.ptr;
+}
+
+void sendHttpResponse(int socket, const char* status, const char* contentType, const std::string& body) {
+    char header[256];
+    int length = snprintf(header, sizeof(header),
+                          "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                          status, contentType, body.size());
+    if (length <= 0 || static_cast<size_t>(length) >= sizeof(header)) {
+        return;
+    }
+    
+    // Header and body go out in one call without concatenating them
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = length;
+    iov[1].iov_base = const_cast<char*>(body.data());
+    iov[1].iov_len = body.size();
+    writev(socket, iov, 2);
+}
+
+} // namespace
+
+const double Metrics::kHistogramBounds[Metrics::kHistogramBuckets] = {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0
+};
+
 Metrics::Metrics() {
     // Initialize common counters
     counters_["total_connections"] = 0;
@@ -18,61 +89,432 @@ Metrics::Metrics() {
     // Initialize common gauges
     gauges_["active_connections"] = 0;
     gauges_["unique_clients"] = 0;
+    gauges_["blocked_clients"] = 0;
 }
 
 Metrics::~Metrics() {
+    stopStatsdExporter();
     stopHttpServer();
 }
 
 void Metrics::incrementCounter(const std::string& name) {
+    counter(name).fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::setGauge(const std::string& name, int64_t value) {
+    gauge(name).store(value, std::memory_order_relaxed);
+}
+
+std::atomic<uint64_t>& Metrics::counter(const std::string& name) {
     std::lock_guard<std::mutex> lock(counterMutex_);
     
     // Create counter if it doesn't exist
-    if (counters_.find(name) == counters_.end()) {
-        counters_[name] = 0;
+    auto it = counters_.find(name);
+    if (it == counters_.end()) {
+        it = counters_.emplace(name, 0).first;
+        generation_.fetch_add(1, std::memory_order_release);
     }
     
-    counters_[name]++;
+    return it->second;
 }
 
-void Metrics::setGauge(const std::string& name, int64_t value) {
+std::atomic<int64_t>& Metrics::gauge(const std::string& name) {
     std::lock_guard<std::mutex> lock(gaugeMutex_);
     
     // Create gauge if it doesn't exist
-    if (gauges_.find(name) == gauges_.end()) {
-        gauges_[name] = 0;
+    auto it = gauges_.find(name);
+    if (it == gauges_.end()) {
+        it = gauges_.emplace(name, 0).first;
+        generation_.fetch_add(1, std::memory_order_release);
+    }
+    
+    return it->second;
+}
+
+void Metrics::observeHistogram(const std::string& name, double value) {
+    histogram(name).observe(value);
+}
+
+Metrics::Histogram& Metrics::histogram(const std::string& name) {
+    std::lock_guard<std::mutex> lock(histogramMutex_);
+    
+    // Create histogram if it doesn't exist
+    auto it = histograms_.find(name);
+    if (it == histograms_.end()) {
+        it = histograms_.emplace(std::piecewise_construct,
+                                 std::forward_as_tuple(name),
+                                 std::forward_as_tuple()).first;
+        generation_.fetch_add(1, std::memory_order_release);
     }
     
-    gauges_[name] = value;
+    return it->second;
+}
+
+void Metrics::Histogram::observe(double value) {
+    size_t bucket = std::lower_bound(kHistogramBounds, kHistogramBounds + kHistogramBuckets, value)
+                    - kHistogramBounds;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    
+    double current = sum.load(std::memory_order_relaxed);
+    while (!sum.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {
+    }
+    count.fetch_add(1, std::memory_order_relaxed);
 }
 
 std::string Metrics::getFormattedMetrics() const {
-    std::stringstream ss;
+    std::lock_guard<std::mutex> lock(renderMutex_);
+    return renderLocked();
+}
+
+void Metrics::rebuildSeriesCache() const {
+    series_.clear();
+    prefixBytes_ = 0;
+    sampleCount_ = 0;
     
-    // Add header
-    ss << "# HELP throttlebox_metrics ThrottleBox proxy metrics\n";
-    ss << "# TYPE throttlebox_counter counter\n";
-    ss << "# TYPE throttlebox_gauge gauge\n\n";
+    auto addSeries = [this](const std::string& name, const char* suffix,
+                            const char* type, const char* help) {
+        Series series;
+        series.name = name;
+        series.prefix.reserve(96 + 3 * name.size());
+        std::string metric = "throttlebox_" + name + suffix;
+        series.prefix += "# HELP " + metric + " " + help + "\n";
+        series.prefix += "# TYPE " + metric + " " + type + "\n";
+        series_.push_back(std::move(series));
+        return metric;
+    };
     
-    // Add counters
+    // Writers are only blocked while the pointer list is copied; values
+    // are read later without any lock.
     {
         std::lock_guard<std::mutex> lock(counterMutex_);
         for (const auto& pair : counters_) {
-            ss << "throttlebox_" << pair.first << "_total " << pair.second.load() << "\n";
+            std::string metric = addSeries(pair.first, "_total", "counter", describeMetric(pair.first));
+            series_.back().prefix += metric + " ";
+            series_.back().counter = &pair.second;
         }
     }
     
-    ss << "\n";
-    
-    // Add gauges
     {
         std::lock_guard<std::mutex> lock(gaugeMutex_);
         for (const auto& pair : gauges_) {
-            ss << "throttlebox_" << pair.first << " " << pair.second.load() << "\n";
+            std::string metric = addSeries(pair.first, "", "gauge", describeMetric(pair.first));
+            series_.back().prefix += metric + " ";
+            series_.back().gauge = &pair.second;
+        }
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(histogramMutex_);
+        for (const auto& pair : histograms_) {
+            std::string metric = addSeries(pair.first, "", "histogram", describeMetric(pair.first));
+            Series& series = series_.back();
+            series.histogram = &pair.second;
+            
+            char bound[32];
+            for (size_t i = 0; i < kHistogramBuckets; i++) {
+                char* end = formatDecimal(bound, bound + sizeof(bound), kHistogramBounds[i]);
+                series.sampleNames.push_back(metric + "_bucket{le=\"" + std::string(bound, end) + "\"} ");
+            }
+            series.sampleNames.push_back(metric + "_bucket{le=\"+Inf\"} ");
+            series.sampleNames.push_back(metric + "_sum ");
+            series.sampleNames.push_back(metric + "_count ");
+        }
+    }
+    
+    // Stable exposition order: counters, gauges, then histograms, by name
+    auto kind = [](const Series& series) {
+        return series.counter ? 0 : series.gauge ? 1 : 2;
+    };
+    std::sort(series_.begin(), series_.end(), [&kind](const Series& a, const Series& b) {
+        if (kind(a) != kind(b)) {
+            return kind(a) < kind(b);
+        }
+        return a.name < b.name;
+    });
+    
+    for (const auto& series : series_) {
+        prefixBytes_ += series.prefix.size();
+        for (const auto& sample : series.sampleNames) {
+            prefixBytes_ += sample.size();
+        }
+        sampleCount_ += series.histogram ? series.sampleNames.size() : 1;
+    }
+}
+
+void Metrics::refreshSeriesLocked() const {
+    // Read the generation before the maps so a series registered while we
+    // rebuild is picked up by the next refresh rather than missed.
+    uint64_t generation = generation_.load(std::memory_order_acquire);
+    if (generation != cachedGeneration_) {
+        rebuildSeriesCache();
+        cachedGeneration_ = generation;
+    }
+}
+
+const std::string& Metrics::renderLocked() const {
+    refreshSeriesLocked();
+    
+    // Worst case per sample: a shortest-form double (24 chars) and "\n\n"
+    constexpr size_t kMaxValueBytes = 32;
+    size_t capacity = prefixBytes_ + sampleCount_ * kMaxValueBytes;
+    if (renderBuffer_.size() < capacity) {
+        renderBuffer_.resize(capacity);
+    }
+    
+    char* out = &renderBuffer_[0];
+    char* end = out + renderBuffer_.size();
+    auto append = [&out](const std::string& text) {
+        std::memcpy(out, text.data(), text.size());
+        out += text.size();
+    };
+    
+    for (const auto& series : series_) {
+        append(series.prefix);
+        
+        if (series.histogram) {
+            // Prometheus buckets are cumulative
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i <= kHistogramBuckets; i++) {
+                cumulative += series.histogram->buckets[i].load(std::memory_order_relaxed);
+                append(series.sampleNames[i]);
+                out = std::to_chars(out, end, cumulative).ptr;
+                *out++ = '\n';
+            }
+            append(series.sampleNames[kHistogramBuckets + 1]);
+            out = std::to_chars(out, end, series.histogram->sum.load(std::memory_order_relaxed)).ptr;
+            *out++ = '\n';
+            append(series.sampleNames[kHistogramBuckets + 2]);
+            out = std::to_chars(out, end, series.histogram->count.load(std::memory_order_relaxed)).ptr;
+        } else if (series.counter) {
+            out = std::to_chars(out, end, series.counter->load(std::memory_order_relaxed)).ptr;
+        } else {
+            out = std::to_chars(out, end, series.gauge->load(std::memory_order_relaxed)).ptr;
+        }
+        *out++ = '\n';
+        *out++ = '\n';
+    }
+    
+    // Shrinking keeps the allocation, so steady-state scrapes never allocate
+    renderBuffer_.resize(out - renderBuffer_.data());
+    return renderBuffer_;
+}
+
+void Metrics::addHttpHandler(const std::string& path, const std::string& contentType,
+                             std::function<std::string()> handler) {
+    std::lock_guard<std::mutex> lock(httpHandlersMutex_);
+    httpHandlers_.push_back(HttpHandler{path, contentType, std::move(handler)});
+}
+
+void Metrics::removeHttpHandler(const std::string& path) {
+    std::lock_guard<std::mutex> lock(httpHandlersMutex_);
+    httpHandlers_.erase(std::remove_if(httpHandlers_.begin(), httpHandlers_.end(),
+                                       [&path](const HttpHandler& entry) { return entry.path == path; }),
+                        httpHandlers_.end());
+}
+
+bool Metrics::startStatsdExporter(const StatsdSettings& settings) {
+    if (statsdRunning_) {
+        return false; // Already running
+    }
+    
+    statsdSettings_ = settings;
+    
+    // Everything that exists at startup is the baseline, not a delta
+    {
+        std::lock_guard<std::mutex> lock(renderMutex_);
+        refreshSeriesLocked();
+        for (const auto& series : series_) {
+            if (series.counter) {
+                statsdLastCounts_[series.counter] = series.counter->load(std::memory_order_relaxed);
+            } else if (series.histogram) {
+                for (const auto& bucket : series.histogram->buckets) {
+                    statsdLastCounts_[&bucket] = bucket.load(std::memory_order_relaxed);
+                }
+                statsdLastSums_[series.histogram] = series.histogram->sum.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    statsdRunning_ = true;
+    
+    statsdThread_ = std::thread(&Metrics::statsdExporterLoop, this);
+    
+    std::cout << "StatsD exporter pushing to " << settings.host << ":" << settings.port
+              << " every " << settings.flushIntervalMs << "ms" << std::endl;
+    return true;
+}
+
+void Metrics::stopStatsdExporter() {
+    if (!statsdRunning_) {
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(statsdWakeMutex_);
+        statsdRunning_ = false;
+    }
+    statsdWake_.notify_all();
+    
+    if (statsdThread_.joinable()) {
+        statsdThread_.join();
+    }
+    
+    std::cout << "StatsD exporter stopped" << std::endl;
+}
+
+void Metrics::statsdExporterLoop() {
+    int udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udpSocket < 0) {
+        std::cerr << "Failed to create StatsD socket" << std::endl;
+        return;
+    }
+    
+    struct sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(statsdSettings_.port);
+    
+    if (inet_pton(AF_INET, statsdSettings_.host.c_str(), &address.sin_addr) <= 0 ||
+        connect(udpSocket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        std::cerr << "Invalid StatsD address " << statsdSettings_.host << ":"
+                  << statsdSettings_.port << std::endl;
+        close(udpSocket);
+        return;
+    }
+    
+    auto interval = std::chrono::milliseconds(statsdSettings_.flushIntervalMs);
+    auto nextFlush = std::chrono::steady_clock::now() + interval;
+    
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(statsdWakeMutex_);
+            statsdWake_.wait_until(lock, nextFlush, [this]() { return !statsdRunning_; });
         }
+        
+        // Always flush once more on shutdown so the last interval isn't lost
+        flushStatsd(udpSocket);
+        
+        if (!statsdRunning_) {
+            break;
+        }
+        nextFlush += interval;
     }
     
-    return ss.str();
+    close(udpSocket);
+}
+
+size_t Metrics::flushStatsd(int socket) {
+    const StatsdSettings& settings = statsdSettings_;
+    std::string& datagram = statsdBuffer_;
+    datagram.clear();
+    size_t datagrams = 0;
+    
+    auto sendDatagram = [&]() {
+        if (!datagram.empty()) {
+            // Best effort: a full socket buffer only loses this interval
+            ::send(socket, datagram.data(), datagram.size(), MSG_DONTWAIT);
+            datagrams++;
+            datagram.clear();
+        }
+    };
+    
+    // Lines are newline-separated; a line is never split across datagrams
+    char line[512];
+    auto emit = [&](const std::string& name, const char* suffix, const char* value, size_t valueLen,
+                    const char* type) {
+        int len = snprintf(line, sizeof(line), "%s%s%s:%.*s|%s",
+                           settings.prefix.c_str(), name.c_str(), suffix,
+                           static_cast<int>(valueLen), value, type);
+        if (len <= 0 || static_cast<size_t>(len) >= sizeof(line)) {
+            return;
+        }
+        size_t lineLen = len;
+        if (settings.dogstatsd && !settings.tags.empty()) {
+            lineLen += snprintf(line + lineLen, sizeof(line) - lineLen, "|#%s", settings.tags.c_str());
+            lineLen = std::min(lineLen, sizeof(line) - 1);
+        }
+        
+        size_t needed = datagram.empty() ? lineLen : datagram.size() + 1 + lineLen;
+        if (needed > settings.maxDatagramBytes) {
+            sendDatagram();
+        }
+        if (!datagram.empty()) {
+            datagram += '\n';
+        }
+        datagram.append(line, lineLen);
+    };
+    
+    char value[32];
+    auto emitInt = [&](const std::string& name, const char* suffix, int64_t number, const char* type) {
+        char* end = std::to_chars(value, value + sizeof(value), number).ptr;
+        emit(name, suffix, value, end - value, type);
+    };
+    auto emitDouble = [&](const std::string& name, const char* suffix, double number, const char* type) {
+        char* end = formatDecimal(value, value + sizeof(value), number);
+        emit(name, suffix, value, end - value, type);
+    };
+    
+    std::lock_guard<std::mutex> lock(renderMutex_);
+    refreshSeriesLocked();
+    
+    for (const auto& series : series_) {
+        if (series.counter) {
+            uint64_t current = series.counter->load(std::memory_order_relaxed);
+            uint64_t& last = statsdLastCounts_[series.counter];
+            if (current != last) {
+                emitInt(series.name, "", static_cast<int64_t>(current - last), "c");
+                last = current;
+            }
+        } else if (series.gauge) {
+            int64_t current = series.gauge->load(std::memory_order_relaxed);
+            if (current < 0) {
+                // A signed StatsD gauge value is a relative change; reset first
+                emitInt(series.name, "", 0, "g");
+            }
+            emitInt(series.name, "", current, "g");
+        } else {
+            const Histogram& histogram = *series.histogram;
+            uint64_t deltas[kHistogramBuckets + 1];
+            uint64_t total = 0;
+            for (size_t i = 0; i <= kHistogramBuckets; i++) {
+                uint64_t current = histogram.buckets[i].load(std::memory_order_relaxed);
+                uint64_t& last = statsdLastCounts_[&histogram.buckets[i]];
+                deltas[i] = current - last;
+                last = current;
+                total += deltas[i];
+            }
+            double sum = histogram.sum.load(std::memory_order_relaxed);
+            double& lastSum = statsdLastSums_[&histogram];
+            double sumDelta = sum - lastSum;
+            lastSum = sum;
+            
+            if (total == 0) {
+                continue;
+            }
+            
+            // Summaries from this interval's buckets; a quantile reports the
+            // upper bound of the bucket it falls in
+            auto quantile = [&](double q) {
+                uint64_t rank = static_cast<uint64_t>(q * total + 0.5);
+                uint64_t seen = 0;
+                for (size_t i = 0; i < kHistogramBuckets; i++) {
+                    seen += deltas[i];
+                    if (seen >= rank) {
+                        return kHistogramBounds[i];
+                    }
+                }
+                return kHistogramBounds[kHistogramBuckets - 1];
+            };
+            emitInt(series.name, ".count", static_cast<int64_t>(total), "c");
+            emitDouble(series.name, ".sum", sumDelta, "c");
+            emitDouble(series.name, ".avg", sumDelta / total, "g");
+            emitDouble(series.name, ".p50", quantile(0.50), "g");
+            emitDouble(series.name, ".p99", quantile(0.99), "g");
+        }
+    }
+    
+    sendDatagram();
+    return datagrams;
 }
 
 bool Metrics::startHttpServer(int port) {
@@ -164,24 +606,30 @@ void Metrics::httpServerLoop() {
                     
                     // Check if it's a GET request to /metrics
                     if (strstr(buffer, "GET /metrics") != nullptr) {
-                        std::string metrics = getFormattedMetrics();
-                        
-                        std::string response = "HTTP/1.1 200 OK\r\n";
-                        response += "Content-Type: text/plain\r\n";
-                        response += "Content-Length: " + std::to_string(metrics.length()) + "\r\n";
-                        response += "Connection: close\r\n\r\n";
-                        response += metrics;
-                        
-                        send(clientSocket, response.c_str(), response.length(), 0);
+                        std::lock_guard<std::mutex> lock(renderMutex_);
+                        sendHttpResponse(clientSocket, "200 OK", "text/plain; version=0.0.4", renderLocked());
                     } else {
-                        // Return 404 for other paths
-                        std::string response = "HTTP/1.1 404 Not Found\r\n";
-                        response += "Content-Type: text/plain\r\n";
-                        response += "Content-Length: 9\r\n";
-                        response += "Connection: close\r\n\r\n";
-                        response += "Not Found";
+                        std::function<std::string()> handler;
+                        std::string contentType;
+                        {
+                            std::lock_guard<std::mutex> lock(httpHandlersMutex_);
+                            for (const auto& entry : httpHandlers_) {
+                                std::string request = "GET " + entry.path;
+                                if (strncmp(buffer, request.c_str(), request.size()) == 0 &&
+                                    (buffer[request.size()] == ' ' || buffer[request.size()] == '?')) {
+                                    handler = entry.handler;
+                                    contentType = entry.contentType;
+                                    break;
+                                }
+                            }
+                        }
                         
-                        send(clientSocket, response.c_str(), response.length(), 0);
+                        if (handler) {
+                            sendHttpResponse(clientSocket, "200 OK", contentType.c_str(), handler());
+                        } else {
+                            // Return 404 for other paths
+                            sendHttpResponse(clientSocket, "404 Not Found", "text/plain", "Not Found");
+                        }
                     }
                 }
                 
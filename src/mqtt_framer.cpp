@@ -0,0 +1,454 @@
+#include "throttlebox/mqtt_framer.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace throttlebox {
+
+MqttFramer::MqttFramer(size_t maxPacketSize)
+    : buffer_(4096), maxPacketSize_(maxPacketSize) {
+}
+
+uint8_t* MqttFramer::prepare(size_t minBytes) {
+    // Move the partial packet to the front before growing
+    if (start_ > 0) {
+        size_t pending = end_ - start_;
+        if (pending > 0) {
+            std::memmove(buffer_.data(), buffer_.data() + start_, pending);
+        }
+        start_ = 0;
+        end_ = pending;
+    }
+
+    if (buffer_.size() - end_ < minBytes) {
+        buffer_.resize(std::max(buffer_.size() * 2, end_ + minBytes));
+    }
+    return buffer_.data() + end_;
+}
+
+void MqttFramer::commit(size_t bytes) {
+    end_ = std::min(end_ + bytes, buffer_.size());
+}
+
+bool MqttFramer::next(MqttPacket& packet) {
+    if (!peek(packet)) {
+        return false;
+    }
+    start_ += packet.size;
+    return true;
+}
+
+bool MqttFramer::peek(MqttPacket& packet) {
+    if (error_ || end_ - start_ < 2) {
+        return false;
+    }
+
+    const uint8_t* data = buffer_.data() + start_;
+    size_t available = end_ - start_;
+
+    // Remaining length: 1-4 bytes, 7 bits each, least significant first
+    size_t remaining = 0;
+    size_t headerSize = 1;
+    for (int shift = 0;; shift += 7) {
+        if (headerSize >= available) {
+            return false; // Length not complete yet
+        }
+        uint8_t byte = data[headerSize++];
+        remaining |= static_cast<size_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+        if (headerSize == 5) {
+            error_ = true; // Continuation bit on the fourth length byte
+            return false;
+        }
+    }
+
+    if (headerSize + remaining > maxPacketSize_) {
+        error_ = true;
+        oversized_ = true;
+        return false;
+    }
+    if (available < headerSize + remaining) {
+        return false;
+    }
+
+    packet.data = data;
+    packet.size = headerSize + remaining;
+    packet.headerSize = headerSize;
+    packet.type = data[0] >> 4;
+    packet.flags = data[0] & 0x0F;
+    return true;
+}
+
+bool viewPacket(const uint8_t* data, size_t size, MqttPacket& packet) {
+    size_t remaining = 0;
+    size_t headerSize = 1;
+    for (int shift = 0;; shift += 7) {
+        if (headerSize >= size || headerSize == 5) {
+            return false;
+        }
+        uint8_t byte = data[headerSize++];
+        remaining |= static_cast<size_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    if (size - headerSize < remaining) {
+        return false;
+    }
+    
+    packet.data = data;
+    packet.size = headerSize + remaining;
+    packet.headerSize = headerSize;
+    packet.type = data[0] >> 4;
+    packet.flags = data[0] & 0x0F;
+    return true;
+}
+
+bool packetIdOf(const MqttPacket& packet, uint16_t& id) {
+    const uint8_t* body = packet.body();
+    size_t bodySize = packet.bodySize();
+    size_t offset = 0;
+    
+    switch (packet.type) {
+        case mqtt::kPublish: {
+            if (publishQos(packet) == 0 || bodySize < 2) {
+                return false;
+            }
+            // Skip the topic name
+            offset = 2 + ((static_cast<size_t>(body[0]) << 8) | body[1]);
+            break;
+        }
+        case mqtt::kPuback:
+        case mqtt::kPubrec:
+        case mqtt::kPubrel:
+        case mqtt::kPubcomp:
+            break;
+        default:
+            return false;
+    }
+    
+    if (offset + 2 > bodySize) {
+        return false;
+    }
+    id = static_cast<uint16_t>((body[offset] << 8) | body[offset + 1]);
+    return true;
+}
+
+namespace {
+
+// Cursor over a packet body; every read checks the bounds and a failed
+// read leaves ok false
+struct Reader {
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+    bool ok = true;
+    
+    uint8_t byte() {
+        if (!ok || offset >= size) {
+            ok = false;
+            return 0;
+        }
+        return data[offset++];
+    }
+    
+    uint16_t u16() {
+        uint16_t high = byte();
+        return static_cast<uint16_t>((high << 8) | byte());
+    }
+    
+    ByteSpan bytes(size_t length) {
+        if (!ok || size - offset < length) {
+            ok = false;
+            return ByteSpan();
+        }
+        ByteSpan span{data + offset, length};
+        offset += length;
+        return span;
+    }
+    
+    // Two-byte length prefix, then the bytes
+    std::string_view string() {
+        ByteSpan span = bytes(u16());
+        return std::string_view(reinterpret_cast<const char*>(span.data), span.size);
+    }
+    
+    uint32_t u32() {
+        uint32_t high = u16();
+        return (high << 16) | u16();
+    }
+    
+    // Variable byte integer: 1-4 bytes, 7 bits each, least significant first
+    uint32_t varint() {
+        uint32_t value = 0;
+        for (int shift = 0; shift < 28; shift += 7) {
+            uint8_t next = byte();
+            value |= static_cast<uint32_t>(next & 0x7F) << shift;
+            if ((next & 0x80) == 0) {
+                return value;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+    
+    // Two-byte length prefix, then binary data
+    ByteSpan binary() {
+        return bytes(u16());
+    }
+    
+    // MQTT 5 properties: variable byte integer length, then the properties
+    ByteSpan properties() {
+        return bytes(varint());
+    }
+    
+    ByteSpan rest() { return bytes(ok ? size - offset : 0); }
+};
+
+void appendVarint(std::vector<uint8_t>& out, size_t value) {
+    do {
+        uint8_t byte = value % 128;
+        value /= 128;
+        out.push_back(value > 0 ? byte | 0x80 : byte);
+    } while (value > 0);
+}
+
+} // namespace
+
+bool PropertyReader::next(MqttProperty& property) {
+    if (error_ || offset_ == properties_.size) {
+        return false;
+    }
+    
+    Reader reader{properties_.data, properties_.size, offset_};
+    property.id = reader.byte();
+    property.value = 0;
+    property.data = ByteSpan();
+    switch (property.id) {
+        // Byte
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+            property.value = reader.byte();
+            break;
+        // Two byte integer
+        case mqtt::kPropertyServerKeepAlive: case mqtt::kPropertyReceiveMaximum: case mqtt::kPropertyTopicAliasMaximum: case mqtt::kPropertyTopicAlias:
+            property.value = reader.u16();
+            break;
+        // Four byte integer
+        case 0x02: case 0x11: case 0x18: case mqtt::kPropertyMaximumPacketSize:
+            property.value = reader.u32();
+            break;
+        // Variable byte integer (subscription identifier)
+        case 0x0B:
+            property.value = reader.varint();
+            break;
+        // UTF-8 string or binary data
+        case 0x03: case 0x08: case 0x12: case 0x15: case 0x1A: case 0x1C: case 0x1F:
+        case 0x09: case 0x16:
+            property.data = reader.binary();
+            break;
+        // User property: a string pair
+        case 0x26: {
+            size_t start = reader.offset;
+            reader.binary();
+            reader.binary();
+            property.data = ByteSpan{properties_.data + start, reader.offset - start};
+            break;
+        }
+        default:
+            reader.ok = false;
+    }
+    
+    if (!reader.ok) {
+        error_ = true;
+        return false;
+    }
+    property.encoded = ByteSpan{properties_.data + offset_, reader.offset - offset_};
+    offset_ = reader.offset;
+    return true;
+}
+
+bool parsePublish(const MqttPacket& packet, uint8_t protocolLevel, PublishView& view) {
+    if (packet.type != mqtt::kPublish) {
+        return false;
+    }
+    
+    Reader reader{packet.body(), packet.bodySize()};
+    view.qos = publishQos(packet);
+    view.dup = (packet.flags & 0x08) != 0;
+    view.retain = (packet.flags & 0x01) != 0;
+    view.topic = reader.string();
+    view.packetId = view.qos > 0 ? reader.u16() : 0;
+    view.properties = protocolLevel >= mqtt::kProtocolV5 ? reader.properties() : ByteSpan();
+    view.payload = reader.rest();
+    return reader.ok;
+}
+
+bool rewritePublishTopic(const MqttPacket& publish, std::string_view topic, std::vector<uint8_t>& out) {
+    if (publish.type != mqtt::kPublish || topic.size() > 0xFFFF) {
+        return false;
+    }
+    Reader reader{publish.body(), publish.bodySize()};
+    reader.string();
+    if (!reader.ok) {
+        return false;
+    }
+    
+    ByteSpan rest = reader.rest();
+    out.clear();
+    out.push_back(publish.data[0]);
+    appendVarint(out, 2 + topic.size() + rest.size);
+    out.push_back(static_cast<uint8_t>(topic.size() >> 8));
+    out.push_back(static_cast<uint8_t>(topic.size()));
+    out.insert(out.end(), topic.begin(), topic.end());
+    out.insert(out.end(), rest.data, rest.data + rest.size);
+    return true;
+}
+
+bool parseConnect(const MqttPacket& packet, ConnectView& view) {
+    if (packet.type != mqtt::kConnect) {
+        return false;
+    }
+    
+    view = ConnectView();
+    Reader reader{packet.body(), packet.bodySize()};
+    view.protocolName = reader.string();
+    view.protocolLevel = reader.byte();
+    view.flags = reader.byte();
+    view.keepAlive = reader.u16();
+    const bool v5 = view.protocolLevel >= mqtt::kProtocolV5;
+    view.properties = v5 ? reader.properties() : ByteSpan();
+    
+    // Payload: client identifier, then each field its flag announces
+    view.clientId = reader.string();
+    if (view.hasWill()) {
+        view.willProperties = v5 ? reader.properties() : ByteSpan();
+        view.willTopic = reader.string();
+        view.willPayload = reader.binary();
+    }
+    if (view.hasUsername()) {
+        view.username = reader.string();
+    }
+    if (view.flags & mqtt::kConnectPassword) {
+        view.password = reader.binary();
+    }
+    return reader.ok && reader.offset == reader.size && (view.flags & mqtt::kConnectReserved) == 0;
+}
+
+bool parseDisconnect(const MqttPacket& packet, uint8_t protocolLevel, DisconnectView& view) {
+    if (packet.type != mqtt::kDisconnect) {
+        return false;
+    }
+    
+    // Before MQTT 5 a DISCONNECT has no body; from 5 on both fields are
+    // optional when the reason is a normal disconnection
+    view = DisconnectView();
+    if (protocolLevel < mqtt::kProtocolV5 || packet.bodySize() == 0) {
+        return packet.bodySize() == 0;
+    }
+    Reader reader{packet.body(), packet.bodySize()};
+    view.reasonCode = reader.byte();
+    if (reader.offset < reader.size) {
+        view.properties = reader.properties();
+    }
+    return reader.ok && reader.offset == reader.size;
+}
+
+bool parseConnack(const MqttPacket& packet, uint8_t protocolLevel, ConnackView& view) {
+    if (packet.type != mqtt::kConnack) {
+        return false;
+    }
+    Reader reader{packet.body(), packet.bodySize()};
+    view = ConnackView();
+    view.ackFlags = reader.byte();
+    view.reasonCode = reader.byte();
+    if (protocolLevel >= mqtt::kProtocolV5) {
+        view.properties = reader.properties();
+    }
+    return reader.ok && reader.offset == reader.size;
+}
+
+bool rewriteConnack(const MqttPacket& connack, const ConnackLimits& limits, std::vector<uint8_t>& out) {
+    ConnackView view;
+    if (!parseConnack(connack, mqtt::kProtocolV5, view) || view.reasonCode >= 0x80) {
+        return false;
+    }
+    
+    // Copy the broker's properties, holding back the ones being lowered
+    std::vector<uint8_t> kept;
+    uint32_t receiveMaximum = limits.receiveMaximum;
+    uint32_t maximumPacketSize = limits.maximumPacketSize;
+    uint32_t topicAliasMaximum = 0;
+    PropertyReader propertyReader(view.properties);
+    MqttProperty property;
+    while (propertyReader.next(property)) {
+        if (property.id == mqtt::kPropertyReceiveMaximum && receiveMaximum > 0) {
+            receiveMaximum = std::min(receiveMaximum, property.value);
+        } else if (property.id == mqtt::kPropertyMaximumPacketSize && maximumPacketSize > 0) {
+            maximumPacketSize = std::min(maximumPacketSize, property.value);
+        } else if (property.id == mqtt::kPropertyTopicAliasMaximum && limits.topicAliasMaximum > 0) {
+            topicAliasMaximum = std::min<uint32_t>(limits.topicAliasMaximum, property.value);
+        } else {
+            kept.insert(kept.end(), property.encoded.data, property.encoded.data + property.encoded.size);
+        }
+    }
+    if (propertyReader.error()) {
+        return false;
+    }
+    if (receiveMaximum > 0) {
+        kept.push_back(mqtt::kPropertyReceiveMaximum);
+        kept.push_back(static_cast<uint8_t>(receiveMaximum >> 8));
+        kept.push_back(static_cast<uint8_t>(receiveMaximum));
+    }
+    if (maximumPacketSize > 0) {
+        kept.push_back(mqtt::kPropertyMaximumPacketSize);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            kept.push_back(static_cast<uint8_t>(maximumPacketSize >> shift));
+        }
+    }
+    if (topicAliasMaximum > 0) {
+        kept.push_back(mqtt::kPropertyTopicAliasMaximum);
+        kept.push_back(static_cast<uint8_t>(topicAliasMaximum >> 8));
+        kept.push_back(static_cast<uint8_t>(topicAliasMaximum));
+    }
+    
+    std::vector<uint8_t> body = {view.ackFlags, view.reasonCode};
+    appendVarint(body, kept.size());
+    body.insert(body.end(), kept.begin(), kept.end());
+    
+    out.clear();
+    out.push_back(static_cast<uint8_t>(mqtt::kConnack << 4));
+    appendVarint(out, body.size());
+    out.insert(out.end(), body.begin(), body.end());
+    return true;
+}
+
+size_t encodeAck(uint8_t type, uint16_t id, uint8_t reasonCode, uint8_t protocolLevel, uint8_t* out) {
+    bool withReason = protocolLevel >= mqtt::kProtocolV5 && reasonCode != mqtt::kSuccess;
+    
+    // PUBREL's fixed header flags are reserved as 0b0010
+    out[0] = static_cast<uint8_t>((type << 4) | (type == mqtt::kPubrel ? 0x02 : 0x00));
+    out[1] = withReason ? 3 : 2;
+    out[2] = static_cast<uint8_t>(id >> 8);
+    out[3] = static_cast<uint8_t>(id & 0xFF);
+    if (withReason) {
+        out[4] = reasonCode;
+        return 5;
+    }
+    return 4;
+}
+
+size_t encodeConnackRefusal(uint8_t reasonCode, uint8_t protocolLevel, uint8_t* out) {
+    bool v5 = protocolLevel >= mqtt::kProtocolV5;
+    out[0] = static_cast<uint8_t>(mqtt::kConnack << 4);
+    out[1] = v5 ? 3 : 2;
+    out[2] = 0x00; // No session present
+    out[3] = v5 ? reasonCode : mqtt::kServerUnavailable;
+    if (v5) {
+        out[4] = 0x00; // No properties
+        return 5;
+    }
+    return 4;
+}
+
+} // namespace throttlebox
@@ -0,0 +1,187 @@
+#include "throttlebox/mqtt_validate.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define THROTTLEBOX_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace throttlebox {
+
+namespace {
+
+// Index of the first byte at or after i that needs a closer look: a lead
+// or continuation byte, NUL, or in topic names a wildcard. size if none.
+size_t skipPlainScalar(const uint8_t* data, size_t size, size_t i, bool topic) {
+    for (; i < size; i++) {
+        uint8_t byte = data[i];
+        if (byte >= 0x80 || byte == 0 || (topic && (byte == '+' || byte == '#'))) {
+            break;
+        }
+    }
+    return i;
+}
+
+#ifdef THROTTLEBOX_X86_KERNELS
+
+// Bit per byte of the 16 at data that skipPlainScalar() would stop at
+inline uint32_t stopMaskSse2(const uint8_t* data, bool topic) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i stop = _mm_cmpeq_epi8(chunk, _mm_setzero_si128());
+    if (topic) {
+        stop = _mm_or_si128(stop, _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('+')),
+                                               _mm_cmpeq_epi8(chunk, _mm_set1_epi8('#'))));
+    }
+    // The chunk's own high bits mark non-ASCII bytes
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(stop, chunk)));
+}
+
+size_t skipPlainSse2(const uint8_t* data, size_t size, size_t i, bool topic) {
+    if (size < 16) {
+        return skipPlainScalar(data, size, i, topic);
+    }
+    for (; i + 16 <= size; i += 16) {
+        uint32_t mask = stopMaskSse2(data + i, topic);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if (i == size) {
+        return size;
+    }
+    
+    // The tail as the last 16 bytes, minus those already checked
+    size_t base = size - 16;
+    uint32_t mask = stopMaskSse2(data + base, topic) >> (i - base);
+    return mask != 0 ? i + __builtin_ctz(mask) : size;
+}
+
+__attribute__((target("avx2")))
+inline uint32_t stopMaskAvx2(const uint8_t* data, bool topic) {
+    __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    __m256i stop = _mm256_cmpeq_epi8(chunk, _mm256_setzero_si256());
+    if (topic) {
+        stop = _mm256_or_si256(stop, _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('+')),
+                                                     _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('#'))));
+    }
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(stop, chunk)));
+}
+
+// Short strings go to the SSE2 kernel before any 256-bit register is
+// touched; past that point every path returns from here, since jumping to
+// SSE2 code with the upper register halves dirty costs a state transition
+__attribute__((target("avx2")))
+size_t skipPlainAvx2(const uint8_t* data, size_t size, size_t i, bool topic) {
+    if (size < 32) {
+        return skipPlainSse2(data, size, i, topic);
+    }
+    for (; i + 32 <= size; i += 32) {
+        uint32_t mask = stopMaskAvx2(data + i, topic);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    if (i == size) {
+        return size;
+    }
+    
+    size_t base = size - 32;
+    uint32_t mask = stopMaskAvx2(data + base, topic) >> (i - base);
+    return mask != 0 ? i + __builtin_ctz(mask) : size;
+}
+
+#endif // THROTTLEBOX_X86_KERNELS
+
+struct Kernel {
+    const char* name;
+    size_t (*skipPlain)(const uint8_t* data, size_t size, size_t i, bool topic);
+};
+
+const Kernel& kernel() {
+    static const Kernel selected = []() -> Kernel {
+#ifdef THROTTLEBOX_X86_KERNELS
+        if (__builtin_cpu_supports("avx2")) {
+            return Kernel{"avx2", skipPlainAvx2};
+        }
+        return Kernel{"sse2", skipPlainSse2};
+#else
+        return Kernel{"scalar", skipPlainScalar};
+#endif
+    }();
+    return selected;
+}
+
+// Length of the well-formed multi-byte sequence starting at data[i], or 0
+size_t sequenceLength(const uint8_t* data, size_t size, size_t i) {
+    uint8_t lead = data[i];
+    size_t length;
+    uint32_t codePoint;
+    
+    // 0xC0 and 0xC1 could only start overlong two-byte forms
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+        codePoint = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        codePoint = lead & 0x0F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        codePoint = lead & 0x07;
+    } else {
+        return 0;
+    }
+    
+    if (size - i < length) {
+        return 0;
+    }
+    for (size_t k = 1; k < length; k++) {
+        uint8_t byte = data[i + k];
+        if ((byte & 0xC0) != 0x80) {
+            return 0;
+        }
+        codePoint = (codePoint << 6) | (byte & 0x3F);
+    }
+    
+    if (length == 3 && (codePoint < 0x800 || (codePoint >= 0xD800 && codePoint <= 0xDFFF))) {
+        return 0;
+    }
+    if (length == 4 && (codePoint < 0x10000 || codePoint > 0x10FFFF)) {
+        return 0;
+    }
+    return length;
+}
+
+bool validate(const uint8_t* data, size_t size, bool topic) {
+    const Kernel& scan = kernel();
+    size_t i = 0;
+    
+    while (true) {
+        i = scan.skipPlain(data, size, i, topic);
+        if (i == size) {
+            return true;
+        }
+        if (data[i] < 0x80) {
+            return false; // NUL or a wildcard
+        }
+        size_t length = sequenceLength(data, size, i);
+        if (length == 0) {
+            return false;
+        }
+        i += length;
+    }
+}
+
+} // namespace
+
+bool isValidMqttString(const uint8_t* data, size_t size) {
+    return validate(data, size, false);
+}
+
+bool isValidTopicName(std::string_view topic) {
+    return validate(reinterpret_cast<const uint8_t*>(topic.data()), topic.size(), true);
+}
+
+const char* mqttValidateKernel() {
+    return kernel().name;
+}
+
+} // namespace throttlebox
@@ -0,0 +1,34 @@
+#include "throttlebox/packet_queue.hpp"
+
+namespace throttlebox {
+
+void PacketQueue::push(const uint8_t* data, size_t size) {
+    // Reclaim the released front once it outweighs what is still queued
+    if (head_ > 0 && head_ >= storage_.size() - head_) {
+        storage_.erase(storage_.begin(), storage_.begin() + head_);
+        head_ = 0;
+    }
+    storage_.insert(storage_.end(), data, data + size);
+    sizes_.push_back(static_cast<uint32_t>(size));
+}
+
+size_t PacketQueue::frontBytes(size_t n) const {
+    size_t total = 0;
+    for (size_t i = 0; i < n && i < sizes_.size(); i++) {
+        total += sizes_[i];
+    }
+    return total;
+}
+
+void PacketQueue::pop(size_t n) {
+    for (size_t i = 0; i < n && !sizes_.empty(); i++) {
+        head_ += sizes_.front();
+        sizes_.pop_front();
+    }
+    if (sizes_.empty()) {
+        storage_.clear();
+        head_ = 0;
+    }
+}
+
+} // namespace throttlebox
@@ -1,93 +1,576 @@
 #include "throttlebox/rate_limiter.hpp"
+#include "throttlebox/metrics.hpp"
 #include <algorithm>
+#include <cmath>
 #include <iostream>
 
 namespace throttlebox {
 
-RateLimiter::RateLimiter(const RateLimitPolicy& defaultPolicy)
-    : defaultPolicy_(defaultPolicy) {
+RateLimiter::RateLimiter(const RateLimitPolicy& defaultPolicy, std::shared_ptr<Clock> clock)
+    : defaultPolicy_(defaultPolicy),
+      clock_(clock ? std::move(clock) : std::make_shared<MonotonicClock>()) {
+}
+
+bool parseLimitMode(const std::string& text, LimitMode& mode) {
+    if (text == "drop") {
+        mode = LimitMode::Drop;
+    } else if (text == "shape") {
+        mode = LimitMode::Shape;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseRejectAction(const std::string& text, RejectAction& action) {
+    if (text == "drop") {
+        action = RejectAction::Drop;
+    } else if (text == "silent_ack") {
+        action = RejectAction::SilentAck;
+    } else if (text == "reason_code") {
+        action = RejectAction::ReasonCode;
+    } else if (text == "disconnect") {
+        action = RejectAction::Disconnect;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseIdentityKey(const std::string& text, IdentityKey& key) {
+    IdentityKey parsed{false, false, false};
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = std::min(text.find('+', start), text.size());
+        std::string part = text.substr(start, end - start);
+        if (part == "client_id") {
+            parsed.clientId = true;
+        } else if (part == "username") {
+            parsed.username = true;
+        } else if (part == "ip") {
+            parsed.ip = true;
+        } else {
+            return false;
+        }
+        start = end + 1;
+    }
+    key = parsed;
+    return true;
+}
+
+std::string identityOf(const IdentityKey& key, const std::string& ip, const std::string& clientId,
+                       const std::string& username) {
+    std::string identity;
+    auto append = [&](const char* kind, const std::string& part) {
+        if (!identity.empty()) {
+            identity += '\0';
+        }
+        identity += kind;
+        identity += part;
+    };
+    
+    // Each part is tagged with what it is, so a username or client ID
+    // spelled like an address never shares that address's bucket
+    if (key.clientId) {
+        clientId.empty() ? append("ip:", ip) : append("c:", clientId);
+    }
+    if (key.username) {
+        username.empty() ? append("ip:", ip) : append("u:", username);
+    }
+    if (key.ip) {
+        append("ip:", ip);
+    }
+    return identity;
+}
+
+PacketClass classifyPacket(uint8_t type) {
+    switch (type) {
+        case 1: return PacketClass::Connect;
+        case 3: return PacketClass::Publish;
+        case 8:    // SUBSCRIBE
+        case 10:   // UNSUBSCRIBE
+            return PacketClass::Subscribe;
+        case 12: return PacketClass::Ping;
+        default: return PacketClass::Other;
+    }
+}
+
+const char* packetClassName(PacketClass packetClass) {
+    switch (packetClass) {
+        case PacketClass::Publish: return "publish";
+        case PacketClass::Subscribe: return "subscribe";
+        case PacketClass::Ping: return "ping";
+        case PacketClass::Connect: return "connect";
+        case PacketClass::Other: return "other";
+    }
+    return "other";
 }
 
 bool RateLimiter::allow(const std::string& ip, const std::string& clientId) {
+    return check(ip, clientId).allowed;
+}
+
+RateLimitDecision RateLimiter::check(const std::string& ip, const std::string& clientId) {
+    return check(ip, clientId, clock_->now());
+}
+
+RateLimitDecision RateLimiter::check(const std::string& ip, const std::string& clientId,
+                                     std::chrono::steady_clock::time_point now) {
     // Use clientId as primary key, fallback to IP if clientId is empty
     std::string key = clientId.empty() ? ip : clientId;
     
     // Get policy for this client
     RateLimitPolicy policy = defaultPolicy_;
+    PolicyLevel level = PolicyLevel::Default;
     {
         std::lock_guard<std::mutex> lock(mutex_);
         auto it = clientPolicies_.find(clientId);
         if (it != clientPolicies_.end()) {
             policy = it->second;
+            level = PolicyLevel::Client;
         }
     }
     
-    bool allowed = checkAndUpdateBucket(key, policy);
+    RateLimitDecision decision = checkAndUpdateBucket(key, policy, now);
+    decision.level = level;
+    
+    recordDecisions(decision.allowed ? 1 : 0, decision.allowed ? 0 : 1);
+    
+    return decision;
+}
+
+RateLimiter::ClientHandle& RateLimiter::ClientHandle::operator=(ClientHandle&& other) noexcept {
+    if (this != &other) {
+        reset();
+        limiter_ = other.limiter_;
+        key_ = other.key_;
+        bucket_ = other.bucket_;
+        policy_ = other.policy_;
+        level_ = other.level_;
+        other.limiter_ = nullptr;
+        other.key_ = nullptr;
+        other.bucket_ = nullptr;
+    }
+    return *this;
+}
+
+void RateLimiter::ClientHandle::reset() {
+    if (bucket_) {
+        std::lock_guard<std::mutex> lock(limiter_->mutex_);
+        bucket_->pins--;
+    }
+    limiter_ = nullptr;
+    key_ = nullptr;
+    bucket_ = nullptr;
+}
+
+RateLimiter::ClientHandle RateLimiter::acquire(const std::string& ip, const std::string& clientId) {
+    return acquireIdentity(clientId.empty() ? ip : clientId, clientId);
+}
+
+RateLimiter::ClientHandle RateLimiter::acquireIdentity(const std::string& identity, const std::string& clientId) {
+    ClientHandle handle;
+    handle.limiter_ = this;
+    handle.policy_ = defaultPolicy_;
+    
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    auto policyIt = clientPolicies_.find(clientId);
+    if (policyIt != clientPolicies_.end()) {
+        handle.policy_ = policyIt->second;
+        handle.level_ = PolicyLevel::Client;
+    }
+    
+    // Map nodes never move, so the key and bucket addresses stay valid
+    // while the pin keeps cleanupExpired() away
+    auto inserted = buckets_.try_emplace(identity);
+    if (inserted.second) {
+        onBucketCreated();
+    }
+    handle.key_ = &inserted.first->first;
+    handle.bucket_ = &inserted.first->second;
+    handle.bucket_->pins++;
+    
+    return handle;
+}
+
+bool RateLimiter::isBlocked(const std::string& identity) {
+    auto now = clock_->now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    expireBlocksLocked(now);
+    auto it = buckets_.find(identity);
+    return it != buckets_.end() && it->second.isBlocked && now < it->second.blockedUntil;
+}
+
+size_t RateLimiter::allowN(ClientHandle& handle, size_t n, RateLimitDecision* last) {
+    return allowN(handle, n, clock_->now(), last);
+}
+
+size_t RateLimiter::allowN(ClientHandle& handle, size_t n, std::chrono::steady_clock::time_point now,
+                           RateLimitDecision* last) {
+    RateLimitDecision decision;
+    size_t allowed = 0;
     
-    // Update statistics
     {
-        std::lock_guard<std::mutex> lock(statsMutex_);
-        if (allowed) {
-            allowedMessages_++;
-        } else {
-            blockedMessages_++;
-        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        expireBlocksLocked(now);
+        allowed = takeTokensLocked(*handle.key_, *handle.bucket_, handle.policy_, now, n, decision);
     }
     
+    decision.level = handle.level_;
+    if (last) {
+        *last = decision;
+    }
+    recordDecisions(allowed, n - allowed);
     return allowed;
 }
 
-bool RateLimiter::checkAndUpdateBucket(const std::string& key, const RateLimitPolicy& policy) {
+void RateLimiter::allowBatch(BatchEntry* entries, size_t count) {
+    uint64_t allowedTotal = 0;
+    uint64_t rejectedTotal = 0;
+    auto now = clock_->now();
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        expireBlocksLocked(now);
+        
+        RateLimitDecision decision;
+        for (size_t i = 0; i < count; i++) {
+            BatchEntry& entry = entries[i];
+            ClientHandle& handle = *entry.handle;
+            entry.allowed = static_cast<uint32_t>(
+                takeTokensLocked(*handle.key_, *handle.bucket_, handle.policy_, now, entry.count, decision));
+            allowedTotal += entry.allowed;
+            rejectedTotal += entry.count - entry.allowed;
+        }
+    }
+    
+    recordDecisions(allowedTotal, rejectedTotal);
+}
+
+size_t RateLimiter::allowPackets(ClientHandle& handle, const uint8_t* types, const uint32_t* sizes,
+                                 const std::string_view* topics, size_t n, bool* allowed,
+                                 std::chrono::steady_clock::time_point now, RateLimitDecision* last,
+                                 bool* denied) {
+    RateLimitDecision decision;
+    size_t allowedCount = 0;
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        expireBlocksLocked(now);
+        allowedCount = takePacketsLocked(*handle.key_, *handle.bucket_, handle.policy_, now,
+                                         types, sizes, topics, n, allowed, denied, false, 0, decision);
+    }
+    
+    decision.level = handle.level_;
+    if (last) {
+        *last = decision;
+    }
+    recordDecisions(allowedCount, n - allowedCount);
+    return allowedCount;
+}
+
+size_t RateLimiter::allowPacketsInOrder(ClientHandle& handle, const uint8_t* types, const uint32_t* sizes,
+                                        const std::string_view* topics, size_t n, bool* allowed,
+                                        std::chrono::steady_clock::time_point now, RateLimitDecision* last,
+                                        uint32_t waiting, bool* denied) {
+    RateLimitDecision decision;
+    size_t allowedCount = 0;
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        expireBlocksLocked(now);
+        allowedCount = takePacketsLocked(*handle.key_, *handle.bucket_, handle.policy_, now,
+                                         types, sizes, topics, n, allowed, denied, true, waiting, decision);
+    }
+    
+    decision.level = handle.level_;
+    if (last) {
+        *last = decision;
+    }
+    recordDecisions(allowedCount, n - allowedCount);
+    return allowedCount;
+}
+
+void RateLimiter::recordDecisions(uint64_t allowed, uint64_t rejected) {
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    allowedMessages_ += allowed;
+    blockedMessages_ += rejected;
+}
+
+RateLimitDecision RateLimiter::checkAndUpdateBucket(const std::string& key, const RateLimitPolicy& policy,
+                                                    std::chrono::steady_clock::time_point now) {
     std::lock_guard<std::mutex> lock(mutex_);
     
-    auto now = std::chrono::steady_clock::now();
-    auto& bucket = buckets_[key];
+    expireBlocksLocked(now);
+    
+    auto inserted = buckets_.try_emplace(key);
+    auto& bucket = inserted.first->second;
+    if (inserted.second) {
+        onBucketCreated();
+    }
     
+    RateLimitDecision decision;
+    takeTokensLocked(key, bucket, policy, now, 1, decision);
+    return decision;
+}
+
+size_t RateLimiter::takeTokensLocked(const std::string& key, TokenBucket& bucket, const RateLimitPolicy& policy,
+                                     std::chrono::steady_clock::time_point now, size_t n,
+                                     RateLimitDecision& last) {
     // Refill tokens based on time elapsed first
-    refillBucket(bucket, policy);
+    refillBucket(bucket, policy, now);
+    
+    last = RateLimitDecision();
     
     // Check if client is still blocked
     if (bucket.isBlocked && now < bucket.blockedUntil) {
-        return false;
+        last.blocked = true;
+        last.tokensLeft = bucket.tokens;
+        last.retryAfter = bucket.blockedUntil - now;
+        return 0;
     }
     
     // Clear block status if block period has expired
     if (bucket.isBlocked && now >= bucket.blockedUntil) {
-        bucket.isBlocked = false;
+        onUnblocked(bucket);
     }
     
-    // Check if we have tokens available
-    if (bucket.tokens >= 1.0) {
-        bucket.tokens -= 1.0;
-        return true;
-    } else {
-        // No tokens available
-        if (policy.blockDurationSec > 0) {
-            // Block the client if block duration is configured
-            bucket.isBlocked = true;
-            bucket.blockedUntil = now + std::chrono::seconds(policy.blockDurationSec);
+    // Packets pass in order while whole tokens last
+    size_t allowed = std::min(n, static_cast<size_t>(std::max(0.0, bucket.tokens)));
+    bucket.tokens -= static_cast<double>(allowed);
+    
+    if (allowed == n) {
+        last.allowed = true;
+    } else if (policy.blockDurationSec > 0 && policy.mode != LimitMode::Shape) {
+        // Block the client if block duration is configured; shaped clients
+        // are only ever delayed
+        onBlocked(key, bucket, now + std::chrono::seconds(policy.blockDurationSec));
+    }
+    
+    if (bucket.isBlocked) {
+        last.retryAfter = bucket.blockedUntil - now;
+    } else if (!last.allowed) {
+        // Time for the bucket to refill to one whole token, rounded up
+        double wait = (1.0 - bucket.tokens) / policy.maxMessagesPerSec;
+        last.retryAfter = std::chrono::nanoseconds(static_cast<int64_t>(std::ceil(wait * 1e9)));
+    }
+    
+    last.tokensLeft = bucket.tokens;
+    return allowed;
+}
+
+size_t RateLimiter::takePacketsLocked(const std::string& key, TokenBucket& bucket, const RateLimitPolicy& policy,
+                                      std::chrono::steady_clock::time_point now, const uint8_t* types,
+                                      const uint32_t* sizes, const std::string_view* topics, size_t n,
+                                      bool* allowed, bool* denied, bool inOrder, uint32_t waiting,
+                                      RateLimitDecision& last) {
+    refillBucket(bucket, policy, now);
+    
+    last = RateLimitDecision();
+    
+    bool blocked = bucket.isBlocked && now < bucket.blockedUntil;
+    if (bucket.isBlocked && !blocked) {
+        onUnblocked(bucket);
+    }
+    
+    size_t allowedCount = 0;
+    bool sharedRejected = false;
+    bool rejectionSeen = false;
+    bool limitBytes = policy.maxBytesPerSec > 0 && sizes;
+    double byteCapacity = policy.byteCapacity();
+    bool matchTopics = topics && !topicTrie_.empty();
+    uint32_t stopped = inOrder ? waiting : 0;   // Buckets whose packets are no longer decided
+    auto soonest = std::chrono::nanoseconds::max();
+    
+    for (size_t i = 0; i < n; i++) {
+        PacketClass packetClass = classifyPacket(types[i]);
+        const PacketBudget& budget = policy.budget(packetClass);
+        uint32_t bucketBit = 1u << policy.bucketOf(packetClass);
+        bool hasTopic = matchTopics && packetClass == PacketClass::Publish && !topics[i].empty();
+        bool ok;
+        
+        if (stopped & bucketBit) {
+            // Undecided, but a denied publish need not wait to be dropped
+            allowed[i] = false;
+            if (denied) {
+                denied[i] = hasTopic && topicDeniedLocked(topics[i]);
+            }
+            continue;
         }
-        return false;
+        
+        // The first rejection is described in last. In order, every
+        // rejection is the first of its bucket, and only brings
+        // last.retryAfter forward.
+        RateLimitDecision later;
+        RateLimitDecision& why = rejectionSeen ? later : last;
+        bool describe = !rejectionSeen || inOrder;
+        
+        // Topic rules come on top of the packet's other budgets and are only
+        // charged if all of them pass; refusals by them never block
+        topicMatches_.clear();
+        bool topicOk = true;
+        if (hasTopic) {
+            topicOk = checkTopicLocked(bucket, topics[i], now, describe, why);
+        }
+        bool isDenied = !topicOk && why.denied;
+        if (denied) {
+            denied[i] = isDenied;
+        }
+        
+        if (!topicOk) {
+            ok = false;
+        } else if (budget.maxPerSec > 0) {
+            // A class with its own budget ignores blocks on the policy's bucket
+            if (!bucket.classBuckets) {
+                bucket.classBuckets.reset(new ClassBucket[kPacketClasses]);
+            }
+            ClassBucket& own = bucket.classBuckets[static_cast<size_t>(packetClass)];
+            double capacity = budget.burstSize > 0 ? budget.burstSize : std::ceil(budget.maxPerSec);
+            refillTokens(own.tokens, own.lastRefill, budget.maxPerSec, capacity, now);
+            ok = own.tokens >= budget.weight;
+            if (ok) {
+                own.tokens -= budget.weight;
+            } else if (describe) {
+                double wait = (budget.weight - own.tokens) / budget.maxPerSec;
+                why.retryAfter = std::chrono::nanoseconds(static_cast<int64_t>(std::ceil(wait * 1e9)));
+            }
+        } else {
+            // A packet larger than the byte bucket passes once the bucket is
+            // full and leaves it in debt, so it is limited to the average rate
+            double bytes = limitBytes ? sizes[i] : 0.0;
+            bool bytesOk = !limitBytes || bucket.byteTokens >= std::min(bytes, byteCapacity);
+            ok = !blocked && bucket.tokens >= budget.weight && bytesOk;
+            if (ok) {
+                bucket.tokens -= budget.weight;
+                bucket.byteTokens -= bytes;
+            } else {
+                sharedRejected = true;
+                if (describe && blocked) {
+                    why.blocked = true;
+                    why.retryAfter = bucket.blockedUntil - now;
+                } else if (describe) {
+                    // Until both the message and the byte bucket suffice
+                    double wait = std::max(0.0, (budget.weight - bucket.tokens) / policy.maxMessagesPerSec);
+                    if (!bytesOk) {
+                        wait = std::max(wait, (std::min(bytes, byteCapacity) - bucket.byteTokens) /
+                                                  policy.maxBytesPerSec);
+                        why.overQuota = bucket.tokens >= budget.weight;
+                    }
+                    why.retryAfter = std::chrono::nanoseconds(static_cast<int64_t>(std::ceil(wait * 1e9)));
+                }
+            }
+        }
+        
+        allowed[i] = ok;
+        if (ok) {
+            for (uint32_t index : topicMatches_) {
+                bucket.topicBuckets[index].second.tokens -= 1.0;
+            }
+            allowedCount++;
+            continue;
+        }
+        rejectionSeen = true;
+        if (inOrder && !isDenied) {
+            soonest = std::min(soonest, why.retryAfter);
+            stopped |= bucketBit;
+        }
+    }
+    if (soonest != std::chrono::nanoseconds::max()) {
+        last.retryAfter = soonest;
+    }
+    
+    // Overrunning the policy's bucket blocks like a rejected single message;
+    // shaped clients are only ever delayed
+    if (sharedRejected && !blocked && policy.blockDurationSec > 0 && policy.mode != LimitMode::Shape) {
+        onBlocked(key, bucket, now + std::chrono::seconds(policy.blockDurationSec));
     }
+    
+    last.allowed = !rejectionSeen;
+    last.tokensLeft = bucket.tokens;
+    return allowedCount;
 }
 
-void RateLimiter::refillBucket(TokenBucket& bucket, const RateLimitPolicy& policy) {
-    auto now = std::chrono::steady_clock::now();
+bool RateLimiter::checkTopicLocked(TokenBucket& bucket, std::string_view topic,
+                                   std::chrono::steady_clock::time_point now, bool first,
+                                   RateLimitDecision& last) {
+    bool denied = false;
+    topicTrie_.forEachMatch(topic, [&](uint32_t rule) {
+        if (topicRules_[rule].deny) {
+            denied = true;
+            return;
+        }
+        // Clients rarely publish under more than a handful of rules
+        size_t index = 0;
+        while (index < bucket.topicBuckets.size() && bucket.topicBuckets[index].first != rule) {
+            index++;
+        }
+        if (index == bucket.topicBuckets.size()) {
+            bucket.topicBuckets.emplace_back(rule, ClassBucket());
+        }
+        topicMatches_.push_back(static_cast<uint32_t>(index));
+    });
     
-    if (bucket.lastRefill == std::chrono::steady_clock::time_point{}) {
+    if (denied) {
+        last.denied = true;
+        return false;
+    }
+    
+    bool ok = true;
+    for (uint32_t index : topicMatches_) {
+        auto& entry = bucket.topicBuckets[index];
+        const TopicRule& rule = topicRules_[entry.first];
+        refillTokens(entry.second.tokens, entry.second.lastRefill, rule.maxMessagesPerSec, rule.capacity(), now);
+        if (entry.second.tokens < 1.0) {
+            ok = false;
+            if (first) {
+                double wait = (1.0 - entry.second.tokens) / rule.maxMessagesPerSec;
+                last.retryAfter = std::max(last.retryAfter,
+                                           std::chrono::nanoseconds(static_cast<int64_t>(std::ceil(wait * 1e9))));
+            }
+        }
+    }
+    return ok;
+}
+
+void RateLimiter::refillBucket(TokenBucket& bucket, const RateLimitPolicy& policy,
+                               std::chrono::steady_clock::time_point now) {
+    if (policy.maxBytesPerSec > 0) {
+        // Shares lastRefill with the message tokens, so it goes first
+        double capacity = policy.byteCapacity();
+        if (bucket.lastRefill == std::chrono::steady_clock::time_point{}) {
+            bucket.byteTokens = capacity;
+        } else if (now > bucket.lastRefill) {
+            std::chrono::duration<double> elapsed = now - bucket.lastRefill;
+            bucket.byteTokens = std::min(capacity, bucket.byteTokens + elapsed.count() * policy.maxBytesPerSec);
+        }
+    }
+    refillTokens(bucket.tokens, bucket.lastRefill, policy.maxMessagesPerSec, policy.burstSize, now);
+}
+
+void RateLimiter::refillTokens(double& tokens, std::chrono::steady_clock::time_point& lastRefill,
+                               double ratePerSec, double capacity, std::chrono::steady_clock::time_point now) {
+    if (lastRefill == std::chrono::steady_clock::time_point{}) {
         // First time - initialize
-        bucket.lastRefill = now;
-        bucket.tokens = policy.burstSize;
+        lastRefill = now;
+        tokens = capacity;
+        return;
+    }
+    
+    // Callers read the clock before taking the lock, so a racing thread
+    // may arrive with a slightly older time
+    if (now <= lastRefill) {
         return;
     }
     
-    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - bucket.lastRefill);
-    double secondsElapsed = elapsed.count() / 1000.0;
+    // Full clock resolution: truncating to whole milliseconds would drop
+    // up to a millisecond of refill on every message from fast clients
+    std::chrono::duration<double> elapsed = now - lastRefill;
     
     // Add tokens based on rate
-    double tokensToAdd = secondsElapsed * policy.maxMessagesPerSec;
-    bucket.tokens = std::min(static_cast<double>(policy.burstSize), bucket.tokens + tokensToAdd);
-    bucket.lastRefill = now;
+    double tokensToAdd = elapsed.count() * ratePerSec;
+    tokens = std::min(capacity, tokens + tokensToAdd);
+    lastRefill = now;
 }
 
 void RateLimiter::setClientPolicy(const std::string& clientId, const RateLimitPolicy& policy) {
@@ -95,16 +578,109 @@ void RateLimiter::setClientPolicy(const std::string& clientId, const RateLimitPo
     clientPolicies_[clientId] = policy;
 }
 
+void RateLimiter::setTopicRules(std::vector<TopicRule> rules) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    topicTrie_ = TopicTrie(rules);
+    topicRules_ = std::move(rules);
+    hasTopicRules_.store(!topicRules_.empty(), std::memory_order_relaxed);
+    
+    // Rule indices change meaning with the new rules
+    for (auto& entry : buckets_) {
+        entry.second.topicBuckets.clear();
+    }
+}
+
+bool RateLimiter::topicDenied(std::string_view topic) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return topicDeniedLocked(topic);
+}
+
+bool RateLimiter::topicDeniedLocked(std::string_view topic) const {
+    bool denied = false;
+    topicTrie_.forEachMatch(topic, [&](uint32_t rule) {
+        denied = denied || topicRules_[rule].deny;
+    });
+    return denied;
+}
+
+void RateLimiter::bindMetrics(Metrics& metrics) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    trackedClientsGauge_ = &metrics.gauge("unique_clients");
+    blockedClientsGauge_ = &metrics.gauge("blocked_clients");
+    trackedClientsGauge_->store(trackedClients_.load(), std::memory_order_relaxed);
+    blockedClientsGauge_->store(blockedClients_.load(), std::memory_order_relaxed);
+}
+
+void RateLimiter::onBucketCreated() {
+    trackedClients_.fetch_add(1, std::memory_order_relaxed);
+    if (trackedClientsGauge_) {
+        trackedClientsGauge_->fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void RateLimiter::onBucketErased(const TokenBucket& bucket) {
+    if (bucket.isBlocked) {
+        blockedClients_.fetch_sub(1, std::memory_order_relaxed);
+        if (blockedClientsGauge_) {
+            blockedClientsGauge_->fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    trackedClients_.fetch_sub(1, std::memory_order_relaxed);
+    if (trackedClientsGauge_) {
+        trackedClientsGauge_->fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void RateLimiter::onBlocked(const std::string& key, TokenBucket& bucket,
+                            std::chrono::steady_clock::time_point until) {
+    if (!bucket.isBlocked) {
+        bucket.isBlocked = true;
+        blockedClients_.fetch_add(1, std::memory_order_relaxed);
+        if (blockedClientsGauge_) {
+            blockedClientsGauge_->fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    bucket.blockedUntil = until;
+    blockExpiries_.push(BlockExpiry{until, key});
+}
+
+void RateLimiter::onUnblocked(TokenBucket& bucket) const {
+    bucket.isBlocked = false;
+    blockedClients_.fetch_sub(1, std::memory_order_relaxed);
+    if (blockedClientsGauge_) {
+        blockedClientsGauge_->fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void RateLimiter::expireBlocksLocked(std::chrono::steady_clock::time_point now) const {
+    // Amortized O(1): each block transition is pushed and popped once
+    while (!blockExpiries_.empty() && blockExpiries_.top().until <= now) {
+        auto it = buckets_.find(blockExpiries_.top().key);
+        if (it != buckets_.end() && it->second.isBlocked && it->second.blockedUntil <= now) {
+            onUnblocked(it->second);
+        }
+        blockExpiries_.pop();
+    }
+}
+
 void RateLimiter::cleanupExpired() {
+    cleanupExpired(clock_->now());
+}
+
+void RateLimiter::cleanupExpired(std::chrono::steady_clock::time_point now) {
     std::lock_guard<std::mutex> lock(mutex_);
     
-    auto now = std::chrono::steady_clock::now();
+    expireBlocksLocked(now);
+    
     auto it = buckets_.begin();
     
     while (it != buckets_.end()) {
-        // Remove buckets that haven't been used for 1 hour
+        // Remove unpinned buckets that haven't been used for 1 hour
         auto timeSinceLastRefill = now - it->second.lastRefill;
-        if (timeSinceLastRefill > std::chrono::hours(1)) {
+        if (it->second.pins == 0 && timeSinceLastRefill > std::chrono::hours(1)) {
+            onBucketErased(it->second);
             it = buckets_.erase(it);
         } else {
             ++it;
@@ -117,15 +693,11 @@ RateLimiter::Stats RateLimiter::getStats() const {
     
     {
         std::lock_guard<std::mutex> lock(mutex_);
-        stats.totalClients = buckets_.size();
         
-        // Count blocked clients
-        auto now = std::chrono::steady_clock::now();
-        for (const auto& pair : buckets_) {
-            if (pair.second.isBlocked && now < pair.second.blockedUntil) {
-                stats.blockedClients++;
-            }
-        }
+        // Retire blocks that lapsed without further traffic
+        expireBlocksLocked(clock_->now());
+        stats.totalClients = trackedClients_.load(std::memory_order_relaxed);
+        stats.blockedClients = blockedClients_.load(std::memory_order_relaxed);
     }
     
     {
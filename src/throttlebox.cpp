@@ -1,27 +1,170 @@
 #include "throttlebox/throttlebox.hpp"
+#include "throttlebox/mqtt_validate.hpp"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <algorithm>
+#include <cmath>
+#include <unordered_set>
+#include <deque>
 
 namespace throttlebox {
 
+namespace {
+
+constexpr size_t kReadSize = 4096;
+
+// A client's whole CONNECT may not exceed this
+constexpr size_t kMaxConnectBytes = 256 * 1024;
+
+// Connection deadlines are seconds to minutes away and need no better
+// than tick precision; a revolution of about 7 minutes keeps keepalive
+// deadlines from being rescanned before they are due
+constexpr auto kDeadlineTick = std::chrono::milliseconds(100);
+constexpr size_t kDeadlineSlots = 4096;
+
+// Send packets that sit in one framer buffer. Adjacent packets are
+// coalesced, so the usual all-contiguous run goes out as a single iovec.
+bool sendPackets(int socket, const MqttPacket* packets, size_t count) {
+    static constexpr size_t kMaxIov = 64;
+    struct iovec iov[kMaxIov];
+    size_t i = 0;
+    
+    while (i < count) {
+        size_t iovCount = 0;
+        size_t expected = 0;
+        while (i < count) {
+            const uint8_t* data = packets[i].data;
+            if (iovCount > 0 && data == static_cast<const uint8_t*>(iov[iovCount - 1].iov_base) + iov[iovCount - 1].iov_len) {
+                iov[iovCount - 1].iov_len += packets[i].size;
+            } else if (iovCount == kMaxIov) {
+                break;
+            } else {
+                iov[iovCount].iov_base = const_cast<uint8_t*>(data);
+                iov[iovCount].iov_len = packets[i].size;
+                iovCount++;
+            }
+            expected += packets[i].size;
+            i++;
+        }
+        struct msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = iovCount;
+        if (sendmsg(socket, &message, MSG_NOSIGNAL) != static_cast<ssize_t>(expected)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Topic Alias of an MQTT 5 PUBLISH, 0 if it has none. False if its
+// properties are malformed.
+bool topicAliasOf(ByteSpan properties, uint16_t& alias) {
+    alias = 0;
+    PropertyReader reader(properties);
+    MqttProperty property;
+    while (reader.next(property)) {
+        if (property.id == mqtt::kPropertyTopicAlias) {
+            alias = static_cast<uint16_t>(property.value);
+        }
+    }
+    return !reader.error();
+}
+
+// Limiter for one kind of CONNECT-rate bucket, or null when rate is 0.
+// Each connection attempt is one message; there is no block on top.
+std::unique_ptr<RateLimiter> makeConnectLimiter(double rate, int burst, ClockSource clockSource) {
+    if (rate <= 0) {
+        return nullptr;
+    }
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = rate;
+    policy.burstSize = burst > 0 ? burst : std::max(1, static_cast<int>(std::ceil(rate)));
+    policy.blockDurationSec = 0;
+    return std::make_unique<RateLimiter>(policy, makeClock(clockSource));
+}
+
+} // namespace
+
 ThrottleBox::ThrottleBox(const Config& config)
     : config_(config), serverSocket_(-1), running_(false) {
     
-    rateLimiter_ = std::make_unique<RateLimiter>(config_.getGlobalLimits());
+    rateLimiter_ = std::make_unique<RateLimiter>(config_.getGlobalLimits(),
+                                                 makeClock(config_.getProxySettings().clockSource));
     metrics_ = std::make_unique<Metrics>();
+    logger_ = std::make_unique<AsyncLogger>(config_.getLoggingSettings());
+    
+    timerWheel_ = std::make_unique<TimerWheel>(std::chrono::steady_clock::now());
+    deadlineWheel_ = std::make_unique<TimerWheel>(std::chrono::steady_clock::now(), kDeadlineTick,
+                                                  kDeadlineSlots);
+    deadlineClock_ = std::make_shared<MonotonicClock>();
+    
+    rateLimiter_->setTopicRules(config_.getTopicRules());
+    rateLimiter_->bindMetrics(*metrics_);
+    activeConnections_ = &metrics_->gauge("active_connections");
+    
+    const auto& connection = config_.getConnectionSettings();
+    connectionLimiter_ = std::make_unique<ConnectionLimiter>(connection.maxConnections,
+                                                             connection.maxConnectionsPerIp,
+                                                             connection.cidrLimits);
+    ClockSource clockSource = config_.getProxySettings().clockSource;
+    ipConnectLimiter_ = makeConnectLimiter(connection.ipConnectRate, connection.ipConnectBurst, clockSource);
+    clientConnectLimiter_ = makeConnectLimiter(connection.clientConnectRate, connection.clientConnectBurst,
+                                               clockSource);
+    connectRateRejections_ = &metrics_->counter("connect_rate_rejections");
+    connectRateLogSampler_ = LogSampler(config_.getLoggingSettings().sampleIntervalMs);
+    
+    const auto& diagnostics = config_.getDiagnosticsSettings();
+    if (diagnostics.flightRecorderEvents > 0) {
+        flightRecorder_ = std::make_unique<FlightRecorder>(diagnostics.flightRecorderEvents);
+        metrics_->addHttpHandler("/debug/flightrecorder", "application/octet-stream",
+                                 [this]() { return flightRecorder_->dump(); });
+    }
+    
+    if (!diagnostics.traceCapturePath.empty()) {
+        traceWriter_ = std::make_unique<TraceWriter>(diagnostics.traceCapturePath);
+        if (!traceWriter_->isOpen()) {
+            std::cerr << "Cannot open trace capture file " << diagnostics.traceCapturePath << std::endl;
+            traceWriter_.reset();
+        }
+    }
     
     // Start metrics server if configured
-    metrics_->startHttpServer(9090);
+    const auto& metricsSettings = config_.getMetricsSettings();
+    metrics_->startHttpServer(metricsSettings.httpPort);
+    
+    if (metricsSettings.statsdEnabled) {
+        metrics_->startStatsdExporter(metricsSettings.statsd);
+    }
 }
 
 ThrottleBox::~ThrottleBox() {
     stop();
+    if (timerThread_.joinable()) {
+        timerThread_.join();
+    }
+    
+    // The handler refers to flightRecorder_, which is destroyed before metrics_
+    if (flightRecorder_) {
+        metrics_->removeHttpHandler("/debug/flightrecorder");
+    }
+}
+
+bool ThrottleBox::dumpFlightRecorder(const std::string& path) {
+    if (!flightRecorder_) {
+        return false;
+    }
+    
+    const std::string& target = path.empty() ? config_.getDiagnosticsSettings().flightRecorderPath : path;
+    return flightRecorder_->dumpToFile(target);
 }
 
 void ThrottleBox::runProxy() {
@@ -60,11 +203,14 @@ void ThrottleBox::runProxy() {
         throw std::runtime_error("Failed to listen on socket");
     }
     
+    timerThread_ = std::thread(&ThrottleBox::timerLoop, this);
+    
     std::cout << "ThrottleBox listening on " 
               << config_.getProxySettings().listenAddress << ":" 
               << config_.getProxySettings().listenPort << std::endl;
     
     // Accept client connections
+    LogSampler refusalSampler(config_.getLoggingSettings().sampleIntervalMs);
     while (running_) {
         fd_set readfds;
         FD_ZERO(&readfds);
@@ -91,9 +237,29 @@ void ThrottleBox::runProxy() {
             if (clientSocket >= 0) {
                 metrics_->incrementCounter("total_connections");
                 
-                // Handle client in separate thread
-                std::thread clientThread(&ThrottleBox::handleClient, this, clientSocket);
-                clientThread.detach(); // Let it run independently
+                // Over a cap the socket is closed before a thread is spent on it
+                uint32_t address = ntohl(clientAddr.sin_addr.s_addr);
+                ConnectionLimiter::Admission admission = connectionLimiter_->admit(address);
+                if (admission == ConnectionLimiter::Admission::Admitted) {
+                    // Handle client in separate thread
+                    std::thread clientThread(&ThrottleBox::handleClient, this, clientSocket, address);
+                    clientThread.detach(); // Let it run independently
+                } else {
+                    const char* cap = admission == ConnectionLimiter::Admission::Global ? "global"
+                                      : admission == ConnectionLimiter::Admission::Ip ? "ip" : "cidr";
+                    metrics_->incrementCounter(std::string(cap) + "_connection_refusals");
+                    
+                    uint64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+                    if (refusalSampler.admit(nowNs)) {
+                        char ip[INET_ADDRSTRLEN];
+                        inet_ntop(AF_INET, &clientAddr.sin_addr, ip, sizeof(ip));
+                        logger_->log(LogLevel::Warn, "connection_refused",
+                                     {{"ip", std::string(ip)}, {"limit", cap},
+                                      {"suppressed", refusalSampler.suppressed()}});
+                    }
+                    close(clientSocket);
+                }
             }
         }
         
@@ -102,6 +268,12 @@ void ThrottleBox::runProxy() {
         auto now = std::chrono::steady_clock::now();
         if (now - lastCleanup > std::chrono::minutes(5)) {
             rateLimiter_->cleanupExpired();
+            if (ipConnectLimiter_) {
+                ipConnectLimiter_->cleanupExpired();
+            }
+            if (clientConnectLimiter_) {
+                clientConnectLimiter_->cleanupExpired();
+            }
             lastCleanup = now;
         }
     }
@@ -111,10 +283,14 @@ void ThrottleBox::runProxy() {
         close(serverSocket_);
         serverSocket_ = -1;
     }
+    
+    timerWake_.notify_one();
+    timerThread_.join();
 }
 
 void ThrottleBox::stop() {
     running_ = false;
+    timerWake_.notify_one();
     
     if (serverSocket_ >= 0) {
         close(serverSocket_);
@@ -122,39 +298,104 @@ void ThrottleBox::stop() {
     }
 }
 
-void ThrottleBox::handleClient(int clientSocket) {
+void ThrottleBox::handleClient(int clientSocket, uint32_t address) {
+    // Count the connection as active for its whole lifetime, whichever way it ends
+    struct ActiveConnection {
+        std::atomic<int64_t>& gauge;
+        ConnectionLimiter& limiter;
+        uint32_t address;
+        ActiveConnection(std::atomic<int64_t>& g, ConnectionLimiter& l, uint32_t a)
+            : gauge(g), limiter(l), address(a) { gauge.fetch_add(1); }
+        ~ActiveConnection() {
+            gauge.fetch_sub(1);
+            limiter.release(address);
+        }
+    } active(*activeConnections_, *connectionLimiter_, address);
+    
+    // Packets over max_packet_size end the connection, the CONNECT included.
+    // Each is held whole until it is decided, so without one (an explicit
+    // max_packet_size: 0) a single header can declare 256 MB.
+    size_t maxPacketSize = config_.getProxySettings().maxPacketSize;
     ClientInfo clientInfo;
+    MqttFramer framer(maxPacketSize > 0 ? maxPacketSize : MqttFramer::kMaxRemainingLength + 5);
+    clientInfo.handle = nextClientHandle_.fetch_add(1, std::memory_order_relaxed);
+    
+    // A deadline that passes shuts the socket down from the timer thread,
+    // ending whatever read this thread is blocked in. The socket is closed
+    // only once the deadline is disarmed, on every way out. The timer
+    // thread wakes at least once per tick of the deadline wheel, so unlike
+    // scheduleTimer() arming a deadline need not wake it.
+    auto watch = std::make_shared<ConnectionWatch>(*deadlineWheel_, deadlineClock_, [clientSocket](const char*) {
+        shutdown(clientSocket, SHUT_RDWR);
+    });
+    struct ClientSocket {
+        ThrottleBox& box;
+        int socket;
+        ConnectionWatch& watch;
+        const ClientInfo& info;
+        ~ClientSocket() { box.closeClient(socket, watch, info); }
+    } owner{*this, clientSocket, *watch, clientInfo};
+    
+    const auto& connection = config_.getConnectionSettings();
+    auto accepted = watch->lastActivity();
+    watch->arm("connect", accepted + std::chrono::milliseconds(connection.connectTimeoutMs));
     
     try {
         // Extract client information from connection
-        if (!extractClientInfo(clientSocket, clientInfo)) {
-            std::cerr << "Failed to extract client info" << std::endl;
-            close(clientSocket);
+        if (!extractClientInfo(clientSocket, framer, clientInfo)) {
+            logger_->log(LogLevel::Warn, "client_info_failed", {{"ip", clientInfo.ip}});
+            return;
+        }
+        
+        // Until the broker answers, the connection holds a thread and a
+        // broker socket without being usable
+        auto halfOpen = accepted + std::chrono::milliseconds(connection.halfOpenTimeoutMs);
+        watch->arm("half_open", halfOpen);
+        
+        // Reconnect storms stop here, before costing a broker connection
+        // or a log line per attempt
+        if (!admitConnect(clientSocket, clientInfo)) {
             return;
         }
         
-        std::cout << "New client: " << clientInfo.ip << " (ID: " << clientInfo.clientId << ")" << std::endl;
+        logger_->log(LogLevel::Info, "client_connected",
+                     {{"client", clientInfo.clientId}, {"ip", clientInfo.ip}, {"handle", clientInfo.handle}});
         
-        // Connect to broker
-        int brokerSocket = connectToBroker();
+        // Connect to broker. Running out of time there is the half-open
+        // deadline passing, whether or not the timer thread has caught up.
+        int brokerSocket = connectToBroker(halfOpen);
+        if (brokerSocket < 0 && deadlineClock_->now() >= halfOpen) {
+            watch->expire();
+            return;
+        }
         if (brokerSocket < 0) {
-            std::cerr << "Failed to connect to broker" << std::endl;
-            close(clientSocket);
+            logger_->log(LogLevel::Error, "broker_connect_failed",
+                         {{"client", clientInfo.clientId}, {"ip", clientInfo.ip}});
             return;
         }
         
         // Forward traffic between client and broker
-        forwardTraffic(clientSocket, brokerSocket, clientInfo);
-        
+        forwardTraffic(clientSocket, brokerSocket, clientInfo, framer, watch);
+    
     } catch (const std::exception& e) {
-        std::cerr << "Error handling client " << clientInfo.ip << ": " << e.what() << std::endl;
+        logger_->log(LogLevel::Error, "client_error", {{"ip", clientInfo.ip}, {"error", e.what()}});
     }
     
-    close(clientSocket);
     metrics_->incrementCounter("client_disconnects");
 }
 
-bool ThrottleBox::extractClientInfo(int socket, ClientInfo& info) {
+void ThrottleBox::closeClient(int clientSocket, ConnectionWatch& watch, const ClientInfo& info) {
+    const char* expired = watch.close();
+    close(clientSocket);
+    
+    if (expired) {
+        metrics_->incrementCounter(std::string(expired) + "_timeouts");
+        logger_->log(LogLevel::Warn, "connection_timeout",
+                     {{"client", info.clientId}, {"ip", info.ip}, {"deadline", expired}});
+    }
+}
+
+bool ThrottleBox::extractClientInfo(int socket, MqttFramer& framer, ClientInfo& info) {
     // Get client IP address
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
@@ -162,105 +403,826 @@ bool ThrottleBox::extractClientInfo(int socket, ClientInfo& info) {
         char ip[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
         info.ip = ip;
+        info.ipv4 = ntohl(addr.sin_addr.s_addr);
     } else {
         info.ip = "unknown";
     }
     
-    // Read MQTT CONNECT packet to extract ClientID
-    // This is a simplified implementation - a real one would need proper MQTT parsing
-    char buffer[1024];
-    ssize_t bytesRead = recv(socket, buffer, sizeof(buffer), MSG_PEEK);
+    // Read until the CONNECT is complete, however the client's TCP stack
+    // splits it. It stays in the framer, so it is charged to the connect
+    // budget and forwarded like any other packet. The connect deadline
+    // shuts the socket down on a client too slow about it, ending the read.
+    MqttPacket packet;
+    while (!framer.peek(packet)) {
+        if (framer.error() || framer.buffered() > kMaxConnectBytes) {
+            return false;
+        }
+        ssize_t bytesRead = recv(socket, framer.prepare(kReadSize), kReadSize, 0);
+        if (bytesRead <= 0) {
+            return false;
+        }
+        framer.commit(bytesRead);
+    }
     
-    if (bytesRead < 10) {
-        return false; // Not enough data for MQTT CONNECT
+    // The first packet must be a CONNECT; malformed strings in it are
+    // refused before the broker sees them
+    ConnectView connect;
+    if (!parseConnect(packet, connect) || !isValidMqttString(connect.clientId) ||
+        !isValidMqttString(connect.username) || !validProperties(connect.properties) ||
+        !validProperties(connect.willProperties)) {
+        return false;
     }
     
-    // Very basic MQTT CONNECT parsing
-    // Real implementation should use a proper MQTT library
-    if (buffer[0] == 0x10) { // CONNECT packet type
-        // Skip fixed header and protocol name
-        int pos = 10; // Simplified - real parsing would be more complex
-        
-        if (pos + 2 < bytesRead) {
-            uint16_t clientIdLen = (buffer[pos] << 8) | buffer[pos + 1];
-            pos += 2;
-            
-            if (pos + clientIdLen < bytesRead) {
-                info.clientId = std::string(buffer + pos, clientIdLen);
-            }
-        }
+    // A will is published by the broker on the client's behalf, so it
+    // must not reach a topic the client could not publish to itself
+    if (connect.hasWill() && (connect.willTopic.empty() || !isValidTopicName(connect.willTopic) ||
+                              rateLimiter_->topicDenied(connect.willTopic))) {
+        return false;
     }
     
+    info.protocolLevel = connect.protocolLevel;
+    info.connectFlags = connect.flags;
+    info.keepAlive = connect.keepAlive;
+    info.clientId.assign(connect.clientId.data(), connect.clientId.size());
+    info.username.assign(connect.username.data(), connect.username.size());
+    info.willTopic.assign(connect.willTopic.data(), connect.willTopic.size());
+    
     if (info.clientId.empty()) {
         info.clientId = "anonymous_" + info.ip;
     }
+    info.identity = identityOf(config_.getIdentityKey(), info.ip, info.clientId, info.username);
     
     return true;
 }
 
-void ThrottleBox::forwardTraffic(int clientSocket, int brokerSocket, const ClientInfo& info) {
+bool ThrottleBox::admitConnect(int clientSocket, const ClientInfo& info) {
+    // A client blocked for its message rate is blocked under its identity,
+    // so reconnecting does not lift the block. It is turned away before
+    // taking a token from the CONNECT-rate buckets.
+    const char* over = nullptr;
+    uint8_t reasonCode = mqtt::kConnectionRateExceeded;
+    if (rateLimiter_->isBlocked(info.identity)) {
+        over = "blocked";
+        reasonCode = mqtt::kQuotaExceeded;
+    } else if (ipConnectLimiter_ && !ipConnectLimiter_->allow(info.ip, "")) {
+        over = "ip";
+    } else if (clientConnectLimiter_ && !clientConnectLimiter_->allow(info.ip, info.clientId)) {
+        over = "client_id";
+    }
+    if (!over) {
+        return true;
+    }
+    
+    uint8_t connack[5];
+    size_t length = encodeConnackRefusal(reasonCode, info.protocolLevel, connack);
+    ssize_t bytesSent = send(clientSocket, connack, length, MSG_NOSIGNAL);
+    (void)bytesSent;
+    if (reasonCode == mqtt::kQuotaExceeded) {
+        metrics_->incrementCounter("blocked_connect_rejections");
+    } else {
+        connectRateRejections_->fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    // A storm is logged once per interval, not once per attempt
+    uint64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::lock_guard<std::mutex> lock(connectRateLogMutex_);
+    if (connectRateLogSampler_.admit(nowNs)) {
+        logger_->log(LogLevel::Warn, reasonCode == mqtt::kQuotaExceeded ? "connect_blocked" : "connect_rate_limited",
+                     {{"client", info.clientId}, {"ip", info.ip}, {"limit", over},
+                      {"suppressed", connectRateLogSampler_.suppressed()}});
+    }
+    return false;
+}
+
+void ThrottleBox::forwardTraffic(int clientSocket, int brokerSocket, const ClientInfo& info,
+                                 MqttFramer& framer, const std::shared_ptr<ConnectionWatch>& watch) {
     fd_set readfds;
-    char buffer[4096];
+    char buffer[kReadSize];
+    std::vector<MqttPacket> packets;
+    std::vector<MqttPacket> rejectedPackets;
+    std::vector<uint8_t> types;              // Control packet type and size per packet, for the limiter
+    std::vector<uint32_t> sizes;
+    std::vector<std::string_view> topics;    // PUBLISH topics in place in the framer, or topic aliases
+    std::vector<uint16_t> aliases;           // Topic Alias per packet, 0 for none
+    std::vector<std::string_view> rejectedTopics;
+    std::unique_ptr<bool[]> passed;          // Per-packet decisions
+    std::unique_ptr<bool[]> deniedPackets;   // Per packet: refused by a deny topic rule
+    size_t passedCapacity = 0;
+    LogSampler dropSampler(config_.getLoggingSettings().sampleIntervalMs);
+    
+    // Resolved once per connection instead of per packet
+    RateLimiter::ClientHandle limiterHandle = rateLimiter_->acquireIdentity(info.identity, info.clientId);
+    std::atomic<uint64_t>& allowedCounter = metrics_->counter("allowed_messages");
+    std::atomic<uint64_t>& blockedCounter = metrics_->counter("blocked_messages");
+    
+    // Shaping: over-limit packets wait here, in one queue per bucket they
+    // draw from (see RateLimitPolicy::bucketOf()), so a PINGREQ with a
+    // budget of its own never waits behind PUBLISHes. The timer wheel wakes
+    // this thread through wakeFd once a bucket has refilled.
+    const RateLimitPolicy& policy = limiterHandle.policy();
+    const bool shaping = policy.mode == LimitMode::Shape;
+    const size_t shapeQueueLimit = policy.shapeQueueBytes;
+    PacketQueue shapeQueues[kPacketClasses + 1];
+    size_t shapeQueuedBytes = 0;   // Across all the queues
+    int wakeFd = shaping ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+    TimerWheel::TimerId shapeTimer = 0;
+    Clock::time_point shapeWakeAt;
+    auto waitingBuckets = [&]() {
+        uint32_t waiting = 0;
+        for (size_t bucket = 0; bucket <= kPacketClasses; bucket++) {
+            if (!shapeQueues[bucket].empty()) {
+                waiting |= 1u << bucket;
+            }
+        }
+        return waiting;
+    };
+    auto reservePassed = [&](size_t count) {
+        if (passedCapacity < count) {
+            passedCapacity = std::max(count, passedCapacity * 2);
+            passed.reset(new bool[passedCapacity]);
+            deniedPackets.reset(new bool[passedCapacity]);
+        }
+    };
+    // Rejection answers written by the proxy itself, sent once per read.
+    // PUBRECs sent for dropped QoS 2 publishes leave a flow the broker
+    // never saw, so the client's PUBREL is answered here as well.
+    const RejectAction rejectAction = limiterHandle.policy().rejectAction;
+    std::vector<uint8_t> replies;
+    std::unordered_set<uint16_t> localQos2Ids;
+    std::atomic<uint64_t>& rejectAckCounter = metrics_->counter("rejected_publish_acks");
+    std::atomic<uint64_t>& rejectDisconnectCounter = metrics_->counter("rate_limit_disconnects");
+    auto appendAck = [&](uint8_t type, uint16_t id, uint8_t reason) {
+        uint8_t ack[5];
+        size_t length = encodeAck(type, id, reason, info.protocolLevel, ack);
+        replies.insert(replies.end(), ack, ack + length);
+    };
+    // Acknowledge a dropped QoS 1/2 publish so it is not retransmitted
+    auto ackDropped = [&](const MqttPacket& dropped, uint8_t reason) {
+        uint16_t id;
+        if (dropped.type != mqtt::kPublish || !packetIdOf(dropped, id)) {
+            return;
+        }
+        bool qos2 = publishQos(dropped) == 2;
+        bool flowEnds = reason != mqtt::kSuccess && info.protocolLevel >= mqtt::kProtocolV5;
+        appendAck(qos2 ? mqtt::kPubrec : mqtt::kPuback, id, reason);
+        if (qos2 && !flowEnds) {
+            localQos2Ids.insert(id);
+        }
+        rejectAckCounter.fetch_add(1, std::memory_order_relaxed);
+    };
+    
+    // Topic rules: the limiter matches each topic once, in the locked pass
+    // that decides the read, and reports denied publishes. Those are
+    // dropped here in either mode, never queued for shaping.
+    const bool matchTopics = rateLimiter_->hasTopicRules();
+    std::atomic<uint64_t>& deniedCounter = metrics_->counter("denied_messages");
+    std::atomic<uint64_t>& malformedCounter = metrics_->counter("malformed_packets");
+    
+    // MQTT 5 topic aliases, tracked on both sides of the proxy. The
+    // client's are set by every publish it sends, so the topic of one that
+    // only carries an alias can be looked up for the topic rules; the
+    // broker's only by publishes actually forwarded. A publish setting an
+    // alias may be dropped, so one using it that the broker would resolve
+    // differently is sent with its topic name spelled out. Both tables are
+    // indexed by alias, up to the Topic Alias Maximum in the client's
+    // CONNACK. Each client topic is its own heap string: views of one stay
+    // valid to the end of the read even if its alias is reassigned.
+    uint16_t topicAliasMaximum = 0;
+    std::vector<std::unique_ptr<std::string>> clientAliases;
+    std::vector<std::unique_ptr<std::string>> retiredAliases;
+    std::vector<std::string> brokerAliases;
+    std::deque<std::vector<uint8_t>> rewrittenPackets;   // Publishes re-encoded this read
+    auto resolveTopic = [&](std::string_view topic, uint16_t alias) -> std::string_view {
+        if (alias == 0) {
+            return topic;
+        }
+        std::unique_ptr<std::string>& slot = clientAliases[alias];
+        if (topic.empty()) {
+            return slot ? std::string_view(*slot) : std::string_view();
+        }
+        if (!slot || *slot != topic) {
+            if (slot) {
+                retiredAliases.push_back(std::move(slot));
+            }
+            slot.reset(new std::string(topic));
+        }
+        return topic;
+    };
+    // Record an aliased publish the broker is about to receive. False if
+    // it only carries the alias and the broker has another topic for it.
+    auto forwardAlias = [&](uint16_t alias, std::string_view topic, const MqttPacket& packet) {
+        std::string& known = brokerAliases[alias];
+        if (known == topic) {
+            return true;
+        }
+        PublishView publish;
+        if (parsePublish(packet, info.protocolLevel, publish) && publish.topic.empty()) {
+            return false;
+        }
+        known.assign(topic.data(), topic.size());
+        return true;
+    };
+    
+    // MQTT 5 clients learn the proxy's limits from a rewritten CONNACK, and
+    // the proxy learns the Topic Alias Maximum they were given: the broker's
+    // stream is framed until its first packet has been seen
+    ConnackLimits connackLimits;
+    connackLimits.receiveMaximum = static_cast<uint16_t>(config_.getProxySettings().receiveMaximum);
+    connackLimits.maximumPacketSize = static_cast<uint32_t>(config_.getProxySettings().maxPacketSize);
+    connackLimits.topicAliasMaximum = static_cast<uint16_t>(config_.getProxySettings().topicAliasMaximum);
+    std::unique_ptr<MqttFramer> connackFramer;
+    if (info.protocolLevel >= mqtt::kProtocolV5) {
+        connackFramer.reset(new MqttFramer());
+    }
+    
+    // Looked up once: building the name on each read would allocate
+    Metrics::Histogram& processingHistogram = metrics_->histogram("processing_duration_seconds");
+    
+    std::atomic<uint64_t>& shapedCounter = metrics_->counter("shaped_messages");
+    std::atomic<int64_t>& shapeQueueGauge = metrics_->gauge("shape_queue_bytes");
+    if (shaping && wakeFd < 0) {
+        logger_->log(LogLevel::Error, "shaping_unavailable", {{"client", info.clientId}, {"ip", info.ip}});
+        close(brokerSocket);
+        return;
+    }
+    
+    auto recordFlight = [&](uint64_t nowNs, uint8_t packetType, FlightDecision decision,
+                            const RateLimitDecision& last) {
+        FlightEvent event;
+        event.timestampNs = nowNs;
+        event.clientHandle = info.handle;
+        event.ipv4 = info.ipv4;
+        event.tokensLeft = static_cast<float>(last.tokensLeft);
+        event.policyLevel = static_cast<uint8_t>(last.level);
+        event.packetType = packetType;
+        event.decision = static_cast<uint8_t>(decision);
+        flightRecorder_->record(event);
+    };
+    
+    // Arm the wake-up for when the next queued packet could pass, moving
+    // it earlier when another queue's bucket refills sooner
+    auto armShapeTimer = [&](Clock::time_point now, const RateLimitDecision& last) {
+        if (shapeQueuedBytes == 0) {
+            return;
+        }
+        auto deadline = now + last.retryAfter;
+        if (shapeTimer != 0) {
+            if (deadline >= shapeWakeAt) {
+                return;
+            }
+            timerWheel_->cancel(shapeTimer);
+        }
+        shapeWakeAt = deadline;
+        shapeTimer = scheduleTimer(deadline, [wakeFd]() {
+            uint64_t one = 1;
+            ssize_t written = write(wakeFd, &one, sizeof(one));
+            (void)written;
+        });
+    };
+    
+    // Send as much of each shaping queue as its bucket allows, deciding
+    // them all in one limiter call
+    auto releaseShaped = [&]() -> bool {
+        auto now = rateLimiter_->clock().now();
+        types.clear();
+        sizes.clear();
+        topics.clear();
+        aliases.clear();
+        for (const PacketQueue& queue : shapeQueues) {
+            size_t offset = 0;
+            for (size_t i = 0; i < queue.packets(); i++) {
+                const uint8_t* queued = queue.front() + offset;
+                types.push_back(queued[0] >> 4);
+                sizes.push_back(static_cast<uint32_t>(queue.packetSize(i)));
+                offset += queue.packetSize(i);
+                
+                // Queued publishes always carry their topic name
+                MqttPacket view;
+                PublishView publish;
+                uint16_t alias = 0;
+                if ((matchTopics || info.protocolLevel >= mqtt::kProtocolV5) &&
+                    viewPacket(queued, sizes.back(), view) && parsePublish(view, info.protocolLevel, publish) &&
+                    topicAliasOf(publish.properties, alias)) {
+                    topics.push_back(publish.topic);
+                } else {
+                    topics.push_back(std::string_view());
+                }
+                aliases.push_back(alias);
+            }
+        }
+        
+        reservePassed(types.size());
+        RateLimitDecision last;
+        size_t released = rateLimiter_->allowPacketsInOrder(limiterHandle, types.data(), sizes.data(),
+                                                            topics.data(), types.size(), passed.get(), now, &last,
+                                                            0, deniedPackets.get());
+        uint64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+        
+        // Send the first count packets of a queue
+        auto sendQueued = [&](PacketQueue& queue, size_t count) -> bool {
+            size_t length = queue.frontBytes(count);
+            ssize_t bytesSent = send(brokerSocket, queue.front(), length, MSG_NOSIGNAL);
+            if (bytesSent != static_cast<ssize_t>(length)) {
+                return false; // Broker connection failed
+            }
+            queue.pop(count);
+            shapeQueuedBytes -= length;
+            shapeQueueGauge.fetch_sub(static_cast<int64_t>(length), std::memory_order_relaxed);
+            return true;
+        };
+        
+        // Every queue draws from one bucket, so what passes is a prefix.
+        // Publishes only denied since they were queued (the topic rules
+        // were replaced) are dropped from it.
+        size_t first = 0;
+        size_t denied = 0;
+        for (PacketQueue& queue : shapeQueues) {
+            size_t queued = queue.packets();
+            size_t passing = 0;
+            for (size_t i = first; i < first + queued && (passed[i] || deniedPackets[i]); i++) {
+                if (flightRecorder_) {
+                    recordFlight(nowNs, types[i], passed[i] ? FlightDecision::Allowed : FlightDecision::Denied, last);
+                }
+                if (passed[i]) {
+                    if (aliases[i] != 0) {
+                        brokerAliases[aliases[i]].assign(topics[i].data(), topics[i].size());
+                    }
+                    passing++;
+                    continue;
+                }
+                if (passing > 0 && !sendQueued(queue, passing)) {
+                    return false;
+                }
+                passing = 0;
+                shapeQueuedBytes -= queue.packetSize(0);
+                shapeQueueGauge.fetch_sub(static_cast<int64_t>(queue.packetSize(0)), std::memory_order_relaxed);
+                queue.pop(1);
+                denied++;
+            }
+            if (passing > 0 && !sendQueued(queue, passing)) {
+                return false;
+            }
+            first += queued;
+        }
+        allowedCounter.fetch_add(released, std::memory_order_relaxed);
+        deniedCounter.fetch_add(denied, std::memory_order_relaxed);
+        
+        armShapeTimer(now, last);
+        return true;
+    };
+    
+    // The CONNECT, and anything sent right behind it, is already framed
+    bool pendingInput = framer.buffered() > 0;
+    
+    // Once the broker has answered the CONNECT the client may be idle for
+    // one and a half times its keepalive, as MQTT lets a server allow, and
+    // without a keepalive for as long as it likes. An MQTT 5 broker may
+    // set the keepalive in its CONNACK instead (Server Keep Alive).
+    bool sessionOpen = false;
+    auto openSession = [&](uint16_t keepAlive) {
+        sessionOpen = true;
+        auto idleLimit = std::chrono::milliseconds(keepAlive * 1500);
+        watch->arm(keepAlive > 0 ? "idle" : nullptr, watch->lastActivity() + idleLimit, idleLimit);
+    };
     
     while (running_) {
         FD_ZERO(&readfds);
-        FD_SET(clientSocket, &readfds);
         FD_SET(brokerSocket, &readfds);
+        int maxfd = brokerSocket;
+        
+        // Backpressure: with the shaping queue full the client is not read,
+        // so its TCP window closes instead of the queue growing
+        if (shapeQueuedBytes < shapeQueueLimit) {
+            FD_SET(clientSocket, &readfds);
+            maxfd = std::max(maxfd, clientSocket);
+        } else {
+            // A client held back by the proxy is not idle
+            watch->recordActivity(std::chrono::steady_clock::now());
+        }
+        if (wakeFd >= 0) {
+            FD_SET(wakeFd, &readfds);
+            maxfd = std::max(maxfd, wakeFd);
+        }
         
         struct timeval timeout;
-        timeout.tv_sec = 1;
+        timeout.tv_sec = pendingInput ? 0 : 1;
         timeout.tv_usec = 0;
         
-        int maxfd = std::max(clientSocket, brokerSocket);
         int activity = select(maxfd + 1, &readfds, nullptr, nullptr, &timeout);
         
-        if (activity <= 0) {
+        if (activity < 0 || (activity == 0 && !pendingInput)) {
             continue;
         }
         
+        // Shaping timer fired: release what the bucket has refilled for
+        if (wakeFd >= 0 && FD_ISSET(wakeFd, &readfds)) {
+            uint64_t wakeups;
+            ssize_t drained = read(wakeFd, &wakeups, sizeof(wakeups));
+            (void)drained;
+            shapeTimer = 0;
+            if (shapeQueuedBytes > 0 && !releaseShaped()) {
+                break;
+            }
+        }
+        
         // Data from client to broker
-        if (FD_ISSET(clientSocket, &readfds)) {
-            ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-            if (bytesRead <= 0) {
-                break; // Client disconnected
+        if (pendingInput || FD_ISSET(clientSocket, &readfds)) {
+            if (!pendingInput) {
+                ssize_t bytesRead = recv(clientSocket, framer.prepare(kReadSize), kReadSize, 0);
+                if (bytesRead <= 0) {
+                    break; // Client disconnected
+                }
+                framer.commit(bytesRead);
             }
+            pendingInput = false;
+            auto processingStart = std::chrono::steady_clock::now();
+            watch->recordActivity(processingStart);
             
-            // Check rate limit
-            if (!rateLimiter_->allow(info.ip, info.clientId)) {
-                metrics_->incrementCounter("blocked_messages");
-                std::cout << "Rate limit exceeded for " << info.clientId 
-                          << " (" << info.ip << "), dropping message" << std::endl;
-                continue; // Drop the message
+            // A read often holds many small packets; a partial one waits
+            // in the framer for the rest of its bytes
+            packets.clear();
+            MqttPacket packet;
+            while (framer.next(packet)) {
+                packets.push_back(packet);
+            }
+            if (framer.error()) {
+                if (framer.oversized() && info.protocolLevel >= mqtt::kProtocolV5) {
+                    const uint8_t disconnect[] = {mqtt::kDisconnect << 4, 1, mqtt::kPacketTooLarge};
+                    ssize_t bytesSent = send(clientSocket, disconnect, sizeof(disconnect), MSG_NOSIGNAL);
+                    (void)bytesSent;
+                }
+                malformedCounter.fetch_add(1, std::memory_order_relaxed);
+                logger_->log(LogLevel::Warn, framer.oversized() ? "packet_too_large" : "malformed_packet",
+                             {{"client", info.clientId}, {"ip", info.ip}});
+                break;
+            }
+            if (packets.empty()) {
+                continue;
+            }
+            
+            replies.clear();
+            if (!localQos2Ids.empty()) {
+                size_t kept = 0;
+                for (const auto& pending : packets) {
+                    uint16_t id;
+                    if (pending.type == mqtt::kPubrel && packetIdOf(pending, id) && localQos2Ids.erase(id) > 0) {
+                        appendAck(mqtt::kPubcomp, id, mqtt::kSuccess);
+                    } else {
+                        packets[kept++] = pending;
+                    }
+                }
+                packets.resize(kept);
             }
             
-            metrics_->incrementCounter("allowed_messages");
+            // One read of the limiter's clock serves the decisions, the
+            // flight recorder, the trace and log sampling
+            auto now = rateLimiter_->clock().now();
+            uint64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                now.time_since_epoch()).count();
             
-            // Forward to broker
-            ssize_t bytesSent = send(brokerSocket, buffer, bytesRead, 0);
-            if (bytesSent != bytesRead) {
+            if (traceWriter_) {
+                for (const auto& traced : packets) {
+                    traceWriter_->record(nowNs, info.ip, info.clientId, traced.type,
+                                         static_cast<uint32_t>(traced.size));
+                }
+            }
+            
+            // Every PUBLISH topic is validated before anything is forwarded.
+            // Topics are viewed in place in the framer's buffer, not copied.
+            uint8_t malformed = mqtt::kSuccess;
+            topics.clear();
+            aliases.clear();
+            retiredAliases.clear();
+            rewrittenPackets.clear();
+            size_t kept = 0;
+            for (const auto& pending : packets) {
+                std::string_view topic;
+                uint16_t alias = 0;
+                if (pending.type == mqtt::kPublish) {
+                    // Only MQTT 5 may send an empty name, with a topic alias
+                    // the client has already set
+                    PublishView publish;
+                    if (!parsePublish(pending, info.protocolLevel, publish) ||
+                        !topicAliasOf(publish.properties, alias)) {
+                        malformed = mqtt::kMalformedPacket;
+                    } else if (publish.topic.empty() ? info.protocolLevel < mqtt::kProtocolV5
+                                                     : !isValidTopicName(publish.topic)) {
+                        malformed = mqtt::kTopicNameInvalid;
+                    } else if (alias > topicAliasMaximum || (publish.topic.empty() && alias == 0)) {
+                        malformed = mqtt::kTopicAliasInvalid;
+                    } else {
+                        topic = resolveTopic(publish.topic, alias);
+                        if (topic.empty()) {
+                            malformed = mqtt::kTopicAliasInvalid;
+                        }
+                    }
+                    if (malformed != mqtt::kSuccess) {
+                        break;
+                    }
+                } else if (pending.type == mqtt::kDisconnect) {
+                    DisconnectView disconnect;
+                    if (!parseDisconnect(pending, info.protocolLevel, disconnect) ||
+                        !validProperties(disconnect.properties)) {
+                        malformed = mqtt::kMalformedPacket;
+                        break;
+                    }
+                }
+                packets[kept++] = pending;
+                topics.push_back(topic);
+                aliases.push_back(alias);
+            }
+            packets.resize(kept);
+            
+            if (malformed != mqtt::kSuccess) {
+                // Nothing from this read is forwarded
+                if (info.protocolLevel >= mqtt::kProtocolV5) {
+                    const uint8_t disconnect[] = {mqtt::kDisconnect << 4, 1, malformed};
+                    ssize_t bytesSent = send(clientSocket, disconnect, sizeof(disconnect), MSG_NOSIGNAL);
+                    (void)bytesSent;
+                }
+                malformedCounter.fetch_add(1, std::memory_order_relaxed);
+                logger_->log(LogLevel::Warn, "malformed_packet",
+                             {{"client", info.clientId}, {"ip", info.ip}, {"reason", static_cast<int>(malformed)}});
+                break;
+            }
+            
+            // One limiter call for the whole read, each packet charged to
+            // its type's budget. Shaped packets keep their order per bucket:
+            // once one waits, later ones drawing from the same bucket queue
+            // behind it, and while any are waiting new ones queue undecided.
+            // Packets with a bucket of their own pass them by.
+            types.clear();
+            sizes.clear();
+            for (const auto& decided : packets) {
+                types.push_back(decided.type);
+                sizes.push_back(static_cast<uint32_t>(decided.size));
+            }
+            reservePassed(packets.size());
+            
+            RateLimitDecision last;
+            size_t allowed = 0;
+            if (!shaping) {
+                allowed = rateLimiter_->allowPackets(limiterHandle, types.data(), sizes.data(),
+                                                     matchTopics ? topics.data() : nullptr, types.size(),
+                                                     passed.get(), now, &last, deniedPackets.get());
+            } else {
+                allowed = rateLimiter_->allowPacketsInOrder(limiterHandle, types.data(), sizes.data(),
+                                                            matchTopics ? topics.data() : nullptr, types.size(),
+                                                            passed.get(), now, &last, waitingBuckets(),
+                                                            deniedPackets.get());
+            }
+            
+            if (flightRecorder_) {
+                FlightDecision rejection = shaping ? FlightDecision::Delayed
+                                         : last.blocked ? FlightDecision::Blocked
+                                                        : FlightDecision::Limited;
+                for (size_t i = 0; i < packets.size(); i++) {
+                    recordFlight(nowNs, packets[i].type,
+                                 passed[i] ? FlightDecision::Allowed
+                                 : deniedPackets[i] ? FlightDecision::Denied
+                                                    : rejection,
+                                 last);
+                }
+            }
+            
+            // Allowed packets to the front, in order; denied ones are
+            // answered as reject_action says and dropped
+            rejectedPackets.clear();
+            rejectedTopics.clear();
+            size_t denied = 0;
+            kept = 0;
+            for (size_t i = 0; i < packets.size(); i++) {
+                if (passed[i]) {
+                    packets[kept] = packets[i];
+                    topics[kept] = topics[i];
+                    aliases[kept] = aliases[i];
+                    kept++;
+                } else if (deniedPackets[i]) {
+                    if (rejectAction == RejectAction::SilentAck) {
+                        ackDropped(packets[i], mqtt::kSuccess);
+                    } else if (rejectAction == RejectAction::ReasonCode) {
+                        ackDropped(packets[i], mqtt::kNotAuthorized);
+                    }
+                    denied++;
+                } else {
+                    rejectedPackets.push_back(packets[i]);
+                    rejectedTopics.push_back(topics[i]);
+                }
+            }
+            packets.resize(kept);
+            deniedCounter.fetch_add(denied, std::memory_order_relaxed);
+            size_t rejected = rejectedPackets.size();
+            
+            if (rejected > 0 && shaping) {
+                // The queue may overshoot its bound by one read before
+                // backpressure stops further reads. Publishes that only
+                // carry an alias are queued with their topic spelled out,
+                // as the alias may be set to another by the time they go.
+                for (size_t i = 0; i < rejectedPackets.size(); i++) {
+                    MqttPacket queued = rejectedPackets[i];
+                    PublishView publish;
+                    if (!rejectedTopics[i].empty() && info.protocolLevel >= mqtt::kProtocolV5 &&
+                        parsePublish(queued, info.protocolLevel, publish) && publish.topic.empty()) {
+                        rewrittenPackets.emplace_back();
+                        rewritePublishTopic(queued, rejectedTopics[i], rewrittenPackets.back());
+                        queued.data = rewrittenPackets.back().data();
+                        queued.size = rewrittenPackets.back().size();
+                    }
+                    shapeQueues[policy.bucketOf(classifyPacket(queued.type))].push(queued.data, queued.size);
+                    shapeQueuedBytes += queued.size;
+                    shapeQueueGauge.fetch_add(static_cast<int64_t>(queued.size), std::memory_order_relaxed);
+                }
+                shapedCounter.fetch_add(rejected, std::memory_order_relaxed);
+                armShapeTimer(now, last);
+            } else if (rejected > 0) {
+                blockedCounter.fetch_add(rejected, std::memory_order_relaxed);
+                if (rejectAction == RejectAction::SilentAck || rejectAction == RejectAction::ReasonCode) {
+                    // Over the byte budget is a quota; a compliant client
+                    // backs off either way
+                    uint8_t reason = rejectAction != RejectAction::ReasonCode ? mqtt::kSuccess
+                                   : last.overQuota ? mqtt::kQuotaExceeded
+                                                    : mqtt::kMessageRateTooHigh;
+                    for (const auto& dropped : rejectedPackets) {
+                        ackDropped(dropped, reason);
+                    }
+                }
+                // One line per client per interval however hard it floods
+                if (dropSampler.admit(nowNs)) {
+                    logger_->log(LogLevel::Warn, "rate_limited",
+                                 {{"client", info.clientId}, {"ip", info.ip},
+                                  {"blocked", last.blocked}, {"suppressed", dropSampler.suppressed()}});
+                }
+            }
+            
+            if (!replies.empty()) {
+                ssize_t bytesSent = send(clientSocket, replies.data(), replies.size(), MSG_NOSIGNAL);
+                if (bytesSent != static_cast<ssize_t>(replies.size())) {
+                    break; // Client connection failed
+                }
+            }
+            
+            if ((denied > 0 || (rejected > 0 && !shaping)) && rejectAction == RejectAction::Disconnect) {
+                // MQTT 5 clients are told why; older ones just see the close
+                if (info.protocolLevel >= mqtt::kProtocolV5) {
+                    const uint8_t disconnect[] = {mqtt::kDisconnect << 4, 1,
+                                                  denied > 0 ? mqtt::kNotAuthorized
+                                                  : last.overQuota ? mqtt::kQuotaExceeded
+                                                                   : mqtt::kMessageRateTooHigh};
+                    ssize_t bytesSent = send(clientSocket, disconnect, sizeof(disconnect), MSG_NOSIGNAL);
+                    (void)bytesSent;
+                }
+                rejectDisconnectCounter.fetch_add(1, std::memory_order_relaxed);
+                logger_->log(LogLevel::Warn, "rate_limit_disconnect", {{"client", info.clientId}, {"ip", info.ip}});
+                break;
+            }
+            
+            if (allowed == 0) {
+                continue; // Dropped or queued
+            }
+            
+            allowedCounter.fetch_add(allowed, std::memory_order_relaxed);
+            
+            // An alias the broker would resolve to another topic, its
+            // setting having been dropped, goes with the topic spelled out
+            for (size_t i = 0; i < allowed; i++) {
+                if (aliases[i] != 0 && !forwardAlias(aliases[i], topics[i], packets[i])) {
+                    rewrittenPackets.emplace_back();
+                    rewritePublishTopic(packets[i], topics[i], rewrittenPackets.back());
+                    viewPacket(rewrittenPackets.back().data(), rewrittenPackets.back().size(), packets[i]);
+                    brokerAliases[aliases[i]].assign(topics[i].data(), topics[i].size());
+                }
+            }
+            
+            // Allowed packets sit in the framer, usually contiguous: one send
+            if (!sendPackets(brokerSocket, packets.data(), allowed)) {
                 break; // Broker connection failed
             }
+            
+            std::chrono::duration<double> processing = std::chrono::steady_clock::now() - processingStart;
+            processingHistogram.observe(processing.count());
+        }
+        
+        // Before MQTT 5 the broker's first bytes are its CONNACK
+        if (!sessionOpen && !connackFramer && FD_ISSET(brokerSocket, &readfds)) {
+            openSession(info.keepAlive);
         }
         
         // Data from broker to client
-        if (FD_ISSET(brokerSocket, &readfds)) {
+        if (FD_ISSET(brokerSocket, &readfds) && connackFramer) {
+            ssize_t bytesRead = recv(brokerSocket, connackFramer->prepare(kReadSize), kReadSize, 0);
+            if (bytesRead <= 0) {
+                break; // Broker disconnected
+            }
+            connackFramer->commit(bytesRead);
+            MqttPacket first;
+            if (!connackFramer->next(first)) {
+                if (connackFramer->error()) {
+                    break;
+                }
+                continue;
+            }
+            
+            // A failed or malformed CONNACK goes to the client unchanged
+            std::vector<uint8_t> outgoing;
+            if (connackLimits.empty() || !rewriteConnack(first, connackLimits, outgoing)) {
+                outgoing.assign(first.data, first.data + first.size);
+            }
+            
+            // The aliases the client was allowed and the keepalive it must
+            // keep, as it will see them
+            MqttPacket sent;
+            ConnackView connack;
+            uint16_t keepAlive = info.keepAlive;
+            if (viewPacket(outgoing.data(), outgoing.size(), sent) &&
+                parseConnack(sent, info.protocolLevel, connack)) {
+                PropertyReader reader(connack.properties);
+                MqttProperty property;
+                while (reader.next(property)) {
+                    if (property.id == mqtt::kPropertyTopicAliasMaximum) {
+                        topicAliasMaximum = static_cast<uint16_t>(property.value);
+                    } else if (property.id == mqtt::kPropertyServerKeepAlive) {
+                        keepAlive = static_cast<uint16_t>(property.value);
+                    }
+                }
+                clientAliases.resize(topicAliasMaximum + 1);
+                brokerAliases.resize(topicAliasMaximum + 1);
+            }
+            openSession(keepAlive);
+            outgoing.insert(outgoing.end(), connackFramer->pending(),
+                            connackFramer->pending() + connackFramer->buffered());
+            connackFramer.reset();
+            ssize_t bytesSent = send(clientSocket, outgoing.data(), outgoing.size(), MSG_NOSIGNAL);
+            if (bytesSent != static_cast<ssize_t>(outgoing.size())) {
+                break; // Client connection failed
+            }
+        } else if (FD_ISSET(brokerSocket, &readfds)) {
             ssize_t bytesRead = recv(brokerSocket, buffer, sizeof(buffer), 0);
             if (bytesRead <= 0) {
                 break; // Broker disconnected
             }
             
             // Forward to client
-            ssize_t bytesSent = send(clientSocket, buffer, bytesRead, 0);
+            ssize_t bytesSent = send(clientSocket, buffer, bytesRead, MSG_NOSIGNAL);
             if (bytesSent != bytesRead) {
                 break; // Client connection failed
             }
         }
     }
     
+    if (dropSampler.pending() > 0) {
+        logger_->log(LogLevel::Warn, "rate_limited_summary",
+                     {{"client", info.clientId}, {"ip", info.ip}, {"suppressed", dropSampler.pending()}});
+    }
+    
+    if (wakeFd >= 0) {
+        // cancel() waits out a callback in flight, so the fd is unused after it
+        if (shapeTimer != 0) {
+            timerWheel_->cancel(shapeTimer);
+        }
+        close(wakeFd);
+        
+        // Packets still waiting never reach the broker
+        for (const PacketQueue& queue : shapeQueues) {
+            blockedCounter.fetch_add(queue.packets(), std::memory_order_relaxed);
+        }
+        shapeQueueGauge.fetch_sub(static_cast<int64_t>(shapeQueuedBytes), std::memory_order_relaxed);
+    }
+    
     close(brokerSocket);
 }
 
-int ThrottleBox::connectToBroker() {
+TimerWheel::TimerId ThrottleBox::scheduleTimer(std::chrono::steady_clock::time_point deadline,
+                                               TimerWheel::Callback callback) {
+    TimerWheel::TimerId id = timerWheel_->schedule(deadline, std::move(callback));
+    {
+        // Taking the lock orders this wake-up after the timer thread's
+        // pending() check, so it cannot be missed
+        std::lock_guard<std::mutex> lock(timerWakeMutex_);
+    }
+    timerWake_.notify_one();
+    return id;
+}
+
+void ThrottleBox::timerLoop() {
+    while (running_) {
+        {
+            // Tick while shaping timers are pending, otherwise sleep until one
+            // is scheduled or the next connection deadline tick
+            std::unique_lock<std::mutex> lock(timerWakeMutex_);
+            if (timerWheel_->pending() > 0) {
+                timerWake_.wait_for(lock, timerWheel_->tick());
+            } else {
+                timerWake_.wait_for(lock, deadlineWheel_->tick());
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        timerWheel_->advance(now);
+        deadlineWheel_->advance(now);
+    }
+}
+
+int ThrottleBox::connectToBroker(std::chrono::steady_clock::time_point deadline) {
     int brokerSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (brokerSocket < 0) {
         return -1;
@@ -275,11 +1237,34 @@ int ThrottleBox::connectToBroker() {
         return -1;
     }
     
-    if (connect(brokerSocket, (struct sockaddr*)&brokerAddr, sizeof(brokerAddr)) < 0) {
+    // Non-blocking, so an unreachable broker costs no more than the time
+    // left: a deadline can end a blocked read, but not a connect()
+    int flags = fcntl(brokerSocket, F_GETFL, 0);
+    if (flags < 0 || fcntl(brokerSocket, F_SETFL, flags | O_NONBLOCK) < 0) {
         close(brokerSocket);
         return -1;
     }
+    if (connect(brokerSocket, (struct sockaddr*)&brokerAddr, sizeof(brokerAddr)) < 0) {
+        if (errno != EINPROGRESS) {
+            close(brokerSocket);
+            return -1;
+        }
+        struct pollfd writable = {brokerSocket, POLLOUT, 0};
+        int ready;
+        do {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            ready = poll(&writable, 1, static_cast<int>(std::max<int64_t>(left.count(), 0)));
+        } while (ready < 0 && errno == EINTR);
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (ready <= 0 || getsockopt(brokerSocket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            close(brokerSocket);
+            return -1;
+        }
+    }
     
+    // Forwarding blocks on the socket
+    fcntl(brokerSocket, F_SETFL, flags);
     return brokerSocket;
 }
 
@@ -0,0 +1,96 @@
+#include "throttlebox/timer_wheel.hpp"
+#include <algorithm>
+
+namespace throttlebox {
+
+TimerWheel::TimerWheel(time_point start, std::chrono::nanoseconds tick, size_t slots)
+    : start_(start), tick_(std::max(tick, std::chrono::nanoseconds(1))),
+      slots_(std::max<size_t>(slots, 1)) {
+}
+
+uint64_t TimerWheel::tickOf(time_point t) const {
+    if (t <= start_) {
+        return 0;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(t - start_);
+    return static_cast<uint64_t>((elapsed.count() + tick_.count() - 1) / tick_.count());
+}
+
+TimerWheel::TimerId TimerWheel::schedule(time_point deadline, Callback callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    // Never into a tick that has already been swept
+    uint64_t deadlineTick = std::max(tickOf(deadline), currentTick_ + 1);
+    size_t slot = deadlineTick % slots_.size();
+    
+    TimerId id = nextId_++;
+    slots_[slot].push_back(Timer{id, deadlineTick, std::move(callback)});
+    slotOf_[id] = slot;
+    return id;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+    std::lock_guard<std::mutex> fireLock(fireMutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    
+    auto it = slotOf_.find(id);
+    if (it == slotOf_.end()) {
+        return false;
+    }
+    
+    auto& slot = slots_[it->second];
+    for (size_t i = 0; i < slot.size(); i++) {
+        if (slot[i].id == id) {
+            slot[i] = std::move(slot.back());
+            slot.pop_back();
+            break;
+        }
+    }
+    slotOf_.erase(it);
+    return true;
+}
+
+size_t TimerWheel::advance(time_point now) {
+    std::lock_guard<std::mutex> fireLock(fireMutex_);
+    std::vector<Callback> due;
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        
+        // Timers due exactly at now count, so round down here
+        uint64_t nowTick = now <= start_ ? 0 : static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_).count() / tick_.count());
+        if (nowTick <= currentTick_) {
+            return 0;
+        }
+        
+        // After a long stall every slot is visited once, not once per tick
+        uint64_t steps = std::min<uint64_t>(nowTick - currentTick_, slots_.size());
+        for (uint64_t step = 1; step <= steps; step++) {
+            auto& slot = slots_[(currentTick_ + step) % slots_.size()];
+            for (size_t i = 0; i < slot.size();) {
+                if (slot[i].deadlineTick <= nowTick) {
+                    slotOf_.erase(slot[i].id);
+                    due.push_back(std::move(slot[i].callback));
+                    slot[i] = std::move(slot.back());
+                    slot.pop_back();
+                } else {
+                    i++;
+                }
+            }
+        }
+        currentTick_ = nowTick;
+    }
+    
+    for (auto& callback : due) {
+        callback();
+    }
+    return due.size();
+}
+
+size_t TimerWheel::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return slotOf_.size();
+}
+
+} // namespace throttlebox
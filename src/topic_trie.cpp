@@ -0,0 +1,132 @@
+#include "throttlebox/topic_trie.hpp"
+#include <cmath>
+#include <sstream>
+
+namespace throttlebox {
+
+double TopicRule::capacity() const {
+    return burstSize > 0 ? burstSize : std::ceil(maxMessagesPerSec);
+}
+
+bool isValidTopicFilter(std::string_view filter) {
+    if (filter.empty()) {
+        return false;
+    }
+    
+    size_t start = 0;
+    while (true) {
+        size_t slash = filter.find('/', start);
+        bool last = slash == std::string_view::npos;
+        std::string_view level = filter.substr(start, last ? std::string_view::npos : slash - start);
+        
+        if (level.find_first_of("+#") != std::string_view::npos) {
+            if (level.size() != 1) {
+                return false;   // Wildcards must fill the whole level
+            }
+            if (level[0] == '#' && !last) {
+                return false;   // '#' only as the last level
+            }
+        }
+        if (last) {
+            return true;
+        }
+        start = slash + 1;
+    }
+}
+
+bool parseTopicRules(const std::string& text, std::vector<TopicRule>& rules, std::string& error) {
+    std::stringstream entries(text);
+    std::string entry;
+    
+    while (std::getline(entries, entry, ';')) {
+        std::stringstream fields(entry);
+        std::string filter, limit, extra;
+        if (!(fields >> filter)) {
+            continue;   // Empty entry, e.g. a trailing ';'
+        }
+        
+        if (!(fields >> limit) || (fields >> extra)) {
+            error = "Topic rule needs a filter and a rate or 'deny': " + entry;
+            return false;
+        }
+        if (!isValidTopicFilter(filter)) {
+            error = "Invalid topic filter: " + filter;
+            return false;
+        }
+        
+        TopicRule rule;
+        rule.filter = filter;
+        if (limit == "deny") {
+            rule.deny = true;
+        } else {
+            try {
+                size_t slash = limit.find('/');
+                rule.maxMessagesPerSec = std::stod(limit.substr(0, slash));
+                if (slash != std::string::npos) {
+                    rule.burstSize = std::stoi(limit.substr(slash + 1));
+                }
+            } catch (const std::exception&) {
+                error = "Invalid topic rule limit: " + limit;
+                return false;
+            }
+            if (rule.maxMessagesPerSec <= 0 || rule.burstSize < 0 || rule.capacity() < 1) {
+                error = "Topic rule limit must allow at least one message: " + limit;
+                return false;
+            }
+        }
+        rules.push_back(rule);
+    }
+    return true;
+}
+
+TopicTrie::TopicTrie(const std::vector<TopicRule>& rules) {
+    if (rules.empty()) {
+        return;
+    }
+    nodes_.emplace_back();
+    
+    for (uint32_t index = 0; index < rules.size(); index++) {
+        std::string_view filter = rules[index].filter;
+        uint32_t node = 0;
+        
+        while (true) {
+            size_t slash = filter.find('/');
+            std::string_view level = filter.substr(0, slash);
+            
+            if (level == "#") {
+                nodes_[node].multiRules.push_back(index);
+                break;
+            }
+            node = addChild(node, level);
+            if (slash == std::string_view::npos) {
+                nodes_[node].rules.push_back(index);
+                break;
+            }
+            filter = filter.substr(slash + 1);
+        }
+    }
+}
+
+uint32_t TopicTrie::addChild(uint32_t parent, std::string_view level) {
+    if (level == "+") {
+        if (nodes_[parent].plusChild == 0) {
+            uint32_t child = static_cast<uint32_t>(nodes_.size());
+            nodes_.emplace_back();
+            nodes_[parent].plusChild = child;
+        }
+        return nodes_[parent].plusChild;
+    }
+    
+    auto found = nodes_[parent].children.find(level);
+    if (found != nodes_[parent].children.end()) {
+        return found->second;
+    }
+    
+    uint32_t child = static_cast<uint32_t>(nodes_.size());
+    levels_.emplace_back(level);
+    nodes_.emplace_back();
+    nodes_[parent].children.emplace(levels_.back(), child);
+    return child;
+}
+
+} // namespace throttlebox
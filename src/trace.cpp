@@ -0,0 +1,167 @@
+#include "throttlebox/trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace throttlebox {
+
+namespace {
+
+const char kTraceMagic[8] = {'T', 'B', 'T', 'R', 'A', 'C', 'E', '\0'};
+const size_t kFlushBytes = 64 * 1024;
+const size_t kEventFixedBytes = 16;
+
+void put16(std::string& out, uint16_t value) {
+    out += static_cast<char>(value & 0xFF);
+    out += static_cast<char>((value >> 8) & 0xFF);
+}
+
+void put32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+void put64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+uint16_t get16(const unsigned char* in) {
+    return static_cast<uint16_t>(in[0] | (in[1] << 8));
+}
+
+uint32_t get32(const unsigned char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= static_cast<uint32_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t get64(const unsigned char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= static_cast<uint64_t>(in[i]) << (8 * i);
+    }
+    return value;
+}
+
+} // namespace
+
+TraceWriter::TraceWriter(const std::string& path) {
+    file_ = std::fopen(path.c_str(), "wb");
+    if (!file_) {
+        return;
+    }
+
+    buffer_.reserve(kFlushBytes + 512);
+    buffer_.append(kTraceMagic, sizeof(kTraceMagic));
+    put32(buffer_, kVersion);
+    put32(buffer_, 0);
+    put64(buffer_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch()).count());
+    put64(buffer_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+TraceWriter::~TraceWriter() {
+    if (file_) {
+        flush();
+        std::fclose(file_);
+    }
+}
+
+void TraceWriter::record(uint64_t timestampNs, const std::string& ip, const std::string& clientId,
+                         uint8_t packetType, uint32_t size) {
+    if (!file_) {
+        return;
+    }
+
+    size_t ipLength = std::min<size_t>(ip.size(), 0xFF);
+    size_t clientIdLength = std::min<size_t>(clientId.size(), 0xFFFF);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    put64(buffer_, timestampNs);
+    put32(buffer_, size);
+    buffer_ += static_cast<char>(packetType);
+    buffer_ += static_cast<char>(ipLength);
+    put16(buffer_, static_cast<uint16_t>(clientIdLength));
+    buffer_.append(ip.data(), ipLength);
+    buffer_.append(clientId.data(), clientIdLength);
+    events_++;
+
+    if (buffer_.size() >= kFlushBytes) {
+        flushLocked();
+    }
+}
+
+void TraceWriter::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flushLocked();
+    if (file_) {
+        std::fflush(file_);
+    }
+}
+
+void TraceWriter::flushLocked() {
+    if (file_ && !buffer_.empty()) {
+        std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+    }
+    buffer_.clear();
+}
+
+TraceReader::TraceReader(const std::string& path) {
+    file_ = std::fopen(path.c_str(), "rb");
+    if (!file_) {
+        return;
+    }
+
+    unsigned char header[TraceWriter::kHeaderBytes];
+    if (std::fread(header, 1, sizeof(header), file_) != sizeof(header) ||
+        std::memcmp(header, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+        get32(header + 8) != TraceWriter::kVersion) {
+        std::fclose(file_);
+        file_ = nullptr;
+        return;
+    }
+
+    header_.version = get32(header + 8);
+    header_.steadyStartNs = get64(header + 16);
+    header_.wallStartNs = get64(header + 24);
+}
+
+TraceReader::~TraceReader() {
+    if (file_) {
+        std::fclose(file_);
+    }
+}
+
+bool TraceReader::next(TraceEvent& event) {
+    if (!file_) {
+        return false;
+    }
+
+    unsigned char fixed[kEventFixedBytes];
+    if (std::fread(fixed, 1, sizeof(fixed), file_) != sizeof(fixed)) {
+        return false;
+    }
+
+    event.timestampNs = get64(fixed);
+    event.size = get32(fixed + 8);
+    event.packetType = fixed[12];
+    size_t ipLength = fixed[13];
+    size_t clientIdLength = get16(fixed + 14);
+
+    event.ip.resize(ipLength);
+    event.clientId.resize(clientIdLength);
+    if ((ipLength > 0 && std::fread(&event.ip[0], 1, ipLength, file_) != ipLength) ||
+        (clientIdLength > 0 && std::fread(&event.clientId[0], 1, clientIdLength, file_) != clientIdLength)) {
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace throttlebox
@@ -160,6 +160,428 @@ void testClientPolicyFallback() {
     std::cout << "Client policy fallback test PASSED" << std::endl;
 }
 
+void testMetricsConfig() {
+    std::cout << "Testing metrics configuration..." << std::endl;
+    
+    std::string filename = "test_metrics_config.yaml";
+    std::ofstream file(filename);
+    file << "metrics_port: 9191\n";
+    file << "statsd_host: 10.0.0.5\n";
+    file << "statsd_port: 8126\n";
+    file << "statsd_flush_interval_ms: 2000\n";
+    file << "statsd_flavor: dogstatsd\n";
+    file << "statsd_tags: site:edge7\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load metrics config");
+    
+    auto metrics = config.getMetricsSettings();
+    assert(metrics.httpPort == 9191);
+    assert(metrics.statsdEnabled);
+    assert(metrics.statsd.host == "10.0.0.5");
+    assert(metrics.statsd.port == 8126);
+    assert(metrics.statsd.flushIntervalMs == 2000);
+    assert(metrics.statsd.dogstatsd);
+    assert(metrics.statsd.tags == "site:edge7");
+    
+    // Push is off unless a host is configured
+    Config defaults;
+    assert(!defaults.getMetricsSettings().statsdEnabled);
+    assert(defaults.getMetricsSettings().httpPort == 9090);
+    
+    // Host names and IPv6 addresses are refused at load, not at the first push
+    for (const char* host : {"statsd.local", "::1"}) {
+        std::ofstream named(filename);
+        named << "statsd_host: " << host << "\n";
+        named.close();
+        Config refused;
+        bool loaded = refused.loadFromFile(filename);
+        assert(!loaded && "statsd_host must be an IPv4 address");
+    }
+    
+    std::remove(filename.c_str());
+    
+    std::cout << "Metrics configuration test PASSED" << std::endl;
+}
+
+void testClockSourceConfig() {
+    std::cout << "Testing clock source configuration..." << std::endl;
+    
+    std::string filename = "test_clock_config.yaml";
+    std::ofstream file(filename);
+    file << "clock_source: coarse\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load clock config");
+    assert(config.getProxySettings().clockSource == ClockSource::Coarse);
+    assert(Config().getProxySettings().clockSource == ClockSource::Monotonic);
+    
+    std::ofstream bad(filename);
+    bad << "clock_source: sundial\n";
+    bad.close();
+    
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Unknown clock source should be rejected");
+    
+    // Coarse time shares the monotonic epoch, so both can be compared
+    auto coarse = makeClock(ClockSource::Coarse)->now();
+    auto precise = makeClock(ClockSource::Monotonic)->now();
+    assert(precise - coarse < std::chrono::milliseconds(50) && coarse - precise < std::chrono::milliseconds(50));
+    
+    std::remove(filename.c_str());
+    
+    std::cout << "Clock source configuration test PASSED" << std::endl;
+}
+
+void testShapeModeConfig() {
+    std::cout << "Testing shape mode configuration..." << std::endl;
+    
+    std::string filename = "test_shape_config.json";
+    std::ofstream file(filename);
+    file << "{\n  \"mode\": \"shape\",\n  \"shape_queue_bytes\": 65536\n}\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load shape config");
+    assert(config.getGlobalLimits().mode == LimitMode::Shape);
+    assert(config.getGlobalLimits().shapeQueueBytes == 65536);
+    assert(Config().getGlobalLimits().mode == LimitMode::Drop);
+    
+    std::ofstream bad(filename);
+    bad << "{\n  \"mode\": \"queue\"\n}\n";
+    bad.close();
+    
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Unknown mode should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::cout << "Shape mode configuration test PASSED" << std::endl;
+}
+
+void testRejectActionConfig() {
+    std::cout << "Testing reject action configuration..." << std::endl;
+    
+    std::string filename = "test_reject_action.json";
+    std::ofstream file(filename);
+    file << "{\n  \"reject_action\": \"reason_code\"\n}\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load reject_action");
+    assert(config.getGlobalLimits().rejectAction == RejectAction::ReasonCode);
+    assert(Config().getGlobalLimits().rejectAction == RejectAction::Drop);
+    
+    std::ofstream bad(filename);
+    bad << "{\n  \"reject_action\": \"ignore\"\n}\n";
+    bad.close();
+    
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Unknown reject action should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::cout << "Reject action configuration test PASSED" << std::endl;
+}
+
+void testPacketBudgetConfig() {
+    std::cout << "Testing per-packet-type and byte budget configuration..." << std::endl;
+    
+    std::string filename = "test_budget_config.yaml";
+    std::ofstream file(filename);
+    file << "burst_size: 20\n"
+         << "ping_rate: 2\n"
+         << "ping_burst: 3\n"
+         << "subscribe_weight: 5\n"
+         << "max_bytes_per_sec: 65536\n"
+         << "byte_burst: 262144\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load packet budgets");
+    const RateLimitPolicy& policy = config.getGlobalLimits();
+    assert(policy.budget(PacketClass::Ping).maxPerSec == 2.0);
+    assert(policy.budget(PacketClass::Ping).burstSize == 3);
+    assert(policy.budget(PacketClass::Subscribe).weight == 5.0);
+    assert(policy.budget(PacketClass::Publish).maxPerSec == 0.0);
+    assert(policy.budget(PacketClass::Publish).weight == 1.0);
+    assert(policy.maxBytesPerSec == 65536.0 && policy.byteCapacity() == 262144.0);
+    assert(Config().getGlobalLimits().maxBytesPerSec == 0.0);
+    
+    // A packet that costs more than its bucket holds could never pass
+    std::ofstream bad(filename);
+    bad << "burst_size: 20\nsubscribe_weight: 50\n";
+    bad.close();
+    
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Weight above bucket capacity should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::cout << "Per-packet-type and byte budget configuration test PASSED" << std::endl;
+}
+
+void testTopicRulesConfig() {
+    std::cout << "Testing topic rules configuration..." << std::endl;
+    
+    std::string filename = "test_topic_rules.yaml";
+    std::ofstream file(filename);
+    file << "topic_rules: factory/+/alarm 1; telemetry/# 50/100\n"
+         << "topic_rules: firmware/# deny\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load topic rules");
+    const auto& rules = config.getTopicRules();
+    assert(rules.size() == 3);
+    assert(rules[0].filter == "factory/+/alarm" && rules[0].maxMessagesPerSec == 1.0);
+    assert(rules[1].burstSize == 100);
+    assert(rules[2].filter == "firmware/#" && rules[2].deny);
+    assert(Config().getTopicRules().empty());
+    
+    std::ofstream bad(filename);
+    bad << "topic_rules: firmware/#/image deny\n";
+    bad.close();
+    
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Invalid topic filter should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::string jsonName = "test_topic_rules.json";
+    std::ofstream json(jsonName);
+    json << "{\n  \"topic_rules\": \"sensors/+/temp 5; $SYS/# deny\"\n}\n";
+    json.close();
+    
+    Config fromJson;
+    assert(fromJson.loadFromFile(jsonName) && "Should load topic rules from JSON");
+    assert(fromJson.getTopicRules().size() == 2 && fromJson.getTopicRules()[1].deny);
+    
+    std::remove(jsonName.c_str());
+    
+    std::cout << "Topic rules configuration test PASSED" << std::endl;
+}
+
+void testMqtt5LimitsConfig() {
+    std::cout << "Testing MQTT 5 CONNACK limits configuration..." << std::endl;
+    
+    assert(Config().getProxySettings().receiveMaximum == 0);
+    assert(Config().getProxySettings().maxPacketSize == 1024 * 1024);
+    assert(Config().getProxySettings().topicAliasMaximum == 0);
+    
+    std::string filename = "test_mqtt5_limits.yaml";
+    std::ofstream file(filename);
+    file << "receive_maximum: 20\nmax_packet_size: 65536\ntopic_alias_maximum: 16\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load MQTT 5 limits");
+    assert(config.getProxySettings().receiveMaximum == 20);
+    assert(config.getProxySettings().maxPacketSize == 65536);
+    assert(config.getProxySettings().topicAliasMaximum == 16);
+    
+    std::ofstream bad(filename);
+    bad << "receive_maximum: 70000\n";
+    bad.close();
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "receive_maximum over 65535 should be rejected");
+    
+    std::ofstream badAliases(filename);
+    badAliases << "topic_alias_maximum: -1\n";
+    badAliases.close();
+    Config negative;
+    assert(!negative.loadFromFile(filename) && "A negative topic_alias_maximum should be rejected");
+    
+    std::ofstream tiny(filename);
+    tiny << "max_packet_size: 10\n";
+    tiny.close();
+    Config tooSmall;
+    assert(!tooSmall.loadFromFile(filename) && "A max_packet_size below a CONNECT should be rejected");
+    
+    std::ofstream unlimited(filename);
+    unlimited << "max_packet_size: 0\n";
+    unlimited.close();
+    Config optedOut;
+    assert(optedOut.loadFromFile(filename) && "max_packet_size: 0 should opt out of the limit");
+    assert(optedOut.getProxySettings().maxPacketSize == 0);
+    
+    std::remove(filename.c_str());
+    
+    std::string jsonName = "test_mqtt5_limits.json";
+    std::ofstream json(jsonName);
+    json << "{\n  \"receive_maximum\": 5,\n  \"max_packet_size\": 1024,\n  \"topic_alias_maximum\": 8\n}\n";
+    json.close();
+    
+    Config fromJson;
+    assert(fromJson.loadFromFile(jsonName) && "Should load MQTT 5 limits from JSON");
+    assert(fromJson.getProxySettings().receiveMaximum == 5 && fromJson.getProxySettings().maxPacketSize == 1024);
+    assert(fromJson.getProxySettings().topicAliasMaximum == 8);
+    
+    std::remove(jsonName.c_str());
+    
+    std::cout << "MQTT 5 CONNACK limits configuration test PASSED" << std::endl;
+}
+
+void testIdentityKeyConfig() {
+    std::cout << "Testing identity key configuration..." << std::endl;
+    
+    IdentityKey defaults = Config().getIdentityKey();
+    assert(defaults.clientId && !defaults.username && !defaults.ip);
+    
+    std::string filename = "test_identity_key.yaml";
+    std::ofstream file(filename);
+    file << "identity_key: username+ip\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load identity_key");
+    assert(!config.getIdentityKey().clientId && config.getIdentityKey().username && config.getIdentityKey().ip);
+    
+    std::ofstream bad(filename);
+    bad << "identity_key: certificate\n";
+    bad.close();
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Unknown identity_key should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::string jsonName = "test_identity_key.json";
+    std::ofstream json(jsonName);
+    json << "{\n  \"identity_key\": \"ip\"\n}\n";
+    json.close();
+    
+    Config fromJson;
+    assert(fromJson.loadFromFile(jsonName) && "Should load identity_key from JSON");
+    assert(!fromJson.getIdentityKey().clientId && fromJson.getIdentityKey().ip);
+    
+    std::remove(jsonName.c_str());
+    
+    std::cout << "Identity key configuration test PASSED" << std::endl;
+}
+
+void testConnectRateConfig() {
+    std::cout << "Testing connect rate configuration..." << std::endl;
+    
+    std::string filename = "test_connect_rate.yaml";
+    std::ofstream file(filename);
+    file << "ip_connect_rate: 2.5\n";
+    file << "ip_connect_burst: 10\n";
+    file << "client_connect_rate: 0.2\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load connect rates");
+    const auto& connection = config.getConnectionSettings();
+    assert(connection.ipConnectRate == 2.5 && connection.ipConnectBurst == 10);
+    assert(connection.clientConnectRate == 0.2 && connection.clientConnectBurst == 0);
+    
+    std::ofstream bad(filename);
+    bad << "client_connect_burst: -1\n";
+    bad.close();
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Negative connect burst should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::string jsonName = "test_connect_rate.json";
+    std::ofstream json(jsonName);
+    json << "{\n  \"client_connect_rate\": 1,\n  \"client_connect_burst\": 3\n}\n";
+    json.close();
+    
+    Config fromJson;
+    assert(fromJson.loadFromFile(jsonName) && "Should load connect rates from JSON");
+    assert(fromJson.getConnectionSettings().clientConnectRate == 1.0);
+    assert(fromJson.getConnectionSettings().clientConnectBurst == 3);
+    assert(fromJson.getConnectionSettings().ipConnectRate == 0.0);
+    
+    std::remove(jsonName.c_str());
+    
+    std::cout << "Connect rate configuration test PASSED" << std::endl;
+}
+
+void testConnectionCapConfig() {
+    std::cout << "Testing connection cap configuration..." << std::endl;
+    
+    std::string filename = "test_connection_caps.yaml";
+    std::ofstream file(filename);
+    file << "max_connections: 5000\n";
+    file << "max_connections_per_ip: 16\n";
+    file << "cidr_connection_limits: 10.0.0.0/8 500\n";
+    file << "cidr_connection_limits: 192.168.0.0/16 50; 172.16.0.0/12 100\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load connection caps");
+    const auto& connection = config.getConnectionSettings();
+    assert(connection.maxConnections == 5000 && connection.maxConnectionsPerIp == 16);
+    assert(connection.cidrLimits.size() == 3 && connection.cidrLimits[2].maxConnections == 100);
+    
+    std::ofstream bad(filename);
+    bad << "cidr_connection_limits: 10.0.0.0/40 5\n";
+    bad.close();
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "Invalid CIDR block should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::string jsonName = "test_connection_caps.json";
+    std::ofstream json(jsonName);
+    json << "{\n  \"max_connections\": 100,\n  \"cidr_connection_limits\": \"10.0.0.0/8 5\"\n}\n";
+    json.close();
+    
+    Config fromJson;
+    assert(fromJson.loadFromFile(jsonName) && "Should load connection caps from JSON");
+    assert(fromJson.getConnectionSettings().maxConnections == 100);
+    assert(fromJson.getConnectionSettings().maxConnectionsPerIp == 0);
+    assert(fromJson.getConnectionSettings().cidrLimits.size() == 1);
+    
+    std::remove(jsonName.c_str());
+    
+    std::cout << "Connection cap configuration test PASSED" << std::endl;
+}
+
+void testConnectionTimeoutConfig() {
+    std::cout << "Testing connection timeout configuration..." << std::endl;
+    
+    Config defaults;
+    assert(defaults.getConnectionSettings().connectTimeoutMs == 10000);
+    assert(defaults.getConnectionSettings().halfOpenTimeoutMs == 30000);
+    
+    std::string filename = "test_connection_timeouts.yaml";
+    std::ofstream file(filename);
+    file << "connect_timeout_ms: 2000\n";
+    file << "half_open_timeout_ms: 5000\n";
+    file.close();
+    
+    Config config;
+    assert(config.loadFromFile(filename) && "Should load connection timeouts");
+    assert(config.getConnectionSettings().connectTimeoutMs == 2000);
+    assert(config.getConnectionSettings().halfOpenTimeoutMs == 5000);
+    
+    // The half-open time includes the CONNECT's arrival
+    std::ofstream bad(filename);
+    bad << "connect_timeout_ms: 40000\n";
+    bad.close();
+    Config invalid;
+    assert(!invalid.loadFromFile(filename) && "connect_timeout_ms over half_open_timeout_ms should be rejected");
+    
+    std::remove(filename.c_str());
+    
+    std::string jsonName = "test_connection_timeouts.json";
+    std::ofstream json(jsonName);
+    json << "{\n  \"connect_timeout_ms\": 0\n}\n";
+    json.close();
+    
+    Config fromJson;
+    assert(!fromJson.loadFromFile(jsonName) && "Zero connect_timeout_ms should be rejected");
+    
+    std::remove(jsonName.c_str());
+    
+    std::cout << "Connection timeout configuration test PASSED" << std::endl;
+}
+
 int main() {
     std::cout << "Running Config tests..." << std::endl << std::endl;
     
@@ -179,6 +601,39 @@ int main() {
         testClientPolicyFallback();
         std::cout << std::endl;
         
+        testMetricsConfig();
+        std::cout << std::endl;
+        
+        testClockSourceConfig();
+        std::cout << std::endl;
+        
+        testShapeModeConfig();
+        std::cout << std::endl;
+        
+        testRejectActionConfig();
+        std::cout << std::endl;
+        
+        testPacketBudgetConfig();
+        std::cout << std::endl;
+        
+        testTopicRulesConfig();
+        std::cout << std::endl;
+        
+        testMqtt5LimitsConfig();
+        std::cout << std::endl;
+        
+        testIdentityKeyConfig();
+        std::cout << std::endl;
+        
+        testConnectRateConfig();
+        std::cout << std::endl;
+        
+        testConnectionCapConfig();
+        std::cout << std::endl;
+        
+        testConnectionTimeoutConfig();
+        std::cout << std::endl;
+        
         std::cout << "All Config tests PASSED!" << std::endl;
         return 0;
         
@@ -0,0 +1,108 @@
+#include "throttlebox/connection_limiter.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cassert>
+
+using namespace throttlebox;
+
+namespace {
+
+// 10.0.0.0 + offset in host byte order
+uint32_t tenNet(uint32_t offset) {
+    return (10u << 24) + offset;
+}
+
+} // namespace
+
+void testParseCidrLimits() {
+    std::cout << "Testing CIDR limit parsing..." << std::endl;
+    
+    std::vector<CidrLimit> limits;
+    std::string error;
+    assert(parseCidrLimits("10.0.0.0/8 500; 192.168.1.77/24 20;0.0.0.0/0 1000;", limits, error));
+    assert(limits.size() == 3);
+    assert(limits[0].network == tenNet(0) && limits[0].prefixLength == 8 && limits[0].maxConnections == 500);
+    assert(limits[0].mask() == 0xFF000000u);
+    
+    // Host bits are cleared
+    assert(limits[1].network == 0xC0A80100u && limits[1].mask() == 0xFFFFFF00u);
+    assert(limits[2].network == 0 && limits[2].mask() == 0);
+    
+    assert(!parseCidrLimits("10.0.0.0/8", limits, error));
+    assert(!parseCidrLimits("10.0.0.0 5", limits, error));
+    assert(!parseCidrLimits("10.0.0.0/33 5", limits, error));
+    assert(!parseCidrLimits("10.0.0/8 5", limits, error));
+    assert(!parseCidrLimits("10.0.0.0/8x 5", limits, error));
+    assert(!parseCidrLimits("10.0.0.0/8 0", limits, error));
+    assert(!parseCidrLimits("10.0.0.0/8 5 6", limits, error));
+    assert(!parseCidrLimits("10.1.0.0/8 5", limits, error) && "Same block as 10.0.0.0/8");
+    
+    std::cout << "CIDR limit parsing test PASSED" << std::endl;
+}
+
+void testConnectionCaps() {
+    std::cout << "Testing concurrent connection caps..." << std::endl;
+    
+    using Admission = ConnectionLimiter::Admission;
+    std::vector<CidrLimit> limits;
+    std::string error;
+    assert(parseCidrLimits("10.0.0.0/24 3; 10.0.0.0/16 4", limits, error));
+    ConnectionLimiter limiter(6, 2, limits);
+    
+    // Two per address
+    assert(limiter.admit(tenNet(1)) == Admission::Admitted);
+    assert(limiter.admit(tenNet(1)) == Admission::Admitted);
+    assert(limiter.admit(tenNet(1)) == Admission::Ip);
+    assert(limiter.connectionsFrom(tenNet(1)) == 2);
+    
+    // Three in 10.0.0.0/24, then four in 10.0.0.0/16: every block counts
+    assert(limiter.admit(tenNet(2)) == Admission::Admitted);
+    assert(limiter.admit(tenNet(2)) == Admission::Cidr);
+    assert(limiter.admit(tenNet(256)) == Admission::Admitted);
+    assert(limiter.admit(tenNet(257)) == Admission::Cidr);
+    
+    // A refusal counts nothing
+    assert(limiter.connections() == 4 && limiter.connectionsFrom(tenNet(257)) == 0);
+    
+    // Six in total
+    assert(limiter.admit(0xC0A80001u) == Admission::Admitted);
+    assert(limiter.admit(0xC0A80002u) == Admission::Admitted);
+    assert(limiter.admit(0xC0A80003u) == Admission::Global);
+    
+    // Released connections make room again and leave no entry behind
+    limiter.release(tenNet(1));
+    limiter.release(tenNet(1));
+    assert(limiter.connectionsFrom(tenNet(1)) == 0 && limiter.connections() == 4);
+    assert(limiter.admit(tenNet(3)) == Admission::Admitted);
+    assert(limiter.admit(tenNet(3)) == Admission::Admitted);
+    assert(limiter.admit(tenNet(4)) == Admission::Global);
+    
+    // Zero caps are unlimited
+    ConnectionLimiter unlimited(0, 0, {});
+    for (int i = 0; i < 1000; i++) {
+        assert(unlimited.admit(tenNet(1)) == Admission::Admitted);
+    }
+    assert(unlimited.connections() == 1000);
+    
+    std::cout << "Concurrent connection caps test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running ConnectionLimiter tests..." << std::endl << std::endl;
+    
+    try {
+        testParseCidrLimits();
+        std::cout << std::endl;
+        
+        testConnectionCaps();
+        std::cout << std::endl;
+        
+        std::cout << "All ConnectionLimiter tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,170 @@
+#include "throttlebox/connection_watch.hpp"
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cassert>
+
+using namespace throttlebox;
+using namespace std::chrono;
+
+namespace {
+
+// A watch on a coarse wheel driven by a virtual clock, recording every
+// deadline that expires
+struct WatchFixture {
+    std::shared_ptr<VirtualClock> clock = std::make_shared<VirtualClock>();
+    TimerWheel wheel{clock->now(), milliseconds(100), 64};
+    std::vector<std::string> expired;
+    std::shared_ptr<ConnectionWatch> watch = std::make_shared<ConnectionWatch>(
+        wheel, clock, [this](const char* kind) { expired.push_back(kind); });
+    
+    // Move the clock to start + offset and fire what is due
+    size_t advanceTo(nanoseconds offset) {
+        clock->set(steady_clock::time_point(hours(1)) + offset);
+        return wheel.advance(clock->now());
+    }
+};
+
+} // namespace
+
+void testFixedDeadline() {
+    std::cout << "Testing a fixed deadline..." << std::endl;
+    
+    WatchFixture fixture;
+    auto start = fixture.clock->now();
+    assert(fixture.watch->lastActivity() == start);
+    fixture.watch->arm("connect", start + seconds(10));
+    assert(std::string(fixture.watch->armed()) == "connect");
+    
+    // Activity does not move a deadline without an idle limit
+    fixture.advanceTo(seconds(5));
+    fixture.watch->recordActivity(fixture.clock->now());
+    size_t fired = fixture.advanceTo(milliseconds(9900));
+    assert(fired == 0 && fixture.expired.empty());
+    fired = fixture.advanceTo(milliseconds(10100));
+    assert(fired == 1 && fixture.expired.size() == 1 && fixture.expired[0] == "connect");
+    
+    // Nothing is armed once a deadline has expired
+    fixture.watch->arm("half_open", fixture.clock->now() + seconds(1));
+    assert(!fixture.watch->armed() && fixture.wheel.pending() == 0);
+    const char* closed = fixture.watch->close();
+    assert(closed && std::string(closed) == "connect");
+    
+    std::cout << "Fixed deadline test PASSED" << std::endl;
+}
+
+void testRearm() {
+    std::cout << "Testing re-arming and disarming..." << std::endl;
+    
+    WatchFixture fixture;
+    auto start = fixture.clock->now();
+    fixture.watch->arm("connect", start + seconds(10));
+    fixture.watch->arm("half_open", start + seconds(30));
+    
+    // The replaced deadline is cancelled, not left to fire as a stale timer
+    assert(fixture.wheel.pending() == 1);
+    size_t fired = fixture.advanceTo(milliseconds(10100));
+    assert(fired == 0 && fixture.expired.empty());
+    
+    // A null kind only disarms
+    fixture.watch->arm(nullptr, start);
+    assert(!fixture.watch->armed() && fixture.wheel.pending() == 0);
+    fired = fixture.advanceTo(seconds(60));
+    assert(fired == 0 && fixture.expired.empty());
+    
+    // And the watch can be armed again afterwards
+    fixture.watch->arm("idle", fixture.clock->now() + seconds(1));
+    fired = fixture.advanceTo(seconds(62));
+    assert(fired == 1 && fixture.expired.size() == 1 && fixture.expired[0] == "idle");
+    
+    std::cout << "Re-arm test PASSED" << std::endl;
+}
+
+void testIdleFollowsActivity() {
+    std::cout << "Testing idle deadlines follow activity..." << std::endl;
+    
+    WatchFixture fixture;
+    auto idleLimit = seconds(15);
+    fixture.watch->arm("idle", fixture.watch->lastActivity() + idleLimit, idleLimit);
+    
+    // A read at 10 s: the timer at 15 s only moves itself to 25 s
+    fixture.advanceTo(seconds(10));
+    fixture.watch->recordActivity(fixture.clock->now());
+    size_t fired = fixture.advanceTo(milliseconds(15100));
+    assert(fired == 1 && fixture.expired.empty() && fixture.wheel.pending() == 1);
+    assert(std::string(fixture.watch->armed()) == "idle");
+    
+    // Re-arming supersedes the moved timer, which carried its generation
+    fixture.watch->arm("idle", fixture.clock->now() + idleLimit, idleLimit);
+    assert(fixture.wheel.pending() == 1);
+    fired = fixture.advanceTo(milliseconds(25100));
+    assert(fired == 0 && fixture.expired.empty());
+    
+    // With no read since, the deadline passes
+    fired = fixture.advanceTo(milliseconds(30200));
+    assert(fired == 1 && fixture.expired.size() == 1 && fixture.expired[0] == "idle");
+    
+    std::cout << "Idle deadline test PASSED" << std::endl;
+}
+
+void testExpireAndClose() {
+    std::cout << "Testing expiring early and closing..." << std::endl;
+    
+    // A wait bounded by the deadline ran out before the wheel caught up
+    WatchFixture early;
+    bool expired = early.watch->expire();
+    assert(!expired && early.expired.empty());
+    early.watch->arm("half_open", early.clock->now() + seconds(30));
+    expired = early.watch->expire();
+    assert(expired && early.expired.size() == 1 && early.expired[0] == "half_open");
+    assert(early.wheel.pending() == 0);
+    expired = early.watch->expire();
+    assert(!expired && early.expired.size() == 1);
+    const char* closed = early.watch->close();
+    assert(closed && std::string(closed) == "half_open");
+    
+    // Closing disarms for good, and reports no deadline passing
+    WatchFixture closing;
+    closing.watch->arm("connect", closing.clock->now() + seconds(10));
+    closed = closing.watch->close();
+    assert(!closed && closing.wheel.pending() == 0);
+    closing.watch->arm("half_open", closing.clock->now() + seconds(1));
+    size_t fired = closing.advanceTo(seconds(20));
+    assert(fired == 0 && closing.expired.empty() && !closing.watch->armed());
+    
+    // Pending timers hold the watch; closing releases it
+    WatchFixture released;
+    released.watch->arm("connect", released.clock->now() + seconds(10));
+    std::weak_ptr<ConnectionWatch> watched = released.watch;
+    released.watch->close();
+    released.watch.reset();
+    assert(watched.expired());
+    
+    std::cout << "Expire and close test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running ConnectionWatch tests..." << std::endl << std::endl;
+    
+    try {
+        testFixedDeadline();
+        std::cout << std::endl;
+        
+        testRearm();
+        std::cout << std::endl;
+        
+        testIdleFollowsActivity();
+        std::cout << std::endl;
+        
+        testExpireAndClose();
+        std::cout << std::endl;
+        
+        std::cout << "All ConnectionWatch tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,167 @@
+#include "throttlebox/flight_recorder.hpp"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <cassert>
+
+using namespace throttlebox;
+
+void testRoundTrip() {
+    std::cout << "Testing dump round trip..." << std::endl;
+    
+    FlightRecorder recorder(16);
+    
+    FlightEvent event;
+    event.timestampNs = FlightRecorder::nowNs();
+    event.clientHandle = 42;
+    event.ipv4 = 0xC0A80164; // 192.168.1.100
+    event.tokensLeft = 0.5f;
+    event.packetType = 3;
+    event.decision = static_cast<uint8_t>(FlightDecision::Blocked);
+    event.policyLevel = 1;
+    recorder.record(event);
+    
+    FlightRecorder::DumpHeader header;
+    std::vector<FlightEvent> events;
+    std::string dump = recorder.dump();
+    assert(dump.size() == FlightRecorder::kHeaderBytes + FlightRecorder::kEventBytes);
+    assert(FlightRecorder::parseDump(dump, header, events));
+    
+    assert(header.version == FlightRecorder::kDumpVersion);
+    assert(header.eventCount == 1);
+    assert(header.steadyNowNs >= event.timestampNs);
+    assert(events.size() == 1);
+    assert(events[0].timestampNs == event.timestampNs);
+    assert(events[0].clientHandle == 42);
+    assert(events[0].ipv4 == 0xC0A80164);
+    assert(events[0].tokensLeft == 0.5f);
+    assert(events[0].packetType == 3);
+    assert(events[0].decision == static_cast<uint8_t>(FlightDecision::Blocked));
+    assert(events[0].policyLevel == 1);
+    
+    // Truncated or foreign data is rejected
+    assert(!FlightRecorder::parseDump(dump.substr(0, dump.size() - 1), header, events));
+    assert(!FlightRecorder::parseDump("not a dump at all, not a dump at all", header, events));
+    
+    std::cout << "Dump round trip test PASSED" << std::endl;
+}
+
+void testRingKeepsNewestEvents() {
+    std::cout << "Testing ring overwrite..." << std::endl;
+    
+    FlightRecorder recorder(8);
+    assert(recorder.eventsPerThread() == 8);
+    
+    for (uint32_t i = 0; i < 20; i++) {
+        FlightEvent event;
+        event.timestampNs = 1000 + i;
+        event.clientHandle = i;
+        recorder.record(event);
+    }
+    
+    FlightRecorder::DumpHeader header;
+    std::vector<FlightEvent> events;
+    assert(FlightRecorder::parseDump(recorder.dump(), header, events));
+    assert(events.size() == 8);
+    for (uint32_t i = 0; i < 8; i++) {
+        assert(events[i].clientHandle == 12 + i && "Only the newest events survive, oldest first");
+    }
+    
+    std::cout << "Ring overwrite test PASSED" << std::endl;
+}
+
+void testPerThreadRings() {
+    std::cout << "Testing per-thread rings..." << std::endl;
+    
+    FlightRecorder recorder(64);
+    
+    // Threads that exit hand their rings back, so sequential threads share one
+    for (int round = 0; round < 3; round++) {
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < 4; t++) {
+            threads.emplace_back([&recorder, t, round]() {
+                for (uint32_t i = 0; i < 10; i++) {
+                    FlightEvent event;
+                    event.timestampNs = FlightRecorder::nowNs();
+                    event.clientHandle = round * 100 + t;
+                    recorder.record(event);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    
+    FlightRecorder::DumpHeader header;
+    std::vector<FlightEvent> events;
+    assert(FlightRecorder::parseDump(recorder.dump(), header, events));
+    
+    // 12 threads ran, but never more than 4 at once
+    assert(events.size() <= 4 * 64);
+    assert(events.size() >= 40);
+    for (size_t i = 1; i < events.size(); i++) {
+        assert(events[i - 1].timestampNs <= events[i].timestampNs);
+    }
+    
+    std::cout << "Per-thread ring test PASSED" << std::endl;
+}
+
+void testDumpWhileRecording() {
+    std::cout << "Testing dumps concurrent with writers..." << std::endl;
+    
+    FlightRecorder recorder(32);
+    std::atomic<bool> done{false};
+    
+    std::thread writer([&recorder, &done]() {
+        uint32_t i = 0;
+        while (!done) {
+            FlightEvent event;
+            event.timestampNs = i;
+            event.clientHandle = i;
+            event.ipv4 = i;
+            recorder.record(event);
+            i++;
+        }
+    });
+    
+    for (int i = 0; i < 200; i++) {
+        FlightRecorder::DumpHeader header;
+        std::vector<FlightEvent> events;
+        assert(FlightRecorder::parseDump(recorder.dump(), header, events));
+        for (const auto& event : events) {
+            // A torn slot would mix fields from two events
+            assert(event.clientHandle == event.timestampNs && event.ipv4 == event.clientHandle);
+        }
+    }
+    
+    done = true;
+    writer.join();
+    
+    std::cout << "Concurrent dump test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running FlightRecorder tests..." << std::endl << std::endl;
+    
+    try {
+        testRoundTrip();
+        std::cout << std::endl;
+        
+        testRingKeepsNewestEvents();
+        std::cout << std::endl;
+        
+        testPerThreadRings();
+        std::cout << std::endl;
+        
+        testDumpWhileRecording();
+        std::cout << std::endl;
+        
+        std::cout << "All FlightRecorder tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
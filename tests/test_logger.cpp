@@ -0,0 +1,163 @@
+#include "throttlebox/logger.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <cassert>
+
+using namespace throttlebox;
+
+std::string readFile(const std::string& path) {
+    std::ifstream file(path);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+size_t countLines(const std::string& text, const std::string& needle) {
+    size_t count = 0;
+    for (size_t pos = text.find(needle); pos != std::string::npos; pos = text.find(needle, pos + 1)) {
+        count++;
+    }
+    return count;
+}
+
+void testTextFormat() {
+    std::cout << "Testing logfmt output..." << std::endl;
+    
+    std::string path = "test_logger_text.log";
+    std::remove(path.c_str());
+    
+    LoggingSettings settings;
+    settings.output = path;
+    {
+        AsyncLogger logger(settings);
+        logger.log(LogLevel::Warn, "rate_limited",
+                   {{"client", "sensor_1"}, {"ip", std::string("10.0.0.7")},
+                    {"tokens", 0.5}, {"suppressed", uint64_t{12}}, {"delta", -3}});
+        logger.log(LogLevel::Info, "client_connected", {{"client", "has space \"quoted\""}});
+        logger.log(LogLevel::Debug, "filtered_out", {});
+    }
+    
+    std::string text = readFile(path);
+    assert(text.find(" level=warn event=rate_limited client=sensor_1 ip=10.0.0.7 tokens=0.5 suppressed=12 delta=-3\n")
+           != std::string::npos);
+    assert(text.find("client=\"has space \\\"quoted\\\"\"") != std::string::npos);
+    assert(text.find("filtered_out") == std::string::npos && "Below the configured level");
+    assert(text.compare(0, 3, "ts=") == 0);
+    
+    std::remove(path.c_str());
+    std::cout << "logfmt output test PASSED" << std::endl;
+}
+
+void testJsonFormat() {
+    std::cout << "Testing JSON output..." << std::endl;
+    
+    std::string path = "test_logger_json.log";
+    std::remove(path.c_str());
+    
+    LoggingSettings settings;
+    settings.output = path;
+    settings.format = LogFormat::Json;
+    settings.level = LogLevel::Debug;
+    {
+        AsyncLogger logger(settings);
+        logger.log(LogLevel::Debug, "packet", {{"client", "a\"b"}, {"size", 42}});
+    }
+    
+    std::string text = readFile(path);
+    assert(text.find("\"level\":\"debug\",\"event\":\"packet\",\"client\":\"a\\\"b\",\"size\":42}\n")
+           != std::string::npos);
+    
+    std::remove(path.c_str());
+    std::cout << "JSON output test PASSED" << std::endl;
+}
+
+void testQueueOverflowDropsRecords() {
+    std::cout << "Testing bounded queue..." << std::endl;
+    
+    std::string path = "test_logger_overflow.log";
+    std::remove(path.c_str());
+    
+    LoggingSettings settings;
+    settings.output = path;
+    settings.queueSize = 8;
+    uint64_t dropped;
+    {
+        AsyncLogger logger(settings);
+        std::vector<std::thread> producers;
+        for (int t = 0; t < 4; t++) {
+            producers.emplace_back([&logger]() {
+                for (int i = 0; i < 5000; i++) {
+                    logger.log(LogLevel::Info, "flood", {{"i", i}});
+                }
+            });
+        }
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        logger.flush();
+        dropped = logger.droppedRecords();
+    }
+    
+    std::string text = readFile(path);
+    size_t written = countLines(text, "event=flood ");
+    assert(written + dropped == 20000 && "Every record is either written or counted as dropped");
+    if (dropped > 0) {
+        assert(text.find("event=log_records_dropped count=") != std::string::npos);
+    }
+    
+    std::remove(path.c_str());
+    std::cout << "Bounded queue test PASSED (" << dropped << " dropped)" << std::endl;
+}
+
+void testSampler() {
+    std::cout << "Testing per-key sampler..." << std::endl;
+    
+    const uint64_t ms = 1000000;
+    LogSampler sampler(1000);
+    
+    assert(sampler.admit(0) && "First occurrence is always logged");
+    assert(sampler.suppressed() == 0);
+    
+    for (int i = 1; i <= 99; i++) {
+        assert(!sampler.admit(i * ms));
+    }
+    assert(sampler.pending() == 99);
+    
+    assert(sampler.admit(1000 * ms) && "Next window logs again");
+    assert(sampler.suppressed() == 99 && "and reports what was swallowed");
+    assert(sampler.pending() == 0);
+    
+    assert(!sampler.admit(1500 * ms));
+    assert(sampler.admit(2600 * ms));
+    assert(sampler.suppressed() == 1);
+    
+    std::cout << "Sampler test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running Logger tests..." << std::endl << std::endl;
+    
+    try {
+        testTextFormat();
+        std::cout << std::endl;
+        
+        testJsonFormat();
+        std::cout << std::endl;
+        
+        testQueueOverflowDropsRecords();
+        std::cout << std::endl;
+        
+        testSampler();
+        std::cout << std::endl;
+        
+        std::cout << "All Logger tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
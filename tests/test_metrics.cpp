@@ -0,0 +1,231 @@
+#include "throttlebox/metrics.hpp"
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cassert>
+
+using namespace throttlebox;
+
+void testExpositionFormat() {
+    std::cout << "Testing Prometheus exposition format..." << std::endl;
+    
+    Metrics metrics;
+    metrics.incrementCounter("allowed_messages");
+    metrics.incrementCounter("allowed_messages");
+    metrics.setGauge("active_connections", -3);
+    
+    std::string text = metrics.getFormattedMetrics();
+    
+    assert(text.find("# HELP throttlebox_allowed_messages_total Messages allowed through\n") != std::string::npos);
+    assert(text.find("# TYPE throttlebox_allowed_messages_total counter\n") != std::string::npos);
+    assert(text.find("throttlebox_allowed_messages_total 2\n") != std::string::npos);
+    assert(text.find("# TYPE throttlebox_active_connections gauge\n") != std::string::npos);
+    assert(text.find("throttlebox_active_connections -3\n") != std::string::npos);
+    
+    // Counters are rendered before gauges
+    assert(text.find("_total ") < text.find("throttlebox_active_connections "));
+    
+    std::cout << "Exposition format test PASSED" << std::endl;
+}
+
+void testCachedSeriesPickUpNewMetrics() {
+    std::cout << "Testing series cache invalidation..." << std::endl;
+    
+    Metrics metrics;
+    std::string first = metrics.getFormattedMetrics();
+    assert(first.find("custom_drops") == std::string::npos);
+    
+    // Values change without new series: cached prefixes, fresh values
+    metrics.incrementCounter("blocked_messages");
+    std::string second = metrics.getFormattedMetrics();
+    assert(second.size() == first.size());
+    assert(second.find("throttlebox_blocked_messages_total 1\n") != std::string::npos);
+    
+    // New series invalidate the cache
+    metrics.incrementCounter("custom_drops");
+    metrics.setGauge("queue_depth", 12345678901LL);
+    std::string third = metrics.getFormattedMetrics();
+    assert(third.find("throttlebox_custom_drops_total 1\n") != std::string::npos);
+    assert(third.find("throttlebox_queue_depth 12345678901\n") != std::string::npos);
+    
+    std::cout << "Series cache test PASSED" << std::endl;
+}
+
+void testConcurrentScrapes() {
+    std::cout << "Testing scrapes concurrent with writers..." << std::endl;
+    
+    Metrics metrics;
+    std::atomic<bool> done{false};
+    
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++) {
+        writers.emplace_back([&metrics, t]() {
+            for (int i = 0; i < 20000; i++) {
+                metrics.incrementCounter("allowed_messages");
+                if (i % 1000 == 0) {
+                    metrics.incrementCounter("series_" + std::to_string(t) + "_" + std::to_string(i));
+                }
+            }
+        });
+    }
+    
+    std::thread scraper([&metrics, &done]() {
+        while (!done) {
+            std::string text = metrics.getFormattedMetrics();
+            assert(!text.empty());
+        }
+    });
+    
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    done = true;
+    scraper.join();
+    
+    std::string text = metrics.getFormattedMetrics();
+    assert(text.find("throttlebox_allowed_messages_total 80000\n") != std::string::npos);
+    assert(text.find("throttlebox_series_3_19000_total 1\n") != std::string::npos);
+    
+    std::cout << "Concurrent scrape test PASSED" << std::endl;
+}
+
+void testHistogramExposition() {
+    std::cout << "Testing histogram exposition..." << std::endl;
+    
+    Metrics metrics;
+    metrics.observeHistogram("processing_duration_seconds", 0.0002);
+    metrics.observeHistogram("processing_duration_seconds", 0.0002);
+    metrics.observeHistogram("processing_duration_seconds", 3.0);
+    
+    std::string text = metrics.getFormattedMetrics();
+    assert(text.find("# TYPE throttlebox_processing_duration_seconds histogram\n") != std::string::npos);
+    assert(text.find("throttlebox_processing_duration_seconds_bucket{le=\"0.0001\"} 0\n") != std::string::npos);
+    assert(text.find("throttlebox_processing_duration_seconds_bucket{le=\"0.00025\"} 2\n") != std::string::npos);
+    assert(text.find("throttlebox_processing_duration_seconds_bucket{le=\"1\"} 2\n") != std::string::npos);
+    assert(text.find("throttlebox_processing_duration_seconds_bucket{le=\"+Inf\"} 3\n") != std::string::npos);
+    assert(text.find("throttlebox_processing_duration_seconds_count 3\n") != std::string::npos);
+    
+    std::cout << "Histogram exposition test PASSED" << std::endl;
+}
+
+// Receive every datagram that arrives within the timeout
+std::vector<std::string> receiveDatagrams(int socket, int timeoutMs) {
+    std::vector<std::string> datagrams;
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = timeoutMs * 1000;
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    char buffer[2048];
+    while (true) {
+        ssize_t bytes = recv(socket, buffer, sizeof(buffer), 0);
+        if (bytes <= 0) break;
+        datagrams.emplace_back(buffer, bytes);
+    }
+    return datagrams;
+}
+
+void testStatsdExporter() {
+    std::cout << "Testing StatsD push exporter..." << std::endl;
+    
+    int listener = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(listener >= 0);
+    
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    assert(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    getsockname(listener, (struct sockaddr*)&addr, &len);
+    
+    Metrics metrics;
+    metrics.incrementCounter("allowed_messages"); // Before start: baseline, not pushed
+    
+    StatsdSettings settings;
+    settings.port = ntohs(addr.sin_port);
+    settings.flushIntervalMs = 60000; // Only the final flush on stop
+    settings.dogstatsd = true;
+    settings.tags = "site:test";
+    settings.maxDatagramBytes = 200;
+    assert(metrics.startStatsdExporter(settings));
+    
+    for (int i = 0; i < 5; i++) {
+        metrics.incrementCounter("blocked_messages");
+    }
+    for (int i = 0; i < 20; i++) {
+        metrics.incrementCounter("burst_" + std::to_string(i));
+    }
+    metrics.setGauge("active_connections", 7);
+    metrics.observeHistogram("processing_duration_seconds", 0.002);
+    
+    metrics.stopStatsdExporter();
+    
+    std::vector<std::string> datagrams = receiveDatagrams(listener, 100);
+    std::string all;
+    size_t multiLine = 0;
+    for (const auto& datagram : datagrams) {
+        assert(datagram.size() <= settings.maxDatagramBytes);
+        if (datagram.find('\n') != std::string::npos) multiLine++;
+        all += datagram + "\n";
+    }
+    
+    assert(datagrams.size() > 1 && "Small datagram limit should split the batch");
+    assert(multiLine > 0 && "Datagrams should carry several metrics");
+    assert(all.find("throttlebox.blocked_messages:5|c|#site:test\n") != std::string::npos);
+    assert(all.find("throttlebox.burst_19:1|c|#site:test\n") != std::string::npos);
+    assert(all.find("throttlebox.active_connections:7|g|#site:test\n") != std::string::npos);
+    assert(all.find("throttlebox.processing_duration_seconds.count:1|c|#site:test\n") != std::string::npos);
+    assert(all.find("throttlebox.processing_duration_seconds.p99:0.0025|g|#site:test\n") != std::string::npos);
+    assert(all.find("throttlebox.allowed_messages:") == std::string::npos);
+    
+    // A restarted exporter only pushes what changed since it started
+    settings.flushIntervalMs = 20;
+    assert(metrics.startStatsdExporter(settings));
+    metrics.incrementCounter("blocked_messages");
+    metrics.incrementCounter("blocked_messages");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    metrics.stopStatsdExporter();
+    
+    all.clear();
+    for (const auto& datagram : receiveDatagrams(listener, 100)) {
+        all += datagram + "\n";
+    }
+    assert(all.find("throttlebox.blocked_messages:2|c|#site:test\n") != std::string::npos);
+    assert(all.find("throttlebox.burst_19:") == std::string::npos);
+    
+    close(listener);
+    std::cout << "StatsD exporter test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running Metrics tests..." << std::endl << std::endl;
+    
+    try {
+        testExpositionFormat();
+        std::cout << std::endl;
+        
+        testCachedSeriesPickUpNewMetrics();
+        std::cout << std::endl;
+        
+        testConcurrentScrapes();
+        std::cout << std::endl;
+        
+        testHistogramExposition();
+        std::cout << std::endl;
+        
+        testStatsdExporter();
+        std::cout << std::endl;
+        
+        std::cout << "All Metrics tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
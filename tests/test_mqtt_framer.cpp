@@ -0,0 +1,206 @@
+#include "throttlebox/mqtt_framer.hpp"
+#include "throttlebox/mqtt_validate.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cassert>
+
+using namespace throttlebox;
+
+namespace {
+
+void feed(MqttFramer& framer, const std::string& bytes) {
+    uint8_t* space = framer.prepare(bytes.size());
+    std::memcpy(space, bytes.data(), bytes.size());
+    framer.commit(bytes.size());
+}
+
+std::string publish(const std::string& topic, const std::string& payload) {
+    std::string body;
+    body += static_cast<char>(topic.size() >> 8);
+    body += static_cast<char>(topic.size() & 0xFF);
+    body += topic + payload;
+    
+    std::string packet(1, static_cast<char>(0x30));
+    size_t length = body.size();
+    do {
+        uint8_t byte = length % 128;
+        length /= 128;
+        packet += static_cast<char>(length > 0 ? byte | 0x80 : byte);
+    } while (length > 0);
+    return packet + body;
+}
+
+} // namespace
+
+void testSeveralPacketsPerRead() {
+    std::cout << "Testing several packets in one read..." << std::endl;
+    
+    MqttFramer framer;
+    std::string pingreq("\xC0\x00", 2);
+    feed(framer, publish("a/b", "1") + pingreq + publish("c", "22"));
+    
+    MqttPacket packet;
+    assert(framer.next(packet) && packet.type == 3 && packet.size == 8 && packet.headerSize == 2);
+    assert(packet.bodySize() == 6 && packet.body()[2] == 'a');
+    assert(framer.next(packet) && packet.type == 12 && packet.size == 2);
+    assert(framer.next(packet) && packet.type == 3 && packet.flags == 0);
+    assert(!framer.next(packet) && !framer.error());
+    assert(framer.buffered() == 0);
+    
+    std::cout << "Several packets per read test PASSED" << std::endl;
+}
+
+void testSplitReads() {
+    std::cout << "Testing packets split across reads..." << std::endl;
+    
+    // 300-byte payload needs a two-byte remaining length
+    std::string big = publish("sensors/temp", std::string(300, 'x'));
+    assert(static_cast<uint8_t>(big[1]) & 0x80);
+    
+    MqttFramer framer;
+    MqttPacket packet;
+    
+    // Byte at a time, including inside the remaining length
+    for (size_t i = 0; i + 1 < big.size(); i++) {
+        feed(framer, big.substr(i, 1));
+        assert(!framer.next(packet) && !framer.error());
+    }
+    feed(framer, big.substr(big.size() - 1));
+    assert(framer.next(packet));
+    assert(packet.size == big.size() && packet.headerSize == 3);
+    assert(std::memcmp(packet.data, big.data(), big.size()) == 0);
+    
+    // Larger than the initial buffer
+    std::string huge = publish("bulk", std::string(100000, 'y'));
+    feed(framer, huge.substr(0, 5000));
+    assert(!framer.next(packet));
+    feed(framer, huge.substr(5000));
+    assert(framer.next(packet) && packet.size == huge.size());
+    
+    // peek() leaves the packet for next()
+    feed(framer, big);
+    assert(framer.peek(packet) && framer.buffered() == big.size());
+    assert(framer.next(packet) && packet.size == big.size() && framer.buffered() == 0);
+    assert(!framer.peek(packet));
+    
+    std::cout << "Split reads test PASSED" << std::endl;
+}
+
+void testMalformedStreams() {
+    std::cout << "Testing malformed streams..." << std::endl;
+    
+    MqttFramer framer;
+    MqttPacket packet;
+    feed(framer, std::string("\x30\xFF\xFF\xFF\xFF\x01", 6));
+    assert(!framer.next(packet) && framer.error());
+    
+    // Packets over the configured maximum are refused before buffering them
+    MqttFramer bounded(1024);
+    feed(bounded, publish("t", std::string(2000, 'z')).substr(0, 10));
+    assert(!bounded.next(packet) && bounded.error());
+    
+    std::cout << "Malformed streams test PASSED" << std::endl;
+}
+
+void testAcks() {
+    std::cout << "Testing packet ids and acknowledgements..." << std::endl;
+    
+    MqttFramer framer;
+    MqttPacket packet;
+    
+    // QoS 1 PUBLISH: topic "t", packet id 0x1234
+    feed(framer, std::string("\x32\x06\x00\x01t\x12\x34x", 8));
+    // QoS 0 PUBLISH has no packet id
+    feed(framer, publish("t", "x"));
+    // PUBREL for id 7
+    feed(framer, std::string("\x62\x02\x00\x07", 4));
+    
+    uint16_t id = 0;
+    assert(framer.next(packet) && publishQos(packet) == 1);
+    assert(packetIdOf(packet, id) && id == 0x1234);
+    PublishView publish;
+    assert(parsePublish(packet, 4, publish) && publish.topic == "t" && publish.packetId == 0x1234);
+    assert(framer.next(packet) && publishQos(packet) == 0 && !packetIdOf(packet, id));
+    assert(framer.next(packet) && packet.type == mqtt::kPubrel);
+    assert(packetIdOf(packet, id) && id == 7);
+    assert(!parsePublish(packet, 4, publish));
+    
+    uint8_t out[5];
+    assert(encodeAck(mqtt::kPuback, 0x1234, mqtt::kMessageRateTooHigh, 4, out) == 4);
+    assert(out[0] == 0x40 && out[1] == 2 && out[2] == 0x12 && out[3] == 0x34);
+    
+    // Reason codes only for MQTT 5, and only when not Success
+    assert(encodeAck(mqtt::kPubrec, 9, mqtt::kMessageRateTooHigh, 5, out) == 5);
+    assert(out[0] == 0x50 && out[1] == 3 && out[3] == 9 && out[4] == 0x96);
+    assert(encodeAck(mqtt::kPubcomp, 9, mqtt::kSuccess, 5, out) == 4 && out[0] == 0x70);
+    assert(encodeAck(mqtt::kPubrel, 9, mqtt::kSuccess, 4, out) == 4 && out[0] == 0x62);
+    
+    std::cout << "Acknowledgements test PASSED" << std::endl;
+}
+
+void testStringValidation() {
+    std::cout << "Testing UTF-8 and topic name validation (" << mqttValidateKernel() << ")..." << std::endl;
+    
+    assert(isValidMqttString(""));
+    assert(isValidMqttString("sensor-42"));
+    assert(isValidMqttString("caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80"));   // 2, 3 and 4 byte forms
+    assert(!isValidMqttString(std::string("a\0b", 3)));                      // U+0000
+    assert(!isValidMqttString("\xC0\xAF"));                                   // Overlong '/'
+    assert(!isValidMqttString("\xE0\x80\xAF"));                              // Overlong, 3 bytes
+    assert(!isValidMqttString("\xED\xA0\x80"));                              // Surrogate U+D800
+    assert(!isValidMqttString("\xF4\x90\x80\x80"));                          // Above U+10FFFF
+    assert(!isValidMqttString("\xE2\x82"));                                   // Truncated
+    assert(!isValidMqttString("\x80"));                                       // Stray continuation
+    
+    assert(isValidTopicName("factory/line1/alarm") && isValidTopicName("/"));
+    assert(!isValidTopicName("factory/+/alarm") && !isValidTopicName("factory/#"));
+    
+    // A bad byte at every offset of strings spanning several vector blocks
+    // and a scalar tail
+    std::string plain(71, 'a');
+    for (size_t i = 0; i < plain.size(); i++) {
+        std::string text = plain;
+        text[i] = '#';
+        assert(isValidMqttString(text) && !isValidTopicName(text));
+        text[i] = '\0';
+        assert(!isValidMqttString(text));
+        text[i] = '\xFF';
+        assert(!isValidMqttString(text));
+        
+        std::string wide = plain.substr(0, i) + "\xC3\xA9" + plain.substr(i);
+        assert(isValidTopicName(wide));
+        assert(!isValidTopicName(wide.substr(0, i + 1) + plain));
+    }
+    
+    std::cout << "String validation test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running MqttFramer tests..." << std::endl << std::endl;
+    
+    try {
+        testSeveralPacketsPerRead();
+        std::cout << std::endl;
+        
+        testSplitReads();
+        std::cout << std::endl;
+        
+        testMalformedStreams();
+        std::cout << std::endl;
+        
+        testAcks();
+        std::cout << std::endl;
+        
+        testStringValidation();
+        std::cout << std::endl;
+        
+        std::cout << "All MqttFramer tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,446 @@
+#include "throttlebox/mqtt_framer.hpp"
+#include "throttlebox/mqtt_validate.hpp"
+#include "throttlebox/rate_limiter.hpp"
+#include "throttlebox/topic_trie.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <cassert>
+
+using namespace throttlebox;
+
+// Every heap allocation in the process is counted, so a test can assert
+// that a code path makes none
+static std::atomic<size_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* memory = std::malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+namespace {
+
+std::string withHeader(uint8_t firstByte, const std::string& body) {
+    std::string packet(1, static_cast<char>(firstByte));
+    size_t length = body.size();
+    do {
+        uint8_t byte = length % 128;
+        length /= 128;
+        packet += static_cast<char>(length > 0 ? byte | 0x80 : byte);
+    } while (length > 0);
+    return packet + body;
+}
+
+std::string mqttString(const std::string& text) {
+    std::string encoded;
+    encoded += static_cast<char>(text.size() >> 8);
+    encoded += static_cast<char>(text.size() & 0xFF);
+    return encoded + text;
+}
+
+const uint8_t* bytesOf(const std::string& text) {
+    return reinterpret_cast<const uint8_t*>(text.data());
+}
+
+// The complete packet at the start of bytes
+MqttPacket packetOf(const std::string& bytes) {
+    MqttPacket packet;
+    if (!viewPacket(bytesOf(bytes), bytes.size(), packet)) {
+        throw std::runtime_error("Test packet is incomplete");
+    }
+    return packet;
+}
+
+bool sameBytes(ByteSpan span, const std::string& expected) {
+    return span.size == expected.size() && std::memcmp(span.data, expected.data(), span.size) == 0;
+}
+
+} // namespace
+
+void testPublishView() {
+    std::cout << "Testing PUBLISH views..." << std::endl;
+    
+    // QoS 1, retained, MQTT 3.1.1
+    std::string v4 = withHeader(0x33, mqttString("a/b") + "\x01\x02" + "payload");
+    MqttPacket packet = packetOf(v4);
+    PublishView view;
+    bool parsed = parsePublish(packet, 4, view);
+    assert(parsed && view.topic == "a/b" && view.packetId == 0x0102 && view.qos == 1);
+    assert(view.retain && !view.dup && view.properties.empty());
+    assert(sameBytes(view.payload, "payload"));
+    
+    // The views point into the packet, not at copies
+    assert(view.topic.data() == v4.data() + 4);
+    
+    // MQTT 5 QoS 0 with a topic alias property and an empty topic
+    std::string v5 = withHeader(0x38, mqttString("") + std::string("\x03\x23\x00\x07", 4) + "x");
+    packet = packetOf(v5);
+    parsed = parsePublish(packet, 5, view);
+    assert(parsed && view.topic.empty() && view.packetId == 0 && view.dup);
+    assert(sameBytes(view.properties, std::string("\x23\x00\x07", 3)));
+    assert(sameBytes(view.payload, "x"));
+    
+    // The same bytes read as 3.1.1 carry no properties
+    parsed = parsePublish(packet, 4, view);
+    assert(parsed && view.properties.empty() && view.payload.size == 5);
+    
+    // Fields that overrun the packet
+    bool shortTopic = parsePublish(packetOf(withHeader(0x30, std::string("\x00\x09" "abc", 5))), 4, view);
+    bool noPacketId = parsePublish(packetOf(withHeader(0x32, mqttString("t") + "\x01")), 4, view);
+    bool longProperties = parsePublish(packetOf(withHeader(0x30, mqttString("t") + "\x05\x01")), 5, view);
+    assert(!shortTopic && !noPacketId && !longProperties);
+    
+    // viewPacket takes the first packet of a longer buffer, but not a partial one
+    std::string two = v4 + v4;
+    bool first = viewPacket(bytesOf(two), two.size(), packet);
+    assert(first && packet.size == v4.size());
+    bool partial = viewPacket(bytesOf(v4), v4.size() - 1, packet);
+    assert(!partial);
+    
+    std::cout << "PUBLISH views test PASSED" << std::endl;
+}
+
+void testPublishTopicRewrite() {
+    std::cout << "Testing PUBLISH topic rewriting..." << std::endl;
+    
+    // An alias-only QoS 1 publish gets its topic back; the alias stays
+    std::string aliased = withHeader(0x32, mqttString("") + std::string("\x00\x05" "\x03\x23\x00\x02", 6) + "data");
+    std::vector<uint8_t> out;
+    bool rewrote = rewritePublishTopic(packetOf(aliased), "a/b", out);
+    assert(rewrote);
+    std::string expected = withHeader(0x32, mqttString("a/b") + std::string("\x00\x05" "\x03\x23\x00\x02", 6) + "data");
+    assert(out.size() == expected.size() && std::memcmp(out.data(), expected.data(), out.size()) == 0);
+    
+    MqttPacket packet;
+    bool complete = viewPacket(out.data(), out.size(), packet);
+    PublishView view;
+    bool parsed = parsePublish(packet, 5, view);
+    assert(complete && parsed && view.topic == "a/b" && view.packetId == 5 && sameBytes(view.payload, "data"));
+    
+    // A longer topic can grow the remaining length to two bytes
+    std::string topic(200, 't');
+    rewrote = rewritePublishTopic(packetOf(aliased), topic, out);
+    complete = viewPacket(out.data(), out.size(), packet);
+    parsed = parsePublish(packet, 5, view);
+    assert(rewrote && complete && packet.headerSize == 3 && packet.size == out.size() && view.topic == topic);
+    
+    // Only PUBLISHes with a whole topic name field are rewritten
+    bool notPublish = rewritePublishTopic(packetOf(withHeader(0xE0, "")), "a", out);
+    bool truncated = rewritePublishTopic(packetOf(withHeader(0x30, std::string("\x00\x09" "abc", 5))), "a", out);
+    assert(!notPublish && !truncated);
+    
+    std::cout << "PUBLISH topic rewriting test PASSED" << std::endl;
+}
+
+void testConnectView() {
+    std::cout << "Testing CONNECT views..." << std::endl;
+    
+    std::string v4 = withHeader(0x10, mqttString("MQTT") + std::string("\x04\x02\x00\x3C", 4) +
+                                      mqttString("sensor-1"));
+    ConnectView view;
+    bool parsed = parseConnect(packetOf(v4), view);
+    assert(parsed && view.protocolName == "MQTT" && view.protocolLevel == 4);
+    assert(view.flags == 0x02 && view.keepAlive == 60 && view.clientId == "sensor-1");
+    
+    // MQTT 5 properties sit between keep alive and the client identifier
+    std::string v5 = withHeader(0x10, mqttString("MQTT") + std::string("\x05\x02\x00\x0A\x05\x11\x00\x00\x00\x3C", 10) +
+                                      mqttString("sensor-5"));
+    parsed = parseConnect(packetOf(v5), view);
+    assert(parsed && view.protocolLevel == 5 && view.properties.size == 5 && view.clientId == "sensor-5");
+    
+    // MQTT 3.1 names the protocol MQIsdp
+    std::string v3 = withHeader(0x10, mqttString("MQIsdp") + std::string("\x03\x02\x00\x3C", 4) + mqttString(""));
+    parsed = parseConnect(packetOf(v3), view);
+    assert(parsed && view.protocolName == "MQIsdp" && view.protocolLevel == 3 && view.clientId.empty());
+    
+    // Will (with MQTT 5 will properties), username and password, in that order
+    std::string full = withHeader(0x10, mqttString("MQTT") + std::string("\x05\xC6\x00\x3C\x00", 5) +
+                                        mqttString("dev") + std::string("\x02\x01\x01", 3) +
+                                        mqttString("status/dev") + mqttString("offline") +
+                                        mqttString("bob") + mqttString("secret"));
+    parsed = parseConnect(packetOf(full), view);
+    assert(parsed && view.hasWill() && view.hasUsername() && view.clientId == "dev");
+    assert(view.willProperties.size == 2 && view.willTopic == "status/dev");
+    assert(sameBytes(view.willPayload, "offline"));
+    assert(view.username == "bob" && sameBytes(view.password, "secret"));
+    
+    // Flags announcing fields that are missing, leftover bytes, the reserved flag
+    bool noUser = parseConnect(packetOf(withHeader(0x10, mqttString("MQTT") + std::string("\x04\x82\x00\x3C", 4) +
+                                                         mqttString("dev"))), view);
+    bool extra = parseConnect(packetOf(withHeader(0x10, mqttString("MQTT") + std::string("\x04\x02\x00\x3C", 4) +
+                                                        mqttString("dev") + "?")), view);
+    bool reserved = parseConnect(packetOf(withHeader(0x10, mqttString("MQTT") + std::string("\x04\x03\x00\x3C", 4) +
+                                                           mqttString("dev"))), view);
+    assert(!noUser && !extra && !reserved);
+    
+    // Truncated client identifier, and a packet that is not a CONNECT
+    bool truncated = parseConnect(packetOf(withHeader(0x10, mqttString("MQTT") +
+                                                            std::string("\x04\x02\x00\x3C", 4) +
+                                                            std::string("\x00\x08" "sens", 6))), view);
+    bool publish = parseConnect(packetOf(withHeader(0x30, mqttString("t"))), view);
+    assert(!truncated && !publish);
+    
+    std::cout << "CONNECT views test PASSED" << std::endl;
+}
+
+void testProperties() {
+    std::cout << "Testing MQTT 5 properties..." << std::endl;
+    
+    // Payload format (byte), topic alias (two byte), message expiry (four
+    // byte), subscription id (varint), content type, user property
+    std::string block = std::string("\x01\x01" "\x23\x00\x07" "\x02\x00\x00\x0E\x10" "\x0B\x81\x01", 13) +
+                        "\x03" + mqttString("text") + "\x26" + mqttString("k") + mqttString("v");
+    PropertyReader reader(ByteSpan{bytesOf(block), block.size()});
+    MqttProperty property;
+    bool more = reader.next(property);
+    assert(more && property.id == 0x01 && property.value == 1);
+    more = reader.next(property);
+    assert(more && property.id == mqtt::kPropertyTopicAlias && property.value == 7);
+    assert(property.encoded.size == 3);
+    more = reader.next(property);
+    assert(more && property.id == 0x02 && property.value == 3600);
+    more = reader.next(property);
+    assert(more && property.id == 0x0B && property.value == 129);
+    more = reader.next(property);
+    assert(more && property.id == 0x03 && sameBytes(property.data, "text"));
+    more = reader.next(property);
+    assert(more && property.id == 0x26 && property.data.size == 6);
+    more = reader.next(property);
+    assert(!more && !reader.error());
+    
+    // An empty block, unknown identifiers and values that overrun the block
+    std::string unknown("\x7F\x00", 2);
+    std::string overrun("\x27\x00\x01", 3);
+    bool empty = validProperties(ByteSpan());
+    bool unknownValid = validProperties(ByteSpan{bytesOf(unknown), unknown.size()});
+    bool overrunValid = validProperties(ByteSpan{bytesOf(overrun), overrun.size()});
+    assert(empty && !unknownValid && !overrunValid);
+    
+    std::cout << "MQTT 5 properties test PASSED" << std::endl;
+}
+
+void testDisconnectView() {
+    std::cout << "Testing DISCONNECT views..." << std::endl;
+    
+    DisconnectView view;
+    MqttPacket plain = packetOf(withHeader(0xE0, ""));
+    bool v4 = parseDisconnect(plain, 4, view);
+    bool v5 = parseDisconnect(plain, 5, view);
+    assert(v4 && v5 && view.reasonCode == 0);
+    
+    // Reason code with a session expiry interval
+    std::string withReason = withHeader(0xE0, std::string("\x04\x05\x11\x00\x00\x00\x00", 7));
+    MqttPacket packet = packetOf(withReason);
+    v5 = parseDisconnect(packet, 5, view);
+    assert(v5 && view.reasonCode == 0x04 && view.properties.size == 5);
+    v4 = parseDisconnect(packet, 4, view);
+    assert(!v4);
+    
+    bool overrun = parseDisconnect(packetOf(withHeader(0xE0, std::string("\x00\x09\x11", 3))), 5, view);
+    assert(!overrun);
+    
+    std::cout << "DISCONNECT views test PASSED" << std::endl;
+}
+
+void testConnackRewrite() {
+    std::cout << "Testing CONNACK rewriting..." << std::endl;
+    
+    ConnackLimits limits;
+    limits.receiveMaximum = 10;
+    limits.maximumPacketSize = 4096;
+    std::vector<uint8_t> out;
+    
+    // No properties from the broker: both limits are added
+    bool rewrote = rewriteConnack(packetOf(withHeader(0x20, std::string("\x00\x00\x00", 3))), limits, out);
+    const uint8_t expected[] = {0x20, 11, 0x00, 0x00, 8, 0x21, 0x00, 10, 0x27, 0x00, 0x00, 0x10, 0x00};
+    assert(rewrote && out.size() == sizeof(expected) && std::memcmp(out.data(), expected, sizeof(expected)) == 0);
+    
+    // The broker's lower Maximum Packet Size wins, its higher Receive
+    // Maximum is lowered, and other properties are kept
+    std::string broker = withHeader(0x20, std::string("\x01\x00\x0B" "\x21\x01\x00" "\x27\x00\x00\x04\x00"
+                                                      "\x22\x00\x05", 14));
+    rewrote = rewriteConnack(packetOf(broker), limits, out);
+    assert(rewrote);
+    MqttPacket rewritten;
+    bool complete = viewPacket(out.data(), out.size(), rewritten);
+    assert(complete && rewritten.size == out.size());
+    assert(rewritten.body()[0] == 0x01);
+    PropertyReader reader(ByteSpan{rewritten.body() + 3, rewritten.bodySize() - 3});
+    MqttProperty property;
+    uint32_t receiveMaximum = 0, maximumPacketSize = 0, topicAliasMaximum = 0;
+    while (reader.next(property)) {
+        if (property.id == mqtt::kPropertyReceiveMaximum) receiveMaximum = property.value;
+        if (property.id == mqtt::kPropertyMaximumPacketSize) maximumPacketSize = property.value;
+        if (property.id == 0x22) topicAliasMaximum = property.value;
+    }
+    assert(!reader.error() && rewritten.body()[2] == rewritten.bodySize() - 3);
+    assert(receiveMaximum == 10 && maximumPacketSize == 1024 && topicAliasMaximum == 5);
+    
+    // Topic Alias Maximum is lowered, never added
+    ConnackLimits aliasLimit;
+    aliasLimit.topicAliasMaximum = 2;
+    rewrote = rewriteConnack(packetOf(broker), aliasLimit, out);
+    complete = viewPacket(out.data(), out.size(), rewritten);
+    ConnackView connack;
+    bool parsed = parseConnack(rewritten, mqtt::kProtocolV5, connack);
+    assert(rewrote && complete && parsed);
+    PropertyReader aliasReader(connack.properties);
+    topicAliasMaximum = 0;
+    while (aliasReader.next(property)) {
+        if (property.id == mqtt::kPropertyTopicAliasMaximum) topicAliasMaximum = property.value;
+    }
+    assert(!aliasReader.error() && topicAliasMaximum == 2);
+    rewrote = rewriteConnack(packetOf(withHeader(0x20, std::string("\x00\x00\x00", 3))), aliasLimit, out);
+    const uint8_t noAliases[] = {0x20, 3, 0x00, 0x00, 0};
+    assert(rewrote && out.size() == sizeof(noAliases) && std::memcmp(out.data(), noAliases, sizeof(noAliases)) == 0);
+    
+    // Refused connections are left alone
+    rewrote = rewriteConnack(packetOf(withHeader(0x20, std::string("\x00\x87\x00", 3))), limits, out);
+    assert(!rewrote);
+    
+    // CONNACKs are parsed per protocol level, with nothing left over
+    parsed = parseConnack(packetOf(withHeader(0x20, std::string("\x01\x00", 2))), 4, connack);
+    assert(parsed && connack.ackFlags == 0x01 && connack.reasonCode == 0 && connack.properties.empty());
+    parsed = parseConnack(packetOf(broker), mqtt::kProtocolV5, connack);
+    assert(parsed && connack.ackFlags == 0x01 && connack.properties.size == 11);
+    bool leftOver = parseConnack(packetOf(broker), 4, connack);
+    bool shortProperties = parseConnack(packetOf(withHeader(0x20, std::string("\x00\x00\x05\x21", 4))), 5, connack);
+    bool notConnack = parseConnack(packetOf(withHeader(0xE0, "")), 5, connack);
+    assert(!leftOver && !shortProperties && !notConnack);
+    
+    // Refusals are encoded per protocol level; before MQTT 5 the only
+    // fitting code is "server unavailable"
+    uint8_t refusal[5];
+    size_t length = encodeConnackRefusal(mqtt::kConnectionRateExceeded, mqtt::kProtocolV5, refusal);
+    assert(length == 5 && refusal[0] == 0x20 && refusal[1] == 3 && refusal[3] == 0x9F && refusal[4] == 0);
+    length = encodeConnackRefusal(mqtt::kConnectionRateExceeded, 4, refusal);
+    assert(length == 4 && refusal[0] == 0x20 && refusal[1] == 2 && refusal[3] == mqtt::kServerUnavailable);
+    
+    std::cout << "CONNACK rewriting test PASSED" << std::endl;
+}
+
+void testInspectAndForwardAllocations() {
+    std::cout << "Testing the PUBLISH inspect path for heap allocations..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1e9;
+    policy.burstSize = 1000000000;
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    std::vector<TopicRule> rules;
+    std::string error;
+    bool parsed = parseTopicRules("factory/+/alarm 1000000; firmware/# deny", rules, error);
+    assert(parsed);
+    limiter.setTopicRules(rules);
+    auto handle = limiter.acquire("10.0.0.1", "sensor");
+    
+    std::string read;
+    for (int i = 0; i < 8; i++) {
+        read += withHeader(0x32, mqttString("factory/line" + std::to_string(i) + "/alarm") + std::string("\x00\x01", 2) +
+                                 std::string(100, 'p'));
+    }
+    
+    // The per-read state lives as long as the connection, as in forwardTraffic
+    MqttFramer framer;
+    std::vector<MqttPacket> packets;
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> sizes;
+    std::vector<std::string_view> topics;
+    packets.reserve(64);
+    types.reserve(64);
+    sizes.reserve(64);
+    topics.reserve(64);
+    bool passed[64];
+    bool denied[64];
+    
+    auto inspectRead = [&]() {
+        uint8_t* space = framer.prepare(read.size());
+        std::memcpy(space, read.data(), read.size());
+        framer.commit(read.size());
+        
+        packets.clear();
+        types.clear();
+        sizes.clear();
+        topics.clear();
+        MqttPacket packet;
+        while (framer.next(packet)) {
+            PublishView publish;
+            bool valid = parsePublish(packet, 4, publish) && isValidTopicName(publish.topic);
+            assert(valid);
+            packets.push_back(packet);
+            types.push_back(packet.type);
+            sizes.push_back(static_cast<uint32_t>(packet.size));
+            topics.push_back(publish.topic);
+        }
+        size_t allowed = limiter.allowPackets(handle, types.data(), sizes.data(), topics.data(), types.size(),
+                                              passed, clock->now(), nullptr, denied);
+        for (size_t i = 0; i < types.size(); i++) {
+            assert(!denied[i]);
+        }
+        return allowed;
+    };
+    
+    // The first read sizes the framer and creates the topic buckets
+    size_t allowed = inspectRead();
+    assert(allowed == 8);
+    
+    size_t before = allocations.load();
+    for (int i = 0; i < 1000; i++) {
+        allowed = inspectRead();
+        assert(allowed == 8);
+    }
+    assert(allocations.load() == before);
+    (void)allowed;
+    
+    std::cout << "Inspect path allocations test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running packet view tests..." << std::endl << std::endl;
+    
+    try {
+        testPublishView();
+        std::cout << std::endl;
+        
+        testPublishTopicRewrite();
+        std::cout << std::endl;
+        
+        testConnectView();
+        std::cout << std::endl;
+        
+        testProperties();
+        std::cout << std::endl;
+        
+        testDisconnectView();
+        std::cout << std::endl;
+        
+        testConnackRewrite();
+        std::cout << std::endl;
+        
+        testInspectAndForwardAllocations();
+        std::cout << std::endl;
+        
+        std::cout << "All packet view tests PASSED!" << std::endl;
+        return 0;
+    
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -1,4 +1,5 @@
 #include "throttlebox/rate_limiter.hpp"
+#include "throttlebox/metrics.hpp"
 #include <iostream>
 #include <thread>
 #include <chrono>
@@ -127,6 +128,407 @@ void testStatistics() {
     std::cout << "  Total clients: " << stats.totalClients << std::endl;
 }
 
+void testClientCountTracking() {
+    std::cout << "Testing incremental client and block counts..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1.0;
+    policy.burstSize = 1;
+    policy.blockDurationSec = 1;
+    
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    Metrics metrics;
+    limiter.bindMetrics(metrics);
+    
+    limiter.allow("10.0.0.1", "counted_a");
+    limiter.allow("10.0.0.2", "counted_b");
+    limiter.allow("10.0.0.2", "counted_b"); // Exhausts b and blocks it
+    
+    auto stats = limiter.getStats();
+    assert(stats.totalClients == 2 && "Should track 2 clients");
+    assert(stats.blockedClients == 1 && "Only counted_b should be blocked");
+    assert(metrics.gauge("unique_clients") == 2);
+    assert(metrics.gauge("blocked_clients") == 1);
+    
+    // Blocked clients stay counted once, however many messages they send
+    limiter.allow("10.0.0.2", "counted_b");
+    limiter.allow("10.0.0.2", "counted_b");
+    assert(limiter.getStats().blockedClients == 1);
+    
+    // The block lapses without any further traffic from the client, and
+    // reading the stats through a const reference retires it
+    clock->advance(std::chrono::milliseconds(1100));
+    const RateLimiter& reader = limiter;
+    stats = reader.getStats();
+    assert(stats.blockedClients == 0 && "Expired block should no longer count");
+    assert(stats.totalClients == 2);
+    assert(metrics.gauge("blocked_clients") == 0);
+    
+    std::cout << "Client count tracking test PASSED" << std::endl;
+}
+
+void testExplicitTime() {
+    std::cout << "Testing decisions at explicit times..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 10.0;
+    policy.burstSize = 5;
+    policy.blockDurationSec = 0;
+    
+    // The same timestamps always give the same decisions
+    auto replay = [&policy]() {
+        RateLimiter limiter(policy);
+        auto start = std::chrono::steady_clock::time_point(std::chrono::hours(1));
+        std::string decisions;
+        for (int i = 0; i < 6; i++) {
+            decisions += limiter.check("10.0.0.1", "replayed", start).allowed ? 'A' : 'L';
+        }
+        // 100ms later exactly one token has been refilled
+        decisions += limiter.check("10.0.0.1", "replayed", start + std::chrono::milliseconds(100)).allowed ? 'A' : 'L';
+        decisions += limiter.check("10.0.0.1", "replayed", start + std::chrono::milliseconds(100)).allowed ? 'A' : 'L';
+        // A time before the last refill refills nothing
+        decisions += limiter.check("10.0.0.1", "replayed", start).allowed ? 'A' : 'L';
+        return decisions;
+    };
+    
+    std::string first = replay();
+    assert(first == "AAAAALALL");
+    assert(replay() == first);
+    
+    std::cout << "Explicit time test PASSED" << std::endl;
+}
+
+void testSubMillisecondRefill() {
+    std::cout << "Testing refill at full clock resolution..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1000.0;
+    policy.burstSize = 10;
+    policy.blockDurationSec = 0;
+    
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    while (limiter.allow("10.0.0.1", "fast_sender")) {
+    }
+    
+    // Every 1.5ms earns 1.5 tokens; whole-millisecond truncation would
+    // only credit 1 and fall behind the configured rate
+    int allowed = 0;
+    for (int i = 0; i < 1000; i++) {
+        clock->advance(std::chrono::microseconds(1500));
+        while (limiter.allow("10.0.0.1", "fast_sender")) {
+            allowed++;
+        }
+    }
+    assert(allowed >= 1499 && allowed <= 1500 && "Should receive 1.5s worth of tokens");
+    
+    // Time readings are shared with whoever holds the clock
+    assert(limiter.clock().now() == clock->now());
+    
+    std::cout << "Sub-millisecond refill test PASSED" << std::endl;
+}
+
+void testAllowN() {
+    std::cout << "Testing batched decisions for one client..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 10.0;
+    policy.burstSize = 5;
+    policy.blockDurationSec = 0;
+    
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    auto handle = limiter.acquire("10.0.0.1", "batched");
+    assert(handle.valid());
+    
+    RateLimitDecision last;
+    assert(limiter.allowN(handle, 3, &last) == 3 && last.allowed);
+    assert(limiter.allowN(handle, 3, &last) == 2 && !last.allowed && !last.blocked);
+    assert(limiter.allowN(handle, 1) == 0);
+    
+    // Handles and per-message checks share the same bucket
+    clock->advance(std::chrono::milliseconds(100));
+    assert(limiter.check("10.0.0.1", "batched").allowed);
+    assert(!limiter.check("10.0.0.1", "batched").allowed);
+    
+    auto stats = limiter.getStats();
+    assert(stats.allowedMessages == 6);
+    assert(stats.blockedMessages == 3);
+    assert(stats.totalClients == 1);
+    
+    // A short batch blocks the client like a rejected single message
+    policy.blockDurationSec = 10;
+    RateLimiter blocking(policy, clock);
+    auto blocked = blocking.acquire("10.0.0.2", "");
+    assert(blocking.allowN(blocked, 8, &last) == 5 && !last.allowed);
+    clock->advance(std::chrono::seconds(1));
+    assert(blocking.allowN(blocked, 1, &last) == 0 && last.blocked);
+    
+    std::cout << "allowN test PASSED" << std::endl;
+}
+
+void testAllowBatch() {
+    std::cout << "Testing batched decisions across clients..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1.0;
+    policy.burstSize = 4;
+    policy.blockDurationSec = 0;
+    
+    RateLimiter limiter(policy, std::make_shared<VirtualClock>());
+    RateLimitPolicy generous = policy;
+    generous.burstSize = 100;
+    limiter.setClientPolicy("generous", generous);
+    
+    auto a = limiter.acquire("10.0.0.1", "regular");
+    auto b = limiter.acquire("10.0.0.2", "generous");
+    assert(a.level() == PolicyLevel::Default);
+    assert(b.level() == PolicyLevel::Client);
+    
+    RateLimiter::BatchEntry entries[2];
+    entries[0].handle = &a;
+    entries[0].count = 10;
+    entries[1].handle = &b;
+    entries[1].count = 10;
+    limiter.allowBatch(entries, 2);
+    
+    assert(entries[0].allowed == 4);
+    assert(entries[1].allowed == 10);
+    assert(limiter.getStats().allowedMessages == 14);
+    assert(limiter.getStats().blockedMessages == 6);
+    
+    std::cout << "allowBatch test PASSED" << std::endl;
+}
+
+void testHandlePinsBucket() {
+    std::cout << "Testing handles pin buckets against cleanup..." << std::endl;
+    
+    RateLimitPolicy policy;
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    
+    auto handle = limiter.acquire("10.0.0.1", "long_lived");
+    limiter.allowN(handle, 1);
+    limiter.allow("10.0.0.2", "short_lived");
+    
+    clock->advance(std::chrono::hours(2));
+    limiter.cleanupExpired();
+    assert(limiter.getStats().totalClients == 1 && "Only the unpinned idle bucket goes");
+    
+    // Moving a handle keeps a single pin
+    RateLimiter::ClientHandle moved = std::move(handle);
+    assert(!handle.valid() && moved.valid());
+    limiter.cleanupExpired();
+    assert(limiter.getStats().totalClients == 1);
+    
+    moved.reset();
+    limiter.cleanupExpired();
+    assert(limiter.getStats().totalClients == 0);
+    
+    std::cout << "Handle pinning test PASSED" << std::endl;
+}
+
+void testShapeModeRetryAfter() {
+    std::cout << "Testing shape mode retry times..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 4.0;
+    policy.burstSize = 2;
+    policy.blockDurationSec = 30;
+    policy.mode = LimitMode::Shape;
+    
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    auto handle = limiter.acquire("10.0.0.1", "shaped");
+    assert(handle.policy().mode == LimitMode::Shape);
+    
+    // An empty bucket reports when the next token lands instead of blocking
+    RateLimitDecision last;
+    assert(limiter.allowN(handle, 3, &last) == 2);
+    assert(!last.allowed && !last.blocked);
+    assert(last.retryAfter == std::chrono::milliseconds(250));
+    assert(limiter.getStats().blockedClients == 0);
+    
+    clock->advance(last.retryAfter);
+    assert(limiter.allowN(handle, 1, &last) == 1 && last.retryAfter.count() == 0);
+    
+    // Drop mode reports the block's remaining time
+    policy.mode = LimitMode::Drop;
+    RateLimiter dropping(policy, clock);
+    auto dropped = dropping.acquire("10.0.0.2", "");
+    assert(dropping.allowN(dropped, 3) == 2);
+    clock->advance(std::chrono::seconds(10));
+    last = dropping.check("10.0.0.2", "");
+    assert(last.blocked && last.retryAfter == std::chrono::seconds(20));
+    
+    std::cout << "Shape mode retry test PASSED" << std::endl;
+}
+
+void testPacketBudgets() {
+    std::cout << "Testing per-packet-type budgets..." << std::endl;
+    
+    const uint8_t kPublish = 3, kSubscribe = 8, kPingreq = 12;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1.0;
+    policy.burstSize = 4;
+    policy.blockDurationSec = 10;
+    policy.packetBudgets[static_cast<size_t>(PacketClass::Subscribe)].weight = 2.0;
+    policy.packetBudgets[static_cast<size_t>(PacketClass::Ping)].maxPerSec = 0.5;
+    assert(classifyPacket(kPingreq) == PacketClass::Ping && classifyPacket(10) == PacketClass::Subscribe);
+    
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    auto handle = limiter.acquire("10.0.0.1", "typed");
+    
+    // A SUBSCRIBE costs two tokens, so the third PUBLISH finds the bucket
+    // empty, but the PINGREQ after it has a bucket of its own
+    uint8_t types[] = {kSubscribe, kPublish, kPublish, kPublish, kPingreq};
+    bool allowed[5];
+    RateLimitDecision last;
+    assert(limiter.allowPackets(handle, types, nullptr, nullptr, 5, allowed, clock->now(), &last) == 4);
+    assert(allowed[0] && allowed[1] && allowed[2] && !allowed[3] && allowed[4]);
+    assert(!last.allowed && !last.blocked);
+    
+    // The shared bucket is now blocked; pings only wait for their own refill
+    clock->advance(std::chrono::seconds(1));
+    uint8_t ping[] = {kPingreq, kPublish};
+    assert(limiter.allowPackets(handle, ping, nullptr, nullptr, 2, allowed, clock->now(), &last) == 0);
+    assert(last.retryAfter == std::chrono::seconds(1));
+    clock->advance(std::chrono::seconds(1));
+    assert(limiter.allowPackets(handle, ping, nullptr, nullptr, 2, allowed, clock->now(), &last) == 1);
+    assert(allowed[0] && !allowed[1] && last.blocked);
+    
+    // In order: nothing after the first rejection from a bucket is charged
+    // to it, but the PINGREQ is decided against its own bucket
+    RateLimitPolicy unblocked = policy;
+    unblocked.blockDurationSec = 0;
+    RateLimiter ordered(unblocked, clock);
+    auto orderedHandle = ordered.acquire("10.0.0.2", "ordered");
+    uint8_t burst[] = {kSubscribe, kSubscribe, kPublish, kPublish, kPingreq};
+    size_t passed = ordered.allowPacketsInOrder(orderedHandle, burst, nullptr, nullptr, 5, allowed,
+                                                clock->now(), &last);
+    assert(passed == 3 && allowed[0] && allowed[1] && !allowed[2] && !allowed[3] && allowed[4]);
+    assert(last.retryAfter == std::chrono::seconds(1));
+    
+    // The soonest bucket to refill sets retryAfter; waiting buckets are
+    // not decided at all
+    clock->advance(std::chrono::seconds(1));
+    passed = ordered.allowPacketsInOrder(orderedHandle, burst + 3, nullptr, nullptr, 2, allowed,
+                                         clock->now(), &last, 1u << unblocked.bucketOf(PacketClass::Publish));
+    assert(passed == 0 && last.retryAfter == std::chrono::seconds(1));
+    passed = ordered.allowPacketsInOrder(orderedHandle, burst + 3, nullptr, nullptr, 1, allowed, clock->now());
+    assert(passed == 1);
+    
+    std::cout << "Per-packet-type budgets test PASSED" << std::endl;
+}
+
+void testByteBudget() {
+    std::cout << "Testing byte-rate limiting..." << std::endl;
+    
+    const uint8_t kPublish = 3;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1000.0;
+    policy.burstSize = 1000;
+    policy.blockDurationSec = 0;
+    policy.maxBytesPerSec = 1000.0;
+    policy.byteBurst = 4000.0;
+    
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    auto handle = limiter.acquire("10.0.0.1", "bulky");
+    
+    // Plenty of messages left, but the third 1500-byte packet exceeds the bytes
+    uint8_t types[] = {kPublish, kPublish, kPublish, kPublish};
+    uint32_t sizes[] = {1500, 1500, 1500, 20};
+    bool allowed[4];
+    RateLimitDecision last;
+    assert(limiter.allowPackets(handle, types, sizes, nullptr, 4, allowed, clock->now(), &last) == 3);
+    assert(allowed[0] && allowed[1] && !allowed[2] && allowed[3]);
+    assert(last.retryAfter == std::chrono::milliseconds(500) && last.overQuota);
+    
+    // Plus the 20 bytes the packet after the rejection took
+    clock->advance(std::chrono::milliseconds(520));
+    assert(limiter.allowPackets(handle, types, sizes, nullptr, 1, allowed, clock->now()) == 1);
+    
+    // Larger than the whole byte bucket: passes only from a full bucket,
+    // then the debt holds back the next packet until it is repaid
+    uint32_t huge[] = {10000, 20};
+    assert(limiter.allowPacketsInOrder(handle, types, huge, nullptr, 1, allowed, clock->now()) == 0);
+    clock->advance(std::chrono::seconds(4));
+    assert(limiter.allowPacketsInOrder(handle, types, huge, nullptr, 2, allowed, clock->now(), &last) == 1);
+    assert(last.retryAfter == std::chrono::milliseconds(6020));
+    
+    // Without sizes only messages are counted
+    assert(limiter.allowPacketsInOrder(handle, types, nullptr, nullptr, 4, allowed, clock->now()) == 4);
+    
+    std::cout << "Byte-rate limiting test PASSED" << std::endl;
+}
+
+void testIdentityKeys() {
+    std::cout << "Testing identity keys..." << std::endl;
+    
+    IdentityKey key;
+    assert(identityOf(key, "10.0.0.1", "sensor", "bob") == "c:sensor");
+    assert(identityOf(key, "10.0.0.1", "", "bob") == "ip:10.0.0.1");
+    
+    bool parsed = parseIdentityKey("username", key);
+    assert(parsed && !key.clientId && key.username && !key.ip);
+    assert(identityOf(key, "10.0.0.1", "sensor", "bob") == "u:bob");
+    assert(identityOf(key, "10.0.0.1", "sensor", "") == "ip:10.0.0.1");
+    
+    // A username spelled like an address is not that address's bucket
+    assert(identityOf(key, "10.0.0.2", "sensor", "10.0.0.1") != identityOf(key, "10.0.0.1", "sensor", ""));
+    
+    parsed = parseIdentityKey("client_id+ip", key);
+    assert(parsed && key.clientId && !key.username && key.ip);
+    assert(identityOf(key, "10.0.0.1", "sensor", "") == std::string("c:sensor\0" "ip:10.0.0.1", 20));
+    
+    IdentityKey unchanged = key;
+    bool unknown = parseIdentityKey("certificate", key);
+    bool trailing = parseIdentityKey("ip+", key);
+    bool empty = parseIdentityKey("", key);
+    assert(!unknown && !trailing && !empty);
+    assert(key.clientId == unchanged.clientId && key.ip == unchanged.ip);
+    
+    // Keyed on the address, a new client ID per connection gets no new bucket
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1.0;
+    policy.burstSize = 3;
+    policy.blockDurationSec = 0;
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    parsed = parseIdentityKey("ip", key);
+    assert(parsed);
+    {
+        auto first = limiter.acquireIdentity(identityOf(key, "10.0.0.1", "id-1", ""), "id-1");
+        assert(limiter.allowN(first, 2, clock->now()) == 2);
+    }
+    auto second = limiter.acquireIdentity(identityOf(key, "10.0.0.1", "id-2", ""), "id-2");
+    assert(limiter.allowN(second, 2, clock->now()) == 1);
+    assert(limiter.getStats().totalClients == 1);
+    
+    // A block outlives the connection that earned it, for the next CONNECT
+    policy.blockDurationSec = 10;
+    RateLimiter blocking(policy, clock);
+    std::string identity = identityOf(key, "10.0.0.1", "id-1", "");
+    {
+        auto handle = blocking.acquireIdentity(identity, "id-1");
+        size_t passed = blocking.allowN(handle, 4, clock->now());
+        assert(passed == 3);
+    }
+    bool blocked = blocking.isBlocked(identity);
+    bool otherBlocked = blocking.isBlocked(identityOf(key, "10.0.0.2", "id-1", ""));
+    assert(blocked && !otherBlocked);
+    clock->advance(std::chrono::seconds(11));
+    blocked = blocking.isBlocked(identity);
+    assert(!blocked);
+    
+    std::cout << "Identity keys test PASSED" << std::endl;
+}
+
 int main() {
     std::cout << "Running RateLimiter tests..." << std::endl << std::endl;
     
@@ -143,6 +545,36 @@ int main() {
         testStatistics();
         std::cout << std::endl;
         
+        testClientCountTracking();
+        std::cout << std::endl;
+        
+        testExplicitTime();
+        std::cout << std::endl;
+        
+        testSubMillisecondRefill();
+        std::cout << std::endl;
+        
+        testAllowN();
+        std::cout << std::endl;
+        
+        testAllowBatch();
+        std::cout << std::endl;
+        
+        testHandlePinsBucket();
+        std::cout << std::endl;
+        
+        testShapeModeRetryAfter();
+        std::cout << std::endl;
+        
+        testPacketBudgets();
+        std::cout << std::endl;
+        
+        testByteBudget();
+        std::cout << std::endl;
+        
+        testIdentityKeys();
+        std::cout << std::endl;
+        
         std::cout << "All RateLimiter tests PASSED!" << std::endl;
         return 0;
         
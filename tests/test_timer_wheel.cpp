@@ -0,0 +1,123 @@
+#include "throttlebox/timer_wheel.hpp"
+#include "throttlebox/packet_queue.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cassert>
+
+using namespace throttlebox;
+using namespace std::chrono;
+
+void testFiresInDeadlineOrder() {
+    std::cout << "Testing timers fire at their deadline..." << std::endl;
+    
+    steady_clock::time_point start(hours(1));
+    TimerWheel wheel(start, milliseconds(1), 8);
+    std::vector<int> fired;
+    
+    wheel.schedule(start + milliseconds(5), [&]() { fired.push_back(5); });
+    wheel.schedule(start + milliseconds(2), [&]() { fired.push_back(2); });
+    // Past one revolution: shares a slot with the 5 ms timer
+    wheel.schedule(start + milliseconds(13), [&]() { fired.push_back(13); });
+    assert(wheel.pending() == 3);
+    
+    assert(wheel.advance(start + milliseconds(1)) == 0);
+    assert(wheel.advance(start + milliseconds(2)) == 1 && fired.back() == 2);
+    assert(wheel.advance(start + milliseconds(6)) == 1 && fired.back() == 5);
+    assert(wheel.advance(start + milliseconds(12)) == 0);
+    assert(wheel.advance(start + milliseconds(13)) == 1 && fired.back() == 13);
+    assert(wheel.pending() == 0);
+    
+    // Sub-tick deadlines round up rather than firing early
+    wheel.schedule(start + milliseconds(20) + microseconds(100), [&]() { fired.push_back(20); });
+    assert(wheel.advance(start + milliseconds(20)) == 0);
+    assert(wheel.advance(start + milliseconds(21)) == 1);
+    
+    // Deadlines already passed fire on the next advance
+    wheel.schedule(start, [&]() { fired.push_back(0); });
+    assert(wheel.advance(start + milliseconds(22)) == 1 && fired.back() == 0);
+    
+    std::cout << "Deadline order test PASSED" << std::endl;
+}
+
+void testCancelAndStall() {
+    std::cout << "Testing cancel and long stalls..." << std::endl;
+    
+    steady_clock::time_point start(hours(1));
+    TimerWheel wheel(start, milliseconds(1), 16);
+    int fired = 0;
+    
+    auto cancelled = wheel.schedule(start + milliseconds(3), [&]() { fired += 100; });
+    for (int i = 1; i <= 50; i++) {
+        wheel.schedule(start + milliseconds(i * 7), [&]() { fired++; });
+    }
+    assert(wheel.cancel(cancelled));
+    assert(!wheel.cancel(cancelled));
+    
+    // A stall many revolutions long visits each slot once and fires everything due
+    assert(wheel.advance(start + milliseconds(200)) == 28);
+    assert(fired == 28 && wheel.pending() == 22);
+    assert(wheel.advance(start + seconds(10)) == 22);
+    
+    // Callbacks may schedule further timers
+    wheel.schedule(start + seconds(11), [&]() {
+        wheel.schedule(start + seconds(12), [&]() { fired = -1; });
+    });
+    wheel.advance(start + seconds(11));
+    assert(wheel.pending() == 1);
+    wheel.advance(start + seconds(12));
+    assert(fired == -1);
+    
+    std::cout << "Cancel and stall test PASSED" << std::endl;
+}
+
+void testPacketQueue() {
+    std::cout << "Testing shaping packet queue..." << std::endl;
+    
+    PacketQueue queue;
+    std::string a = "aaaa", b = "bb", c = "cccccc";
+    queue.push(reinterpret_cast<const uint8_t*>(a.data()), a.size());
+    queue.push(reinterpret_cast<const uint8_t*>(b.data()), b.size());
+    queue.push(reinterpret_cast<const uint8_t*>(c.data()), c.size());
+    assert(queue.packets() == 3 && queue.bytes() == 12);
+    
+    // The first n packets are contiguous
+    assert(queue.frontBytes(2) == 6);
+    assert(std::memcmp(queue.front(), "aaaabb", 6) == 0);
+    
+    queue.pop(1);
+    assert(queue.packets() == 2 && queue.bytes() == 8);
+    assert(std::memcmp(queue.front(), "bbcccccc", 8) == 0);
+    
+    // Pushing after a pop compacts without reordering
+    queue.push(reinterpret_cast<const uint8_t*>(a.data()), a.size());
+    assert(queue.bytes() == 12 && std::memcmp(queue.front(), "bbccccccaaaa", 12) == 0);
+    
+    queue.pop(3);
+    assert(queue.empty() && queue.bytes() == 0);
+    
+    std::cout << "Packet queue test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running TimerWheel tests..." << std::endl << std::endl;
+    
+    try {
+        testFiresInDeadlineOrder();
+        std::cout << std::endl;
+        
+        testCancelAndStall();
+        std::cout << std::endl;
+        
+        testPacketQueue();
+        std::cout << std::endl;
+        
+        std::cout << "All TimerWheel tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
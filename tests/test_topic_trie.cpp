@@ -0,0 +1,175 @@
+#include "throttlebox/topic_trie.hpp"
+#include "throttlebox/rate_limiter.hpp"
+#include <iostream>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cassert>
+
+using namespace throttlebox;
+
+namespace {
+
+std::vector<uint32_t> matches(const TopicTrie& trie, std::string_view topic) {
+    std::vector<uint32_t> found;
+    trie.forEachMatch(topic, [&](uint32_t rule) { found.push_back(rule); });
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+TopicRule rule(const std::string& filter, double rate = 1.0) {
+    TopicRule topicRule;
+    topicRule.filter = filter;
+    topicRule.maxMessagesPerSec = rate;
+    return topicRule;
+}
+
+} // namespace
+
+void testWildcardMatching() {
+    std::cout << "Testing topic filter matching..." << std::endl;
+    
+    TopicTrie trie({rule("factory/+/alarm"), rule("factory/#"), rule("factory/line1/alarm"),
+                    rule("#"), rule("+/+"), rule("$SYS/#")});
+    
+    using Rules = std::vector<uint32_t>;
+    assert(matches(trie, "factory/line1/alarm") == (Rules{0, 1, 2, 3}));
+    assert(matches(trie, "factory/line2/alarm") == (Rules{0, 1, 3}));
+    assert(matches(trie, "factory/line2/alarm/extra") == (Rules{1, 3}));
+    
+    // "#" also matches its parent level
+    assert(matches(trie, "factory") == (Rules{1, 3}));
+    assert(matches(trie, "factory/x") == (Rules{1, 3, 4}));
+    
+    // '+' matches empty levels too
+    assert(matches(trie, "factory//alarm") == (Rules{0, 1, 3}));
+    assert(matches(trie, "other") == (Rules{3}));
+    
+    // Wildcards at the first level never match '$' topics
+    assert(matches(trie, "$SYS/uptime") == (Rules{5}));
+    assert(matches(TopicTrie(), "factory").empty());
+    
+    // Moving keeps the level keys valid
+    TopicTrie moved = std::move(trie);
+    assert(matches(moved, "factory/line1/alarm") == (Rules{0, 1, 2, 3}));
+    
+    std::cout << "Topic filter matching test PASSED" << std::endl;
+}
+
+void testParseRules() {
+    std::cout << "Testing topic rule parsing..." << std::endl;
+    
+    std::vector<TopicRule> rules;
+    std::string error;
+    assert(parseTopicRules("factory/+/alarm 1; firmware/# deny;telemetry/# 50/100;", rules, error));
+    assert(rules.size() == 3);
+    assert(rules[0].filter == "factory/+/alarm" && rules[0].maxMessagesPerSec == 1.0 && !rules[0].deny);
+    assert(rules[1].filter == "firmware/#" && rules[1].deny);
+    assert(rules[2].maxMessagesPerSec == 50.0 && rules[2].burstSize == 100 && rules[2].capacity() == 100);
+    
+    assert(isValidTopicFilter("+") && isValidTopicFilter("a/+/#") && isValidTopicFilter("/a/"));
+    assert(!isValidTopicFilter("") && !isValidTopicFilter("a/#/b") && !isValidTopicFilter("a+/b"));
+    
+    assert(!parseTopicRules("a/#/b 1", rules, error));
+    assert(!parseTopicRules("a/b", rules, error));
+    assert(!parseTopicRules("a/b fast", rules, error));
+    assert(!parseTopicRules("a/b 0", rules, error));
+    assert(!parseTopicRules("a/b 1 2", rules, error));
+    
+    std::cout << "Topic rule parsing test PASSED" << std::endl;
+}
+
+void testTopicBuckets() {
+    std::cout << "Testing per-topic limits and deny rules..." << std::endl;
+    
+    RateLimitPolicy policy;
+    policy.maxMessagesPerSec = 1000.0;
+    policy.burstSize = 1000;
+    policy.blockDurationSec = 60;
+    
+    auto clock = std::make_shared<VirtualClock>();
+    RateLimiter limiter(policy, clock);
+    std::vector<TopicRule> rules;
+    std::string error;
+    assert(parseTopicRules("factory/+/alarm 1; factory/# 3; firmware/# deny", rules, error));
+    limiter.setTopicRules(rules);
+    assert(limiter.hasTopicRules());
+    
+    auto handle = limiter.acquire("10.0.0.1", "sensor");
+    auto other = limiter.acquire("10.0.0.2", "other");
+    const uint8_t kPublish = 3;
+    uint8_t types[] = {kPublish, kPublish, kPublish, kPublish};
+    bool allowed[4];
+    RateLimitDecision last;
+    
+    // One alarm per second; other topics only count against factory/#
+    std::string_view alarms[] = {"factory/a/alarm", "factory/b/alarm", "factory/a/temp", "plant/x"};
+    assert(limiter.allowPackets(handle, types, nullptr, alarms, 4, allowed, clock->now(), &last) == 3);
+    assert(allowed[0] && !allowed[1] && allowed[2] && allowed[3]);
+    assert(last.retryAfter == std::chrono::seconds(1) && !last.blocked);
+    
+    // A topic rejection never blocks the client
+    std::string_view plain[] = {"plant/x"};
+    assert(limiter.allowPackets(handle, types, nullptr, plain, 1, allowed, clock->now()) == 1);
+    
+    // factory/# has one token left; a rejected alarm does not take it
+    assert(limiter.allowPackets(handle, types, nullptr, alarms, 1, allowed, clock->now()) == 0);
+    assert(limiter.allowPackets(handle, types, nullptr, alarms + 2, 1, allowed, clock->now()) == 1);
+    assert(limiter.allowPackets(handle, types, nullptr, alarms + 2, 1, allowed, clock->now()) == 0);
+    
+    // Buckets are per client
+    assert(limiter.allowPackets(other, types, nullptr, alarms, 1, allowed, clock->now()) == 1);
+    
+    clock->advance(std::chrono::seconds(1));
+    assert(limiter.allowPackets(handle, types, nullptr, alarms, 1, allowed, clock->now()) == 1);
+    
+    // Deny rules refuse whatever the budget
+    std::string_view firmware[] = {"firmware/v2/image"};
+    assert(limiter.topicDenied("firmware/v2/image") && !limiter.topicDenied("factory/a/alarm"));
+    assert(limiter.allowPacketsInOrder(handle, types, nullptr, firmware, 1, allowed, clock->now(), &last) == 0);
+    assert(last.denied);
+    
+    // Denials are reported per packet from the same pass. In order, a
+    // denied publish does not hold back the ones behind it, and one behind
+    // a waiting bucket is still reported.
+    std::string_view mixed[] = {"firmware/v2/image", "plant/x"};
+    bool denied[2];
+    size_t passed = limiter.allowPacketsInOrder(handle, types, nullptr, mixed, 2, allowed, clock->now(), &last,
+                                                0, denied);
+    assert(passed == 1 && !allowed[0] && denied[0] && allowed[1] && !denied[1]);
+    uint32_t waiting = 1u << policy.bucketOf(PacketClass::Publish);
+    passed = limiter.allowPacketsInOrder(handle, types, nullptr, mixed, 2, allowed, clock->now(), &last,
+                                         waiting, denied);
+    assert(passed == 0 && denied[0] && !denied[1]);
+    passed = limiter.allowPackets(handle, types, nullptr, mixed, 2, allowed, clock->now(), &last, denied);
+    assert(passed == 1 && denied[0] && !denied[1]);
+    
+    // Replacing the rules resets their buckets
+    limiter.setTopicRules({});
+    assert(!limiter.hasTopicRules());
+    assert(limiter.allowPackets(handle, types, nullptr, firmware, 1, allowed, clock->now()) == 1);
+    
+    std::cout << "Per-topic limits test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running TopicTrie tests..." << std::endl << std::endl;
+    
+    try {
+        testWildcardMatching();
+        std::cout << std::endl;
+        
+        testParseRules();
+        std::cout << std::endl;
+        
+        testTopicBuckets();
+        std::cout << std::endl;
+        
+        std::cout << "All TopicTrie tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
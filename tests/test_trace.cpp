@@ -0,0 +1,97 @@
+#include "throttlebox/trace.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cassert>
+#include <unistd.h>
+
+using namespace throttlebox;
+
+void testRoundTrip() {
+    std::cout << "Testing trace round trip..." << std::endl;
+    
+    const std::string path = "test_trace_roundtrip.bin";
+    {
+        TraceWriter writer(path);
+        assert(writer.isOpen());
+        writer.record(1000, "192.168.1.100", "sensor_001", 3, 42);
+        writer.record(2000, "10.0.0.1", "", 12, 2);
+        writer.record(3000, "10.0.0.2", std::string(300, 'x'), 1, 120);
+        assert(writer.eventsWritten() == 3);
+    }
+    
+    TraceReader reader(path);
+    assert(reader.isOpen());
+    assert(reader.header().version == TraceWriter::kVersion);
+    assert(reader.header().wallStartNs > 0);
+    
+    std::vector<TraceEvent> events;
+    TraceEvent event;
+    while (reader.next(event)) {
+        events.push_back(event);
+    }
+    
+    assert(events.size() == 3);
+    assert(events[0].timestampNs == 1000);
+    assert(events[0].ip == "192.168.1.100");
+    assert(events[0].clientId == "sensor_001");
+    assert(events[0].packetType == 3);
+    assert(events[0].size == 42);
+    assert(events[1].clientId.empty());
+    assert(events[1].packetType == 12);
+    assert(events[2].clientId.size() == 300);
+    
+    std::remove(path.c_str());
+    std::cout << "Trace round trip test PASSED" << std::endl;
+}
+
+void testRejectsForeignFiles() {
+    std::cout << "Testing foreign and truncated files..." << std::endl;
+    
+    const std::string path = "test_trace_foreign.bin";
+    FILE* file = std::fopen(path.c_str(), "wb");
+    std::fputs("definitely not a throttlebox trace file", file);
+    std::fclose(file);
+    assert(!TraceReader(path).isOpen());
+    assert(!TraceReader("does_not_exist.bin").isOpen());
+    
+    // A record cut short ends the stream instead of yielding garbage
+    {
+        TraceWriter writer(path);
+        writer.record(1000, "10.0.0.1", "complete", 3, 10);
+        writer.record(2000, "10.0.0.1", "truncated", 3, 10);
+    }
+    file = std::fopen(path.c_str(), "rb+");
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fclose(file);
+    assert(truncate(path.c_str(), size - 3) == 0);
+    
+    TraceReader reader(path);
+    TraceEvent event;
+    assert(reader.next(event) && event.clientId == "complete");
+    assert(!reader.next(event));
+    
+    std::remove(path.c_str());
+    std::cout << "Foreign file test PASSED" << std::endl;
+}
+
+int main() {
+    std::cout << "Running Trace tests..." << std::endl << std::endl;
+    
+    try {
+        testRoundTrip();
+        std::cout << std::endl;
+        
+        testRejectsForeignFiles();
+        std::cout << std::endl;
+        
+        std::cout << "All Trace tests PASSED!" << std::endl;
+        return 0;
+        
+    } catch (const std::exception& e) {
+        std::cerr << "Test failed with exception: " << e.what() << std::endl;
+        return 1;
+    }
+}
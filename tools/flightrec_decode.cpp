@@ -0,0 +1,154 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <ctime>
+#include <cstdio>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include "throttlebox/flight_recorder.hpp"
+#include "throttlebox/rate_limiter.hpp"
+
+using namespace throttlebox;
+
+namespace {
+
+const char* packetTypeName(uint8_t type) {
+    static const char* names[16] = {
+        "RESERVED", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+        "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "AUTH"
+    };
+    return names[type & 0x0F];
+}
+
+const char* decisionName(uint8_t decision) {
+    switch (static_cast<FlightDecision>(decision)) {
+        case FlightDecision::Allowed: return "ALLOWED";
+        case FlightDecision::Limited: return "LIMITED";
+        case FlightDecision::Blocked: return "BLOCKED";
+        case FlightDecision::Delayed: return "DELAYED";
+        case FlightDecision::Denied: return "DENIED";
+    }
+    return "UNKNOWN";
+}
+
+const char* policyLevelName(uint8_t level) {
+    switch (static_cast<PolicyLevel>(level)) {
+        case PolicyLevel::Default: return "default";
+        case PolicyLevel::Client: return "client";
+    }
+    return "unknown";
+}
+
+std::string formatIpv4(uint32_t ipv4) {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u",
+             (ipv4 >> 24) & 0xFF, (ipv4 >> 16) & 0xFF, (ipv4 >> 8) & 0xFF, ipv4 & 0xFF);
+    return text;
+}
+
+// Event timestamps are steady_clock; the dump header pairs steady and wall
+// time so every event can be shown in UTC
+std::string formatWallTime(const FlightRecorder::DumpHeader& header, uint64_t steadyNs) {
+    int64_t wallNs = static_cast<int64_t>(header.wallNowNs) -
+                     (static_cast<int64_t>(header.steadyNowNs) - static_cast<int64_t>(steadyNs));
+    time_t seconds = static_cast<time_t>(wallNs / 1000000000);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    
+    char text[64];
+    size_t len = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+    snprintf(text + len, sizeof(text) - len, ".%06lldZ",
+             static_cast<long long>((wallNs % 1000000000) / 1000));
+    return text;
+}
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " [OPTIONS] DUMP_FILE\n"
+              << "Decode a ThrottleBox flight recorder dump (SIGUSR1 or GET /debug/flightrecorder)\n"
+              << "Options:\n"
+              << "  -i, --ip ADDRESS     Only show events from this IPv4 address\n"
+              << "  -c, --client HANDLE  Only show events for this connection handle\n"
+              << "  -d, --drops          Only show rejected packets\n"
+              << "  -h, --help           Show this help message\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string ipFilter;
+    long handleFilter = -1;
+    bool dropsOnly = false;
+    
+    static struct option long_options[] = {
+        {"ip", required_argument, 0, 'i'},
+        {"client", required_argument, 0, 'c'},
+        {"drops", no_argument, 0, 'd'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    
+    int c;
+    while ((c = getopt_long(argc, argv, "i:c:dh", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 'i':
+                ipFilter = optarg;
+                break;
+            case 'c':
+                handleFilter = std::stol(optarg);
+                break;
+            case 'd':
+                dropsOnly = true;
+                break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    
+    if (optind >= argc) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    
+    std::ifstream file(argv[optind], std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Cannot open dump file: " << argv[optind] << std::endl;
+        return 1;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    
+    FlightRecorder::DumpHeader header;
+    std::vector<FlightEvent> events;
+    if (!FlightRecorder::parseDump(buffer.str(), header, events)) {
+        std::cerr << "Not a valid flight recorder dump: " << argv[optind] << std::endl;
+        return 1;
+    }
+    
+    std::cout << "# " << events.size() << " events, dumped at "
+              << formatWallTime(header, header.steadyNowNs) << std::endl;
+    std::cout << "# time handle ip packet decision tokens_left policy" << std::endl;
+    
+    for (const auto& event : events) {
+        std::string ip = formatIpv4(event.ipv4);
+        if (!ipFilter.empty() && ip != ipFilter) continue;
+        if (handleFilter >= 0 && event.clientHandle != static_cast<uint32_t>(handleFilter)) continue;
+        if (dropsOnly && event.decision == static_cast<uint8_t>(FlightDecision::Allowed)) continue;
+        
+        char tokens[32];
+        snprintf(tokens, sizeof(tokens), "%.2f", event.tokensLeft);
+        std::cout << formatWallTime(header, event.timestampNs) << " "
+                  << event.clientHandle << " "
+                  << ip << " "
+                  << packetTypeName(event.packetType) << " "
+                  << decisionName(event.decision) << " "
+                  << tokens << " "
+                  << policyLevelName(event.policyLevel) << "\n";
+    }
+    
+    return 0;
+}
@@ -0,0 +1,777 @@
+// High-concurrency MQTT load generator for capacity planning.
+//
+// Opens many client connections from a few epoll threads, sends a
+// well-formed CONNECT on each, then drives PUBLISH at a per-client rate and
+// burst shape. Reports achieved rate, drop ratio (QoS 1 publishes never
+// acknowledged) and latency percentiles for CONNACK, PUBACK and echoed
+// PUBLISH round trips.
+//
+//   throttlebox-loadgen --connections 100000 --source-ips 8 --rate 0.2 --qos 1 --duration 60
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+namespace {
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 1883;
+    size_t connections = 100;
+    double connectRate = 1000.0;     // New connections per second, all threads
+    double rate = 1.0;               // PUBLISH per second per client
+    int burst = 1;                   // Messages sent back to back per burst
+    size_t payloadBytes = 32;
+    int qos = 0;
+    int keepAlive = 60;
+    double durationSec = 10.0;
+    double drainSec = 2.0;           // Wait for outstanding acks after sending stops
+    int threads = 1;
+    int sourceIps = 0;               // Spread sources over 127.0.0.1..N (loopback only)
+    std::string topicPrefix = "loadgen";
+    std::string clientPrefix = "loadgen";
+    bool json = false;
+};
+
+std::atomic<bool> stopRequested{false};
+
+uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear latency histogram: 64 linear sub-buckets per power of two,
+// so any recorded value is reported within ~1.6%
+class LatencyHistogram {
+public:
+    static constexpr int kSubBits = 6;
+    static constexpr int kSub = 1 << kSubBits;
+
+    LatencyHistogram() : counts_(64 * kSub, 0) {}
+
+    void record(uint64_t valueNs) {
+        counts_[indexOf(valueNs)]++;
+        total_++;
+        max_ = std::max(max_, valueNs);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts_.size(); i++) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+
+    uint64_t percentile(double q) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * total_ + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(upperBoundOf(i), max_);
+            }
+        }
+        return max_;
+    }
+
+private:
+    static size_t indexOf(uint64_t value) {
+        if (value < kSub) {
+            return value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        uint64_t sub = (value >> (exponent - kSubBits)) & (kSub - 1);
+        return static_cast<size_t>(exponent - kSubBits + 1) * kSub + sub;
+    }
+
+    static uint64_t upperBoundOf(size_t index) {
+        if (index < static_cast<size_t>(kSub)) {
+            return index;
+        }
+        int exponent = static_cast<int>(index / kSub) + kSubBits - 1;
+        uint64_t sub = index % kSub;
+        return ((kSub + sub + 1) << (exponent - kSubBits)) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+};
+
+struct Stats {
+    std::atomic<uint64_t> connected{0};
+    std::atomic<uint64_t> connectFailed{0};
+    std::atomic<uint64_t> disconnected{0};
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> acked{0};
+    std::atomic<uint64_t> echoed{0};
+    std::atomic<uint64_t> bytesSent{0};
+};
+
+// Echoed payloads start with this marker and the send time
+const uint32_t kPayloadMagic = 0x4C47454E; // "LGEN"
+
+void appendRemainingLength(std::string& out, size_t length) {
+    do {
+        uint8_t byte = length % 128;
+        length /= 128;
+        if (length > 0) {
+            byte |= 0x80;
+        }
+        out += static_cast<char>(byte);
+    } while (length > 0);
+}
+
+void appendString(std::string& out, const std::string& value) {
+    out += static_cast<char>((value.size() >> 8) & 0xFF);
+    out += static_cast<char>(value.size() & 0xFF);
+    out += value;
+}
+
+std::string buildConnect(const std::string& clientId, int keepAlive) {
+    std::string body;
+    appendString(body, "MQTT");
+    body += static_cast<char>(0x04);                 // MQTT 3.1.1
+    body += static_cast<char>(0x02);                 // Clean session
+    body += static_cast<char>((keepAlive >> 8) & 0xFF);
+    body += static_cast<char>(keepAlive & 0xFF);
+    appendString(body, clientId);
+
+    std::string packet(1, static_cast<char>(0x10));
+    appendRemainingLength(packet, body.size());
+    return packet + body;
+}
+
+void appendPublish(std::string& out, const std::string& topic, int qos, uint16_t packetId,
+                   size_t payloadBytes, uint64_t sentNs) {
+    size_t remaining = 2 + topic.size() + (qos > 0 ? 2 : 0) + payloadBytes;
+    out += static_cast<char>(0x30 | (qos << 1));
+    appendRemainingLength(out, remaining);
+    appendString(out, topic);
+    if (qos > 0) {
+        out += static_cast<char>(packetId >> 8);
+        out += static_cast<char>(packetId & 0xFF);
+    }
+
+    size_t start = out.size();
+    out.resize(start + payloadBytes, 'x');
+    if (payloadBytes >= 12) {
+        std::memcpy(&out[start], &kPayloadMagic, 4);
+        std::memcpy(&out[start + 4], &sentNs, 8);
+    }
+}
+
+struct Connection {
+    enum class State { Connecting, AwaitConnack, Active, Closed };
+
+    static constexpr uint16_t kWindow = 64;   // QoS 1 packets in flight
+
+    int fd = -1;
+    State state = State::Closed;
+    size_t index = 0;
+    std::string clientId;
+    std::string topic;
+    std::string out;
+    size_t outOffset = 0;
+    std::vector<uint8_t> in;
+    uint64_t connectStartNs = 0;
+    uint64_t lastSendNs = 0;
+    uint16_t nextPacketId = 1;
+    uint64_t inflight[kWindow] = {};
+};
+
+struct ThreadResult {
+    LatencyHistogram connack;
+    LatencyHistogram puback;
+    LatencyHistogram echo;
+    uint64_t lost = 0;   // QoS 1 publishes whose window slot was reused, or unacked at the end
+};
+
+class Worker {
+public:
+    Worker(const Options& options, Stats& stats, size_t first, size_t count, int workerIndex)
+        : options_(options), stats_(stats), rng_(workerIndex * 7919 + 1) {
+        connections_.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            Connection& conn = connections_[i];
+            conn.index = first + i;
+            conn.clientId = options.clientPrefix + "-" + std::to_string(first + i);
+            conn.topic = options.topicPrefix + "/" + std::to_string(first + i);
+        }
+        connectInterval_ = options.connectRate > 0
+            ? static_cast<uint64_t>(1e9 * options.threads / options.connectRate) : 0;
+        if (options.rate > 0) {
+            burstPeriodNs_ = static_cast<uint64_t>(1e9 * options.burst / options.rate);
+        }
+    }
+
+    void run(uint64_t sendUntilNs, uint64_t stopNs);
+
+    ThreadResult& result() { return result_; }
+
+private:
+    void openConnection(Connection& conn, uint64_t now);
+    void closeConnection(Connection& conn, bool byPeer = true);
+    void onWritable(Connection& conn);
+    void onReadable(Connection& conn, uint64_t now);
+    void handlePacket(Connection& conn, uint8_t header, const uint8_t* body, size_t length, uint64_t now);
+    void sendBurst(Connection& conn, uint64_t now);
+    void flushOut(Connection& conn);
+    void schedule(size_t slot, uint64_t when) { timers_.push({when, slot}); }
+
+    struct Timer {
+        uint64_t when;
+        size_t slot;
+        bool operator>(const Timer& other) const { return when > other.when; }
+    };
+
+    const Options& options_;
+    Stats& stats_;
+    std::mt19937_64 rng_;
+    std::vector<Connection> connections_;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+    uint64_t connectInterval_ = 0;
+    uint64_t burstPeriodNs_ = 0;
+    bool sending_ = true;
+    int epollFd_ = -1;
+    ThreadResult result_;
+};
+
+void Worker::openConnection(Connection& conn, uint64_t now) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        stats_.connectFailed++;
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (options_.sourceIps > 0) {
+        // Each loopback source address has its own ephemeral port space
+        struct sockaddr_in source;
+        std::memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl(0x7F000001 + conn.index % options_.sourceIps);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        bind(fd, (struct sockaddr*)&source, sizeof(source));
+    }
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options_.port);
+    inet_pton(AF_INET, options_.host.c_str(), &addr.sin_addr);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        stats_.connectFailed++;
+        return;
+    }
+
+    conn.fd = fd;
+    conn.state = Connection::State::Connecting;
+    conn.connectStartNs = now;
+    conn.out = buildConnect(conn.clientId, options_.keepAlive);
+    conn.outOffset = 0;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    event.data.u64 = &conn - connections_.data();
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+}
+
+void Worker::closeConnection(Connection& conn, bool byPeer) {
+    if (conn.fd < 0) {
+        return;
+    }
+    bool handshaking = conn.state != Connection::State::Active;
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+    close(conn.fd);
+    conn.fd = -1;
+    if (handshaking) {
+        stats_.connectFailed++;
+    } else if (byPeer) {
+        stats_.disconnected++;
+    }
+    conn.state = Connection::State::Closed;
+    for (auto& sent : conn.inflight) {
+        if (sent != 0) {
+            result_.lost++;
+            sent = 0;
+        }
+    }
+}
+
+void Worker::flushOut(Connection& conn) {
+    while (conn.outOffset < conn.out.size()) {
+        ssize_t sent = send(conn.fd, conn.out.data() + conn.outOffset,
+                            conn.out.size() - conn.outOffset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Kernel buffer full: resume on EPOLLOUT
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+                event.data.u64 = &conn - connections_.data();
+                epoll_ctl(epollFd_, EPOLL_CTL_MOD, conn.fd, &event);
+                return;
+            }
+            closeConnection(conn);
+            return;
+        }
+        conn.outOffset += sent;
+        stats_.bytesSent += sent;
+    }
+    conn.out.clear();
+    conn.outOffset = 0;
+}
+
+void Worker::onWritable(Connection& conn) {
+    if (conn.state == Connection::State::Connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            closeConnection(conn);
+            return;
+        }
+        conn.state = Connection::State::AwaitConnack;
+    }
+
+    flushOut(conn);
+    if (conn.fd >= 0 && conn.out.empty()) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = &conn - connections_.data();
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, conn.fd, &event);
+    }
+}
+
+void Worker::onReadable(Connection& conn, uint64_t now) {
+    uint8_t buffer[16384];
+    while (true) {
+        ssize_t bytes = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (bytes == 0) {
+            closeConnection(conn);
+            return;
+        }
+        if (bytes < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(conn);
+            }
+            break;
+        }
+        conn.in.insert(conn.in.end(), buffer, buffer + bytes);
+        if (static_cast<size_t>(bytes) < sizeof(buffer)) {
+            break;
+        }
+    }
+
+    // Split complete packets off the front of the input buffer
+    size_t pos = 0;
+    while (conn.fd >= 0 && conn.in.size() - pos >= 2) {
+        size_t remaining = 0;
+        size_t multiplier = 1;
+        size_t headerLength = 1;
+        bool complete = false;
+        while (headerLength < 5 && pos + headerLength < conn.in.size()) {
+            uint8_t byte = conn.in[pos + headerLength];
+            remaining += (byte & 0x7F) * multiplier;
+            multiplier *= 128;
+            headerLength++;
+            if ((byte & 0x80) == 0) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete || conn.in.size() - pos < headerLength + remaining) {
+            break;
+        }
+        handlePacket(conn, conn.in[pos], conn.in.data() + pos + headerLength, remaining, now);
+        pos += headerLength + remaining;
+    }
+    if (conn.fd >= 0) {
+        conn.in.erase(conn.in.begin(), conn.in.begin() + pos);
+    }
+}
+
+void Worker::handlePacket(Connection& conn, uint8_t header, const uint8_t* body, size_t length, uint64_t now) {
+    switch (header >> 4) {
+        case 2: { // CONNACK
+            if (conn.state != Connection::State::AwaitConnack && conn.state != Connection::State::Connecting) {
+                return;
+            }
+            if (length < 2 || body[1] != 0) {
+                closeConnection(conn); // Refused
+                return;
+            }
+            conn.state = Connection::State::Active;
+            stats_.connected++;
+            result_.connack.record(now - conn.connectStartNs);
+
+            // Spread clients evenly over the first burst period
+            uint64_t offset = burstPeriodNs_ > 0 ? rng_() % burstPeriodNs_
+                            : static_cast<uint64_t>(options_.keepAlive) * 500000000ULL;
+            schedule(&conn - connections_.data(), now + offset);
+            break;
+        }
+        case 4: { // PUBACK
+            if (length < 2) {
+                return;
+            }
+            uint16_t packetId = (body[0] << 8) | body[1];
+            uint64_t& sent = conn.inflight[packetId % Connection::kWindow];
+            if (sent != 0) {
+                result_.puback.record(now - sent);
+                sent = 0;
+                stats_.acked++;
+            }
+            break;
+        }
+        case 3: { // PUBLISH echoed back by a mock broker
+            if (length < 2) {
+                return;
+            }
+            size_t topicLength = (body[0] << 8) | body[1];
+            size_t offset = 2 + topicLength + (((header >> 1) & 0x03) > 0 ? 2 : 0);
+            if (offset + 12 <= length) {
+                uint32_t magic;
+                uint64_t sentNs;
+                std::memcpy(&magic, body + offset, 4);
+                std::memcpy(&sentNs, body + offset + 4, 8);
+                if (magic == kPayloadMagic && sentNs <= now) {
+                    result_.echo.record(now - sentNs);
+                    stats_.echoed++;
+                }
+            }
+            break;
+        }
+        default:
+            break; // PINGRESP, SUBACK, ...
+    }
+}
+
+void Worker::sendBurst(Connection& conn, uint64_t now) {
+    if (burstPeriodNs_ == 0) {
+        // Connection-only load: keep the session alive
+        const char pingreq[] = {static_cast<char>(0xC0), 0x00};
+        conn.out.append(pingreq, sizeof(pingreq));
+    } else {
+        for (int i = 0; i < options_.burst; i++) {
+            uint16_t packetId = 0;
+            if (options_.qos > 0) {
+                packetId = conn.nextPacketId++;
+                if (conn.nextPacketId == 0) {
+                    conn.nextPacketId = 1;
+                }
+                uint64_t& slot = conn.inflight[packetId % Connection::kWindow];
+                if (slot != 0) {
+                    result_.lost++; // Never acknowledged within a full window
+                }
+                slot = now;
+            }
+            appendPublish(conn.out, conn.topic, options_.qos, packetId, options_.payloadBytes, now);
+        }
+        stats_.published += options_.burst;
+    }
+    conn.lastSendNs = now;
+    flushOut(conn);
+}
+
+void Worker::run(uint64_t sendUntilNs, uint64_t stopNs) {
+    epollFd_ = epoll_create1(0);
+    std::vector<struct epoll_event> events(1024);
+
+    size_t nextToOpen = 0;
+    uint64_t nextOpenNs = nowNs();
+
+    while (!stopRequested) {
+        uint64_t now = nowNs();
+        if (now >= stopNs) {
+            break;
+        }
+        if (sending_ && now >= sendUntilNs) {
+            sending_ = false;
+        }
+
+        // Paced connection ramp-up
+        while (nextToOpen < connections_.size() && now >= nextOpenNs) {
+            openConnection(connections_[nextToOpen++], now);
+            nextOpenNs += connectInterval_;
+        }
+
+        // Due bursts
+        while (!timers_.empty() && timers_.top().when <= now) {
+            Timer timer = timers_.top();
+            timers_.pop();
+            Connection& conn = connections_[timer.slot];
+            if (conn.state != Connection::State::Active || !sending_) {
+                continue;
+            }
+            sendBurst(conn, now);
+            uint64_t period = burstPeriodNs_ > 0 ? burstPeriodNs_
+                            : static_cast<uint64_t>(options_.keepAlive) * 500000000ULL;
+            schedule(timer.slot, timer.when + period);
+        }
+
+        // Sleep until the next timer, connection slot or deadline
+        uint64_t wake = stopNs;
+        if (!timers_.empty()) {
+            wake = std::min(wake, timers_.top().when);
+        }
+        if (nextToOpen < connections_.size()) {
+            wake = std::min(wake, nextOpenNs);
+        }
+        int timeoutMs = wake > now ? static_cast<int>(std::min<uint64_t>((wake - now) / 1000000, 100)) : 0;
+
+        int ready = epoll_wait(epollFd_, events.data(), static_cast<int>(events.size()), timeoutMs);
+        now = nowNs();
+        for (int i = 0; i < ready; i++) {
+            Connection& conn = connections_[events[i].data.u64];
+            if (conn.fd < 0) {
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeConnection(conn);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                onWritable(conn);
+            }
+            if (conn.fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                onReadable(conn, now);
+            }
+        }
+    }
+
+    for (auto& conn : connections_) {
+        closeConnection(conn, false);
+    }
+    close(epollFd_);
+}
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " [OPTIONS]\n"
+              << "Options:\n"
+              << "  -H, --host ADDR         Target address (default: 127.0.0.1)\n"
+              << "  -p, --port PORT         Target port (default: 1883)\n"
+              << "  -n, --connections N     Client connections (default: 100)\n"
+              << "  -c, --connect-rate R    New connections per second (default: 1000)\n"
+              << "  -r, --rate R            PUBLISH per second per client, 0 = connect only (default: 1)\n"
+              << "  -b, --burst N           Messages per burst; bursts keep the average rate (default: 1)\n"
+              << "  -s, --payload BYTES     Payload size (default: 32, >= 12 embeds a timestamp)\n"
+              << "  -q, --qos 0|1           PUBLISH QoS; QoS 1 measures PUBACK latency and drops\n"
+              << "  -k, --keepalive SEC     CONNECT keepalive (default: 60)\n"
+              << "  -d, --duration SEC      Sending time (default: 10)\n"
+              << "  -D, --drain SEC         Time to wait for outstanding acks (default: 2)\n"
+              << "  -t, --threads N         Event loop threads (default: 1)\n"
+              << "  -S, --source-ips N      Bind to 127.0.0.1..N to exceed 64k connections on loopback\n"
+              << "  -T, --topic PREFIX      Topic prefix (default: loadgen)\n"
+              << "  -C, --client PREFIX     Client ID prefix (default: loadgen)\n"
+              << "  -j, --json              Print the final report as JSON\n"
+              << "  -h, --help              Show this help message\n";
+}
+
+void raiseFileLimit(size_t connections) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < connections + 64) {
+        limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, connections + 64);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+
+    static struct option long_options[] = {
+        {"host", required_argument, 0, 'H'},
+        {"port", required_argument, 0, 'p'},
+        {"connections", required_argument, 0, 'n'},
+        {"connect-rate", required_argument, 0, 'c'},
+        {"rate", required_argument, 0, 'r'},
+        {"burst", required_argument, 0, 'b'},
+        {"payload", required_argument, 0, 's'},
+        {"qos", required_argument, 0, 'q'},
+        {"keepalive", required_argument, 0, 'k'},
+        {"duration", required_argument, 0, 'd'},
+        {"drain", required_argument, 0, 'D'},
+        {"threads", required_argument, 0, 't'},
+        {"source-ips", required_argument, 0, 'S'},
+        {"topic", required_argument, 0, 'T'},
+        {"client", required_argument, 0, 'C'},
+        {"json", no_argument, 0, 'j'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "H:p:n:c:r:b:s:q:k:d:D:t:S:T:C:jh", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 'H': options.host = optarg; break;
+            case 'p': options.port = std::stoi(optarg); break;
+            case 'n': options.connections = std::stoul(optarg); break;
+            case 'c': options.connectRate = std::stod(optarg); break;
+            case 'r': options.rate = std::stod(optarg); break;
+            case 'b': options.burst = std::max(1, std::stoi(optarg)); break;
+            case 's': options.payloadBytes = std::stoul(optarg); break;
+            case 'q': options.qos = std::min(1, std::max(0, std::stoi(optarg))); break;
+            case 'k': options.keepAlive = std::stoi(optarg); break;
+            case 'd': options.durationSec = std::stod(optarg); break;
+            case 'D': options.drainSec = std::stod(optarg); break;
+            case 't': options.threads = std::max(1, std::stoi(optarg)); break;
+            case 'S': options.sourceIps = std::stoi(optarg); break;
+            case 'T': options.topicPrefix = optarg; break;
+            case 'C': options.clientPrefix = optarg; break;
+            case 'j': options.json = true; break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGINT, [](int) { stopRequested = true; });
+    signal(SIGPIPE, SIG_IGN);
+    raiseFileLimit(options.connections);
+
+    Stats stats;
+    std::vector<std::unique_ptr<Worker>> workers;
+    size_t perThread = (options.connections + options.threads - 1) / options.threads;
+    for (int i = 0; i < options.threads; i++) {
+        size_t first = i * perThread;
+        if (first >= options.connections) {
+            break;
+        }
+        size_t count = std::min(perThread, options.connections - first);
+        workers.push_back(std::make_unique<Worker>(options, stats, first, count, i));
+    }
+
+    uint64_t start = nowNs();
+    uint64_t sendUntil = start + static_cast<uint64_t>(options.durationSec * 1e9);
+    uint64_t stopAt = sendUntil + static_cast<uint64_t>(options.drainSec * 1e9);
+
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker, sendUntil, stopAt]() { worker->run(sendUntil, stopAt); });
+    }
+
+    // Progress once per second on stderr so stdout stays machine-readable
+    uint64_t lastPublished = 0;
+    uint64_t lastAcked = 0;
+    while (!stopRequested && nowNs() < stopAt) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        uint64_t published = stats.published.load();
+        uint64_t acked = stats.acked.load();
+        std::fprintf(stderr, "[%5.1fs] connected=%llu failed=%llu publish/s=%llu ack/s=%llu\n",
+                     (nowNs() - start) / 1e9,
+                     static_cast<unsigned long long>(stats.connected.load()),
+                     static_cast<unsigned long long>(stats.connectFailed.load()),
+                     static_cast<unsigned long long>(published - lastPublished),
+                     static_cast<unsigned long long>(acked - lastAcked));
+        lastPublished = published;
+        lastAcked = acked;
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    ThreadResult total;
+    for (auto& worker : workers) {
+        total.connack.merge(worker->result().connack);
+        total.puback.merge(worker->result().puback);
+        total.echo.merge(worker->result().echo);
+        total.lost += worker->result().lost;
+    }
+
+    double sendSeconds = std::min(options.durationSec, (nowNs() - start) / 1e9);
+    uint64_t published = stats.published.load();
+    double achievedRate = sendSeconds > 0 ? published / sendSeconds : 0.0;
+    double dropRatio = (options.qos > 0 && published > 0)
+        ? 1.0 - static_cast<double>(stats.acked.load()) / published : 0.0;
+
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    auto percentiles = [&us](const LatencyHistogram& h) {
+        char text[160];
+        std::snprintf(text, sizeof(text), "p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f (n=%llu)",
+                      us(h.percentile(0.5)), us(h.percentile(0.9)), us(h.percentile(0.99)),
+                      us(h.percentile(0.999)), us(h.max()), static_cast<unsigned long long>(h.count()));
+        return std::string(text);
+    };
+    auto percentilesJson = [&us](const LatencyHistogram& h) {
+        char text[200];
+        std::snprintf(text, sizeof(text),
+                      "{\"count\":%llu,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                      static_cast<unsigned long long>(h.count()), us(h.percentile(0.5)), us(h.percentile(0.9)),
+                      us(h.percentile(0.99)), us(h.percentile(0.999)), us(h.max()));
+        return std::string(text);
+    };
+
+    if (options.json) {
+        std::printf("{\"connections\":%zu,\"connected\":%llu,\"connect_failed\":%llu,\"disconnected\":%llu,"
+                    "\"published\":%llu,\"acked\":%llu,\"echoed\":%llu,\"lost\":%llu,"
+                    "\"achieved_rate\":%.1f,\"target_rate\":%.1f,\"drop_ratio\":%.6f,\"bytes_sent\":%llu,"
+                    "\"latency_us\":{\"connack\":%s,\"puback\":%s,\"echo\":%s}}\n",
+                    options.connections,
+                    static_cast<unsigned long long>(stats.connected.load()),
+                    static_cast<unsigned long long>(stats.connectFailed.load()),
+                    static_cast<unsigned long long>(stats.disconnected.load()),
+                    static_cast<unsigned long long>(published),
+                    static_cast<unsigned long long>(stats.acked.load()),
+                    static_cast<unsigned long long>(stats.echoed.load()),
+                    static_cast<unsigned long long>(total.lost),
+                    achievedRate, options.rate * options.connections, dropRatio,
+                    static_cast<unsigned long long>(stats.bytesSent.load()),
+                    percentilesJson(total.connack).c_str(), percentilesJson(total.puback).c_str(),
+                    percentilesJson(total.echo).c_str());
+    } else {
+        std::cout << "Connections:   " << stats.connected.load() << "/" << options.connections << " connected, "
+                  << stats.connectFailed.load() << " failed, " << stats.disconnected.load() << " dropped by peer\n"
+                  << "Publish rate:  " << static_cast<uint64_t>(achievedRate) << " msg/s achieved, "
+                  << static_cast<uint64_t>(options.rate * options.connections) << " msg/s target\n"
+                  << "Published:     " << published << " (" << stats.bytesSent.load() << " bytes)\n";
+        if (options.qos > 0) {
+            std::cout << "Acknowledged:  " << stats.acked.load() << ", drop ratio " << dropRatio << "\n";
+        }
+        std::cout << "CONNACK us:    " << percentiles(total.connack) << "\n";
+        if (options.qos > 0) {
+            std::cout << "PUBACK us:     " << percentiles(total.puback) << "\n";
+        }
+        if (total.echo.count() > 0) {
+            std::cout << "Echo RTT us:   " << percentiles(total.echo) << "\n";
+        }
+    }
+
+    return 0;
+}
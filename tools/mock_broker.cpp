@@ -0,0 +1,478 @@
+// Minimal MQTT broker stand-in for hermetic end-to-end benchmarks.
+//
+// Accepts connections, answers CONNECT with CONNACK, PINGREQ with PINGRESP,
+// QoS 1 PUBLISH with PUBACK and QoS 2 PUBLISH with PUBREC/PUBCOMP, and counts
+// every control packet it receives. With --echo each PUBLISH is sent back
+// to its sender as QoS 0 so throttlebox-loadgen can time the full round
+// trip through the proxy from the timestamp embedded in the payload.
+//
+//   throttlebox-mockbroker --port 1884 --threads 2 --echo
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+namespace {
+
+struct Options {
+    std::string bindAddress = "127.0.0.1";
+    int port = 1884;
+    int threads = 1;
+    bool echo = false;
+    int connackCode = 0;       // Return code sent in every CONNACK
+    int reportIntervalSec = 1; // 0 disables periodic reports
+};
+
+std::atomic<bool> stopRequested{false};
+
+const char* const kPacketNames[16] = {
+    "reserved", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+    "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "AUTH"
+};
+
+struct Counters {
+    std::atomic<uint64_t> packets[16] = {};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> activeConnections{0};
+    std::atomic<uint64_t> malformed{0};
+};
+
+struct Session {
+    bool open = false;
+    std::vector<uint8_t> in;
+    std::string out;
+    size_t outOffset = 0;
+    bool writeArmed = false;   // EPOLLOUT registered while the socket is full
+};
+
+class Worker {
+public:
+    Worker(const Options& options, Counters& counters) : options_(options), counters_(counters) {}
+
+    bool listenOn();
+    void run();
+
+private:
+    void acceptAll();
+    void closeSession(int fd);
+    void onReadable(int fd);
+    void handlePacket(Session& session, uint8_t header, const uint8_t* body, size_t length);
+    bool flush(int fd, Session& session);
+
+    const Options& options_;
+    Counters& counters_;
+    int listenFd_ = -1;
+    int epollFd_ = -1;
+    std::vector<Session> sessions_;  // Indexed by fd
+};
+
+bool Worker::listenOn() {
+    listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listenFd_ < 0) {
+        return false;
+    }
+
+    // Every worker binds its own socket; the kernel spreads accepts over them
+    int one = 1;
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options_.port);
+    if (inet_pton(AF_INET, options_.bindAddress.c_str(), &addr.sin_addr) != 1 ||
+        bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd_, SOMAXCONN) < 0) {
+        close(listenFd_);
+        listenFd_ = -1;
+        return false;
+    }
+
+    epollFd_ = epoll_create1(0);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = listenFd_;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event);
+    return true;
+}
+
+void Worker::acceptAll() {
+    while (true) {
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK);
+        if (fd < 0) {
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (static_cast<size_t>(fd) >= sessions_.size()) {
+            sessions_.resize(fd + 1024);
+        }
+        sessions_[fd] = Session();
+        sessions_[fd].open = true;
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event);
+        counters_.connections++;
+        counters_.activeConnections++;
+    }
+}
+
+void Worker::closeSession(int fd) {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    sessions_[fd] = Session();
+    counters_.activeConnections--;
+}
+
+bool Worker::flush(int fd, Session& session) {
+    while (session.outOffset < session.out.size()) {
+        ssize_t sent = send(fd, session.out.data() + session.outOffset,
+                            session.out.size() - session.outOffset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!session.writeArmed) {
+                    struct epoll_event event;
+                    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+                    event.data.fd = fd;
+                    epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &event);
+                    session.writeArmed = true;
+                }
+                return true;
+            }
+            closeSession(fd);
+            return false;
+        }
+        session.outOffset += sent;
+    }
+
+    session.out.clear();
+    session.outOffset = 0;
+    if (session.writeArmed) {
+        session.writeArmed = false;
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &event);
+    }
+    return true;
+}
+
+void Worker::handlePacket(Session& session, uint8_t header, const uint8_t* body, size_t length) {
+    uint8_t type = header >> 4;
+    counters_.packets[type]++;
+
+    switch (type) {
+        case 1: { // CONNECT
+            // MQTT 5 CONNACKs end with a (here empty) property block
+            size_t levelOffset = length >= 2 ? 2 + ((body[0] << 8) | body[1]) : length;
+            bool v5 = levelOffset < length && body[levelOffset] >= 5;
+            const char connack[] = {0x20, static_cast<char>(v5 ? 0x03 : 0x02), 0x00,
+                                    static_cast<char>(options_.connackCode), 0x00};
+            session.out.append(connack, v5 ? 5 : 4);
+            break;
+        }
+        case 3: { // PUBLISH
+            if (length < 2) {
+                counters_.malformed++;
+                return;
+            }
+            int qos = (header >> 1) & 0x03;
+            size_t topicLength = (body[0] << 8) | body[1];
+            size_t payloadOffset = 2 + topicLength + (qos > 0 ? 2 : 0);
+            if (payloadOffset > length) {
+                counters_.malformed++;
+                return;
+            }
+            if (qos > 0) {
+                const char ack[] = {static_cast<char>(qos == 1 ? 0x40 : 0x50), 0x02,
+                                    static_cast<char>(body[2 + topicLength]),
+                                    static_cast<char>(body[3 + topicLength])};
+                session.out.append(ack, sizeof(ack));
+            }
+            if (options_.echo) {
+                // Same topic and payload back to the sender at QoS 0
+                size_t remaining = 2 + topicLength + (length - payloadOffset);
+                session.out += static_cast<char>(0x30);
+                do {
+                    uint8_t byte = remaining % 128;
+                    remaining /= 128;
+                    session.out += static_cast<char>(remaining > 0 ? byte | 0x80 : byte);
+                } while (remaining > 0);
+                session.out.append(reinterpret_cast<const char*>(body), 2 + topicLength);
+                session.out.append(reinterpret_cast<const char*>(body) + payloadOffset, length - payloadOffset);
+            }
+            break;
+        }
+        case 6: { // PUBREL
+            if (length >= 2) {
+                const char pubcomp[] = {0x70, 0x02, static_cast<char>(body[0]), static_cast<char>(body[1])};
+                session.out.append(pubcomp, sizeof(pubcomp));
+            }
+            break;
+        }
+        case 8: { // SUBSCRIBE: grant QoS 0 for every filter
+            if (length < 2) {
+                return;
+            }
+            std::string suback;
+            suback.push_back(static_cast<char>(body[0]));
+            suback.push_back(static_cast<char>(body[1]));
+            size_t pos = 2;
+            while (pos + 2 <= length) {
+                size_t filterLength = (body[pos] << 8) | body[pos + 1];
+                pos += 2 + filterLength + 1;
+                suback.push_back(0x00);
+            }
+            session.out += static_cast<char>(0x90);
+            session.out += static_cast<char>(suback.size());
+            session.out += suback;
+            break;
+        }
+        case 12: { // PINGREQ
+            const char pingresp[] = {static_cast<char>(0xD0), 0x00};
+            session.out.append(pingresp, sizeof(pingresp));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void Worker::onReadable(int fd) {
+    Session& session = sessions_[fd];
+    uint8_t buffer[65536];
+
+    while (true) {
+        ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+        if (bytes == 0) {
+            closeSession(fd);
+            return;
+        }
+        if (bytes < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeSession(fd);
+                return;
+            }
+            break;
+        }
+        counters_.bytesIn += bytes;
+        session.in.insert(session.in.end(), buffer, buffer + bytes);
+        if (static_cast<size_t>(bytes) < sizeof(buffer)) {
+            break;
+        }
+    }
+
+    size_t pos = 0;
+    while (session.in.size() - pos >= 2) {
+        size_t remaining = 0;
+        size_t multiplier = 1;
+        size_t headerLength = 1;
+        bool complete = false;
+        while (headerLength < 5 && pos + headerLength < session.in.size()) {
+            uint8_t byte = session.in[pos + headerLength];
+            remaining += (byte & 0x7F) * multiplier;
+            multiplier *= 128;
+            headerLength++;
+            if ((byte & 0x80) == 0) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete && headerLength == 5) {
+            counters_.malformed++;
+            closeSession(fd);
+            return;
+        }
+        if (!complete || session.in.size() - pos < headerLength + remaining) {
+            break;
+        }
+
+        uint8_t header = session.in[pos];
+        handlePacket(session, header, session.in.data() + pos + headerLength, remaining);
+        pos += headerLength + remaining;
+
+        if ((header >> 4) == 14) { // DISCONNECT
+            if (flush(fd, session)) {
+                closeSession(fd);
+            }
+            return;
+        }
+    }
+    session.in.erase(session.in.begin(), session.in.begin() + pos);
+
+    flush(fd, session);
+}
+
+void Worker::run() {
+    std::vector<struct epoll_event> events(1024);
+
+    while (!stopRequested) {
+        int ready = epoll_wait(epollFd_, events.data(), static_cast<int>(events.size()), 100);
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd_) {
+                acceptAll();
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeSession(fd);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !flush(fd, sessions_[fd])) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                onReadable(fd);
+            }
+        }
+    }
+
+    for (size_t fd = 0; fd < sessions_.size(); fd++) {
+        if (sessions_[fd].open) {
+            close(static_cast<int>(fd));
+        }
+    }
+    close(listenFd_);
+    close(epollFd_);
+}
+
+void printUsage(const char* programName) {
+    std::cout << "Usage: " << programName << " [OPTIONS]\n"
+              << "Options:\n"
+              << "  -b, --bind ADDR         Listen address (default: 127.0.0.1)\n"
+              << "  -p, --port PORT         Listen port (default: 1884)\n"
+              << "  -t, --threads N         Event loop threads (default: 1)\n"
+              << "  -e, --echo              Echo each PUBLISH back to its sender at QoS 0\n"
+              << "  -c, --connack-code N    Return code sent in CONNACK (default: 0)\n"
+              << "  -r, --report SEC        Packet rate report interval, 0 = off (default: 1)\n"
+              << "  -h, --help              Show this help message\n";
+}
+
+void printTotals(const Counters& counters) {
+    std::cout << "Connections: " << counters.connections.load()
+              << " (" << counters.activeConnections.load() << " open)\n"
+              << "Bytes in:    " << counters.bytesIn.load() << "\n";
+    for (int type = 1; type < 16; type++) {
+        uint64_t count = counters.packets[type].load();
+        if (count > 0) {
+            std::cout << "  " << kPacketNames[type] << ": " << count << "\n";
+        }
+    }
+    if (counters.malformed.load() > 0) {
+        std::cout << "  malformed: " << counters.malformed.load() << "\n";
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+
+    static struct option long_options[] = {
+        {"bind", required_argument, 0, 'b'},
+        {"port", required_argument, 0, 'p'},
+        {"threads", required_argument, 0, 't'},
+        {"echo", no_argument, 0, 'e'},
+        {"connack-code", required_argument, 0, 'c'},
+        {"report", required_argument, 0, 'r'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "b:p:t:ec:r:h", long_options, nullptr)) != -1) {
+        switch (c) {
+            case 'b': options.bindAddress = optarg; break;
+            case 'p': options.port = std::stoi(optarg); break;
+            case 't': options.threads = std::max(1, std::stoi(optarg)); break;
+            case 'e': options.echo = true; break;
+            case 'c': options.connackCode = std::stoi(optarg); break;
+            case 'r': options.reportIntervalSec = std::stoi(optarg); break;
+            case 'h':
+                printUsage(argv[0]);
+                return 0;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGINT, [](int) { stopRequested = true; });
+    signal(SIGTERM, [](int) { stopRequested = true; });
+    signal(SIGPIPE, SIG_IGN);
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Counters counters;
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.threads; i++) {
+        workers.push_back(std::make_unique<Worker>(options, counters));
+        if (!workers.back()->listenOn()) {
+            std::cerr << "Cannot listen on " << options.bindAddress << ":" << options.port
+                      << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker]() { worker->run(); });
+    }
+
+    std::cerr << "Mock broker listening on " << options.bindAddress << ":" << options.port
+              << (options.echo ? " (echo)" : "") << std::endl;
+
+    uint64_t lastPublish = 0;
+    auto lastReport = std::chrono::steady_clock::now();
+    while (!stopRequested) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (options.reportIntervalSec <= 0) {
+            continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastReport < std::chrono::seconds(options.reportIntervalSec)) {
+            continue;
+        }
+        double elapsed = std::chrono::duration<double>(now - lastReport).count();
+        uint64_t publish = counters.packets[3].load();
+        std::fprintf(stderr, "open=%llu connects=%llu publish/s=%.0f\n",
+                     static_cast<unsigned long long>(counters.activeConnections.load()),
+                     static_cast<unsigned long long>(counters.packets[1].load()),
+                     (publish - lastPublish) / elapsed);
+        lastPublish = publish;
+        lastReport = now;
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    printTotals(counters);
+    return 0;
+}